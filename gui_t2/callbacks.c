@@ -9,7 +9,7 @@
  * Updated on October 8, 2019,16:00
  * @author  Luis Bernardo, Rodolfo Oliveira
 \*****************************************************************************/
-#include <gtk/gtk.h>
+#include <glib.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <inttypes.h>
@@ -21,11 +21,20 @@
 #include <math.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include "sock.h"
 #include "file.h"
 #include "gui.h"
 #include "thread.h"
 #include "callbacks.h"
+#include "stripe.h"
+#include "resume.h"
+#include "pool.h"
+#include "scheduler.h"
+#include "tcpinfo.h"
+#include "rate.h"
+#include "peers.h"
+#include "ifaddr.h"
 
 #ifdef DEBUG
 #define debugstr(x)     g_print(x)
@@ -39,10 +48,11 @@
 
 gboolean active = FALSE; 	// TRUE if server is active
 char *user_name = NULL; // User name
-gboolean active4 = FALSE; // TRUE if IPv4 is on and IPv6 if off
-gboolean active6 = FALSE; // TRUE if IPv6 is on and IPv4 is off
+gboolean active4 = FALSE; // TRUE if the IPv4 group is joined
+gboolean active6 = FALSE; // TRUE if the IPv6 group is joined
 
 guint query_timer_id = 0; // Timer event
+int name_period = NAME_TIMER_PERIOD; // Period of the registrations for the users of the group (ms)
 
 gboolean changing = FALSE; // If it is changing the network
 
@@ -89,25 +99,85 @@ const char *str_addr_MCast6 = NULL;// IPv6 multicast address
 struct sockaddr_in6 addr_MCast6; // struct with data of IPv6 socket
 struct ipv6_mreq imr_MCast6; // struct with IPv6 multicast data
 
-GIOChannel *chanUDP = NULL; // GIO channel descriptor of socket UDPv4 or UDPv6
-guint chanUDP_id = 0; // channel number of socket UDPv4 or UDPv6
+int sockQ4 = -1; // IPv4 UDP socket of the queries, with its own port, where the answers arrive
+GIOChannel *chanQ4 = NULL; // GIO channel descriptor of socket sockQ4
+guint chanQ4_id = 0; // channel number of socket sockQ4
+int sockQ6 = -1; // IPv6 UDP socket of the queries, with its own port, where the answers arrive
+GIOChannel *chanQ6 = NULL; // GIO channel descriptor of socket sockQ6
+guint chanQ6_id = 0; // channel number of socket sockQ6
+
+int links4[IFADDR_MAX]; // Interfaces where the IPv4 group is joined; 0 is the one chosen by the kernel
+int nlinks4 = 0;
+int links6[IFADDR_MAX]; // Interfaces where the IPv6 group is joined; 0 is the one chosen by the kernel
+int nlinks6 = 0;
+
+GIOChannel *chanUDP4 = NULL; // GIO channel descriptor of socket UDPv4
+guint chanUDP4_id = 0; // channel number of socket UDPv4
+GIOChannel *chanUDP6 = NULL; // GIO channel descriptor of socket UDPv6
+guint chanUDP6_id = 0; // channel number of socket UDPv6
 
 guint nome_timer_id = 0; // Timer event id
+guint expire_timer_id = 0; // Timer event id of the expiry of the users
 
 u_short port_TCP = 0; // TCP port
 int sockTCP = -1; // IPv6 TCP socket descriptor
 GIOChannel *chanTCP = NULL; // GIO channel descriptor of TCPv6 socket
 guint chanTCP_id = 0; // Channel number of socket TCPv6
 
+int sockNL = -1; // rtnetlink socket descriptor of the monitor of the local addresses
+GIOChannel *chanNL = NULL; // GIO channel descriptor of the rtnetlink socket
+guint chanNL_id = 0; // Channel number of the rtnetlink socket
+
 
 /*********************\
 |*  Local variables  *|
  \*********************/
+// Answer waiting to be sent to a query
+typedef struct {
+	struct sockaddr_in6 to;		// Query socket of the sender (sockaddr_in for IPv4)
+	gboolean is_ipv6;
+	long long arrived;			// Time when the query arrived (usec)
+	long long due;				// Time when the answer is sent (usec)
+} Query_Reply;
+
+static Query_Reply replies[QUERY_MAX_PENDING];	// Answers waiting
+static int nreplies = 0;
+static guint reply_timer_id = 0;		// Timer of the next answer
+static long long reply_timer_due = 0;	// Time when it fires (usec)
+static long long last_announce[2];		// Last registration sent to the IPv4 [0] and IPv6 [1] groups (usec)
+static char reply_buf[MESSAGE_MAX_LENGTH];
+
+static char query_buf[QUERY_KNOWN_LENGTH];	// Query with the users known
+
+static long long name_sent = 0;		// Time of the last periodic registration (usec)
+static int name_jitter = 1000;		// Part of the period until the next one, in [500, 1500[ thousandths
+static double name_avg_size = 0;	// Average length of the registrations received, with the headers
+static int expire_ticks = 0;		// Ticks of the expiry timer since the connections were checked
+
+// Counters of the discovery datagrams: registrations, cancellations, queries and answers
+typedef struct {
+	long long sent;				// Datagrams sent, one per group and interface
+	long long received;			// Datagrams received
+	long long suppressed;		// Registrations not sent: the periodic ones after a recent one, and
+								//   the answers to the queries that listed this user as known
+} Disc_Stats;
+static Disc_Stats dstats;		// In total
+static Disc_Stats dstats_start;	// At the start of the current STATS_PERIOD
+static Disc_Stats dstats_last;	// In the last STATS_PERIOD
+static long long dstats_time = 0;	// Start of the current STATS_PERIOD (usec)
+
+static guint query_report_id = 0;	// Timer of the report of the last query sent
+static long long query_time = 0;	// Time when the last query was sent (usec)
+static long long query_last = 0;	// Time of the last registration learned after it (usec)
+static int query_found = 0;			// Registrations learned after it
 // Used to define unique numbers for incoming files
 static int counter = 0;
+static pthread_mutex_t cmutex = PTHREAD_MUTEX_INITIALIZER;
 // Temporary buffer
 static char tmp_buf[8000];
 
+static int announce_period(void);
+
 
 
 /****************************************\
@@ -117,14 +187,19 @@ static char tmp_buf[8000];
 
 // Handle REGISTRATION/CANCELLATION packets
 gboolean process_registration(const char *name, int n, const char *ip_str,
-		u_short port, gboolean registration) {
+		u_short port, int ifindex, gboolean registration) {
 
 	if (strlen(name) != n - 1) {
 		Log("Packet with string not terminated with '\\0' - ignored\n");
 		return FALSE;
 	}
+	if (n > PEERS_NAME_LENGTH) {
+		// It would be cut in the registry, and never match its refreshes and cancellation
+		Log("Packet with a name too long - ignored\n");
+		return FALSE;
+	}
 	if (registration) {
-		if (GUI_regist_name(name, ip_str, port)) {
+		if (peers_regist(name, ip_str, port, ifindex)) {
 			// New registration
 			if (!strcmp(user_name, name)) {
 				// Same name as the local name
@@ -133,47 +208,88 @@ gboolean process_registration(const char *name, int n, const char *ip_str,
 					return FALSE;
 				}
 			}
+			if (query_report_id > 0) {
+				// Learned after the last query sent
+				query_found++;
+				query_last = g_get_monotonic_time();
+			}
 		} else
 			return FALSE;
 	} else {
 		// Cancellation
-		if (!GUI_cancel_name(name, ip_str, port)) {
+		if (!peers_cancel(name, ip_str, port)) {
 			sprintf(tmp_buf, "Cancellation of unknown user '%s'\n", name);
 			Log(tmp_buf);
 			return FALSE;
 		}
 	}
+	// The users are removed after the periods of the group as it is now
+	name_period = announce_period();
 	return TRUE;
 }
 
 
-// Sends a message using the IPv6 multicast socket
-gboolean send_multicast(const char *buf, int n) {
+// Sends a message to the group of the IPv4 (is_ipv6 FALSE) or IPv6 socket through
+//   socket s, on each interface where the group is joined
+static gboolean send_links(int s, gboolean is_ipv6, const char *buf, int n) {
+	struct ip_mreqn mr4;
+	gboolean sent = FALSE;
+	int i;
+
+	for (i = 0; i < (is_ipv6 ? nlinks6 : nlinks4); i++) {
+		if (is_ipv6)
+			setsockopt(s, IPPROTO_IPV6, IPV6_MULTICAST_IF, &links6[i], sizeof(links6[i]));
+		else {
+			memset(&mr4, 0, sizeof(mr4));
+			mr4.imr_ifindex = links4[i];
+			setsockopt(s, IPPROTO_IP, IP_MULTICAST_IF, &mr4, sizeof(mr4));
+		}
+		if ((is_ipv6 ? sendto(s, buf, n, 0, (struct sockaddr *) &addr_MCast6, sizeof(addr_MCast6)) :
+				sendto(s, buf, n, 0, (struct sockaddr *) &addr_MCast4, sizeof(addr_MCast4))) < 0)
+			perror(is_ipv6 ? "Error while sending multicast datagram to the IPv6 group" :
+					"Error while sending multicast datagram to the IPv4 group");
+		else {
+			sent = TRUE;
+			dstats.sent++;
+		}
+	}
+	return sent;
+}
+
+// Sends a message to the IPv4 group (family AF_INET), the IPv6 group (AF_INET6)
+//   or both (AF_UNSPEC), if they are joined, on every interface where they are joined
+gboolean send_multicast(const char *buf, int n, int family) {
+	gboolean sent = FALSE;
+
 	if (!active) {
 		debugstr("active is false in send_multicast\n");
 		return FALSE;
 	}
-	assert(active4 ^ active6);
-	assert((sockUDP4>0) ^ (sockUDP6>0));
-	// Sends message.
-	if (active4) {
-		if (sendto(sockUDP4, buf, n, 0, (struct sockaddr *) &addr_MCast4,
-				sizeof(addr_MCast4)) < 0) {
-			perror("Error while sending multicast datagram");
-			return FALSE;
-		}
-	} else {
-		if (sendto(sockUDP6, buf, n, 0, (struct sockaddr *) &addr_MCast6,
-				sizeof(addr_MCast6)) < 0) {
-			perror("Error while sending multicast datagram");
-			return FALSE;
-		}
-	}
-	return TRUE;
+	assert(active4 || active6);
+	// Sends message to each group.
+	if (active4 && (family != AF_INET6) && send_links(sockUDP4, FALSE, buf, n))
+		sent = TRUE;
+	if (active6 && (family != AF_INET) && send_links(sockUDP6, TRUE, buf, n))
+		sent = TRUE;
+	return sent;
 }
 
-// Create a REGISTRATION/CANCELLATION message with the name and sends it
-void multicast_name(gboolean registration) {
+// Write a message cod (REGISTRATION_NAME, CANCELLATION_NAME or QUERY_NAME) with the
+//   TCP port and the name in buf; returns its length
+static int write_name(char *buf, unsigned char cod) {
+	char *ptr = buf;
+
+	assert(user_name != NULL);											// user_name
+	assert(port_TCP > 0);												// port_TCP
+	WRITE_BUF(ptr, &cod, 1);            								// Adds cod
+	WRITE_BUF(ptr, &port_TCP, sizeof(port_TCP));        				// Adds port_TCP
+	WRITE_BUF(ptr, user_name, strlen(user_name) + 1);   				// Adds user_name
+	return ptr - buf;													// Length in network format
+}
+
+// Create a REGISTRATION/CANCELLATION message with the name and sends it to the
+//   groups of family (AF_INET, AF_INET6 or AF_UNSPEC: all)
+void multicast_name_family(gboolean registration, int family) {
 
 	// TASK 1
 	// write the REGISTRATION / CANCELLATIOM message to a temporary buffer and
@@ -181,135 +297,420 @@ void multicast_name(gboolean registration) {
 
 	unsigned char cod;
 	short unsigned int len;
-	char *pt = &tmp_buf[0];
-	char *ptr = pt;
 
-	assert(user_name != NULL);											// user_name
-	assert(port_TCP > 0);												// port_TCP
 	cod = (registration ? REGISTRATION_NAME : CANCELLATION_NAME);		// cod
+	len = write_name(tmp_buf, cod);
+
+	if (send_multicast(tmp_buf, len, family) && registration) {		// send_multicast
+		// It also answers the queries that arrived before
+		if (family != AF_INET6)
+			last_announce[0] = g_get_monotonic_time();
+		if (family != AF_INET)
+			last_announce[1] = g_get_monotonic_time();
+	}
+}
 
-	WRITE_BUF(ptr, &cod, 1);            								// Adds cod
-	WRITE_BUF(ptr, &port_TCP, sizeof(port_TCP));        				// Adds port_TCP
-	WRITE_BUF(ptr, user_name, strlen(user_name) + 1);   				// Adds user_name
-	len = ptr - pt;														// Length in network format
+// Create a REGISTRATION/CANCELLATION message with the name and sends it to all groups
+void multicast_name(gboolean registration) {
+	multicast_name_family(registration, AF_UNSPEC);
+}
+
+// Period of the registrations (ms) for the users of the group, as the interval of the
+//   RTCP reports: the registrations of all users share NAME_BANDWIDTH, with
+//   NAME_TIMER_PERIOD as the shortest period
+static int announce_period(void) {
+	int n = peers_count();
+	double t;
 
-	send_multicast(tmp_buf, len);										// send_multicast
+	t = 1000.0 * ((n > 0) ? n : 1) * name_avg_size / NAME_BANDWIDTH;
+	return (t < NAME_TIMER_PERIOD) ? NAME_TIMER_PERIOD : (int) t;
 }
 
+// Set the name timer to the next periodic registration, name_jitter thousandths of the
+//   period after the last one, with the period of the group as it is now
+static void set_name_timer(void) {
+	long long now = g_get_monotonic_time(), due;
 
-// Test the timer for all neighbors
-void remove_overdue(void) {
+	name_period = announce_period();
+	due = name_sent + (long long) name_period * name_jitter;
+	if (nome_timer_id > 0)
+		g_source_remove(nome_timer_id);
+	nome_timer_id = g_timeout_add((due > now) ? (due - now + 999) / 1000 : 0, callback_name_timer, NULL);
+}
 
-	GList *overdue= GUI_test_all_name_timer();
-	UserInfo *pt;
-	if (overdue != NULL) {
-		GList *list= overdue;
-		while (list != NULL) {
-			pt= (UserInfo *) list->data;
-			if (!GUI_cancel_name(pt->name, pt->ip, pt->port)) {
-#ifdef DEBUG
-				g_print("Cancellation of unknown user '%s'\n", pt->name);
-#endif
-			}
-			list = list->next;
+// Start the periodic registrations after the one sent now; the time until the next
+//   one is random, in [0.5, 1.5[ periods, so the users started together do not send together
+static void restart_name_timer(void) {
+	name_sent = g_get_monotonic_time();
+	name_jitter = g_random_int_range(500, 1500);
+	set_name_timer();
+}
+
+// Start a new STATS_PERIOD of the discovery counters, if the current one ended at now
+static void stats_period(long long now) {
+	if (now - dstats_time < STATS_PERIOD * 1000LL)
+		return;
+	dstats_last.sent = dstats.sent - dstats_start.sent;
+	dstats_last.received = dstats.received - dstats_start.received;
+	dstats_last.suppressed = dstats.suppressed - dstats_start.suppressed;
+	dstats_start = dstats;
+	dstats_time = now;
+}
+
+// Write the discovery counters, of the last STATS_PERIOD and in total, in buf (n bytes)
+void discovery_stats_str(char *buf, int n) {
+	snprintf(buf, n, "discovery: %d users, period %.1f s; last minute: %lld sent, %lld received, "
+			"%lld suppressed; total: %lld sent, %lld received, %lld suppressed\n", peers_count(),
+			name_period / 1000.0, dstats_last.sent, dstats_last.received, dstats_last.suppressed,
+			dstats.sent, dstats.received, dstats.suppressed);
+}
+
+
+
+/*************************************\
+|* Queries of the names              *|
+\*************************************/
+
+// Timer callback of the report of the last query sent, QUERY_REPORT_DELAY ms after it
+gboolean callback_query_report(gpointer data) {
+	query_report_id = 0;
+	if (query_found > 0)
+		sprintf(tmp_buf, "Discovery: %d registrations learned after the query, the last after %lld ms\n",
+				query_found, (query_last - query_time) / 1000);
+	else
+		sprintf(tmp_buf, "Discovery: no registrations learned after the query\n");
+	Log(tmp_buf);
+	return FALSE; // one shot
+}
+
+// Append the user p to the users known of the query in query_buf, with length *data,
+//   as mDNS known answers; the users left out when it is full answer too
+static void add_known(const Peer *p, gpointer data) {
+	int *len = (int *) data;
+	u_short port = p->port;
+	int n = strlen(p->name) + 1;
+	char *ptr = query_buf + *len;
+
+	if (*len + sizeof(port) + n > QUERY_KNOWN_LENGTH)
+		return;
+	WRITE_BUF(ptr, &port, sizeof(port));
+	WRITE_BUF(ptr, p->name, n);
+	*len = ptr - query_buf;
+}
+
+// Return TRUE if this user is one of the users known listed in a query, from pt to end
+static gboolean query_known(char *pt, const char *end) {
+	u_short port;
+	char *name;
+
+	while (end - pt > sizeof(port)) {
+		READ_BUF(pt, &port, sizeof(port));
+		name = pt;
+		if ((pt = memchr(name, '\0', end - name)) == NULL)
+			return FALSE;
+		pt++;
+		if ((port == port_TCP) && !strcmp(name, user_name))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// Send a query with the name to the groups of family (AF_INET, AF_INET6 or AF_UNSPEC:
+//   all) from the query sockets, where the users answer with their names
+// The users heard recently in each group are listed, and do not answer
+void multicast_query(int family) {
+	gboolean sent = FALSE;
+	int len;
+
+	if (!active)
+		return;
+	if (active4 && (family != AF_INET6) && (sockQ4 >= 0)) {
+		len = write_name(query_buf, QUERY_NAME);
+		peers_foreach_known(PEER_IPV4, add_known, &len);
+		if (send_links(sockQ4, FALSE, query_buf, len))
+			sent = TRUE;
+	}
+	if (active6 && (family != AF_INET) && (sockQ6 >= 0)) {
+		len = write_name(query_buf, QUERY_NAME);
+		peers_foreach_known(PEER_IPV6, add_known, &len);
+		if (send_links(sockQ6, TRUE, query_buf, len))
+			sent = TRUE;
+	}
+	if (!sent)
+		return;
+	query_time = g_get_monotonic_time();
+	query_found = 0;
+	if (query_report_id > 0)
+		g_source_remove(query_report_id);
+	query_report_id = g_timeout_add(QUERY_REPORT_DELAY, callback_query_report, NULL);
+}
+
+// Set the timer of the answers to fire at time due (usec), if it is not set to fire before
+static void set_reply_timer(long long due) {
+	long long now = g_get_monotonic_time();
+
+	if ((reply_timer_id > 0) && (reply_timer_due <= due))
+		return;
+	if (reply_timer_id > 0)
+		g_source_remove(reply_timer_id);
+	reply_timer_due = due;
+	reply_timer_id = g_timeout_add((due > now) ? (due - now + 999) / 1000 : 0, callback_query_reply, NULL);
+}
+
+// Drop the answers to the queries already answered by a registration sent to the group
+static void drop_answered(void) {
+	int i;
+
+	for (i = 0; i < nreplies; )
+		if (replies[i].arrived <= last_announce[replies[i].is_ipv6])
+			replies[i] = replies[--nreplies];
+		else
+			i++;
+}
+
+// Answer the query received from the query socket at ip_str#udp_port, in the interface
+//   ifindex, after a random time; a query heard twice is answered once
+static void schedule_reply(const char *ip_str, u_short udp_port, int ifindex) {
+	struct sockaddr_in *to4;
+	Query_Reply *r;
+	int i;
+
+	if (nreplies == QUERY_MAX_PENDING) {
+		Log("Too many queries waiting - query ignored\n");
+		return;
+	}
+	r = &replies[nreplies];
+	memset(r, 0, sizeof(*r));
+	r->is_ipv6 = (strchr(ip_str, ':') != NULL);
+	if (r->is_ipv6) {
+		r->to.sin6_family = AF_INET6;
+		r->to.sin6_port = htons(udp_port);
+		if (inet_pton(AF_INET6, ip_str, &r->to.sin6_addr) != 1)
+			return;
+		if (IN6_IS_ADDR_LINKLOCAL(&r->to.sin6_addr))
+			r->to.sin6_scope_id = ifindex;
+	} else {
+		to4 = (struct sockaddr_in *) &r->to;
+		to4->sin_family = AF_INET;
+		to4->sin_port = htons(udp_port);
+		if (inet_pton(AF_INET, ip_str, &to4->sin_addr) != 1)
+			return;
+	}
+	for (i = 0; i < nreplies; i++)
+		if (!memcmp(&replies[i].to, &r->to, sizeof(r->to)))
+			return;
+	r->arrived = g_get_monotonic_time();
+	r->due = r->arrived + 1000LL * g_random_int_range(QUERY_REPLY_MIN, QUERY_REPLY_MAX);
+	nreplies++;
+	set_reply_timer(r->due);
+}
+
+// Timer callback of the answers to the queries
+// The answers due are sent by unicast to the query socket of each user; when
+//   QUERY_MULTICAST_MIN users of a group wait, one registration to the group answers all
+gboolean callback_query_reply(gpointer data) {
+	long long now = g_get_monotonic_time(), next = 0;
+	int due[2] = { 0, 0 };
+	int i, len, s;
+
+	reply_timer_id = 0;
+	if (!active) {
+		nreplies = 0;
+		return FALSE;
+	}
+	drop_answered();
+	for (i = 0; i < nreplies; i++)
+		if (replies[i].due <= now)
+			due[replies[i].is_ipv6]++;
+	if (due[0] >= QUERY_MULTICAST_MIN)
+		multicast_name_family(TRUE, AF_INET);
+	if (due[1] >= QUERY_MULTICAST_MIN)
+		multicast_name_family(TRUE, AF_INET6);
+	drop_answered();
+
+	len = write_name(reply_buf, REGISTRATION_NAME);
+	for (i = 0; i < nreplies; ) {
+		if (replies[i].due > now) {
+			if ((next == 0) || (replies[i].due < next))
+				next = replies[i].due;
+			i++;
+			continue;
 		}
-		GUI_free_UserInfo_list (overdue);
+		s = replies[i].is_ipv6 ? sockUDP6 : sockUDP4;
+		if ((s >= 0) && (sendto(s, reply_buf, len, 0, (struct sockaddr *) &replies[i].to,
+				replies[i].is_ipv6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) < 0))
+			perror("Error while sending the answer to a query");
+		else if (s >= 0)
+			dstats.sent++;
+		replies[i] = replies[--nreplies];
 	}
+	if (next > 0)
+		set_reply_timer(next);
+	return FALSE; // set again for the next answer
 }
 
 
-// Timer callback for periodical registration of the server's name
+// Remove the neighbors that are overdue
+void remove_overdue(void) {
+	peers_expire();
+}
+
+
+// Timer callback of the expiry of the users, each PEERS_WHEEL_TICK ms, and of the
+//   idle connections, each NAME_TIMER_PERIOD
+gboolean callback_expire_timer(gpointer data) {
+	if (!active)
+		return FALSE;
+	if (!changing)
+		remove_overdue();
+	if (++expire_ticks >= NAME_TIMER_PERIOD / PEERS_WHEEL_TICK) {
+		expire_ticks = 0;
+		pool_expire();
+		sched_expire();
+	}
+	stats_period(g_get_monotonic_time());
+	return TRUE; // periodic timer
+}
+
+
+// Timer callback of the registration of the server's name, after a random part of the period
+// The timer is set again if the group grew since it was set (reconsideration, as
+//   RTCP), and a group that got a registration since the last one in the last half
+//   period, when a query or a change was answered, does not get another one
 gboolean callback_name_timer(gpointer data) {
-	// data - entrymSec with number
+	long long now = g_get_monotonic_time();
+	int f;
+
+	nome_timer_id = 0;
 	if (!active)
 		return FALSE;
 	if (changing) {
 		debugstr("Callback_name_timer while changing\n");
-		return TRUE;
+		restart_name_timer();
+		return FALSE;
 	}
-	debugstr("Callback_name_timer sent NAME\n");
-	multicast_name(TRUE);
-	remove_overdue();
-	return TRUE; // periodic timer
+	name_period = announce_period();
+	if (name_sent + (long long) name_period * name_jitter > now) {
+		set_name_timer();
+		return FALSE;
+	}
+	for (f = 0; f < 2; f++) {
+		if (!(f ? active6 : active4))
+			continue;
+		if ((last_announce[f] > name_sent) && (now - last_announce[f] < name_period * 500LL)) {
+			dstats.suppressed++;
+			continue;
+		}
+		debugstr("Callback_name_timer sent NAME\n");
+		multicast_name_family(TRUE, f ? AF_INET6 : AF_INET);
+	}
+	restart_name_timer();
+	return FALSE; // set again for the next registration
 }
 
 
-// Callback to receive data from UDP socket
+// Handle one datagram of n bytes in buf, received from ip_str#port
+static void process_datagram(char *buf, int n, const char *ip_str, u_short udp_port, int ifindex) {
+	u_short port;
+	unsigned char m;
+	char *pt, *end;
+
+	dstats.received++;
+	if (n < 4) {
+		Log("Packet too short - ignored\n");
+		return;
+	}
+	// Read data //
+	pt = buf;
+	READ_BUF(pt, &m, 1); // Reads type and advances pointer
+	READ_BUF(pt, &port, 2); // Reads port and advances pointer
+#ifdef DEBUG
+	g_print("Received %d bytes from %s#%hu - type %hhd\n", n, ip_str, udp_port, m);
+#endif
+	switch (m) {
+	case REGISTRATION_NAME:
+		// Average length of the registrations, as RTCP, with the headers
+		name_avg_size += (n + NAME_HEADER_LENGTH + ((strchr(ip_str, ':') != NULL) ? 20 : 0)
+				- name_avg_size) / 16;
+		snprintf(tmp_buf, sizeof(tmp_buf), "Registration of '%s' - %s#%hu\n", pt, ip_str,
+				port);
+		if (process_registration(pt, n - 3, ip_str, port, ifindex, TRUE))
+			Log(tmp_buf);
+		break;
+	case CANCELLATION_NAME:
+		snprintf(tmp_buf, sizeof(tmp_buf), "Cancellation of '%s' - %s#%hu\n", pt, ip_str,
+				port);
+		if (process_registration(pt, n - 3, ip_str, port, ifindex, FALSE))
+			Log(tmp_buf);
+		break;
+	case QUERY_NAME:
+		// A registration that asks the users for their names, followed by the users known
+		if ((end = memchr(pt, '\0', n - 3)) == NULL) {
+			Log("Packet with string not terminated with '\\0' - ignored\n");
+			break;
+		}
+		snprintf(tmp_buf, sizeof(tmp_buf), "Query of '%s' - %s#%hu\n", pt, ip_str,
+				port);
+		if (process_registration(pt, end - pt + 1, ip_str, port, ifindex, TRUE))
+			Log(tmp_buf);
+		if (is_local_ip(ip_str) && (port == port_TCP))
+			break; // Own query
+		if (query_known(end + 1, buf + n))
+			dstats.suppressed++; // Known by the user that asked
+		else
+			schedule_reply(ip_str, udp_port, ifindex);
+		break;
+	default:
+		sprintf(tmp_buf, "Invalid packet type (%d) - ignored\n",
+				(int) m);
+		Log(tmp_buf);
+		break;
+	}
+}
+
+
+// Callback to receive data from UDP socket; data points to the variable with the socket
+// It drains the socket in batches of UDP_BATCH datagrams, up to UDP_DRAIN_BATCHES per event
 gboolean callback_UDP_data(GIOChannel *source, GIOCondition condition,
 		gpointer data) {
-	static char buf[MESSAGE_MAX_LENGTH]; // buffer for reading data
-	struct in6_addr ipv6;
-	struct in_addr ipv4;
+	static Udp_Batch batch; // buffers for reading data
 	char ip_str[81];
 	u_short port;
-	int n;
+	int s, n, i, k;
 
-	assert(main_window != NULL);
 	if (!active) {
 		debugstr("callback_UDP_data with active FALSE\n");
 		return FALSE;
 	}
 	if (condition == G_IO_IN) {
-		// Receive packet //
-		if (active6) {
-			n = read_data_ipv6(sockUDP6, buf, MESSAGE_MAX_LENGTH, &ipv6, &port);
-			strncpy(ip_str, addr_ipv6(&ipv6), sizeof(ip_str));
-		} else if (active4) {
-			n = read_data_ipv4(sockUDP4, buf, MESSAGE_MAX_LENGTH, &ipv4, &port);
-			strncpy(ip_str, addr_ipv4(&ipv4), sizeof(ip_str));
-		} else {
+		// Receive packets //
+		s = *(int *) data;
+		if (s < 0) {
 			if (changing)
 				return TRUE;
 			assert(active6 || active4);
+			return TRUE;
 		}
-		if (n <= 0) {
-			Log("Failed reading packet from multicast socket\n");
-			return TRUE; // Continue waiting for more events
-		} else {
-			time_t tbuf;
-			unsigned char m;
-			char *pt;
-
-			// Read data //
-			pt = buf;
-			READ_BUF(pt, &m, 1); // Reads type and advances pointer
-			READ_BUF(pt, &port, 2); // Reads port and advances pointer
-			// Writes date and sender's data //
-			time(&tbuf);
-			sprintf(tmp_buf, "%sReceived %d bytes from %s#%hu - type %hhd\n",
-					ctime(&tbuf), n, ip_str, port, m);
-			g_print("%s", tmp_buf);
-			switch (m) {
-			case REGISTRATION_NAME:
-				sprintf(tmp_buf, "Registration of '%s' - %s#%hu\n", pt, ip_str,
-						port);
-				if (process_registration(pt, n - 3, ip_str, port, TRUE))
-					Log(tmp_buf);
-				else
-					g_print("%s", tmp_buf);
-				break;
-			case CANCELLATION_NAME:
-				sprintf(tmp_buf, "Cancellation of '%s' - %s#%hu\n", pt, ip_str,
-						port);
-				if (process_registration(pt, n - 3, ip_str, port, FALSE))
-					Log(tmp_buf);
-				else
-					g_print("%s", tmp_buf);
-				break;
-			default:
-				sprintf(tmp_buf, "Invalid packet type (%d) - ignored\n",
-						(int) m);
-				Log(tmp_buf);
+		for (k = 0; k < UDP_DRAIN_BATCHES; k++) {
+			if ((n = read_batch_udp(s, &batch)) < 0) {
+				if ((k == 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+					Log("Failed reading packet from multicast socket\n");
 				break;
 			}
-			return TRUE; // Keeps receiving more packets
+			for (i = 0; i < n; i++) {
+				strncpy(ip_str, batch_sender(&batch, i, &port), sizeof(ip_str));
+				process_datagram(batch.buf[i], batch.len[i], ip_str, port, batch.ifindex[i]);
+			}
+			if (n < UDP_BATCH)
+				break; // The socket is empty
 		}
+		return TRUE; // Keeps receiving more packets
 	} else if ((condition == G_IO_NVAL) || (condition == G_IO_ERR)) {
 		Log("Error detected in UDP socket\n");
 		// Turns sockets off
 		close_all();
 		// Closes the application
-		gtk_main_quit();
+		GUI_quit();
 		return FALSE; // Stops callback for receiving packets from socket
 	} else {
 		assert(0); // Should never reach this line
@@ -317,6 +718,41 @@ gboolean callback_UDP_data(GIOChannel *source, GIOCondition condition,
 	}
 }
 
+// Callback of the changes of links and local addresses, sent by the kernel
+// The groups of the families changed are joined in the interfaces as they are now
+//   and the name is announced to them, so the other users learn the new address
+//   without waiting for the timer
+gboolean callback_netlink(GIOChannel *source, GIOCondition condition,
+		gpointer data) {
+	int changed;
+
+	if ((condition == G_IO_NVAL) || (condition == G_IO_ERR)) {
+		Log("Error detected in rtnetlink socket - local addresses are not monitored\n");
+		return FALSE;
+	}
+	if ((changed = ifaddr_monitor_read(sockNL)) <= 0)
+		return TRUE;
+	if (update_local_IP()) {
+		char ipv4[16];
+		strcpy(ipv4, addr_ipv4(&local_ipv4));
+		GUI_local_addresses(ipv4, addr_ipv6(&local_ipv6));
+	}
+	if (!active || changing)
+		return TRUE;
+	if ((changed & IFADDR_CHANGED_IPV4) && active4) {
+		join_links(FALSE);
+		multicast_name_family(TRUE, AF_INET);
+		multicast_query(AF_INET);
+	}
+	if ((changed & IFADDR_CHANGED_IPV6) && active6) {
+		join_links(TRUE);
+		multicast_name_family(TRUE, AF_INET6);
+		multicast_query(AF_INET6);
+	}
+	return TRUE;
+}
+
+
 /***********************************************************\
 |* Functions to handle the list of file transfer threads   *|
  \**********************************************************/
@@ -332,7 +768,7 @@ Thread_Data *new_file_thread_desc(gboolean sending, struct in6_addr *ip, u_short
 	//  g_print("new_desc(pid=%d ; pipe=%d ; %s)\n", pid, pipe, sending?"SND":"RCV");
 	pt = (Thread_Data *) malloc(sizeof(Thread_Data));
 	pt->sending= sending;
-	pt->slow= slow;
+	rate_set(pt, slow ? rate_transfer : 0);
 	memcpy(&pt->ip, ip, sizeof(struct in6_addr));
 	pt->port= port;
 	strncpy(pt->fname, filename, sizeof(pt->fname));
@@ -340,7 +776,23 @@ Thread_Data *new_file_thread_desc(gboolean sending, struct in6_addr *ip, u_short
 	pt->len= 0;
 	pt->s= 0;
 	pt->f= NULL;
+	pt->fd= -1;
+	pt->stripe= NULL;
+	pt->stripe_idx= 0;
 	pt->flen= 0;
+	pt->offset= 0;
+	pt->journal= FALSE;
+	pt->resume_sum= 0;
+	pt->unhashed= FALSE;
+	pt->check= NULL;
+	hash_init(&pt->hash);
+	pt->hashed= TRUE;
+	pt->verified= HASH_NONE;
+	pt->keep= FALSE;
+	pt->reused= FALSE;
+	pt->sched= SCHED_NONE;
+	pt->tcpinfo= NULL;
+	file_write_behind_init(&pt->wb, 0);
 	pt->total= 0;
 	pt->nome[0]= '\0';
 	pt->name_str[0]='\0';
@@ -376,8 +828,14 @@ gboolean free_file_thread_desc(unsigned tid, Thread_Data *pt) {
 		}
 		pt->finished= TRUE;  // Mark the thread as ending
 		UNLOCK_MUTEX(&tmutex, "unlock_t2\n");
-		// Remove the thread from the GUI
-		GUI_remove_thread((unsigned)pt->tid);
+		// Remove the thread from the GUI; a striped file is shown in the row of its first connection
+		if ((pt->stripe == NULL) || stripe_leave(pt))
+			GUI_remove_thread((unsigned)pt->tid);
+		// Let other receptions resume the output file; the journal of incomplete files remains
+		if (pt->journal)
+			resume_release(pt);
+		// Write the TCP_INFO samples of the connection
+		tcpinfo_end(pt);
 		// Close the socket
 		if (pt->s>0) {
 			close (pt->s);
@@ -388,6 +846,12 @@ gboolean free_file_thread_desc(unsigned tid, Thread_Data *pt) {
 			fclose(pt->f);
 			pt->f= NULL;
 		}
+		if (pt->fd >= 0) {
+			close(pt->fd);
+			pt->fd= -1;
+		}
+		// Start the next queued transfer
+		sched_done(pt);
 		// Mark block as freed
 		pt->self= NULL;
 		// Free memory
@@ -414,12 +878,29 @@ void stop_all_file_threads() {
 	UNLOCK_MUTEX(&tmutex, "unlock_t3\n");
 }
 
+// Call func for every transfer, with the list locked; the descriptors are not freed meanwhile
+void foreach_file_thread(void (*func)(Thread_Data *pt, void *data), void *data) {
+	GList *list;
+
+	LOCK_MUTEX(&tmutex, "lock_t4\n");
+	for (list= tcp_conn; list != NULL; list= list->next)
+		func((Thread_Data *) list->data, data);
+	UNLOCK_MUTEX(&tmutex, "unlock_t4\n");
+}
+
+// Choose the name of the next file received, keeping the files left in out_dir
+//   by previous runs for resuming; also called by the receptions of kept connections
+void new_rcv_filename(char *buf, size_t len) {
+	pthread_mutex_lock(&cmutex);
+	do
+		snprintf(buf, len, "%s/file%d.out", out_dir, counter++);
+	while (!access(buf, F_OK));
+	pthread_mutex_unlock(&cmutex);
+}
+
 // Callback to receive connections at TCP socket
 gboolean callback_connections_TCP(GIOChannel *source, GIOCondition condition,
 		gpointer data) {
-	char buf[180]; // buffer for receiving data
-
-	assert(main_window != NULL);
 	assert(active);
 	if (condition == G_IO_IN) {
 		// Received a new connection
@@ -436,12 +917,8 @@ gboolean callback_connections_TCP(GIOChannel *source, GIOCondition condition,
 			sprintf(tmp_buf, "Received connection from %s - %d\n", addr_ipv6(
 					&server.sin6_addr), ntohs(server.sin6_port));
 			Log(tmp_buf);
-			// Sets the filename where the received data will be created
-			sprintf(buf, "%s/file%d.out", out_dir, counter++);
-			// Starts a thread to read the data from the socket
-			Thread_Data *pt= start_rcv_file_thread(msgsock, &server.sin6_addr,
-					ntohs(server.sin6_port), buf, get_slow());
-			return (pt != NULL);
+			// Starts a thread to read the data from the socket, or queues the connection
+			return sched_rcv(msgsock, &server.sin6_addr, ntohs(server.sin6_port), get_slow());
 		}
 
 	} else if ((condition == G_IO_NVAL) || (condition == G_IO_ERR)) {
@@ -449,7 +926,7 @@ gboolean callback_connections_TCP(GIOChannel *source, GIOCondition condition,
 		// Closes the sockets
 		close_all();
 		// Quits the application
-		gtk_main_quit();
+		GUI_quit();
 		return FALSE; // Stops callback for receiving connections in the socket
 	} else {
 		assert(0); // Should never reach this line
@@ -457,20 +934,13 @@ gboolean callback_connections_TCP(GIOChannel *source, GIOCondition condition,
 	}
 }
 
-// Start sending a file to the selected user - handle button "SendFile"
-void on_buttonSendFile_clicked(GtkButton *button, gpointer user_data) {
-	char *ip, *name;
-	int port;
+// Start sending a file to the user 'name' at ip (text) and port, or queue it
+gboolean send_file(const char *ip, int port, const char *name, const char *filename, gboolean slow) {
 	struct in6_addr ip_file;
-	GtkTreeIter iter;
 
 	if (!active) {
 		Log("This program is not active\n");
-		return;
-	}
-	if (!GUI_get_selected_User(&ip, &port, &name, &iter)) {
-		Log("No user is selected\n");
-		return;
+		return FALSE;
 	}
 
 	// TASK 6:
@@ -479,107 +949,219 @@ void on_buttonSendFile_clicked(GtkButton *button, gpointer user_data) {
 	// Suggestion: read section 2.1.5.1 of the introduction document and look to the functions
 	//           in sock.h/sock.c
 
-	// if ipv4 is active, translate to ipv6; if not, store it in ip_file using inet_pton
-	if(active4)
-		g_print("result = %d", translate_ipv4_to_ipv6(ip, &ip_file));
-	else
-		g_print("result = %d", inet_pton(AF_INET6, ip, &ip_file));
-
-	const char *filename = gtk_entry_get_text(main_window->FileName);
-	FILE *f = fopen(filename, "r");
-	if (f == NULL) {
-		Log("Select a valid file to transmit and try again\n");
-		// Open window
-		on_buttonFilename_clicked(NULL, NULL);
-		return;
+	// if ip is an IPv4 address, translate to ipv6; if not, store it in ip_file using inet_pton
+	if ((strchr(ip, ':') == NULL) ? !translate_ipv4_to_ipv6(ip, &ip_file) : (inet_pton(AF_INET6, ip, &ip_file) != 1)) {
+		sprintf(tmp_buf, "Invalid address of user '%s': %s\n", name, ip);
+		Log(tmp_buf);
+		return FALSE;
+	}
+	if (access(filename, R_OK)) {
+		sprintf(tmp_buf, "Cannot read file '%s'\n", filename);
+		Log(tmp_buf);
+		return FALSE;
 	}
-	fclose(f);
 
-	// Start sending the file
-	start_snd_file_thread(&ip_file, port, name, filename, get_slow());
+	// Start sending the file, or queue it; "Slow" files wait for the others
+	return sched_snd(&ip_file, port, name, filename, slow,
+			slow ? SCHED_PRIO_LOW : SCHED_PRIO_NORMAL);
 }
 
-// Stop the selected file transmission - handle button "Stop"
-void on_buttonStop_clicked(GtkButton *button, gpointer user_data) {
-	GtkTreeIter iter;
-	unsigned tid;
-
-	if (!GUI_get_selected_Filetx(&tid, &iter)) {
-		Log("No file transfer is selected\n");
-		return;
-	}
+// Stop the file transfer tid, running or queued
+gboolean stop_transfer(unsigned tid) {
 	fprintf(stderr, "stopping tid %u\n", (unsigned)tid);
 	Thread_Data *th= locate_file_thead_desc(tid);
 	if (th != NULL) {
 		if (!th->finished && (th->self == th))
 			th->finished= TRUE;
-	} else {
+	} else if (!sched_cancel(tid)) {
 		Log("Stop did not locate thread\n");
+		return FALSE;
 	}
+	return TRUE;
+}
+
+// Set the rate of "Slow" transfers (bytes/s); returns TRUE if it was also applied to the transfer tid
+gboolean set_transfer_rate(unsigned tid, long long rate) {
+	rate_transfer= rate;
+	Thread_Data *th= locate_file_thead_desc(tid);
+	if ((th != NULL) && !th->finished && (th->self == th)) {
+		rate_set(th, rate_transfer);
+		return TRUE;
+	}
+	return FALSE;
 }
 
 /*********************************\
 |* Functions to control sockets  *|
 \*********************************/
 
-// Close the UDP sockets
-void close_sockUDP(void) {
-	gboolean old_changing = changing;
-	debugstr("close_sockUDP\n");
-	changing = TRUE;
+// Join (join TRUE) or leave the group of the IPv4 (is_ipv6 FALSE) or IPv6 socket
+//   in the interface ifindex; 0 is the interface chosen by the kernel
+gboolean set_membership(gboolean is_ipv6, int ifindex, gboolean join) {
+	struct ip_mreqn mr4;
+	struct ipv6_mreq mr6;
 
-	if (chanUDP != NULL) {
-		if ((sockUDP4 > 0) ^ (sockUDP6 > 0)) {
-			remove_socket_from_mainloop((sockUDP4 > 0)?sockUDP4:sockUDP6, chanUDP_id, chanUDP);
-			chanUDP= NULL;
+	if (is_ipv6) {
+		mr6 = imr_MCast6;
+		mr6.ipv6mr_interface = ifindex;
+		return setsockopt(sockUDP6, IPPROTO_IPV6, join ? IPV6_JOIN_GROUP : IPV6_LEAVE_GROUP,
+				(char *) &mr6, sizeof(mr6)) == 0;
+	}
+	memset(&mr4, 0, sizeof(mr4));
+	mr4.imr_multiaddr = imr_MCast4.imr_multiaddr;
+	mr4.imr_ifindex = ifindex;
+	return setsockopt(sockUDP4, IPPROTO_IP, join ? IP_ADD_MEMBERSHIP : IP_DROP_MEMBERSHIP,
+			(char *) &mr4, sizeof(mr4)) == 0;
+}
+
+// Join the group of the IPv4 (is_ipv6 FALSE) or IPv6 socket in every interface with
+//   multicast and an address of the family, and leave it in the interfaces gone; without
+//   such interfaces it is joined in the one chosen by the kernel
+// Returns FALSE if the group is not joined in any interface
+gboolean join_links(gboolean is_ipv6) {
+	int *links = is_ipv6 ? links6 : links4;
+	int *nlinks = is_ipv6 ? &nlinks6 : &nlinks4;
+	int want[IFADDR_MAX], joined[IFADDR_MAX];
+	int nwant, njoined = 0, i, j;
+	char ifname[40];		// Interface name, or "the default interface"
+
+	nwant = ifaddr_mcast_links(is_ipv6 ? AF_INET6 : AF_INET, want, IFADDR_MAX);
+	if (nwant == 0)
+		want[nwant++] = 0;
+	// Leave the interfaces not wanted, and the one chosen by the kernel, which may
+	//   have changed; it fails if the interface is gone, with the membership
+	for (i = 0; i < *nlinks; i++) {
+		for (j = 0; (j < nwant) && (want[j] != links[i]); j++)
+			;
+		if ((j == nwant) || (links[i] == 0))
+			set_membership(is_ipv6, links[i], FALSE);
+	}
+	for (j = 0; j < nwant; j++) {
+		for (i = 0; (i < *nlinks) && (links[i] != want[j]); i++)
+			;
+		if ((i < *nlinks) && (want[j] != 0)) {
+			joined[njoined++] = want[j]; // Already joined
+			continue;
 		}
-		// It closed all sockets!
-	} else {
-		if (sockUDP4 > 0) {
-			// TASK 4:
-			// Leave the group and close the UDP IPv4 socket
-			// Look at the IPv6 code and translate to IPv4 ...
-			if (str_addr_MCast4 != NULL) {
-				// Leaves the group
-				if (setsockopt(sockUDP4, IPPROTO_IP, MCAST_LEAVE_GROUP,
-						(char *) &imr_MCast4, sizeof(imr_MCast4)) == -1) {
+		if ((want[j] == 0) || (if_indextoname(want[j], ifname) == NULL))
+			strcpy(ifname, "the default interface");
+		if (set_membership(is_ipv6, want[j], TRUE)) {
+			joined[njoined++] = want[j];
+			sprintf(tmp_buf, "Joined the IPv%d multicast group on %s\n", is_ipv6 ? 6 : 4, ifname);
+		} else {
+			perror("Failed association to multicast group");
+			sprintf(tmp_buf, "Failed association to IPv%d multicast group on %s\n", is_ipv6 ? 6 : 4, ifname);
+		}
+		Log(tmp_buf);
+	}
+	memcpy(links, joined, njoined * sizeof(int));
+	*nlinks = njoined;
+	return njoined > 0;
+}
+
+// Close the query socket of the IPv4 (is_ipv6 FALSE) or IPv6 group
+static void close_sock_query(gboolean is_ipv6) {
+	int *s = is_ipv6 ? &sockQ6 : &sockQ4;
+	GIOChannel **chan = is_ipv6 ? &chanQ6 : &chanQ4;
+	guint *chan_id = is_ipv6 ? &chanQ6_id : &chanQ4_id;
+
+	if (*chan != NULL) {
+		remove_socket_from_mainloop(*s, *chan_id, *chan);
+		*chan = NULL;
+	} else if (*s >= 0)
+		close(*s);
+	*s = -1;
+}
+
+// Create the query socket of the IPv4 (is_ipv6 FALSE) or IPv6 group, with a port of
+//   its own where the answers to the queries arrive, and register its callback
+static gboolean init_sock_query(gboolean is_ipv6) {
+	int *s = is_ipv6 ? &sockQ6 : &sockQ4;
+	GIOChannel **chan = is_ipv6 ? &chanQ6 : &chanQ4;
+	guint *chan_id = is_ipv6 ? &chanQ6_id : &chanQ4_id;
+
+	*s = is_ipv6 ? init_socket_ipv6(SOCK_DGRAM, 0, FALSE) : init_socket_ipv4(SOCK_DGRAM, 0, FALSE);
+	if (*s < 0) {
+		Log("Failed opening the query socket - the names are only learned from the announcements\n");
+		return FALSE;
+	}
+	if (!put_socket_in_mainloop(*s, s, chan_id, chan, G_IO_IN, callback_UDP_data)) {
+		Log("Failed registration of the query socket at Gnome\n");
+		close_sock_query(is_ipv6);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// Close the IPv4 UDP socket
+void close_sockUDP4(void) {
+	int i;
+
+	close_sock_query(FALSE);
+
+	if (chanUDP4 != NULL) {
+		remove_socket_from_mainloop(sockUDP4, chanUDP4_id, chanUDP4);
+		chanUDP4= NULL;
+		// It closed the socket!
+	} else if (sockUDP4 > 0) {
+		if (str_addr_MCast4 != NULL) {
+			// Leaves the group
+			for (i = 0; i < nlinks4; i++)
+				if (!set_membership(FALSE, links4[i], FALSE)) {
 					perror("Failed de-association to IPv4 multicast group");
-					sprintf(
-							tmp_buf,
-							"Failed de-association to IPv4 multicast group (%hu)\n",
+					sprintf(tmp_buf, "Failed de-association to IPv4 multicast group (%hu)\n",
 							sockUDP4);
 					Log(tmp_buf);
 				}
-			}
-			// Close socket
-			if (close(sockUDP4))
-				perror("Error during close of IPv4 multicast socket");
 		}
+		// Close socket
+		if (close(sockUDP4))
+			perror("Error during close of IPv4 multicast socket");
+	}
+	sockUDP4 = -1;
+	str_addr_MCast4 = NULL;
+	nlinks4 = 0;
+	active4 = FALSE;
+}
 
-		if (sockUDP6 > 0) {
-			if (str_addr_MCast6 != NULL) {
-				// Leaves the group
-				if (setsockopt(sockUDP6, IPPROTO_IPV6, IPV6_LEAVE_GROUP,
-						(char *) &imr_MCast6, sizeof(imr_MCast6)) == -1) {
+// Close the IPv6 UDP socket
+void close_sockUDP6(void) {
+	int i;
+
+	close_sock_query(TRUE);
+
+	if (chanUDP6 != NULL) {
+		remove_socket_from_mainloop(sockUDP6, chanUDP6_id, chanUDP6);
+		chanUDP6= NULL;
+		// It closed the socket!
+	} else if (sockUDP6 > 0) {
+		if (str_addr_MCast6 != NULL) {
+			// Leaves the group
+			for (i = 0; i < nlinks6; i++)
+				if (!set_membership(TRUE, links6[i], FALSE)) {
 					perror("Failed de-association to IPv6 multicast group");
-					sprintf(
-							tmp_buf,
-							"Failed de-association to IPv6 multicast group (%hu)\n",
+					sprintf(tmp_buf, "Failed de-association to IPv6 multicast group (%hu)\n",
 							sockUDP6);
 					Log(tmp_buf);
 					/* NOTE: Kernel 2.4 has a bug - it does not support de-association of IPv6 groups! */
 				}
-			}
-			if (close(sockUDP6))
-				perror("Error during close of IPv6 multicast socket");
 		}
+		if (close(sockUDP6))
+			perror("Error during close of IPv6 multicast socket");
 	}
-	sockUDP4 = -1;
-	str_addr_MCast4 = NULL;
-	active4 = FALSE;
 	sockUDP6 = -1;
 	str_addr_MCast6 = NULL;
+	nlinks6 = 0;
 	active6 = FALSE;
+}
+
+// Close the UDP sockets
+void close_sockUDP(void) {
+	gboolean old_changing = changing;
+	debugstr("close_sockUDP\n");
+	changing = TRUE;
+	close_sockUDP4();
+	close_sockUDP6();
 	changing = old_changing;
 }
 
@@ -596,6 +1178,38 @@ void close_sockTCP(void) {
 	port_TCP = 0;
 }
 
+// Close the rtnetlink socket
+void close_sockNL(void) {
+	if (chanNL != NULL) {
+		remove_socket_from_mainloop(sockNL, chanNL_id, chanNL);
+		chanNL= NULL;
+	} else if (sockNL >= 0)
+		close(sockNL);
+	sockNL = -1;
+}
+
+// Create the rtnetlink socket of the monitor of the local addresses, register its
+//   callback, and read the local addresses again, as they may have changed before
+gboolean init_socket_nl(void) {
+	if (sockNL >= 0)
+		close_sockNL();
+	if ((sockNL = ifaddr_monitor_open()) < 0) {
+		Log("Failed opening rtnetlink socket\n");
+		return FALSE;
+	}
+	if (!put_socket_in_mainloop(sockNL, NULL, &chanNL_id, &chanNL, G_IO_IN, callback_netlink)) {
+		Log("Failed registration of rtnetlink socket at Gnome\n");
+		close_sockNL();
+		return FALSE;
+	}
+	if (ifaddr_scan() && update_local_IP()) {
+		char ipv4[16];
+		strcpy(ipv4, addr_ipv4(&local_ipv4));
+		GUI_local_addresses(ipv4, addr_ipv6(&local_ipv6));
+	}
+	return TRUE;
+}
+
 // Create IPv4 UDP socket, configure it, and register its callback
 // It receives configurations from global variables:
 //     port_MCast - multicast port
@@ -603,13 +1217,11 @@ gboolean init_socket_udp4(const char *addr_multicast) {
 	gboolean old_changing = changing;
 	char loop = 1;
 
-	if (active4)
-		return TRUE;
 	changing = TRUE;
-
-	if ((sockUDP6 > 0) || (sockUDP4 > 0)) {
+	if (sockUDP4 > 0) {
+		// Move to another IPv4 group; the IPv6 group is kept
 		debugstr("WARNING: 'init_sockets_udp4' closed UDP socket\n");
-		close_sockUDP();
+		close_sockUDP4();
 	}
 
 	// TASK 4:
@@ -634,9 +1246,8 @@ gboolean init_socket_udp4(const char *addr_multicast) {
 		return FALSE;
 	}
 
-	// Join the group
-	if (setsockopt(sockUDP4, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *) &imr_MCast4, sizeof(imr_MCast4)) == -1) {
-			perror("Failed association to IPv4 multicast group");
+	// Join the group in each interface
+	if (!join_links(FALSE)) {
 			Log("Failed association to IPv4 multicast group\n");
 			return FALSE;
 	}
@@ -645,15 +1256,16 @@ gboolean init_socket_udp4(const char *addr_multicast) {
 	// Configures the socket to receive an echo of the multicast packets sent by this application
 	setsockopt(sockUDP4, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
 
-	// Regist the socket in the main loop of Gtk+
+	// Regist the socket in the GLib main loop
 	// ...
 	//      Use the callback function: callback_UDP_data
 
-	if (!put_socket_in_mainloop(sockUDP4, (void *) 0, &chanUDP_id, &chanUDP, G_IO_IN, callback_UDP_data)) {
+	if (!put_socket_in_mainloop(sockUDP4, &sockUDP4, &chanUDP4_id, &chanUDP4, G_IO_IN, callback_UDP_data)) {
 			Log("Failed registration of UDPv4 socket at Gnome\n");
-			close_sockUDP();
+			close_sockUDP4();
 			return FALSE;
 	}
+	init_sock_query(FALSE);
 	active4 = TRUE;
 	changing = old_changing;
 	return TRUE;
@@ -666,13 +1278,11 @@ gboolean init_socket_udp6(const char *addr_multicast) {
 	gboolean old_changing = changing;
 	char loop = 1;
 
-	if (active6)
-		return TRUE;
-
 	changing = TRUE;
-	if ((sockUDP6 > 0) || (sockUDP4 > 0)) {
+	if (sockUDP6 > 0) {
+		// Move to another IPv6 group; the IPv4 group is kept
 		debugstr("WARNING: 'init_sockets_udp6' closed UDP socket\n");
-		close_sockUDP();
+		close_sockUDP6();
 	}
 
 	// Prepare the data structures
@@ -693,10 +1303,8 @@ gboolean init_socket_udp6(const char *addr_multicast) {
 		Log("Failed opening IPv6 UDP socket\n");
 		return FALSE;
 	}
-	// Join the multicast group
-	if (setsockopt(sockUDP6, IPPROTO_IPV6, IPV6_JOIN_GROUP,
-			(char *) &imr_MCast6, sizeof(imr_MCast6)) == -1) {
-		perror("Failed association to IPv6 multicast group");
+	// Join the multicast group in each interface
+	if (!join_links(TRUE)) {
 		Log("Failed association to IPv6 multicast group\n");
 		return FALSE;
 	}
@@ -705,30 +1313,34 @@ gboolean init_socket_udp6(const char *addr_multicast) {
 	// Configure the socket to receive an echo of the multicast packets sent by this application
 	setsockopt(sockUDP6, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop));
 
-	// Regist the socket in the main loop of Gtk+
-	if (!put_socket_in_mainloop(sockUDP6, (void *) 0, &chanUDP_id, &chanUDP, G_IO_IN,
+	// Regist the socket in the GLib main loop
+	if (!put_socket_in_mainloop(sockUDP6, &sockUDP6, &chanUDP6_id, &chanUDP6, G_IO_IN,
 			callback_UDP_data)) {
 		Log("Failed registration of UDPv6 socket at Gnome\n");
-		close_sockUDP();
+		close_sockUDP6();
 		return FALSE;
 	}
+	init_sock_query(TRUE);
 	active6 = TRUE;
 	changing = old_changing;
 	return TRUE;
 }
 
-// Initialize all sockets. Receives configuration from global variables:
+// Initialize all sockets, joining the IPv4 group addr_multicast4 and the IPv6
+//   group addr_multicast6 (NULL: not joined). Receives configuration from global variables:
 // str_addr_MCast4/6 - IP multicast address
 // imr_MCast4/6 - struct for association to to IP Multicast address
 // port_MCast4/6 - multicast port
 // addr_MCast4/6 - struct with UDP socket data for sending packets to the group
-gboolean init_sockets(gboolean is_ipv6, const char *addr_multicast) {
-	if (is_ipv6) {
-		if (!init_socket_udp6(addr_multicast))
-			return FALSE;
-	} else {
-		if (!init_socket_udp4(addr_multicast))
-			return FALSE;
+gboolean init_sockets(const char *addr_multicast4, const char *addr_multicast6) {
+	assert((addr_multicast4 != NULL) || (addr_multicast6 != NULL));
+	if ((addr_multicast4 != NULL) && !init_socket_udp4(addr_multicast4)) {
+		close_sockUDP();
+		return FALSE;
+	}
+	if ((addr_multicast6 != NULL) && !init_socket_udp6(addr_multicast6)) {
+		close_sockUDP();
+		return FALSE;
 	}
 
 	// Socket TCP   //////////////////////////////////////////////////////////
@@ -760,8 +1372,8 @@ gboolean init_sockets(gboolean is_ipv6, const char *addr_multicast) {
 		return FALSE;
 	}
 
-	// Regists the TCP socket in Gtk+ main loop
-	if (!put_socket_in_mainloop(sockTCP, main_window, &chanTCP_id, &chanTCP, G_IO_IN,
+	// Regists the TCP socket in the GLib main loop
+	if (!put_socket_in_mainloop(sockTCP, NULL, &chanTCP_id, &chanTCP, G_IO_IN,
 			callback_connections_TCP)) {
 		Log("Failed registration of TCPv6 socket at Gnome\n");
 		close_sockUDP();
@@ -784,167 +1396,121 @@ void close_all(void) {
 			g_source_remove(nome_timer_id);
 			nome_timer_id = 0;
 		}
+	if (expire_timer_id > 0) {
+		g_source_remove(expire_timer_id);
+		expire_timer_id = 0;
+	}
+	if (reply_timer_id > 0) {
+		g_source_remove(reply_timer_id);
+		reply_timer_id = 0;
+	}
+	nreplies = 0;
+	if (query_report_id > 0) {
+		g_source_remove(query_report_id);
+		query_report_id = 0;
+	}
 
 	if (user_name != NULL)
 		multicast_name(FALSE);  // send a CANCELLATION message
 	close_sockUDP();
 	close_sockTCP();
+	close_sockNL();
 	set_portT_number(0);
+	sched_clear();
 	stop_all_file_threads();
+	pool_clear();
 	if (user_name != NULL) {
 		free(user_name);
 		user_name = NULL;
 	}
 
-	GUI_clear_names();
+	peers_clear();
 	changing = old_changing;
 }
 
-// Button that starts and stops the application
-void on_togglebuttonActive_toggled(GtkToggleButton *togglebutton, gpointer user_data) {
-
-	if (gtk_toggle_button_get_active(main_window->active)) {
-
-		// *** Starts the server ***
-		const gchar *addr_str, *textNome;
-		gboolean is_ipv6;
-		gboolean b6 = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(main_window->check_ip6));
-		gboolean b4 = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(main_window->check_ip4));
-		assert(b4 ^ b6);
-		changing = TRUE;
-
-		// Get local IP
-		set_local_IP();
-		gtk_entry_set_text(main_window->entryIPv6loc, addr_ipv6(&local_ipv6));
-		gtk_entry_set_text(main_window->entryIPv4loc, addr_ipv4(&local_ipv4));
-		// Read parameters
-		if ((textNome = gtk_entry_get_text(main_window->entryName)) == NULL) {
-			Log("Undefined user name\n");
-			gtk_toggle_button_set_active(togglebutton, FALSE); // Turns button off
-			changing = FALSE;
-			return;
-		}
-		int n = get_portM_number();
-		if (n < 0) {
-			Log("Invalid multicast port number\n");
-			gtk_toggle_button_set_active(togglebutton, FALSE); // Turns button off
-			changing = FALSE;
-			return;
-		}
-		port_MCast = (unsigned short) n;
-		if (!(addr_str = get_IPmult(&is_ipv6, &addr_MCast4.sin_addr,
-				&addr_MCast6.sin6_addr))) {
-			Log("Invalid IP multicast address\n");
-			gtk_toggle_button_set_active(togglebutton, FALSE); // Turns button off
-			changing = FALSE;
-			return;
-		}
-		if (b6 != is_ipv6) {
-			Log("Invalid IP version of multicast address\n");
-			gtk_toggle_button_set_active(togglebutton, FALSE); // Turns button off
-			changing = FALSE;
-			return;
-		}
-		if (b6) {
-			addr_MCast6.sin6_port = htons(port_MCast);
-			addr_MCast6.sin6_family = AF_INET6;
-			addr_MCast6.sin6_flowinfo = 0;
-			bcopy(&addr_MCast6.sin6_addr, &imr_MCast6.ipv6mr_multiaddr,
-					sizeof(addr_MCast6.sin6_addr));
-			imr_MCast6.ipv6mr_interface = 0;
-		} else {
-			assert(b4); // IPv4
-			addr_MCast4.sin_port = htons(port_MCast);
-			addr_MCast4.sin_family = AF_INET;
-			bcopy(&addr_MCast4.sin_addr, &imr_MCast4.imr_multiaddr,
-					sizeof(addr_MCast4.sin_addr));
-			imr_MCast4.imr_interface.s_addr = htonl(INADDR_ANY);
-		}
-		if (!init_sockets(b6, addr_str)) {
-			Log("Failed configuration of server\n");
-			gtk_toggle_button_set_active(togglebutton, FALSE); // Turns button off
-			changing = FALSE;
-			return;
-		}
-		set_portT_number(port_TCP);
-
-		// ****
-		// Starts periodical sending of the NAME
-		user_name = strdup(textNome);
-
-		nome_timer_id = g_timeout_add(NAME_TIMER_PERIOD, callback_name_timer, NULL);
-
-		// ****
-		block_entrys(FALSE);
+// Start the server: join the IPv4 group addr4 and the IPv6 group addr6 (NULL: not joined)
+//   at port port_mcast, open the TCP socket and announce the user name periodically
+gboolean start_server(const char *name, const char *addr4, const char *addr6, u_short port_mcast) {
+	assert(!active);
+	changing = TRUE;
+	port_MCast = port_mcast;
+	if (!init_sockets(addr4, addr6)) {
+		Log("Failed configuration of server\n");
 		changing = FALSE;
-		active = TRUE;
-		// Sends the local name
-		multicast_name(TRUE);
-		Log("fileexchange active\n");
-
-	} else {
-
-		// *** Stops the server ***
-		close_all();
-		block_entrys(TRUE);
-		active = FALSE;
-		Log("fileexchange stopped\n");
+		return FALSE;
 	}
+	set_portT_number(port_TCP);
+	// Follow the changes of the local addresses; without it, they are fixed
+	if (!init_socket_nl())
+		Log("The changes of the local addresses will not be followed\n");
+
+	// ****
+	// Starts periodical sending of the NAME
+	user_name = strdup(name);
+
+	name_avg_size = NAME_HEADER_LENGTH + 3 + strlen(name) + 1;
+	name_period = NAME_TIMER_PERIOD;
+	memset(&dstats, 0, sizeof(dstats));
+	memset(&dstats_start, 0, sizeof(dstats_start));
+	memset(&dstats_last, 0, sizeof(dstats_last));
+	dstats_time = g_get_monotonic_time();
+	expire_timer_id = g_timeout_add(PEERS_WHEEL_TICK, callback_expire_timer, NULL);
+
+	// ****
+	changing = FALSE;
+	active = TRUE;
+	// Sends the local name, and asks the others for theirs
+	multicast_name(TRUE);
+	restart_name_timer();
+	multicast_query(AF_UNSPEC);
+	Log("fileexchange active\n");
+	return TRUE;
+}
 
+// Stop the server
+void stop_server(void) {
+	udp_stats_str(tmp_buf, sizeof(tmp_buf));
+	Log(tmp_buf);
+	discovery_stats_str(tmp_buf, sizeof(tmp_buf));
+	Log(tmp_buf);
+	close_all();
+	active = FALSE;
+	Log("fileexchange stopped\n");
 }
 
-// IPv4 type button modified; it redefines the multicast address and the socket type
-void on_checkbuttonIPv4_toggled(GtkToggleButton *togglebutton,
-		gpointer user_data) {
-	changing = TRUE;
-	// Set IP to IPv4 multicast address
-	gboolean b4 = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(main_window->check_ip4));
-	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(main_window->check_ip6), !b4);
-	gtk_entry_set_text(main_window->entryMIP, g_strdup(!b4 ? "ff18:10:33::1"
-			: "225.0.0.1"));
-	if (active) {
-		if ((!b4 ? !init_socket_udp6("ff18:10:33::1") : !init_socket_udp4(
-				"225.0.0.1"))) {
-			// Creation of socket failed
-			close_all();
-			gtk_toggle_button_set_active(main_window->active, FALSE);
+// Move to the IPv4 or IPv6 multicast group addr_str, or leave the group of that family
+//   if addr_str is NULL; the group of the other family is kept
+// Returns FALSE if it would leave the last group, and closes everything if the new group fails
+gboolean change_group(gboolean is_ipv6, const char *addr_str) {
+	if (active && (addr_str == NULL)) {
+		if (!(is_ipv6 ? active4 : active6)) {
+			Log("At least one multicast group is needed\n");
+			return FALSE;
 		}
+		// The users of this group learn that it is gone
+		multicast_name_family(FALSE, is_ipv6 ? AF_INET6 : AF_INET);
+		changing = TRUE;
+		if (is_ipv6)
+			close_sockUDP6();
+		else
+			close_sockUDP4();
+		changing = FALSE;
+		return TRUE;
 	}
-	changing = FALSE;
-	if (active) {
-		// Sends its local name
-		multicast_name(TRUE);
-	}
-}
-
-// IPv6 type button modified; it redefines the multicast address and the socket type
-void on_checkbuttonIPv6_toggled(GtkToggleButton *togglebutton,
-		gpointer user_data) {
 	changing = TRUE;
-	// Set IP to IPv6 multicast address
-	gboolean b6 = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(main_window->check_ip6));
-	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(main_window->check_ip4), !b6);
-	gtk_entry_set_text(main_window->entryMIP, g_strdup(b6 ? "ff18:10:33::1"
-			: "225.0.0.1"));
 	if (active) {
-		if ((b6 ? !init_socket_udp6("ff18:10:33::1") : !init_socket_udp4(
-				"225.0.0.1"))) {
+		if (is_ipv6 ? !init_socket_udp6(addr_str) : !init_socket_udp4(addr_str)) {
 			// Creation of socket failed
 			close_all();
-			gtk_toggle_button_set_active(main_window->active, FALSE);
+			changing = FALSE;
+			return FALSE;
 		}
 	}
 	changing = FALSE;
 	if (active) {
-		// Sends its local name
+		// Sends its local name, and asks the users of the new group for theirs
 		multicast_name(TRUE);
+		multicast_query(is_ipv6 ? AF_INET6 : AF_INET);
 	}
-}
-
-// The user closed the main window
-gboolean on_window1_delete_event(GtkWidget *widget, GdkEvent *event,
-		gpointer user_data) {
-	close_all();
-	gtk_main_quit();
-	return FALSE;
+	return TRUE;
 }
@@ -10,11 +10,12 @@
  * @author  Luis Bernardo, Rodolfo Oliveira
 \*****************************************************************************/
 
-#include <gtk/gtk.h>
 #include <glib.h>
 #include <netinet/in.h>
 #include <inttypes.h>
 #include "gui.h"
+#include "hash.h"
+#include "file.h"
 
 #ifndef FALSE
 #define FALSE 0
@@ -36,12 +37,16 @@ extern char *out_dir;
 extern char *user_name;
 // List with active TCP connections/threads
 extern GList *tcp_conn;
-// TRUE if IPv4 is on and IPv6 if off
+// TRUE if the IPv4 group is joined
 extern gboolean active4;
-// TRUE if IPv6 is on and IPv4 is off
+// TRUE if the IPv6 group is joined
 extern gboolean active6;
 // Timer event
 extern guint query_timer_id;
+// TCP port where the files are received
+extern u_short port_TCP;
+// Period of the registrations of the name for the users of the group (ms)
+extern int name_period;
 
 
 
@@ -59,14 +64,46 @@ typedef struct Thread_Data {
     char name_str[80]; 	// Thread name
     int s;			   	// Descriptor of the TCP socket
     FILE *f;		   	// In/out file descriptor
+    int fd;				// Raw output file descriptor (receiving)
     long long total; 	// Bytes handled in the subprocess
     long long flen;		// File length
+    long long offset;	// First byte of the body; > 0 for resumed transfers
+    gboolean journal;	// (!sending) output file has a resume journal in out_dir
+    uint32_t resume_sum;	// (!sending) CRC32C of the bytes before offset, from the journal
+    gboolean unhashed;	// (!sending) CRC32C of the bytes before total not known: moved by splice
+    struct Resume_Check *check;	// (sending) check of the resume reply by a helper thread (engine)
+    Hash_State hash;	// Hash of the body bytes moved in this connection
+    gboolean hashed;	// A digest trailer follows the body (no HEADER_NOHASH)
+    int verified;		// (!sending) result of the check of the trailer: HASH_*
+    gboolean keep;		// Connection carries more files after this one (see pool.h)
+    gboolean reused;	// (sending) connection taken from the pool: connected again if it fails before the body
+    int sched;			// Slot held in the transfer scheduler: SCHED_* (see scheduler.h)
+    struct Tcpinfo_Series *tcpinfo;	// TCP_INFO samples of the connection (see tcpinfo.h); NULL before the first
+    Write_Behind wb;	// (!sending) write-behind of the output file
     struct in6_addr ip; // IP address of remote node
     u_short port;		// port number of remote node
     char nome[80];		// User name
-	gboolean slow;		// Using slow configuration
+    long long rate;		// Rate limit of this transfer (bytes/s); 0 if unlimited (rate.c)
+    double rate_tokens;	// Token bucket of the rate limit
+    long long rate_last;	// Time of the last update of the bucket (usec)
 
     gboolean finished;	// If it finished the transference
+
+    struct Stripe_Group *stripe;	// Connections of a striped file being received; NULL if not striped
+    int stripe_idx;		// Range received by this connection
+
+    // State of transfers run by the event-driven engine (unused by transfer threads)
+    int state;			// Current phase of the transfer (ENG_* in engine.c)
+    char hdr[512];		// Header being received or sent
+    int hdr_pos;		// Header bytes already handled
+    int hdr_len;		// Header bytes expected
+    gboolean zerocopy;	// Body sent with sendfile
+    short int last_c;	// Last percentage shown in the GUI
+    long long start;	// Time when the transfer started (usec)
+    long long last_io;	// Time of the last socket activity (usec)
+    long long next_io;	// Time when a transfer paused by its rate limit resumes (usec); 0 if not paused
+    gboolean striped;	// Header starts with a stripe extension, kept at the end of hdr
+    gboolean resumable;	// Connection negotiates the offset where the body starts
     struct Thread_Data *self;	// Self testing pointer, to detected freed memory blocks
 } Thread_Data ;
 
@@ -74,33 +111,74 @@ typedef struct Thread_Data {
 
 //#define DEBUG
 #define MESSAGE_MAX_LENGTH	9000
+#define UDP_DRAIN_BATCHES	8		// Batches of datagrams read per event of the multicast socket
 
 /* Packet types */
 #define REGISTRATION_NAME		21
 #define CANCELLATION_NAME		20
+#define QUERY_NAME				22		// Registration that asks the users to answer with
+										//   theirs, by unicast to the port it came from; it
+										//   is followed by the users known (port and name),
+										//   which do not answer
+
+/* Default multicast groups */
+#define MCAST_GROUP_IPV4	"225.0.0.1"
+#define MCAST_GROUP_IPV6	"ff18:10:33::1"
 
 /* Clock period durations */
-#define NAME_TIMER_PERIOD	10000
+#define NAME_TIMER_PERIOD	10000	// Shortest period of the registrations (ms)
+#define NAME_BANDWIDTH		200		// Bytes/s of a group shared by the registrations of all
+									//   users, as the RTCP reports: the period grows with the users
+#define NAME_HEADER_LENGTH	28		// IPv4 and UDP headers of a registration; 48 with IPv6
+#define STATS_PERIOD		60000	// Period of the discovery counters (ms)
+
+/* Answers to the queries */
+#define QUERY_REPLY_MIN		10		// Each answer waits a random time in [MIN, MAX[ ms,
+#define QUERY_REPLY_MAX		100		//   so the answers of many users do not collide
+#define QUERY_MULTICAST_MIN	4		// Queries of a group due at once, answered with one
+									//   registration to the group instead
+#define QUERY_MAX_PENDING	64		// Answers waiting
+#define QUERY_REPORT_DELAY	1000	// Time after a query when the registrations learned are logged (ms)
+#define QUERY_KNOWN_LENGTH	1400	// Longest query with the users known, not fragmented
 
 
 
 /****************************************\
 |* Functions to handle list of users    *|
  \****************************************/
-// Handle REGISTRATION/CANCELLATION packets
+// Handle REGISTRATION/CANCELLATION packets, received in the interface ifindex
 gboolean process_registration(const char *name, int n, const char *ip_str,
-		u_short port, gboolean registration);
-// Sends a message using the IPv6 multicast socket
-gboolean send_multicast(const char *buf, int n);
-// Create a REGISTRATION/CANCELLATION message with the name and sends it
+		u_short port, int ifindex, gboolean registration);
+// Sends a message to the IPv4 group (family AF_INET), the IPv6 group (AF_INET6)
+//   or both (AF_UNSPEC), if they are joined, on every interface where they are joined
+gboolean send_multicast(const char *buf, int n, int family);
+// Create a REGISTRATION/CANCELLATION message with the name and sends it to the
+//   groups of family (AF_INET, AF_INET6 or AF_UNSPEC: all)
+void multicast_name_family(gboolean registration, int family);
+// Create a REGISTRATION/CANCELLATION message with the name and sends it to all groups
 void multicast_name(gboolean registration);
-// Test the timer for all neighbors
-void test_all_name_timer(void);
-// Timer callback for periodical registration of the server's name
+// Send a query with the name to the groups of family (AF_INET, AF_INET6 or AF_UNSPEC:
+//   all) from the query sockets, where the users answer with their names
+void multicast_query(int family);
+// Timer callback of the answers to the queries
+gboolean callback_query_reply(gpointer data);
+// Timer callback of the report of the last query sent
+gboolean callback_query_report(gpointer data);
+// Remove the neighbors that are overdue
+void remove_overdue(void);
+// Timer callback of the registration of the server's name, after a random part of the period
 gboolean callback_name_timer(gpointer data);
+// Write the discovery counters, of the last STATS_PERIOD and in total, in buf (n bytes)
+void discovery_stats_str(char *buf, int n);
+// Timer callback of the expiry of the users, each PEERS_WHEEL_TICK ms, and of the idle connections
+gboolean callback_expire_timer(gpointer data);
 // Callback to receive data from UDP socket
 gboolean callback_UDP_data(GIOChannel *source, GIOCondition condition,
 		gpointer data);
+// Callback of the changes of links and local addresses: joins the groups again and
+//   announces the name to the families changed
+gboolean callback_netlink(GIOChannel *source, GIOCondition condition,
+		gpointer data);
 
 /***********************************************************\
 |* Functions to handle the list of file transfer threads   *|
@@ -114,27 +192,44 @@ Thread_Data *locate_file_thead_in_list(unsigned tid);
 gboolean free_file_thread_desc(unsigned tid, Thread_Data *pt);
 // Stop the transmission of all files
 void stop_all_file_threads();
+// Call func for every transfer, with the list locked
+void foreach_file_thread(void (*func)(Thread_Data *pt, void *data), void *data);
+// Choose the name of the next file received
+void new_rcv_filename(char *buf, size_t len);
 // Callback to receive connections at TCP socket
 gboolean callback_connections_TCP(GIOChannel *source, GIOCondition condition,
 		gpointer data);
 
 
-// Start sending a file to the selected user - handle button "SendFile"
-void
-on_buttonSendFile_clicked                (GtkButton       *button,
-        								 gpointer         user_data);
-// Stop the selected file transmission - handle button "Stop"
-void
-on_buttonStop_clicked                 	(GtkButton       *button,
-		                                 gpointer         user_data);
+// Start sending a file to the user 'name' at ip (text) and port, or queue it
+gboolean send_file(const char *ip, int port, const char *name, const char *filename, gboolean slow);
+// Stop the file transfer tid, running or queued
+gboolean stop_transfer(unsigned tid);
+// Set the rate of "Slow" transfers (bytes/s); returns TRUE if it was also applied to the transfer tid
+gboolean set_transfer_rate(unsigned tid, long long rate);
 
 /*********************************\
 |* Functions to control sockets  *|
 \*********************************/
+// Join (join TRUE) or leave the group of the IPv4 (is_ipv6 FALSE) or IPv6 socket
+//   in the interface ifindex; 0 is the interface chosen by the kernel
+gboolean set_membership(gboolean is_ipv6, int ifindex, gboolean join);
+// Join the group of the IPv4 (is_ipv6 FALSE) or IPv6 socket in every interface with
+//   multicast and an address of the family (the one chosen by the kernel if none),
+//   and leave it in the interfaces gone; FALSE if it is not joined in any interface
+gboolean join_links(gboolean is_ipv6);
+// Close the IPv4 UDP socket
+void close_sockUDP4(void);
+// Close the IPv6 UDP socket
+void close_sockUDP6(void);
 // Close the UDP sockets
 void close_sockUDP(void);
 // Close TCP socket
 void close_sockTCP(void);
+// Close the rtnetlink socket
+void close_sockNL(void);
+// Create the rtnetlink socket of the monitor of the local addresses, and register its callback
+gboolean init_socket_nl(void);
 // Create IPv4 UDP socket, configure it, and register its callback
 // It receives configurations from global variables:
 //     port_MCast - multicast port
@@ -143,12 +238,13 @@ gboolean init_socket_udp4(const char *addr_multicast);
 // It receives configurations from global variables:
 //     port_MCast - multicast port
 gboolean init_socket_udp6(const char *addr_multicast);
-// Initialize all sockets. Receives configuration from global variables:
+// Initialize all sockets, joining the IPv4 group addr_multicast4 and the IPv6
+//   group addr_multicast6 (NULL: not joined). Receives configuration from global variables:
 // str_addr_MCast4/6 - IP multicast address
 // imr_MCast4/6 - struct for association to to IP Multicast address
 // port_MCast4/6 - multicast port
 // addr_MCast4/6 - struct with UDP socket data for sending packets to the group
-gboolean init_sockets(gboolean is_ipv6, const char *addr_multicast);
+gboolean init_sockets(const char *addr_multicast4, const char *addr_multicast6);
 
 
 /*******************************************************\
@@ -156,21 +252,13 @@ gboolean init_sockets(gboolean is_ipv6, const char *addr_multicast);
 \*******************************************************/
 // Closes everything
 void close_all(void);
-// Button that starts and stops the application
-void
-on_togglebuttonActive_toggled          (GtkToggleButton *togglebutton,
-                                        gpointer         user_data);
-// IPv4 type button modified; it redefines the multicast address and the socket type
-void
-on_checkbuttonIPv4_toggled             (GtkToggleButton *togglebutton,
-                                        gpointer         user_data);
-// IPv6 type button modified; it redefines the multicast address and the socket type
-void
-on_checkbuttonIPv6_toggled             (GtkToggleButton *togglebutton,
-                                        gpointer         user_data);
-// The user closed the main window
-gboolean
-on_window1_delete_event                (GtkWidget       *widget,
-                                        GdkEvent        *event,
-                                        gpointer         user_data);
+// Start the server: join the IPv4 group addr4 and the IPv6 group addr6 (NULL: not joined)
+//   at port port_mcast, open the TCP socket and announce the user name periodically
+gboolean start_server(const char *name, const char *addr4, const char *addr6, u_short port_mcast);
+// Stop the server
+void stop_server(void);
+// Move to the IPv4 or IPv6 multicast group addr_str, or leave the group of that family
+//   if addr_str is NULL; the group of the other family is kept
+// Returns FALSE if it would leave the last group, and closes everything if the new group fails
+gboolean change_group(gboolean is_ipv6, const char *addr_str);
 #endif
@@ -0,0 +1,390 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * daemon.c
+ *
+ * Main function of the headless daemon, configured by the command line and
+ * controlled through a UNIX socket
+ *
+ * The control socket accepts one command per line and answers with text
+ * lines, e.g.:
+ *     echo users | socat - UNIX-CONNECT:/tmp/gui_t2d-<pid>.ctl
+ * Commands: help, status, users, transfers, send <user> <file>,
+ * sendslow <user> <file>, stop <tid>, rate <kbytes/s> [<tid>],
+ * total <kbytes/s>, shutdown.
+ \*****************************************************************************/
+#include <glib.h>
+#include <glib-unix.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "headless.h"
+#include "gui.h"
+#include "peers.h"
+#include "sock.h"
+#include "callbacks.h"
+#include "engine.h"
+#include "rate.h"
+#include "pool.h"
+#include "scheduler.h"
+#include "options.h"
+
+#define DAEMON_DEFAULT_PORT		20000			// Multicast port
+#define CONTROL_LINE_MAX		1024			// Longest command line
+
+// Connection to the control socket
+typedef struct {
+	int s;
+	GIOChannel *chan;
+	guint chan_id;
+	char buf[CONTROL_LINE_MAX];		// Command line being received
+	int len;
+} Control_Client;
+
+/* Options */
+static const char *opt_name= NULL;				// User name; default p<pid>
+static const char *opt_group4= NULL;			// Multicast groups; default both
+static const char *opt_group6= NULL;			//   MCAST_GROUP_IPV4 and MCAST_GROUP_IPV6
+static int opt_port= DAEMON_DEFAULT_PORT;
+static const char *opt_control= NULL;			// Path of the control socket; default /tmp/gui_t2d-<pid>.ctl
+
+/* Control socket */
+static char control_path[108];
+static int sockCtl= -1;
+static GIOChannel *chanCtl= NULL;
+static guint chanCtl_id= 0;
+
+
+// Print the command line options
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [options]\n"
+			"  -u name                     user name (default p<pid>)\n"
+			"  -m address                  IPv6 or IPv4 multicast group; give it twice to join\n"
+			"                              one group of each (default %s and %s)\n"
+			"  -p port                     multicast port (default %d)\n"
+			"  -c path                     control socket (default /tmp/gui_t2d-<pid>.ctl)\n"
+			"  -S                          receive the files as \"Slow\" transfers\n",
+			prog, MCAST_GROUP_IPV6, MCAST_GROUP_IPV4, DAEMON_DEFAULT_PORT);
+	transfer_usage();
+	fprintf(stderr, "  -h                          show this help\n");
+}
+
+// Read the command line options
+static gboolean read_options(int argc, char *argv[]) {
+	int opt;
+
+	while ((opt= getopt(argc, argv, TRANSFER_OPTIONS "u:m:p:c:Sh")) != -1) {
+		switch (opt) {
+		case 'u':
+			opt_name= optarg;
+			break;
+		case 'm':
+			if (strchr(optarg, ':') != NULL)
+				opt_group6= optarg;
+			else
+				opt_group4= optarg;
+			break;
+		case 'p':
+			opt_port= atoi(optarg);
+			if ((opt_port <= 0) || (opt_port > 65535)) {
+				usage(argv[0]);
+				return FALSE;
+			}
+			break;
+		case 'c':
+			opt_control= optarg;
+			break;
+		case 'S':
+			headless_slow= TRUE;
+			break;
+		default:
+			if (!transfer_option(opt, optarg)) {
+				usage(argv[0]);
+				return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
+
+
+/*********************************\
+|* Commands of the control socket *|
+\*********************************/
+
+// Split "<user> <file>"; returns FALSE if one is missing
+static gboolean get_user_file(char *args, char **user, char **file) {
+	if ((args == NULL) || ((*user= strtok_r(args, " \t", file)) == NULL))
+		return FALSE;
+	while ((**file == ' ') || (**file == '\t'))
+		(*file)++;
+	return **file != '\0';
+}
+
+// Run one command and append the answer to out
+static void run_command(char *line, GString *out) {
+	char *cmd, *args, *user, *file;
+	char ip[64], buf[300];
+	int port, rate;
+	Sched_Stats st;
+
+	if ((cmd= strtok_r(line, " \t", &args)) == NULL)
+		return;
+	while ((*args == ' ') || (*args == '\t'))
+		args++;
+
+	if (!strcmp(cmd, "help")) {
+		g_string_append(out, "help | status | users | transfers | send <user> <file> | sendslow <user> <file> |\n"
+				"stop <tid> | rate <kbytes/s> [<tid>] | total <kbytes/s> | shutdown\n");
+
+	} else if (!strcmp(cmd, "status")) {
+		sched_stats(&st);
+		g_string_append_printf(out, "user %s, groups %s %s #%d, %s, TCP port %hu\n",
+				(user_name != NULL) ? user_name : "-", active4 ? opt_group4 : "-",
+				active6 ? opt_group6 : "-", opt_port,
+				active ? "active" : "stopped", port_TCP);
+		g_string_append_printf(out, "sending %d (%d queued), receiving %d (%d queued), "
+				"slow rate %lld KB/s, total rate %lld KB/s\n", st.active_snd, st.queued_snd,
+				st.active_rcv, st.queued_rcv, rate_transfer/1024, rate_global/1024);
+		udp_stats_str(buf, sizeof(buf));
+		g_string_append(out, buf);
+		discovery_stats_str(buf, sizeof(buf));
+		g_string_append(out, buf);
+
+	} else if (!strcmp(cmd, "users")) {
+		headless_print_users(out);
+
+	} else if (!strcmp(cmd, "transfers")) {
+		headless_print_threads(out);
+
+	} else if (!strcmp(cmd, "send") || !strcmp(cmd, "sendslow")) {
+		if (!get_user_file(args, &user, &file))
+			g_string_append(out, "error: send <user> <file>\n");
+		else if (!peers_locate_name(user, ip, sizeof(ip), &port))
+			g_string_append_printf(out, "error: unknown user '%s'\n", user);
+		else if (!send_file(ip, port, user, file, !strcmp(cmd, "sendslow")))
+			g_string_append(out, "error: the file was not sent\n");
+		else
+			g_string_append_printf(out, "sending %s to %s\n", file, user);
+
+	} else if (!strcmp(cmd, "stop")) {
+		if ((*args == '\0') || !stop_transfer((unsigned)strtoul(args, NULL, 10)))
+			g_string_append(out, "error: unknown transfer\n");
+		else
+			g_string_append(out, "stopped\n");
+
+	} else if (!strcmp(cmd, "rate")) {
+		if ((rate= atoi(args)) <= 0) {
+			g_string_append(out, "error: rate <kbytes/s> [<tid>]\n");
+		} else {
+			strtok_r(args, " \t", &args);
+			if (set_transfer_rate((unsigned)strtoul(args, NULL, 10), rate*1024LL))
+				g_string_append_printf(out, "Transfer %s limited to %d KB/s\n", args, rate);
+			else
+				g_string_append_printf(out, "Slow transfers limited to %d KB/s\n", rate);
+		}
+
+	} else if (!strcmp(cmd, "total")) {
+		if ((*args == '\0') || ((rate= atoi(args)) < 0)) {
+			g_string_append(out, "error: total <kbytes/s>\n");
+		} else {
+			rate_set_global(rate*1024LL);
+			g_string_append_printf(out, "All transfers limited to %d KB/s (0: no limit)\n", rate);
+		}
+
+	} else if (!strcmp(cmd, "shutdown")) {
+		g_string_append(out, "shutting down\n");
+		GUI_quit();
+
+	} else {
+		g_string_append_printf(out, "error: unknown command '%s' - try help\n", cmd);
+	}
+}
+
+// Callback to receive commands from a connection to the control socket
+static gboolean callback_control_client(GIOChannel *source, GIOCondition condition,
+		gpointer data) {
+	Control_Client *c= (Control_Client *)data;
+	GString *out;
+	char *line, *end;
+	int n;
+
+	if (condition & G_IO_IN) {
+		n= read(c->s, c->buf+c->len, sizeof(c->buf)-1-c->len);
+		if (n > 0) {
+			c->len+= n;
+			c->buf[c->len]= '\0';
+			out= g_string_new(NULL);
+			// Run the complete lines
+			line= c->buf;
+			while ((end= strchr(line, '\n')) != NULL) {
+				*end= '\0';
+				if ((end > line) && (end[-1] == '\r'))
+					end[-1]= '\0';
+				run_command(line, out);
+				line= end+1;
+			}
+			if ((line == c->buf) && (c->len == (int)sizeof(c->buf)-1)) {
+				g_string_append(out, "error: line too long\n");
+				c->len= 0;
+			} else {
+				c->len-= line-c->buf;
+				memmove(c->buf, line, c->len);
+			}
+			if ((out->len > 0) && (write(c->s, out->str, out->len) < 0))
+				perror("writing to the control socket");
+			g_string_free(out, TRUE);
+			return TRUE;
+		}
+		if ((n < 0) && (errno == EINTR))
+			return TRUE;
+	}
+	// The client closed the connection, or it failed
+	free_gio_channel(c->chan);
+	free(c);
+	return FALSE;
+}
+
+// Callback to receive connections at the control socket
+static gboolean callback_control(GIOChannel *source, GIOCondition condition,
+		gpointer data) {
+	Control_Client *c;
+	int s;
+
+	if (!(condition & G_IO_IN)) {
+		Log("Error detected in the control socket\n");
+		return FALSE;
+	}
+	if ((s= accept(sockCtl, NULL, NULL)) < 0) {
+		perror("accept in the control socket");
+		return TRUE;
+	}
+	if ((c= (Control_Client *)calloc(1, sizeof(Control_Client))) == NULL) {
+		close(s);
+		return TRUE;
+	}
+	c->s= s;
+	if (!put_socket_in_mainloop(s, c, &c->chan_id, &c->chan, G_IO_IN, callback_control_client)) {
+		close(s);
+		free(c);
+	}
+	return TRUE;
+}
+
+// Create the control socket and register its callback
+static gboolean init_control(void) {
+	struct sockaddr_un addr;
+	char buf[200];
+
+	if (opt_control != NULL)
+		g_strlcpy(control_path, opt_control, sizeof(control_path));
+	else
+		snprintf(control_path, sizeof(control_path), "/tmp/gui_t2d-%d.ctl", getpid());
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family= AF_UNIX;
+	g_strlcpy(addr.sun_path, control_path, sizeof(addr.sun_path));
+	unlink(control_path);
+	if ((sockCtl= socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("control socket");
+		return FALSE;
+	}
+	if (bind(sockCtl, (struct sockaddr *)&addr, sizeof(addr)) || listen(sockCtl, 5)) {
+		perror("control socket");
+		close(sockCtl);
+		sockCtl= -1;
+		return FALSE;
+	}
+	if (!put_socket_in_mainloop(sockCtl, NULL, &chanCtl_id, &chanCtl, G_IO_IN, callback_control)) {
+		close(sockCtl);
+		sockCtl= -1;
+		return FALSE;
+	}
+	snprintf(buf, sizeof(buf), "Control socket at '%s'\n", control_path);
+	Log(buf);
+	return TRUE;
+}
+
+// Close the control socket
+static void close_control(void) {
+	if (chanCtl != NULL) {
+		remove_socket_from_mainloop(sockCtl, chanCtl_id, chanCtl);
+		chanCtl= NULL;
+	}
+	sockCtl= -1;
+	unlink(control_path);
+}
+
+// SIGINT and SIGTERM: leave the main loop, so the name is cancelled before leaving
+static gboolean callback_signal(gpointer data) {
+	Log("Signal received - stopping\n");
+	GUI_quit();
+	return TRUE;
+}
+
+
+// main function
+int main(int argc, char *argv[]) {
+	char name[80];
+	struct in_addr addrv4;
+	struct in6_addr addrv6;
+
+	if (!read_options(argc, argv))
+		return 1;
+	// Validate the multicast groups
+	if ((opt_group4 == NULL) && (opt_group6 == NULL)) {
+		opt_group4= MCAST_GROUP_IPV4;
+		opt_group6= MCAST_GROUP_IPV6;
+	}
+	if (((opt_group4 != NULL) && !get_IPv4(opt_group4, &addrv4)) ||
+			((opt_group6 != NULL) && !get_IPv6(opt_group6, &addrv6))) {
+		usage(argv[0]);
+		return 1;
+	}
+	start_transfers();
+
+	// Get local IP
+	set_local_IP();
+	if (valid_local_ipv4)
+		g_print("Local IPv4 address: %s\n", addr_ipv4(&local_ipv4));
+	if (valid_local_ipv6)
+		g_print("Local IPv6 address: %s\n", addr_ipv6(&local_ipv6));
+
+	// Defines the output directory, where the files will be written
+	init_out_dir();
+
+	main_loop= g_main_loop_new(NULL, FALSE);
+	if (!init_control())
+		return 1;
+	g_unix_signal_add(SIGINT, callback_signal, NULL);
+	g_unix_signal_add(SIGTERM, callback_signal, NULL);
+
+	// Defines local name using the pid (process id)
+	if (opt_name == NULL) {
+		sprintf(name, "p%d", getpid());
+		opt_name= name;
+	}
+	if (!start_server(opt_name, opt_group4, opt_group6, (u_short)opt_port)) {
+		close_control();
+		return 1;
+	}
+
+	// Infinite loop handled by GLib
+	g_main_loop_run(main_loop);
+
+	if (active)
+		stop_server();
+	close_control();
+	if (engine_running())
+		engine_stop();
+	pool_clear();
+	g_main_loop_unref(main_loop);
+	return 0;
+}
@@ -0,0 +1,313 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * discobench.c
+ *
+ * Benchmark of the discovery of the users by a user that joins the group
+ *
+ * It starts N headless daemons (gui_t2d) in this host, in an IPv4 group and a
+ * port of their own, and then joins as a new user: it sends a QUERY_NAME and
+ * measures the time until the REGISTRATION_NAME of every daemon arrives, by
+ * unicast or to the group, and the datagrams received meanwhile. With -p it
+ * sends no query and waits for the periodic registrations, as the users that
+ * do not know the query (up to 1.5 periods of the registrations).
+ *     make bench && ./discobench -n 20 -r 5
+ \*****************************************************************************/
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "callbacks.h"
+
+#define BENCH_MAX_PEERS		200
+#define BENCH_PORT			20600			// Multicast port of the benchmark
+#define BENCH_TCP_PORT		1				// TCP port sent in the query; no daemon has it
+#define BENCH_NAME			"discobench"
+
+
+static int npeers= 10;					// Daemons started
+static int rounds= 5;					// Queries measured
+static int timeout_ms= 15000;			// Longest wait of each round
+static gboolean passive= FALSE;			// TRUE: measure the periodic registrations
+static const char *daemon_path= "./gui_t2d";
+static int port= BENCH_PORT;
+
+static pid_t pids[BENCH_MAX_PEERS];
+static char dir[64];					// Directory of the daemons' files
+
+
+// Time in microseconds
+static long long now_usec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Start the daemon k; returns FALSE if it could not be started
+static gboolean start_peer(int k) {
+	char name[32], out[128], ctl[128], log[128], port_str[16];
+
+	sprintf(name, "peer%d", k);
+	sprintf(out, "%s/%s", dir, name);
+	sprintf(ctl, "%s/%s.ctl", dir, name);
+	sprintf(log, "%s/%s.log", dir, name);
+	sprintf(port_str, "%d", port);
+	if ((pids[k]= fork()) < 0) {
+		perror("fork failed");
+		return FALSE;
+	}
+	if (pids[k] == 0) {
+		if (freopen(log, "w", stdout) == NULL || freopen(log, "a", stderr) == NULL)
+			_exit(1);
+		execl(daemon_path, daemon_path, "-u", name, "-o", out, "-c", ctl,
+				"-m", MCAST_GROUP_IPV4, "-p", port_str, (char *)NULL);
+		perror("exec failed");
+		_exit(1);
+	}
+	return TRUE;
+}
+
+// Wait until the control socket of every daemon exists
+static gboolean wait_peers(void) {
+	char ctl[128];
+	struct stat st;
+	long long end= now_usec() + 10000000;
+	int k;
+
+	for (k= 0; k < npeers; k++) {
+		sprintf(ctl, "%s/peer%d.ctl", dir, k);
+		while (stat(ctl, &st) < 0) {
+			if (now_usec() > end) {
+				fprintf(stderr, "peer%d did not start (see %s/peer%d.log)\n", k, dir, k);
+				return FALSE;
+			}
+			usleep(10000);
+		}
+	}
+	return TRUE;
+}
+
+// Stop the daemons and remove their files
+static void stop_peers(void) {
+	char cmd[100];
+	int k;
+
+	for (k= 0; k < npeers; k++)
+		if (pids[k] > 0)
+			kill(pids[k], SIGTERM);
+	for (k= 0; k < npeers; k++)
+		if (pids[k] > 0)
+			waitpid(pids[k], NULL, 0);
+	sprintf(cmd, "rm -rf %s", dir);
+	if (system(cmd) != 0)
+		fprintf(stderr, "could not remove %s\n", dir);
+}
+
+// Open the socket of the group, joined in the default interface
+static int open_group(void) {
+	struct sockaddr_in name;
+	struct ip_mreq mreq;
+	int s, reuse= 1;
+
+	if ((s= socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		perror("socket failed");
+		return -1;
+	}
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	memset(&name, 0, sizeof(name));
+	name.sin_family= AF_INET;
+	name.sin_port= htons(port);
+	if (bind(s, (struct sockaddr *)&name, sizeof(name)) < 0) {
+		perror("bind failed");
+		close(s);
+		return -1;
+	}
+	inet_pton(AF_INET, MCAST_GROUP_IPV4, &mreq.imr_multiaddr);
+	mreq.imr_interface.s_addr= htonl(INADDR_ANY);
+	if (setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+		perror("IP_ADD_MEMBERSHIP failed");
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+// Send a message cod of the user BENCH_NAME to the group from socket s
+static gboolean send_name(int s, unsigned char cod) {
+	struct sockaddr_in to;
+	char buf[64];
+	u_short p= BENCH_TCP_PORT;
+	int n;
+
+	buf[0]= cod;
+	memcpy(buf+1, &p, sizeof(p));
+	strcpy(buf+3, BENCH_NAME);
+	n= 3 + strlen(BENCH_NAME) + 1;
+	memset(&to, 0, sizeof(to));
+	to.sin_family= AF_INET;
+	to.sin_port= htons(port);
+	inet_pton(AF_INET, MCAST_GROUP_IPV4, &to.sin_addr);
+	if (sendto(s, buf, n, 0, (struct sockaddr *)&to, sizeof(to)) != n) {
+		perror("sendto failed");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// Run one round: returns the time (ms) until the registration of every daemon
+//   arrived, or -1 if some did not; sets datagrams with the datagrams received
+static double run_round(int sq, int sg, int *datagrams) {
+	u_short seen[BENCH_MAX_PEERS], p;
+	struct pollfd fds[2];
+	char buf[MESSAGE_MAX_LENGTH];
+	long long start, end, t;
+	int nseen= 0, i, j, n;
+
+	// Discard the datagrams of the previous round
+	while (recv(sq, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+	while (recv(sg, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+	*datagrams= 0;
+	start= now_usec();
+	end= start + (long long)timeout_ms * 1000;
+	if (!passive && !send_name(sq, QUERY_NAME))
+		return -1;
+	fds[0].fd= sq;
+	fds[1].fd= sg;
+	fds[0].events= fds[1].events= POLLIN;
+	while ((nseen < npeers) && ((t= now_usec()) < end)) {
+		if (poll(fds, 2, (int)((end - t + 999) / 1000)) <= 0)
+			continue;
+		for (i= 0; i < 2; i++) {
+			if (!(fds[i].revents & POLLIN))
+				continue;
+			if ((n= recv(fds[i].fd, buf, sizeof(buf), 0)) <= 0)
+				continue;
+			(*datagrams)++;
+			if ((n < 5) || (buf[0] != REGISTRATION_NAME))
+				continue;
+			memcpy(&p, buf+1, sizeof(p));
+			for (j= 0; (j < nseen) && (seen[j] != p); j++)
+				;
+			if (j == nseen)
+				seen[nseen++]= p;
+		}
+	}
+	if (nseen < npeers) {
+		fprintf(stderr, "only %d of %d users were found\n", nseen, npeers);
+		return -1;
+	}
+	return (now_usec() - start) / 1000.0;
+}
+
+int main(int argc, char *argv[]) {
+	struct sockaddr_in name;
+	double t, sum= 0, best= -1, worst= -1;
+	int opt, sq, sg, r, ok= 0, datagrams, total= 0, k;
+
+	while ((opt= getopt(argc, argv, "n:r:t:d:P:ph")) != -1) {
+		switch (opt) {
+		case 'n':
+			npeers= atoi(optarg);
+			break;
+		case 'r':
+			rounds= atoi(optarg);
+			break;
+		case 't':
+			timeout_ms= atoi(optarg);
+			break;
+		case 'd':
+			daemon_path= optarg;
+			break;
+		case 'P':
+			port= atoi(optarg);
+			break;
+		case 'p':
+			passive= TRUE;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n peers] [-r rounds] [-t timeout ms] [-d gui_t2d] [-P port] [-p]\n"
+					"  -p  send no query: wait for the periodic registrations\n", argv[0]);
+			return 1;
+		}
+	}
+	if ((npeers < 1) || (npeers > BENCH_MAX_PEERS) || (rounds < 1)) {
+		fprintf(stderr, "1 to %d peers and at least one round\n", BENCH_MAX_PEERS);
+		return 1;
+	}
+
+	// Query socket: a new user's, in an ephemeral port, where the unicast answers arrive
+	if ((sq= socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		perror("socket failed");
+		return 1;
+	}
+	memset(&name, 0, sizeof(name));
+	name.sin_family= AF_INET;
+	if (bind(sq, (struct sockaddr *)&name, sizeof(name)) < 0) {
+		perror("bind failed");
+		return 1;
+	}
+	if ((sg= open_group()) < 0)
+		return 1;
+
+	sprintf(dir, "/tmp/discobench-%d", (int)getpid());
+	if (mkdir(dir, 0700) < 0) {
+		perror("mkdir failed");
+		return 1;
+	}
+	for (k= 0; k < npeers; k++)
+		if (!start_peer(k)) {
+			npeers= k;
+			stop_peers();
+			return 1;
+		}
+	if (!wait_peers()) {
+		stop_peers();
+		return 1;
+	}
+	// Let the daemons find each other, as a group the new user joins
+	sleep(1);
+
+	for (r= 0; r < rounds; r++) {
+		t= run_round(sq, sg, &datagrams);
+		if (!passive)
+			send_name(sq, CANCELLATION_NAME);
+		if (t < 0) {
+			printf("round %d: not converged after %d ms, %d datagrams\n", r+1, timeout_ms, datagrams);
+			continue;
+		}
+		printf("round %d: %d users in %.1f ms, %d datagrams\n", r+1, npeers, t, datagrams);
+		fflush(stdout);
+		ok++;
+		sum+= t;
+		total+= datagrams;
+		if ((best < 0) || (t < best))
+			best= t;
+		if (t > worst)
+			worst= t;
+		// The answers to this query are not left for the next one
+		usleep(200000);
+	}
+	if (ok > 0)
+		printf("%s: %d users, %d/%d rounds converged: mean %.1f ms, best %.1f ms, worst %.1f ms, %.1f datagrams/round\n",
+				passive ? "periodic" : "query", npeers, ok, rounds, sum/ok, best, worst, (double)total/ok);
+	stop_peers();
+	close(sq);
+	close(sg);
+	return (ok == rounds) ? 0 : 1;
+}
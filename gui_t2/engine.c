@@ -0,0 +1,1029 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * engine.c
+ *
+ * Event-driven file transfer engine
+ *
+ * Each worker owns an epoll set. A transfer is a Thread_Data descriptor whose
+ * socket is non-blocking and registered in exactly one worker, which runs the
+ * header and body phases coded as blocking loops in rcv_file_thread and
+ * snd_file_thread. Only the owning worker frees the descriptor.
+ \*****************************************************************************/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <glib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "engine.h"
+#include "stripe.h"
+#include "resume.h"
+#include "header.h"
+#include "pool.h"
+#include "scheduler.h"
+#include "tune.h"
+#include "tcpinfo.h"
+#include "hash.h"
+#include "rate.h"
+#include "thread.h"
+#include "callbacks.h"
+#include "sock.h"
+#include "file.h"
+#include "gui.h"
+#include "peers.h"
+
+#define ENGINE_BUFLEN		(256*1024)	// Worker buffer used to receive file bodies
+#define ENGINE_CHUNK		(256*1024)	// Maximum bytes moved per event, for fairness
+#define ENGINE_MAX_EVENTS	64			// Events handled per epoll_wait call
+#define ENGINE_SWEEP_MS		100			// Period of the test of stopped and idle transfers
+#define ENGINE_IDLE_TIMEOUT	10000000LL	// Abort transfers without activity for 10 s (usec)
+
+/* Transfer phases */
+#define ENG_RCV_SLEN	1	// Receiving user name length
+#define ENG_RCV_NAME	2	// Receiving user name
+#define ENG_RCV_FLEN	3	// Receiving file name length
+#define ENG_RCV_FNAME	4	// Receiving file name
+#define ENG_RCV_SIZE	5	// Receiving file length
+#define ENG_RCV_BODY	6	// Receiving file contents
+#define ENG_RCV_STRIPES	8	// Owner received its range and waits for the other connections
+#define ENG_RCV_OFFSET	9	// Resume reply sent; receiving the offset where the body starts
+#define ENG_RCV_TRAILER	10	// Receiving the digest sent after the body
+#define ENG_RCV_PACKED	16	// Receiving the rest of a packed header
+#define ENG_SND_CONNECT	11	// Waiting for the connection to be established
+#define ENG_SND_HEADER	12	// Sending the header
+#define ENG_SND_BODY	13	// Sending file contents
+#define ENG_SND_RESUME	14	// Receiving the resume reply
+#define ENG_SND_TRAILER	15	// Sending the digest after the body
+#define ENG_SND_CHECK	17	// A helper thread checks the bytes of the resume reply
+
+/* Results of the state handlers */
+#define ENG_WAIT		0	// Wait for the next event
+#define ENG_DONE		1	// Transfer completed
+#define ENG_FAIL		-1	// Transfer failed
+
+
+// Worker thread data
+typedef struct {
+	pthread_t tid;			// Thread ID
+	int ep;					// epoll descriptor
+	GList *xfers;			// Transfers owned by this worker
+	long long wake;			// Earliest end of a pause of a transfer (0 if none)
+	pthread_mutex_t mutex;	// Protects xfers
+	char buf[ENGINE_BUFLEN];// Receive buffer
+} Engine_Worker;
+
+
+int engine_workers= 0;						// Number of I/O worker threads
+static Engine_Worker *workers[ENGINE_MAX_WORKERS];
+static int nworkers= 0;
+static int next_worker= 0;					// Round-robin assignment of transfers
+static volatile gboolean running= FALSE;
+static unsigned next_id= 1;					// Identifiers of transfers in the GUI table
+static pthread_mutex_t emutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**********************************\
+|*  Transfer state machines       *|
+\**********************************/
+
+// Change the events watched for a transfer
+static void engine_watch(Engine_Worker *w, Thread_Data *pt, uint32_t events)
+{
+	struct epoll_event ev;
+	ev.events= events;
+	ev.data.ptr= pt;
+	if (epoll_ctl(w->ep, EPOLL_CTL_MOD, pt->s, &ev))
+		perror("epoll_ctl MOD");
+}
+
+
+// Receive the missing bytes of the current header field into pt->hdr
+static int rcv_field(Thread_Data *pt)
+{
+	ssize_t n;
+	while (pt->hdr_pos < pt->hdr_len) {
+		n= read(pt->s, pt->hdr+pt->hdr_pos, pt->hdr_len-pt->hdr_pos);
+		if (n > 0) {
+			pt->hdr_pos += n;
+			continue;
+		}
+		if ((n < 0) && (errno == EINTR))
+			continue;
+		if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+			return ENG_WAIT;
+		// A kept connection closed by the sender before the next header is not an error
+		if ((n < 0) || (pt->state != ENG_RCV_SLEN) || (pt->hdr_pos > 0))
+			g_print("%s connection closed while receiving the header\n", pt->name_str);
+		return ENG_FAIL;
+	}
+	return ENG_DONE;
+}
+
+
+// Open the output of a reception after its header and start receiving the body
+static int rcv_open(Thread_Data *pt, const char *nome_p, const char *f_name)
+{
+	if (pt->striped) {
+		Stripe_Header sh;
+		memcpy(&sh, pt->hdr+sizeof(pt->hdr)-sizeof(sh), sizeof(sh));
+		if (!stripe_rcv_join(pt, &sh, nome_p, f_name))
+			return ENG_FAIL;
+	} else if (pt->resumable) {
+		if (!resume_open(pt, nome_p, f_name, pt->offset))
+			return ENG_FAIL;
+	} else if ((pt->fd= open(pt->fname, O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0) {
+		perror("Error creating file for writing");
+		fprintf(stderr, "%s failed to create file '%s' for writing\n", pt->name_str, pt->fname);
+		return ENG_FAIL;
+	}
+	// Reserve the rest of the file at once, instead of growing it write by write
+	if (!pt->striped && !file_preallocate(pt->fd, pt->offset, pt->flen-pt->offset)) {
+		g_print("%s no disk space for %lld bytes - aborting\n", pt->name_str, pt->flen-pt->offset);
+		return ENG_FAIL;
+	}
+	pt->state= ENG_RCV_BODY;
+	// Only the owner of a striped file logs its statistics
+	pt->start= (!pt->striped || stripe_rcv_owner(pt)) ? g_get_monotonic_time() : 0;
+	return ENG_WAIT;
+}
+
+
+// Handle the header phases of a reception; the header fields are stored in sequence in pt->hdr
+static int rcv_header(Thread_Data *pt)
+{
+	short int slen, flen;
+	Resume_Reply rr;
+	Packed_Header h;
+	char *ptr;
+	int r;
+
+	while ((r= rcv_field(pt)) == ENG_DONE) {
+		switch (pt->state) {
+		case ENG_RCV_SLEN:
+			memcpy(&slen, pt->hdr, sizeof(slen));
+			if (slen == HEADER_MARK) {
+				pt->hdr_len= sizeof(Packed_Header);
+				pt->state= ENG_RCV_PACKED;
+				break;
+			}
+			if ((slen <= 0) || (slen > 129)) {
+				g_print("%s invalid user name length - aborting\n", pt->name_str);
+				return ENG_FAIL;
+			}
+			pt->hdr_len += slen;
+			pt->state= ENG_RCV_NAME;
+			break;
+		case ENG_RCV_PACKED:
+			memcpy(&h, pt->hdr, sizeof(h));
+			if (h.version != HEADER_VERSION) {
+				g_print("%s unknown header version %d - aborting\n", pt->name_str, h.version);
+				return ENG_FAIL;
+			}
+			if (!header_valid(&h, pt->name_str))
+				return ENG_FAIL;
+			// Continue with the fields laid out as in the original header
+			if ((pt->striped= (h.flags & HEADER_STRIPE) != 0))
+				memcpy(pt->hdr+sizeof(pt->hdr)-sizeof(Stripe_Header), &h.stripe, sizeof(Stripe_Header));
+			pt->resumable= !pt->striped && (h.flags & HEADER_RESUME);
+			pt->keep= !pt->striped && (h.flags & HEADER_KEEP);
+			pt->hashed= !(h.flags & HEADER_NOHASH);
+			ptr= pt->hdr;
+			slen= h.slen;
+			flen= h.flen;
+			WRITE_BUF(ptr, &slen, sizeof(slen));
+			WRITE_BUF(ptr, h.user, slen);
+			WRITE_BUF(ptr, &flen, sizeof(flen));
+			WRITE_BUF(ptr, h.fname, flen);
+			WRITE_BUF(ptr, &h.size, sizeof(h.size));
+			pt->hdr_pos= pt->hdr_len= ptr-pt->hdr;
+			pt->state= ENG_RCV_SIZE;
+			break;
+		case ENG_RCV_NAME:
+			if (pt->hdr[pt->hdr_pos-1] != '\0') {
+				g_print("%s user name does not have '\\0'- aborting\n", pt->name_str);
+				return ENG_FAIL;
+			}
+			pt->hdr_len += sizeof(flen);
+			pt->state= ENG_RCV_FLEN;
+			break;
+		case ENG_RCV_FLEN:
+			memcpy(&flen, pt->hdr+pt->hdr_pos-sizeof(flen), sizeof(flen));
+			if ((flen <= 0) || (flen > 257)) {
+				g_print("%s invalid file name length - aborting\n", pt->name_str);
+				return ENG_FAIL;
+			}
+			pt->hdr_len += flen;
+			pt->state= ENG_RCV_FNAME;
+			break;
+		case ENG_RCV_FNAME:
+			if (pt->hdr[pt->hdr_pos-1] != '\0') {
+				g_print("%s invalid file name - aborting\n", pt->name_str);
+				return ENG_FAIL;
+			}
+			pt->hdr_len += sizeof(pt->flen);
+			pt->state= ENG_RCV_SIZE;
+			break;
+		case ENG_RCV_SIZE:
+			memcpy(&pt->flen, pt->hdr+pt->hdr_pos-sizeof(pt->flen), sizeof(pt->flen));
+			if (pt->flen < 0) {
+				g_print("%s invalid file length - aborting\n", pt->name_str);
+				return ENG_FAIL;
+			}
+			memcpy(&slen, pt->hdr, sizeof(slen));
+			const char *nome_p= pt->hdr+sizeof(slen);
+			const char *f_name= nome_p+slen+sizeof(flen);
+			GUI_update_thread_info((unsigned)pt->tid, nome_p, f_name);
+			g_print("%s receiving file %s from %s with %lld bytes\n", pt->name_str, f_name, nome_p, pt->flen);
+			if (!pt->resumable)
+				return rcv_open(pt, nome_p, f_name);
+
+			// Tell the sender how much of the file is already here
+			// Nothing was sent in this connection yet, so the reply fits in the socket buffer
+			resume_lookup(pt, nome_p, f_name, &rr);
+			if (send(pt->s, &rr, sizeof(rr), MSG_NOSIGNAL) != sizeof(rr)) {
+				perror("engine send resume reply");
+				return ENG_FAIL;
+			}
+			// Keep the reply after the header, to validate the offset
+			memcpy(pt->hdr+pt->hdr_len, &rr, sizeof(rr));
+			pt->hdr_len += sizeof(rr);
+			pt->hdr_pos= pt->hdr_len;
+			pt->hdr_len += sizeof(pt->offset);
+			pt->state= ENG_RCV_OFFSET;
+			break;
+		case ENG_RCV_OFFSET:
+			memcpy(&pt->offset, pt->hdr+pt->hdr_pos-sizeof(pt->offset), sizeof(pt->offset));
+			memcpy(&rr, pt->hdr+pt->hdr_pos-sizeof(pt->offset)-sizeof(rr), sizeof(rr));
+			if ((pt->offset != 0) && (pt->offset != rr.have)) {
+				g_print("%s invalid resume offset %lld - aborting\n", pt->name_str, pt->offset);
+				return ENG_FAIL;
+			}
+			memcpy(&slen, pt->hdr, sizeof(slen));
+			return rcv_open(pt, pt->hdr+sizeof(slen), pt->hdr+sizeof(slen)+slen+sizeof(flen));
+		default:
+			assert(0);
+		}
+	}
+	return r;
+}
+
+
+// Receive the digest sent after the body (or the range of a striped file) and compare it
+static int rcv_trailer(Thread_Data *pt)
+{
+	uint32_t digest;
+	int r, result= HASH_UNCHECKED;	// Sent without a digest (HEADER_NOHASH)
+
+	if (pt->hashed) {
+		if (pt->state != ENG_RCV_TRAILER) {
+			pt->state= ENG_RCV_TRAILER;
+			pt->hdr_pos= 0;
+			pt->hdr_len= sizeof(digest);
+		}
+		if ((r= rcv_field(pt)) != ENG_DONE)
+			return r;
+		memcpy(&digest, pt->hdr, sizeof(digest));
+		result= hash_check(&pt->hash, digest);
+	}
+	if (pt->stripe != NULL) {
+		if (!stripe_rcv_verify(pt, result))
+			return ENG_FAIL;
+		if (!stripe_rcv_owner(pt))
+			return ENG_DONE;
+		pt->state= ENG_RCV_STRIPES;
+		return ENG_WAIT;
+	}
+	pt->verified= result;
+	if (pt->verified == HASH_MISMATCH)
+		g_print("%s %s does not match the sender - '%s' is corrupted\n", pt->name_str, HASH_NAME, pt->fname);
+	return ENG_DONE;
+}
+
+
+// Receive one chunk of the range of a striped file
+static int rcv_stripe(Engine_Worker *w, Thread_Data *pt)
+{
+	long long left= stripe_rcv_left(pt);
+	ssize_t n;
+
+	if (left > 0) {
+		n= read(pt->s, w->buf, rate_chunk(pt, (left < ENGINE_BUFLEN) ? left : ENGINE_BUFLEN));
+		if (n < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+				return ENG_WAIT;
+			perror("engine read");
+			return ENG_FAIL;
+		}
+		if (n == 0) {
+			g_print("%s connection closed before the end of stripe %d\n", pt->name_str, pt->stripe_idx);
+			return ENG_FAIL;
+		}
+		if (!stripe_rcv_write(pt, w->buf, n))
+			return ENG_FAIL;
+		rate_charge(pt, n);
+		if (n < left)
+			return ENG_WAIT;
+	}
+	return rcv_trailer(pt);
+}
+
+
+// Wait for the other connections of a striped file, after the owner received its range
+// The sender closes all connections at the end, so the end of this one is a good time to test the file
+static int rcv_stripes(Engine_Worker *w, Thread_Data *pt)
+{
+	int r= stripe_rcv_status(pt);
+	ssize_t n;
+	char c;
+
+	if (r != STRIPE_RUNNING)
+		return (r == XFER_OK) ? ENG_DONE : ENG_FAIL;
+	n= read(pt->s, &c, 1);
+	if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+		return ENG_WAIT;
+	if (n > 0) {
+		g_print("%s unexpected data after stripe %d - aborting\n", pt->name_str, pt->stripe_idx);
+		return ENG_FAIL;
+	}
+	// Connection ended before the other ranges were written: engine_sweep tests the file from now on
+	if (epoll_ctl(w->ep, EPOLL_CTL_DEL, pt->s, NULL) && (errno != ENOENT))
+		perror("epoll_ctl DEL");
+	return ENG_WAIT;
+}
+
+
+// Receive one chunk of the file body into pt->fd
+static int rcv_body(Engine_Worker *w, Thread_Data *pt)
+{
+	long long left= pt->flen-pt->total;
+	ssize_t n, m, k;
+
+	if (pt->stripe != NULL)
+		return rcv_stripe(w, pt);
+	if (left <= 0)
+		return rcv_trailer(pt);
+	n= read(pt->s, w->buf, rate_chunk(pt, (left < ENGINE_BUFLEN) ? left : ENGINE_BUFLEN));
+	if (n < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+			return ENG_WAIT;
+		perror("engine read");
+		return ENG_FAIL;
+	}
+	if (n == 0) {
+		// The body is short: the journal is kept, for the sender to resume it
+		g_print("%s connection closed by the sender after %lld of %lld bytes\n", pt->name_str,
+				pt->total, pt->flen);
+		return ENG_FAIL;
+	}
+	for (m= 0; m < n; m += k) {
+		if ((k= write(pt->fd, w->buf+m, n-m)) <= 0) {
+			perror("engine write");
+			return ENG_FAIL;
+		}
+	}
+	hash_update(&pt->hash, w->buf, n);
+	pt->total += n;
+	file_write_behind(&pt->wb, pt->fd, pt->total);
+	rate_charge(pt, n);
+	update_progress(pt, &pt->last_c);
+	return (pt->total >= pt->flen) ? rcv_trailer(pt) : ENG_WAIT;
+}
+
+
+// Prepare the header of a file to send in pt->hdr, the same sent by snd_file_thread
+// Returns FALSE if the names do not fit in the header
+static gboolean snd_build_header(Thread_Data *pt)
+{
+	const char *base= get_trunc_filename(pt->fname);
+	Packed_Header h;
+
+	memmove(pt->fname, base, strlen(base)+1);
+	// Large files are sent in resumable connections, announced in the header
+	pt->resumable= resume_wanted(pt);
+	pt->keep= pool_enabled;
+	// sendfile does not see the bytes: without hash_zerocopy no digest is sent
+	pt->hashed= hash_zerocopy || !pt->zerocopy;
+	if (!header_build(&h, user_name, pt->fname, pt->flen, (pt->resumable ? HEADER_RESUME : 0) |
+			(pt->keep ? HEADER_KEEP : 0) | (pt->hashed ? 0 : HEADER_NOHASH), NULL))
+		return FALSE;
+	memcpy(pt->hdr, &h, sizeof(h));
+	pt->hdr_pos= 0;
+	pt->hdr_len= sizeof(h);
+	// Without the resume reply to wait for, the header, the body of small files and
+	// the trailer leave together in full segments
+	if (!pt->resumable)
+		set_cork(pt->s, TRUE);
+	return TRUE;
+}
+
+
+// Start connecting a new socket pt->s to the receiver; FALSE if it failed
+static gboolean snd_connect(Thread_Data *pt)
+{
+	struct sockaddr_in6 server;
+
+	if ((pt->s= socket(AF_INET6, SOCK_STREAM|SOCK_NONBLOCK, 0)) < 0) {
+		perror("opening stream socket");
+		return FALSE;
+	}
+	server.sin6_family = AF_INET6;
+	server.sin6_flowinfo= 0;
+	server.sin6_port = htons(pt->port);
+	server.sin6_addr = pt->ip;
+	server.sin6_scope_id= peers_scope_id(&pt->ip, pt->port);	// Link-local: interface where it was heard
+	tune_socket(pt->s, TUNE_SND, pt->name_str);
+	if ((connect(pt->s, (struct sockaddr *)&server, sizeof(server)) < 0) && (errno != EINPROGRESS)) {
+		perror("SND>error connecting the TCP socket to send the file");
+		return FALSE;
+	}
+	pt->state= ENG_SND_CONNECT;
+	return TRUE;
+}
+
+
+// The receiver may be closing a kept connection: a file that fails on it before the
+//   body is sent once more over a new connection. Returns FALSE if it is not retried
+static gboolean snd_reconnect(Engine_Worker *w, Thread_Data *pt)
+{
+	struct epoll_event ev;
+
+	if (!pt->reused || ((pt->state != ENG_SND_HEADER) && (pt->state != ENG_SND_RESUME) &&
+			(pt->state != ENG_SND_CHECK)))
+		return FALSE;
+	g_print("%s the kept connection failed before the body - connecting again\n", pt->name_str);
+	pt->reused= FALSE;
+	resume_check_drop(pt);
+	epoll_ctl(w->ep, EPOLL_CTL_DEL, pt->s, NULL);
+	close(pt->s);
+	pt->s= -1;
+	if (!snd_connect(pt) || !snd_build_header(pt))
+		return FALSE;
+	pt->last_io= g_get_monotonic_time();
+	ev.events= EPOLLOUT;
+	ev.data.ptr= pt;
+	if (epoll_ctl(w->ep, EPOLL_CTL_ADD, pt->s, &ev)) {
+		perror("epoll_ctl ADD");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+// Send the missing bytes of pt->hdr
+static int snd_field(Thread_Data *pt)
+{
+	ssize_t n;
+	while (pt->hdr_pos < pt->hdr_len) {
+		n= send(pt->s, pt->hdr+pt->hdr_pos, pt->hdr_len-pt->hdr_pos, MSG_NOSIGNAL);
+		if (n >= 0) {
+			pt->hdr_pos += n;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			return ENG_WAIT;
+		perror("engine send header");
+		return ENG_FAIL;
+	}
+	return ENG_DONE;
+}
+
+
+// Send the missing bytes of the header
+static int snd_header(Thread_Data *pt)
+{
+	int r;
+
+	if ((r= snd_field(pt)) != ENG_DONE)
+		return r;
+	g_print("%s sending file %s from %s with %lld bytes\n", user_name, pt->fname, pt->nome, pt->flen);
+	if (pt->resumable) {
+		// Wait for the reply of the receiver before sending the body
+		pt->state= ENG_SND_RESUME;
+		pt->hdr_pos= 0;
+		pt->hdr_len= sizeof(Resume_Reply);
+		return ENG_DONE;
+	}
+	pt->state= ENG_SND_BODY;
+	pt->start= g_get_monotonic_time();
+	return ENG_DONE;
+}
+
+
+// Send the offset where the body of a resumable file starts
+static int snd_offset(Thread_Data *pt, long long off)
+{
+	// Only the header was sent before, so the offset fits in the socket buffer
+	if (send(pt->s, &off, sizeof(off), MSG_NOSIGNAL) != sizeof(off)) {
+		perror("engine send resume offset");
+		return ENG_FAIL;
+	}
+	pt->offset= pt->total= off;
+	pt->state= ENG_SND_BODY;
+	pt->start= g_get_monotonic_time();
+	return ENG_DONE;
+}
+
+
+// Receive the reply of the receiver of a resumable file and send the offset where the body starts
+// Reading the bytes of the receiver to check them takes long for large files, so a helper
+//   thread does it (ENG_SND_CHECK), and engine_sweep sends the offset when it ends
+static int snd_resume(Thread_Data *pt)
+{
+	Resume_Reply rr;
+	int r;
+
+	if ((r= rcv_field(pt)) != ENG_DONE)
+		return r;
+	memcpy(&rr, pt->hdr, sizeof(rr));
+	if (!resume_check_needed(pt, &rr))
+		return snd_offset(pt, resume_offset(pt, &rr));
+	if (!resume_check_start(pt, &rr)) {
+		g_print("%s could not check the copy of the receiver - sending the whole file\n", pt->name_str);
+		return snd_offset(pt, 0);
+	}
+	pt->state= ENG_SND_CHECK;
+	return ENG_WAIT;
+}
+
+
+// Send the digest of the body after its last byte
+static int snd_trailer(Thread_Data *pt)
+{
+	uint32_t digest;
+	int r;
+
+	if (!pt->hashed) {
+		set_cork(pt->s, FALSE);
+		return ENG_DONE;
+	}
+	if (pt->state != ENG_SND_TRAILER) {
+		digest= hash_final(&pt->hash);
+		memcpy(pt->hdr, &digest, sizeof(digest));
+		pt->state= ENG_SND_TRAILER;
+		pt->hdr_pos= 0;
+		pt->hdr_len= sizeof(digest);
+	}
+	if ((r= snd_field(pt)) == ENG_DONE)
+		set_cork(pt->s, FALSE);
+	return r;
+}
+
+
+// Send one chunk of the file body, with sendfile or through the worker buffer
+static int snd_body(Engine_Worker *w, Thread_Data *pt)
+{
+	long long left= pt->flen-pt->total;
+	size_t len= rate_chunk(pt, (left < ENGINE_CHUNK) ? left : ENGINE_CHUNK);
+	off_t off= pt->total;
+	ssize_t n;
+
+	if (left <= 0)
+		return snd_trailer(pt);
+	if (pt->zerocopy) {
+		n= sendfile(pt->s, fileno(pt->f), &off, len);
+		if ((n < 0) && (pt->total == pt->offset) && ((errno == EINVAL) || (errno == ENOSYS))) {
+			g_print("%s sendfile not supported - using buffered copy\n", pt->name_str);
+			pt->zerocopy= FALSE;
+			return ENG_WAIT;
+		}
+	} else {
+		n= pread(fileno(pt->f), w->buf, (len < ENGINE_BUFLEN) ? len : ENGINE_BUFLEN, pt->total);
+		if (n > 0)
+			n= send(pt->s, w->buf, n, MSG_NOSIGNAL);
+		// Only the bytes accepted by the socket are hashed; the rest is read again
+		if (n > 0)
+			hash_update(&pt->hash, w->buf, n);
+	}
+	if (n < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+			return ENG_WAIT;
+		perror("engine send");
+		return ENG_FAIL;
+	}
+	if (n == 0) {
+		g_print("%s file ended before the announced length\n", pt->name_str);
+		return ENG_FAIL;
+	}
+	// The pages just sent are still in the page cache
+	if (pt->zerocopy && pt->hashed && !hash_update_fd(&pt->hash, fileno(pt->f), off-n, n))
+		return ENG_FAIL;
+	pt->total += n;
+	rate_charge(pt, n);
+	update_progress(pt, &pt->last_c);
+	return (pt->total >= pt->flen) ? snd_trailer(pt) : ENG_WAIT;
+}
+
+
+// Pass the connection of a complete transfer to the next file, when both sides keep it:
+//   the sender stores it in the pool and the receiver waits there for the next header (sched_keep)
+static void engine_keep(Engine_Worker *w, Thread_Data *pt)
+{
+	if (!pt->keep || (pt->total < pt->flen) || !active || (pt->self != pt))
+		return;
+	if (!pt->sending && ((pt->stripe != NULL) || !HASH_ACCEPTED(pt->verified)))
+		return;
+	if (epoll_ctl(w->ep, EPOLL_CTL_DEL, pt->s, NULL))
+		return;
+	// The samples of the connection end with this file
+	tcpinfo_end(pt);
+	if (pt->sending) {
+		pool_put(&pt->ip, pt->port, pt->s);
+		pt->s= -1;
+	} else {
+		if (sched_keep(pt))
+			pt->s= -1;
+	}
+}
+
+
+// Remove a transfer from its worker, log it and free the descriptor
+static void engine_close(Engine_Worker *w, Thread_Data *pt, gboolean ok)
+{
+	pthread_mutex_lock(&w->mutex);
+	w->xfers= g_list_remove(w->xfers, pt);
+	pthread_mutex_unlock(&w->mutex);
+	resume_check_drop(pt);
+	if (!pt->sending && (pt->stripe == NULL))
+		file_write_behind_end(&pt->wb, pt->fd, pt->total);
+	if (ok && pt->journal && (pt->total >= pt->flen) && HASH_ACCEPTED(pt->verified))
+		resume_complete(pt);
+	if (pt->start > 0)
+		log_transfer_stats(pt, pt->sending ? "sending transfer" : "receiving transfer",
+				ok ? (pt->stripe ? "epoll, striped" : (pt->zerocopy ? "epoll+sendfile" : "epoll")) : "epoll, aborted",
+				(long)(g_get_monotonic_time()-pt->start), -1);
+	if (ok)
+		engine_keep(w, pt);
+	if (pt->self == pt)
+		free_file_thread_desc((unsigned)pt->tid, pt);
+}
+
+
+// Handle an event of a transfer
+static void engine_handle(Engine_Worker *w, Thread_Data *pt, uint32_t events)
+{
+	int r= ENG_WAIT;
+	long long d;
+
+	if (!active || (pt->self != pt) || pt->finished) {
+		engine_close(w, pt, FALSE);
+		return;
+	}
+	pt->last_io= g_get_monotonic_time();
+	switch (pt->state) {
+	case ENG_SND_CONNECT: {
+		int err= 0;
+		socklen_t len= sizeof(err);
+		if ((events & (EPOLLERR|EPOLLHUP)) || getsockopt(pt->s, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+			fprintf(stderr, "%sconnection failed: %s\n", pt->name_str, strerror(err));
+			r= ENG_FAIL;
+			break;
+		}
+		pt->state= ENG_SND_HEADER;
+	}
+	// fall through
+	case ENG_SND_HEADER:
+		if ((r= snd_header(pt)) != ENG_DONE)
+			break;
+		if (pt->state == ENG_SND_RESUME) {
+			engine_watch(w, pt, EPOLLIN);
+			r= ENG_WAIT;
+			break;
+		}
+	// fall through
+	case ENG_SND_BODY:
+		r= snd_body(w, pt);
+		break;
+	case ENG_SND_TRAILER:
+		r= snd_trailer(pt);
+		break;
+	case ENG_SND_RESUME:
+		if ((r= snd_resume(pt)) == ENG_DONE) {
+			engine_watch(w, pt, EPOLLOUT);
+			r= ENG_WAIT;
+		} else if (pt->state == ENG_SND_CHECK)
+			engine_watch(w, pt, 0);
+		break;
+	case ENG_SND_CHECK:
+		// The receiver waits for the offset: only an error is expected
+		if (events & (EPOLLERR|EPOLLHUP))
+			r= ENG_FAIL;
+		break;
+	case ENG_RCV_BODY:
+		r= rcv_body(w, pt);
+		break;
+	case ENG_RCV_TRAILER:
+		r= rcv_trailer(pt);
+		break;
+	case ENG_RCV_STRIPES:
+		r= rcv_stripes(w, pt);
+		break;
+	default:
+		r= rcv_header(pt);
+		break;
+	}
+	if ((r == ENG_FAIL) && snd_reconnect(w, pt))
+		return;
+	if (r == ENG_WAIT) {
+		if (((pt->state == ENG_SND_BODY) || (pt->state == ENG_RCV_BODY)) && ((d= rate_delay(pt)) > 0)) {
+			// Over its rate limit: pause the transfer; engine_sweep resumes it
+			pt->next_io= pt->last_io+d;
+			if ((w->wake == 0) || (pt->next_io < w->wake))
+				w->wake= pt->next_io;
+			engine_watch(w, pt, 0);
+		}
+		return;
+	}
+	engine_close(w, pt, r == ENG_DONE);
+}
+
+
+// Longest time a transfer may go without socket activity (usec)
+static long long engine_idle_timeout(Thread_Data *pt)
+{
+	Resume_Reply rr;
+
+	// The sender reads its copy of the bytes of the resume reply before sending the offset
+	if (pt->state == ENG_RCV_OFFSET) {
+		memcpy(&rr, pt->hdr+pt->hdr_len-sizeof(pt->offset)-sizeof(rr), sizeof(rr));
+		return resume_timeout(rr.have);
+	}
+	if ((pt->state == ENG_SND_CHECK) && (pt->check != NULL))
+		return resume_timeout(pt->check->rr.have);
+	return ENGINE_IDLE_TIMEOUT;
+}
+
+
+// Close stopped and idle transfers, and resume paused ones
+static void engine_sweep(Engine_Worker *w)
+{
+	GList *list, *done= NULL, *complete= NULL, *checked= NULL;
+	long long now= g_get_monotonic_time();
+	Thread_Data *pt;
+	int r= XFER_OK;
+	long long d;
+
+	w->wake= 0;
+	pthread_mutex_lock(&w->mutex);
+	for (list= w->xfers; list != NULL; list= list->next) {
+		pt= (Thread_Data *)list->data;
+		if (!running || !active || (pt->self != pt) || pt->finished) {
+			done= g_list_append(done, pt);
+		} else if ((pt->stripe != NULL) && ((r= stripe_rcv_status(pt)) == XFER_ERROR)) {
+			done= g_list_append(done, pt);
+		} else if (pt->state == ENG_RCV_STRIPES) {
+			if (r == XFER_OK)
+				complete= g_list_append(complete, pt);
+		} else if ((pt->state == ENG_SND_CHECK) && resume_check_done(pt, &pt->offset)) {
+			checked= g_list_append(checked, pt);
+		} else if (pt->next_io > 0) {
+			// The limits may have changed during the pause
+			if ((now >= pt->next_io) && ((d= rate_delay(pt)) > 0))
+				pt->next_io= now+d;
+			if (now >= pt->next_io) {
+				pt->next_io= 0;
+				pt->last_io= now;
+				engine_watch(w, pt, pt->sending ? EPOLLOUT : EPOLLIN);
+			} else if ((w->wake == 0) || (pt->next_io < w->wake)) {
+				w->wake= pt->next_io;
+			}
+		} else if (now-pt->last_io > (d= engine_idle_timeout(pt))) {
+			g_print("%s no activity for %lld s - aborting\n", pt->name_str, d/1000000);
+			done= g_list_append(done, pt);
+		}
+	}
+	pthread_mutex_unlock(&w->mutex);
+	// The check of the resume reply ended: send the offset and the body
+	for (list= checked; list != NULL; list= list->next) {
+		pt= (Thread_Data *)list->data;
+		pt->last_io= now;
+		if ((snd_offset(pt, pt->offset) == ENG_DONE) || snd_reconnect(w, pt))
+			engine_watch(w, pt, EPOLLOUT);
+		else
+			done= g_list_append(done, pt);
+	}
+	g_list_free(checked);
+	for (list= done; list != NULL; list= list->next)
+		engine_close(w, (Thread_Data *)list->data, FALSE);
+	for (list= complete; list != NULL; list= list->next)
+		engine_close(w, (Thread_Data *)list->data, TRUE);
+	g_list_free(done);
+	g_list_free(complete);
+}
+
+
+// I/O worker thread
+static void *engine_worker(void *ptr)
+{
+	Engine_Worker *w= (Engine_Worker *)ptr;
+	struct epoll_event ev[ENGINE_MAX_EVENTS];
+	long long last_sweep= 0, now;
+	int i, n, timeout;
+
+	while (running) {
+		// Wake up at the end of the first pause, with millisecond resolution
+		timeout= ENGINE_SWEEP_MS;
+		if (w->wake > 0) {
+			now= (w->wake-g_get_monotonic_time()+999)/1000;
+			timeout= (now < 0) ? 0 : ((now < ENGINE_SWEEP_MS) ? (int)now : ENGINE_SWEEP_MS);
+		}
+		n= epoll_wait(w->ep, ev, ENGINE_MAX_EVENTS, timeout);
+		if ((n < 0) && (errno != EINTR)) {
+			perror("epoll_wait");
+			break;
+		}
+		for (i= 0; i < n; i++)
+			engine_handle(w, (Thread_Data *)ev[i].data.ptr, ev[i].events);
+		now= g_get_monotonic_time();
+		if ((now-last_sweep >= ENGINE_SWEEP_MS*1000) || ((w->wake > 0) && (now >= w->wake))) {
+			engine_sweep(w);
+			last_sweep= g_get_monotonic_time();
+		}
+	}
+	engine_sweep(w);	// running is FALSE: closes all transfers
+	return NULL;
+}
+
+
+/**********************************\
+|*  Engine control                *|
+\**********************************/
+
+// Start the worker threads; returns FALSE if they could not be created
+gboolean engine_start(int n)
+{
+	int i;
+
+	assert((n > 0) && (n <= ENGINE_MAX_WORKERS));
+	running= TRUE;
+	for (i= 0; i < n; i++) {
+		Engine_Worker *w= (Engine_Worker *)malloc(sizeof(Engine_Worker));
+		w->xfers= NULL;
+		w->wake= 0;
+		pthread_mutex_init(&w->mutex, NULL);
+		if ((w->ep= epoll_create1(EPOLL_CLOEXEC)) < 0) {
+			perror("epoll_create1");
+			free(w);
+			break;
+		}
+		if (pthread_create(&w->tid, NULL, engine_worker, w)) {
+			fprintf(stderr, "engine: error starting worker thread\n");
+			close(w->ep);
+			free(w);
+			break;
+		}
+		workers[nworkers++]= w;
+	}
+	if (nworkers < n) {
+		engine_stop();
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+// Stop the worker threads, aborting all transfers still running
+void engine_stop(void)
+{
+	int i;
+
+	running= FALSE;
+	for (i= 0; i < nworkers; i++) {
+		pthread_join(workers[i]->tid, NULL);
+		close(workers[i]->ep);
+		pthread_mutex_destroy(&workers[i]->mutex);
+		free(workers[i]);
+		workers[i]= NULL;
+	}
+	nworkers= 0;
+}
+
+
+// TRUE if the engine is running the transfers
+gboolean engine_running(void)
+{
+	return running && (nworkers > 0);
+}
+
+
+// Give a new identifier to a transfer and register it in the GUI table
+static void engine_regist(Thread_Data *pt, const char *type, const char *name, const char *filename)
+{
+	pthread_mutex_lock(&emutex);
+	pt->tid= (pthread_t)next_id++;
+	pthread_mutex_unlock(&emutex);
+	sprintf(pt->name_str, "%s(%u)> ", type, (unsigned)pt->tid);
+	GUI_regist_thread((unsigned)pt->tid, type, name, filename);
+}
+
+
+// Register the socket of a transfer in the next worker
+static gboolean engine_add(Thread_Data *pt, uint32_t events)
+{
+	struct epoll_event ev;
+	Engine_Worker *w;
+
+	pthread_mutex_lock(&emutex);
+	w= workers[next_worker];
+	next_worker= (next_worker+1) % nworkers;
+	pthread_mutex_unlock(&emutex);
+
+	pt->last_c= 0;
+	pt->start= 0;
+	pt->next_io= 0;
+	pt->last_io= g_get_monotonic_time();
+	fcntl(pt->s, F_SETFL, fcntl(pt->s, F_GETFL)|O_NONBLOCK);
+
+	pthread_mutex_lock(&w->mutex);
+	w->xfers= g_list_append(w->xfers, pt);
+	ev.events= events;
+	ev.data.ptr= pt;
+	if (epoll_ctl(w->ep, EPOLL_CTL_ADD, pt->s, &ev)) {
+		perror("epoll_ctl ADD");
+		w->xfers= g_list_remove(w->xfers, pt);
+		pthread_mutex_unlock(&w->mutex);
+		return FALSE;
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return TRUE;
+}
+
+
+// Start receiving a file from an accepted connection
+Thread_Data *engine_start_rcv(int msgsock, struct in6_addr *ip, u_short port,
+		const char *filename, gboolean slow)
+{
+	if (!active)
+		return NULL;
+	Thread_Data *pt= new_file_thread_desc(FALSE, ip, port, filename, slow);
+	pt->s= msgsock;
+	pt->state= ENG_RCV_SLEN;
+	pt->hdr_pos= 0;
+	pt->hdr_len= sizeof(short int);
+	pt->zerocopy= FALSE;
+	pt->striped= FALSE;
+	pt->resumable= FALSE;
+	// Register in the GUI before the worker can update the line
+	engine_regist(pt, "RCV", "?", filename);
+	tune_socket(pt->s, TUNE_RCV, pt->name_str);
+	if (!engine_add(pt, EPOLLIN)) {
+		free_file_thread_desc((unsigned)pt->tid, pt);
+		return NULL;
+	}
+	return pt;
+}
+
+
+// Start sending a file to (ip_file, port)
+Thread_Data *engine_start_snd(struct in6_addr *ip_file, u_short port,
+		const char *nome, const char *filename, gboolean slow)
+{
+	assert(ip_file != NULL);
+	assert(nome != NULL);
+	assert(filename != NULL);
+
+	Thread_Data *pt= new_file_thread_desc(TRUE, ip_file, port, filename, slow);
+	strncpy(pt->nome, nome, sizeof(pt->nome));
+	pt->zerocopy= (snd_mode == XFER_MODE_ZEROCOPY);
+	engine_regist(pt, "SND", nome, filename);
+
+	if ((pt->f= fopen(pt->fname, "r")) == NULL) {
+		perror("Error opening file");
+		free_file_thread_desc((unsigned)pt->tid, pt);
+		return NULL;
+	}
+	pt->flen= get_filesize(pt->fname);
+	// Reuse the connection left open by a previous file sent to the same peer
+	if ((pt->s= pool_get(&pt->ip, pt->port, TRUE)) >= 0) {
+		pt->state= ENG_SND_HEADER;
+		pt->reused= TRUE;
+	} else if (!snd_connect(pt)) {
+		free_file_thread_desc((unsigned)pt->tid, pt);
+		return NULL;
+	}
+	if (!snd_build_header(pt)) {
+		g_print("%s user or file name too long - aborting\n", pt->name_str);
+		free_file_thread_desc((unsigned)pt->tid, pt);
+		return NULL;
+	}
+	if (!engine_add(pt, EPOLLOUT)) {
+		free_file_thread_desc((unsigned)pt->tid, pt);
+		return NULL;
+	}
+	return pt;
+}
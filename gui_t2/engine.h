@@ -0,0 +1,44 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * engine.h
+ *
+ * Header file of the event-driven file transfer engine
+ *
+ * A small fixed set of I/O worker threads runs all transfers, each one as a
+ * non-blocking state machine registered in the epoll set of one worker.
+ \*****************************************************************************/
+#ifndef ENGINE_INC_
+#define ENGINE_INC_
+
+#include <glib.h>
+#include <netinet/in.h>
+
+#include "callbacks.h"
+
+#define ENGINE_MAX_WORKERS	64
+
+// Number of I/O worker threads; 0 selects one thread per transfer
+extern int engine_workers;
+
+
+/*******************************************************\
+|* Functions that control the event-driven engine      *|
+\*******************************************************/
+
+// Start the worker threads; returns FALSE if they could not be created
+gboolean engine_start(int nworkers);
+// Stop the worker threads, aborting all transfers still running
+void engine_stop(void);
+// TRUE if the engine is running the transfers
+gboolean engine_running(void);
+
+// Start receiving a file from an accepted connection
+Thread_Data *engine_start_rcv(int msgsock, struct in6_addr *ip, u_short port,
+		const char *filename, gboolean slow);
+// Start sending a file to (ip_file, port)
+Thread_Data *engine_start_snd(struct in6_addr *ip_file, u_short port,
+		const char *nome, const char *filename, gboolean slow);
+
+#endif
@@ -9,18 +9,27 @@
  * Updated on October 8, 2019,16:00
  * @author  Luis Bernardo, Rodolfo Oliveira
 \*****************************************************************************/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #ifdef HAVE_CONFIG_H
 #  include <config.h>
 #endif
 
-#include <gtk/gtk.h>
+#include <glib.h>
 #include <assert.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "hash.h"
+#include "file.h"
 
+int write_behind= WRITE_BEHIND_DEFAULT;
 
 
 // Creates a directory and sets permissions that allow creation of new files
@@ -52,14 +61,69 @@ uint64_t get_filesize(const char *FileName)
 }
 
 
-// Returns a XOR HASH value for the contents of a file
+// Returns the CRC32C hash of the contents of a file (the digest sent after the body)
 uint32_t fhash(FILE *f) {
   assert(f != NULL);
   rewind(f);
-  uint32_t sum= 0;
-  uint32_t aux= 0;
-  while (fread(&aux, 1, sizeof(aux), f) > 0)
-      sum ^= aux;
-  return sum;
+  unsigned char buf[64*1024];
+  Hash_State h;
+  size_t n;
+
+  hash_init(&h);
+  while ((n= fread(buf, 1, sizeof(buf), f)) > 0)
+      hash_update(&h, buf, n);
+  return hash_final(&h);
+}
+
+
+// Reserves the blocks of len bytes of a file being received, from offset off
+// The file size is kept, so a partial copy shows how much was received
+// Returns FALSE only if the disk has no space for the file
+gboolean file_preallocate(int fd, long long off, long long len) {
+  if ((len <= 0) || !fallocate(fd, FALLOC_FL_KEEP_SIZE, off, len))
+    return TRUE;
+  if (errno == ENOSPC)
+    return FALSE;
+  if ((errno != EOPNOTSUPP) && (errno != ENOSYS))
+    perror("fallocate");
+  return TRUE;  // Filesystem without fallocate: the file grows as it is written
+}
+
+
+// Starts the write-behind of a file written sequentially from offset off
+void file_write_behind_init(Write_Behind *wb, long long off) {
+  wb->flushed= wb->dropped= off;
+}
+
+
+// Write-behind of a file written sequentially up to offset end
+// Every write_behind bytes, starts the writeback of the new data and waits for the
+// previous window, already on its way to the disk, before dropping it from the page cache
+void file_write_behind(Write_Behind *wb, int fd, long long end) {
+  if ((write_behind <= 0) || (end-wb->flushed < write_behind))
+    return;
+  sync_file_range(fd, wb->flushed, end-wb->flushed, SYNC_FILE_RANGE_WRITE);
+  if (wb->flushed > wb->dropped) {
+    sync_file_range(fd, wb->dropped, wb->flushed-wb->dropped,
+        SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, wb->dropped, wb->flushed-wb->dropped, POSIX_FADV_DONTNEED);
+    wb->dropped= wb->flushed;
+  }
+  wb->flushed= end;
 }
 
+
+// Ends the write-behind of a file written up to offset end, before it is closed
+// The last window is only submitted, so closing the file does not wait for the disk
+void file_write_behind_end(Write_Behind *wb, int fd, long long end) {
+  if ((write_behind <= 0) || (fd < 0))
+    return;
+  if (wb->flushed > wb->dropped) {
+    sync_file_range(fd, wb->dropped, wb->flushed-wb->dropped,
+        SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, wb->dropped, wb->flushed-wb->dropped, POSIX_FADV_DONTNEED);
+  }
+  if (end > wb->flushed)
+    sync_file_range(fd, wb->flushed, end-wb->flushed, SYNC_FILE_RANGE_WRITE);
+  wb->flushed= wb->dropped= end;
+}
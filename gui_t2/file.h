@@ -13,6 +13,17 @@
 #define FILE_INC_
 #include <inttypes.h>
 
+#define WRITE_BEHIND_DEFAULT	(8*1024*1024)	// Default window of the write-behind
+
+// Bytes of received data kept dirty in the page cache before they are written and dropped (0 disables)
+extern int write_behind;
+
+// Write-behind state of a file being received
+typedef struct {
+  long long flushed;	// Writeback started for the bytes before this offset
+  long long dropped;	// Bytes before this offset are on disk and out of the page cache
+} Write_Behind;
+
 // Creates a directory and sets permissions that allow creation of new files
 gboolean make_directory(const char *dirname);
 
@@ -22,7 +33,18 @@ const char *get_trunc_filename(const char *FileName);
 // Returns the file length
 uint64_t get_filesize(const char *FileName);
 
-// Returns a XOR HASH value for the contents of a file
+// Returns the CRC32C hash of the contents of a file (the digest sent after the body)
 uint32_t fhash(FILE *f);
 
+// Reserves the blocks of len bytes of a file being received, from offset off, keeping its size
+// Returns FALSE only if the disk has no space for the file
+gboolean file_preallocate(int fd, long long off, long long len);
+
+// Starts the write-behind of a file written sequentially from offset off
+void file_write_behind_init(Write_Behind *wb, long long off);
+// Write-behind of a file written sequentially up to offset end
+void file_write_behind(Write_Behind *wb, int fd, long long end);
+// Ends the write-behind of a file written up to offset end, before it is closed
+void file_write_behind_end(Write_Behind *wb, int fd, long long end);
+
 #endif
@@ -4,7 +4,11 @@
  *
  * gui.h
  *
- * Header file of functions that handle graphical user interface interaction
+ * Header file of functions that handle the user interface
+ *
+ * The functions are called by the application logic and implemented by each
+ * front-end: the GTK+ window (gui_g3.c, widgets in gui_gtk.h) and the
+ * headless daemon (headless.c). They only use GLib types.
  *
  * Updated on October 8, 2019,16:00
  * @author  Luis Bernardo, Rodolfo Oliveira
@@ -13,143 +17,57 @@
 #ifndef _INCL_GUI_H
 #define _INCL_GUI_H
 
-#include <gtk/gtk.h>
+#include <glib.h>
 #include <netinet/in.h>
 
-/* store the widgets which may need to be accessed in a typedef struct */
-typedef struct
-{
-        GtkWidget               *window;
-        GtkEntry				*entryMIP;
-        GtkEntry				*entryMPort;
-        GtkEntry				*entryName;
-        GtkToggleButton			*active;
-        GtkCheckButton			*check_ip4;
-        GtkEntry				*entryIPv4loc;
-        GtkCheckButton			*check_ip6;
-        GtkEntry				*entryIPv6loc;
-        GtkEntry				*entryTCPPort;
-        GtkTreeView				*treeUsers;
-        GtkListStore			*listUsers;
-        GtkEntry				*FileName;
-        GtkCheckButton			*check_Slow;
-        GtkTreeView				*treeFiles;
-        GtkListStore			*listFiles;
-        GtkTextView				*textView;
-} WindowElements;
-
-/** temporary struct to return lists of users */
-typedef struct {
-		gchar 					*name;
-		gchar 					*ip;
-		int						 port;
-} UserInfo;
-
-
-// Global pointer to the main window elements
-extern WindowElements *main_window;
+#include "peers.h"
 
-// Initialization function
-gboolean init_app (WindowElements *window);
 
-// Log the message str to the textview and command line
-void Log (const gchar * str);
-
-
-/********************************************************\
-|* Functions for writing and reading from main window   *|
-\********************************************************/
-// Write a message to the GtkTextView window
+/*********************************************\
+|* Functions for writing and reading values  *|
+\*********************************************/
+// Log the message str to the user interface and command line
 void Log(const gchar *str);
-// Return the multicast port number
-int get_portM_number(void);
-// Write the TCP port in the GtkEntry box
+// Write the TCP port
 void set_portT_number(u_short porto_TCP);
-// Read the multicast address from the box and converts it to the numerical format (addrv4 or addrv6 depending on is_ipv6)
-const char *get_IPmult(gboolean *is_ipv6, struct in_addr *addrv4,
-	struct in6_addr *addrv6);
-// Return the value of the CheckButton "Slow"
+// Return TRUE if the files received are "Slow"
 gboolean get_slow(void);
-// Set the content of Local IPv6
-void set_LocalIPv6(const char *addr);
-// Set the content of Local IPv4
-void set_LocalIPv4(const char *addr);
-// Block edition of GtkEntry boxes
-void block_entrys(gboolean editable);
+// Leave the main loop and end the application
+void GUI_quit(void);
+// Show the local addresses, after they changed
+void GUI_local_addresses(const char *ipv4, const char *ipv6);
 
 /******************************************************************\
-|* Functions to handle the graphical table with the users list    *|
+|* Functions to handle the table with the users list              *|
 \******************************************************************/
-// Search for a user in the GUI users list by name
-gboolean GUI_locate_User_by_name(const char *name, GtkTreeIter *iter);
-// Search for a user in the GUI users list by ip and port
-gboolean GUI_locate_User_by_ip(const char *ip, int port, GtkTreeIter *iter);
-// Search for a user in the GUI users list by name, ip and port
-gboolean GUI_locate_User_by_name_and_ip(const char *name, const char *ip, int port, GtkTreeIter *iter);
-// Regist name in the GUI table
-gboolean GUI_regist_name(const char *name, const char *ip, int port);
-// Remove the name 'name' from the GUI table
-gboolean GUI_cancel_name(const char *name, const char *ip_str, int port);
-// Clear the GUI names' list
-void GUI_clear_names();
-// Get selected user data; returns FALSE if none is selected; returns TRUE and iter pointing to the line
-gboolean GUI_get_selected_User(char **ip, int *port, char **name, GtkTreeIter *iter);
-// Set column 3 (timer counter) with value "0" of GUI's name list
-void GUI_reset_name_timer(GtkTreeIter *iter);
-// Increments the value in column 3 and returns TRUE if it is <3 for a name in GUI list
-gboolean GUI_test_name_timer (GtkTreeIter *iter);
-// Test column 3 for all users and return a list with all that are overdue
-GList *GUI_test_all_name_timer (void);
-// Free the memory allocated in a UserInfo list returned by GUI_test_all_name_timer
-void GUI_free_UserInfo_list (GList *list);
+// The table is a view of the registry of peers (peers.c), which calls these
+// functions with the registry locked
+// Add a row for the new user p; returns the row, kept by the registry in p->view
+gpointer GUI_add_user(const Peer *p);
+// Write the address, the name and the timer counter of p in its row
+void GUI_update_user(const Peer *p);
+// Remove the row of p
+void GUI_remove_user(const Peer *p);
 
 
 /****************************************************************\
-|* Functions to handle the GUI file transfer subprocess table   *|
+|* Functions to handle the file transfer subprocess table       *|
 \****************************************************************/
-// Search for a subprocess in the GUI file transfer subprocess list
-gboolean GUI_locate_thread_by_tid(unsigned tid, GtkTreeIter *iter);
-// Regist a subprocess in GUI subprocess table
+// Regist a subprocess in subprocess table
 gboolean GUI_regist_thread(unsigned tid, const char *type,
 		const char *name, const char *f_name);
-// Update the bytes sent in GUI subprocess table
+// Update the bytes sent in subprocess table
 gboolean GUI_update_bytes_sent(unsigned tid, int trans);
-// Update the filename in GUI subprocess table (to complete information)
+// Update the filename in subprocess table (to complete information)
 gboolean GUI_update_thread_info(unsigned tid, const char *name, const char *name_f);
-// Cancels a file transfer subprocess from GUI table
+// Update the TCP state of a connection in subprocess table
+// rtt in ms, cwnd in segments, rate in Mbit/s, sndq in KB
+gboolean GUI_update_thread_tcp(unsigned tid, double rtt, unsigned cwnd, unsigned retrans,
+		double rate, unsigned sndq);
+// Cancels a file transfer subprocess from table
 gboolean GUI_remove_thread(unsigned tid);
-// Clear the GUI subprocess' list
+// Clear the subprocess' list
 void GUI_clear_threads();
-// Get selected subprocess data; returns FALSE if none is selected; returns TRUE and iter pointing to the line
-gboolean GUI_get_selected_Filetx(unsigned *tid, GtkTreeIter *iter);
-
-
-/*************************************************************\
-|* Functions to support the selection of a file to transmit  *|
-\*************************************************************/
-// Create a window to select a file to open
-char *open_select_filename_window();
-// Handler of filename button
-void on_buttonFilename_clicked(GtkButton *button, gpointer user_data);
-
-/***************************\
-|*   Auxiliary functions   *|
-\***************************/
-
-// Create a window with an error message and outputs it to the command line
-void error_message (const gchar *message);
-
-/***********************\
-|*   Event handlers    *|
-\***********************/
-// Event handlers in gui_g3.c
-
-// Handles 'Clear' button - clears textMemo
-void on_buttonClear_clicked (GtkButton *button, gpointer user_data);
-
-// External event handlers in callbacks.c
-void on_togglebutton1_toggled (GtkToggleButton *togglebutton, gpointer user_data);
-void on_buttonStop_clicked (GtkButton *button, gpointer user_data);
 
 
 #endif
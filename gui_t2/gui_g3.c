@@ -19,9 +19,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
-#include "gui.h"
+#include "gui_gtk.h"
 #include "callbacks.h"
 #include "sock.h"
+#include "rate.h"
 
 // Set here the glade file name
 #define GLADE_FILE "gui_t2.glade"
@@ -103,6 +104,10 @@ init_app (WindowElements *win)
                                                              "entryFileName"));
         win->check_Slow = GTK_CHECK_BUTTON (gtk_builder_get_object (builder,
                                                              "checkbuttonSlow"));
+        win->entryRate = GTK_ENTRY (gtk_builder_get_object (builder,
+                                                             "entryRate"));
+        win->entryTotal = GTK_ENTRY (gtk_builder_get_object (builder,
+                                                             "entryTotal"));
        win->treeFiles = GTK_TREE_VIEW (gtk_builder_get_object (builder,
                                                              "treeFiletx"));
         win->listFiles = GTK_LIST_STORE (gtk_builder_get_object (builder,
@@ -196,6 +201,41 @@ gboolean get_slow(void) {
 }
 
 
+// Leave the GTK+ main loop
+void GUI_quit(void) {
+	gtk_main_quit();
+}
+
+
+// Return the rate of "Slow" transfers (KB/s), or -1 if invalid
+int get_rate(void) {
+	int rate= get_number_from_text(gtk_entry_get_text(main_window->entryRate));
+	return (rate > 0) ? rate : -1;
+}
+
+
+// Write the rate of "Slow" transfers (KB/s)
+void set_rate(int rate) {
+	char buf[20];
+	sprintf(buf, "%d", rate);
+	gtk_entry_set_text(main_window->entryRate, buf);
+}
+
+
+// Return the limit of all transfers (KB/s; 0 if unlimited), or -1 if invalid
+int get_total_rate(void) {
+	return get_number_from_text(gtk_entry_get_text(main_window->entryTotal));
+}
+
+
+// Write the limit of all transfers (KB/s)
+void set_total_rate(int rate) {
+	char buf[20];
+	sprintf(buf, "%d", rate);
+	gtk_entry_set_text(main_window->entryTotal, buf);
+}
+
+
 // Set the content of Local IPv6
 void set_LocalIPv6(const char *addr) {
 	assert(addr != NULL);
@@ -210,6 +250,13 @@ void set_LocalIPv4(const char *addr) {
 }
 
 
+// Show the local addresses, after they changed
+void GUI_local_addresses(const char *ipv4, const char *ipv6) {
+	set_LocalIPv4(ipv4);
+	set_LocalIPv6(ipv6);
+}
+
+
 // Block edition of GtkEntry boxes
 void block_entrys(gboolean editable)
 {
@@ -223,268 +270,55 @@ void block_entrys(gboolean editable)
 |* Functions to handle the graphical table with the users list    *|
 \******************************************************************/
 
-// Search for a user in the GUI users list by name
-gboolean GUI_locate_User_by_name(const char *name, GtkTreeIter *iter) {
-	assert(name != NULL);
-	assert(iter != NULL);
-	GtkTreeModel *list_store = GTK_TREE_MODEL(main_window->listUsers);
-	gboolean valid;
-
-	// Get the first iter in the list
-	valid = gtk_tree_model_get_iter_first(list_store, iter);
-
-	while (valid) {
-		// Walk through the list, reading each row
-		gchar *str_name;
-
-		// Make sure you terminate calls to gtk_tree_model_get() with a '-1' value
-		gtk_tree_model_get(list_store, iter, 2, &str_name, -1);
-
-		// Do something with the data
-#ifdef DEBUG
-		g_print("Lookup for: Name='%s'\n", str_name);
-#endif
-		if (!strcmp(str_name, name)) {
-			g_free(str_name);
-			return TRUE;
-		}
-		valid = gtk_tree_model_iter_next(list_store, iter);
-		g_free(str_name);
-	}
-	return FALSE;
-}
-
-
-// Search for a user in the GUI users list by ip and port
-gboolean GUI_locate_User_by_ip(const char *ip, int port, GtkTreeIter *iter) {
-	assert(ip != NULL);
-	assert(iter != NULL);
-	GtkTreeModel *list_store = GTK_TREE_MODEL(main_window->listUsers);
-	gboolean valid;
-
-	// Get the first iter in the list
-	valid = gtk_tree_model_get_iter_first(list_store, iter);
-
-	while (valid) {
-		// Walk through the list, reading each row
-		gchar *str_ip;
-		int str_port;
-
-		// Make sure you terminate calls to gtk_tree_model_get() with a '-1' value
-		gtk_tree_model_get(list_store, iter, 0, &str_ip, 1, &str_port, -1);
-
-		// Do something with the data
-#ifdef DEBUG
-		g_print("Lookup for: IP='%s' port=%d\n", str_ip, str_port);
-#endif
-		if (!strcmp(str_ip, ip) && (str_port==port)) {
-			g_free(str_ip);
-			return TRUE;
-		}
-		valid = gtk_tree_model_iter_next(list_store, iter);
-		g_free(str_ip);
-	}
-	return FALSE;
-}
-
-
-// Search for a user in the GUI users list by name, ip and port
-gboolean GUI_locate_User_by_name_and_ip(const char *name, const char *ip, int port, GtkTreeIter *iter) {
-	assert(name != NULL);
-	assert(ip != NULL);
-	assert(iter != NULL);
-	GtkTreeModel *list_store = GTK_TREE_MODEL(main_window->listUsers);
-	gboolean valid;
-
-	// Get the first iter in the list
-	valid = gtk_tree_model_get_iter_first(list_store, iter);
-
-	while (valid) {
-		// Walk through the list, reading each row
-		gchar *str_name;
-		gchar *str_ip;
-		int str_port;
-
-		// Make sure you terminate calls to gtk_tree_model_get() with a '-1' value
-		gtk_tree_model_get(list_store, iter, 0, &str_ip, 1, &str_port, 2, &str_name, -1);
-
-		// Do something with the data
-#ifdef DEBUG
-		g_print("Lookup for: Name='%s' IP='%s' port=%d\n", str_name, str_ip, str_port);
-#endif
-		if (!strcmp(str_name, name) && !strcmp(str_ip, ip) && (str_port==port)) {
-			g_free(str_name);
-			g_free(str_ip);
-			return TRUE;
-		}
-		valid = gtk_tree_model_iter_next(list_store, iter);
-		g_free(str_name);
-		g_free(str_ip);
-	}
-	return FALSE;
-}
-
-
-// Regist name in the GUI table
-gboolean GUI_regist_name(const char *name, const char *ip, int port)
+// Add a row for the new user p; returns the row, kept by the registry in p->view
+// The rows of a GtkListStore persist while they are in the list, so the row is
+//   changed and removed later without searching the list
+gpointer GUI_add_user(const Peer *p)
 {
-	assert(name != NULL);
-	assert(ip != NULL);
-
-	GtkTreeIter iter;
+	assert(p != NULL);
+	GtkTreeIter *iter;
 
-	LOCK_MUTEX(&umutex, "lock_u1\n");
-	if (GUI_locate_User_by_name_and_ip(name, ip, port, &iter)) {
-		// Name already in the table
-		GUI_reset_name_timer(&iter);
-		UNLOCK_MUTEX(&umutex, "unlock_u1\n");
-		return FALSE;
-	} else {
-		// New registration
-		if (GUI_locate_User_by_ip(ip, port, &iter)) {
-			sprintf(tmp_buf, "WARNING: The user at %s:%d did not cancel its previous name\n",
-				ip, port);
-			Log(tmp_buf);
-			// Registration will be replaced
-		} else if (GUI_locate_User_by_name(name, &iter)) {
-			sprintf(tmp_buf, "WARNING: Duplicate name registered '%s'\n", name);
-			Log(tmp_buf);
-			gtk_list_store_append(main_window->listUsers, &iter);
-		} else {
-			// New registration
-			gtk_list_store_append(main_window->listUsers, &iter);
-		}
-		if (GTK_IS_LIST_STORE(main_window->listUsers)) {
-			gtk_list_store_set(main_window->listUsers, &iter, 0, ip, 1, port,
-					2, name, 3, 0, -1);
-			UNLOCK_MUTEX(&umutex, "unlock_u1\n");
-			return TRUE;
-		} else {
+	if (!GTK_IS_LIST_STORE(main_window->listUsers)) {
 #ifdef DEBUG
-			Log("Internal Error: Users' list store not active\n");
+		Log("Internal Error: Users' list store not active\n");
 #endif
-			UNLOCK_MUTEX(&umutex, "unlock_u1\n");
-			return FALSE;
-		}
+		return NULL;
 	}
+	iter= g_new(GtkTreeIter, 1);
+	LOCK_MUTEX(&umutex, "lock_u1\n");
+	gtk_list_store_append(main_window->listUsers, iter);
+	gtk_list_store_set(main_window->listUsers, iter, 0, p->ip, 1, p->port,
+			2, p->name, 3, p->timer, -1);
+	UNLOCK_MUTEX(&umutex, "unlock_u1\n");
+	return iter;
 }
 
 
-// Remove the name 'name' from the GUI table
-gboolean GUI_cancel_name(const char *name, const char *ip, int port)
+// Write the address, the name and the timer counter of p in its row
+void GUI_update_user(const Peer *p)
 {
-	assert(name != NULL);
-	assert(ip != NULL);
-	GtkTreeIter iter;
+	assert(p != NULL);
 
+	if (p->view == NULL)
+		return;
 	LOCK_MUTEX(&umutex, "lock_u2\n");
-	GtkTreeModel *list_store = GTK_TREE_MODEL(main_window->listUsers);
-	if (GUI_locate_User_by_name_and_ip(name, ip, port, &iter)) {
-		gtk_list_store_remove(GTK_LIST_STORE(list_store), &iter);
-		UNLOCK_MUTEX(&umutex, "unlock_u2\n");
-		return TRUE;
-	} else {
-		UNLOCK_MUTEX(&umutex, "unlock_u2\n");
-		sprintf(tmp_buf,
-		        "WARNING: The user at %s:%hu canceled a non-existing name '%s'\n",
-			ip, port, name);
-		Log(tmp_buf);
-		return FALSE;
-	}
+	gtk_list_store_set(main_window->listUsers, (GtkTreeIter *)p->view, 0, p->ip,
+			2, p->name, 3, p->timer, -1);
+	UNLOCK_MUTEX(&umutex, "unlock_u2\n");
 }
 
 
-// Clear the GUI names' list
-void GUI_clear_names() {
-	LOCK_MUTEX(&umutex, "lock_u3\n");
-	gtk_list_store_clear(main_window->listUsers);
-	UNLOCK_MUTEX(&umutex, "unlock_u3\n");
-}
-
-
-// Set column 3 (timer counter) with value "0" of GUI's name list
-void GUI_reset_name_timer (GtkTreeIter *iter)
-{
-	assert(iter != NULL);
-	gtk_list_store_set(main_window->listUsers, iter, 3, 0, -1);
-}
-
-
-// Increments the value in column 3 and returns TRUE if it is <3 for a name in GUI list
-gboolean GUI_test_name_timer (GtkTreeIter *iter)
+// Remove the row of p
+void GUI_remove_user(const Peer *p)
 {
-	assert(iter != NULL);
-
-	GtkTreeModel *list_store = GTK_TREE_MODEL(main_window->listUsers);
-	int cnt= -1;
+	assert(p != NULL);
 
-	gtk_tree_model_get(list_store, iter, 3, &cnt, -1);
-	if ((cnt==-1) || (cnt>1)) {
-		return FALSE;
-	}
-	cnt++;
-	gtk_list_store_set(GTK_LIST_STORE(main_window->listUsers), iter, 3, cnt, -1);
-	return TRUE;
-}
-
-// Constructor of a UserInfo structure block
-static UserInfo *GUI_new_UserInfo(char *name, char *ip, int port) {
-	UserInfo *pt= (UserInfo *)malloc(sizeof(UserInfo));
-	pt->name= name;
-	pt->ip= ip;
-	pt->port= port;
-	return pt;
-}
-
-// Free all memory allocated in a user info object returned by GUI_test_all_name_timer
-void GUI_free_UserInfo(UserInfo *pt) {
-	if (pt->name != NULL)
-		free (pt->name);
-	if (pt->ip != NULL)
-		free (pt->ip);
-	free (pt);
-}
-
-// Free the memory allocated in a UserInfo list returned by GUI_test_all_name_timer
-void GUI_free_UserInfo_list (GList *list) {
-	while (list != NULL) {
-		GUI_free_UserInfo((UserInfo *) list->data);
-		list = list->next;
-	}
-	g_list_free(list);
-}
-
-
-// Test column 3 for all users and return a list with all that are overdue
-GList *GUI_test_all_name_timer (void) {
-	GtkTreeIter iter;
-	gboolean valid;
-	GList *list= NULL;
-	gchar *ip;
-	int port;
-	gchar *name;
-
-	LOCK_MUTEX(&umutex, "lock_u4\n");
-	GtkTreeModel *list_store = GTK_TREE_MODEL(main_window->listUsers);
-	// Get the first iter in the list
-	valid = gtk_tree_model_get_iter_first(list_store, &iter);
-	while (valid && active) {
-		// Walk through the list, reading each row
-		if (!GUI_test_name_timer(&iter)) {
-			gtk_tree_model_get(list_store, &iter, 0, &ip, 1, &port, 2, &name, -1);
-			sprintf(tmp_buf,
-					"User '%s' marked - name timeout\n",
-					name);
-			g_print("%s", tmp_buf);
-			Log(tmp_buf);
-
-			// Add to list
-			list= g_list_append(list, GUI_new_UserInfo(name, ip, port));
-		}
-		valid = gtk_tree_model_iter_next(list_store, &iter);
-	}
-	UNLOCK_MUTEX(&umutex, "unlock_u4\n");
-	return list;
+	if (p->view == NULL)
+		return;
+	LOCK_MUTEX(&umutex, "lock_u3\n");
+	gtk_list_store_remove(main_window->listUsers, (GtkTreeIter *)p->view);
+	UNLOCK_MUTEX(&umutex, "unlock_u3\n");
+	g_free(p->view);
 }
 
 
@@ -609,6 +443,32 @@ gboolean GUI_update_thread_info(unsigned tid, const char *name, const char *name
 }
 
 
+// Update the TCP state of a connection in GUI subprocess table
+// rtt in ms, cwnd in segments, rate in Mbit/s, sndq in KB
+gboolean GUI_update_thread_tcp(unsigned tid, double rtt, unsigned cwnd, unsigned retrans,
+		double rate, unsigned sndq)
+{
+	GtkTreeIter iter;
+	char rtt_s[16], cwnd_s[16], retrans_s[16], rate_s[16], sndq_s[16];
+
+	sprintf(rtt_s, "%.1f", rtt);
+	sprintf(cwnd_s, "%u", cwnd);
+	sprintf(retrans_s, "%u", retrans);
+	sprintf(rate_s, "%.1f", rate);
+	sprintf(sndq_s, "%u", sndq);
+	LOCK_MUTEX(&gmutex, "lock_g7\n");
+	if (!GUI_locate_thread_by_tid(tid, &iter)) {
+		// The transfer may end between the sample and this update
+		UNLOCK_MUTEX(&gmutex, "unlock_g7\n");
+		return FALSE;
+	}
+	gtk_list_store_set(main_window->listFiles, &iter, 5, rtt_s, 6, cwnd_s, 7, retrans_s,
+			8, rate_s, 9, sndq_s, -1);
+	UNLOCK_MUTEX(&gmutex, "unlock_g7\n");
+	return TRUE;
+}
+
+
 // Cancels a file transfer subprocess from GUI table
 gboolean GUI_remove_thread(unsigned tid)
 {
@@ -741,6 +601,174 @@ void on_buttonClear_clicked (GtkButton * button, gpointer user_data)
 }
 
 
+// Start sending a file to the selected user - handle button "SendFile"
+void on_buttonSendFile_clicked(GtkButton *button, gpointer user_data) {
+	char *ip, *name;
+	int port;
+	GtkTreeIter iter;
+
+	if (!active) {
+		Log("This program is not active\n");
+		return;
+	}
+	if (!GUI_get_selected_User(&ip, &port, &name, &iter)) {
+		Log("No user is selected\n");
+		return;
+	}
+	const char *filename = gtk_entry_get_text(main_window->FileName);
+	FILE *f = fopen(filename, "r");
+	if (f == NULL) {
+		Log("Select a valid file to transmit and try again\n");
+		// Open window
+		on_buttonFilename_clicked(NULL, NULL);
+		return;
+	}
+	fclose(f);
+	send_file(ip, port, name, filename, get_slow());
+	g_free(ip);
+	g_free(name);
+}
+
+
+// Stop the selected file transmission - handle button "Stop"
+void on_buttonStop_clicked(GtkButton *button, gpointer user_data) {
+	GtkTreeIter iter;
+	unsigned tid;
+
+	if (!GUI_get_selected_Filetx(&tid, &iter)) {
+		Log("No file transfer is selected\n");
+		return;
+	}
+	stop_transfer(tid);
+}
+
+
+// Handle the rate box: new rate of "Slow" transfers, also applied to the selected transfer
+void on_entryRate_activate(GtkEntry *entry, gpointer user_data) {
+	GtkTreeIter iter;
+	unsigned tid= 0;
+	int rate= get_rate();
+
+	if (rate < 0) {
+		Log("Invalid rate\n");
+		set_rate(rate_transfer/1024);
+		return;
+	}
+	GUI_get_selected_Filetx(&tid, &iter);
+	if (set_transfer_rate(tid, rate*1024LL))
+		sprintf(tmp_buf, "Transfer %u limited to %d KB/s\n", tid, rate);
+	else
+		sprintf(tmp_buf, "Slow transfers limited to %d KB/s\n", rate);
+	Log(tmp_buf);
+}
+
+
+// Handle the total rate box: new limit of all transfers together (0 removes it)
+void on_entryTotal_activate(GtkEntry *entry, gpointer user_data) {
+	int rate= get_total_rate();
+
+	if (rate < 0) {
+		Log("Invalid total rate\n");
+		set_total_rate(rate_global/1024);
+		return;
+	}
+	rate_set_global(rate*1024LL);
+	if (rate > 0)
+		sprintf(tmp_buf, "All transfers limited to %d KB/s\n", rate);
+	else
+		sprintf(tmp_buf, "Transfers without a total limit\n");
+	Log(tmp_buf);
+}
+
+
+// Button that starts and stops the application
+void on_togglebuttonActive_toggled(GtkToggleButton *togglebutton, gpointer user_data) {
+
+	if (gtk_toggle_button_get_active(main_window->active)) {
+
+		// *** Starts the server ***
+		const gchar *addr_str, *textNome;
+		gboolean is_ipv6;
+		struct in_addr addrv4;
+		struct in6_addr addrv6;
+		gboolean b6 = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(main_window->check_ip6));
+		gboolean b4 = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(main_window->check_ip4));
+		assert(b4 || b6);
+
+		// Get local IP
+		set_local_IP();
+		gtk_entry_set_text(main_window->entryIPv6loc, addr_ipv6(&local_ipv6));
+		gtk_entry_set_text(main_window->entryIPv4loc, addr_ipv4(&local_ipv4));
+		// Read parameters
+		if ((textNome = gtk_entry_get_text(main_window->entryName)) == NULL) {
+			Log("Undefined user name\n");
+			gtk_toggle_button_set_active(togglebutton, FALSE); // Turns button off
+			return;
+		}
+		int n = get_portM_number();
+		if (n < 0) {
+			Log("Invalid multicast port number\n");
+			gtk_toggle_button_set_active(togglebutton, FALSE); // Turns button off
+			return;
+		}
+		if (!(addr_str = get_IPmult(&is_ipv6, &addrv4, &addrv6))) {
+			Log("Invalid IP multicast address\n");
+			gtk_toggle_button_set_active(togglebutton, FALSE); // Turns button off
+			return;
+		}
+		if (is_ipv6 ? !b6 : !b4) {
+			Log("Invalid IP version of multicast address\n");
+			gtk_toggle_button_set_active(togglebutton, FALSE); // Turns button off
+			return;
+		}
+		// The box has the group of one family; the other one uses its default group
+		if (!start_server(textNome, b4 ? (is_ipv6 ? MCAST_GROUP_IPV4 : addr_str) : NULL,
+				b6 ? (is_ipv6 ? addr_str : MCAST_GROUP_IPV6) : NULL, (u_short) n)) {
+			gtk_toggle_button_set_active(togglebutton, FALSE); // Turns button off
+			return;
+		}
+		block_entrys(FALSE);
+
+	} else {
+
+		// *** Stops the server ***
+		stop_server();
+		block_entrys(TRUE);
+	}
+
+}
+
+
+// IPv4 type button modified; it joins or leaves the IPv4 multicast group
+void on_checkbuttonIPv4_toggled(GtkToggleButton *togglebutton,
+		gpointer user_data) {
+	gboolean b4 = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(main_window->check_ip4));
+	if (!b4 && !gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(main_window->check_ip6)))
+		// At least one group is needed: join the IPv6 group
+		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(main_window->check_ip6), TRUE);
+	gtk_entry_set_text(main_window->entryMIP, b4 ? MCAST_GROUP_IPV4 : MCAST_GROUP_IPV6);
+	if (!change_group(FALSE, b4 ? MCAST_GROUP_IPV4 : NULL))
+		gtk_toggle_button_set_active(main_window->active, FALSE);
+}
+
 
+// IPv6 type button modified; it joins or leaves the IPv6 multicast group
+void on_checkbuttonIPv6_toggled(GtkToggleButton *togglebutton,
+		gpointer user_data) {
+	gboolean b6 = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(main_window->check_ip6));
+	if (!b6 && !gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(main_window->check_ip4)))
+		// At least one group is needed: join the IPv4 group
+		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(main_window->check_ip4), TRUE);
+	gtk_entry_set_text(main_window->entryMIP, b6 ? MCAST_GROUP_IPV6 : MCAST_GROUP_IPV4);
+	if (!change_group(TRUE, b6 ? MCAST_GROUP_IPV6 : NULL))
+		gtk_toggle_button_set_active(main_window->active, FALSE);
+}
 
 
+// The user closed the main window
+gboolean on_window1_delete_event(GtkWidget *widget, GdkEvent *event,
+		gpointer user_data) {
+	close_all();
+	gtk_main_quit();
+	return FALSE;
+}
@@ -0,0 +1,130 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * gui_gtk.h
+ *
+ * Header file of functions that handle graphical user interface interaction
+ *
+ * Updated on October 8, 2019,16:00
+ * @author  Luis Bernardo, Rodolfo Oliveira
+\*****************************************************************************/
+
+#ifndef _INCL_GUI_GTK_H
+#define _INCL_GUI_GTK_H
+
+#include <gtk/gtk.h>
+#include <netinet/in.h>
+#include "gui.h"
+
+/* store the widgets which may need to be accessed in a typedef struct */
+typedef struct
+{
+        GtkWidget               *window;
+        GtkEntry				*entryMIP;
+        GtkEntry				*entryMPort;
+        GtkEntry				*entryName;
+        GtkToggleButton			*active;
+        GtkCheckButton			*check_ip4;
+        GtkEntry				*entryIPv4loc;
+        GtkCheckButton			*check_ip6;
+        GtkEntry				*entryIPv6loc;
+        GtkEntry				*entryTCPPort;
+        GtkTreeView				*treeUsers;
+        GtkListStore			*listUsers;
+        GtkEntry				*FileName;
+        GtkCheckButton			*check_Slow;
+        GtkEntry				*entryRate;
+        GtkEntry				*entryTotal;
+        GtkTreeView				*treeFiles;
+        GtkListStore			*listFiles;
+        GtkTextView				*textView;
+} WindowElements;
+
+
+// Global pointer to the main window elements
+extern WindowElements *main_window;
+
+// Initialization function
+gboolean init_app (WindowElements *window);
+
+
+/********************************************************\
+|* Functions for writing and reading from main window   *|
+\********************************************************/
+// Return the multicast port number
+int get_portM_number(void);
+// Read the multicast address from the box and converts it to the numerical format (addrv4 or addrv6 depending on is_ipv6)
+const char *get_IPmult(gboolean *is_ipv6, struct in_addr *addrv4,
+	struct in6_addr *addrv6);
+// Return the rate of "Slow" transfers (KB/s), or -1 if invalid
+int get_rate(void);
+// Write the rate of "Slow" transfers (KB/s)
+void set_rate(int rate);
+// Return the limit of all transfers (KB/s; 0 if unlimited), or -1 if invalid
+int get_total_rate(void);
+// Write the limit of all transfers (KB/s)
+void set_total_rate(int rate);
+// Set the content of Local IPv6
+void set_LocalIPv6(const char *addr);
+// Set the content of Local IPv4
+void set_LocalIPv4(const char *addr);
+// Block edition of GtkEntry boxes
+void block_entrys(gboolean editable);
+
+/******************************************************************\
+|* Functions to handle the graphical table with the users list    *|
+\******************************************************************/
+// Get selected user data; returns FALSE if none is selected; returns TRUE and iter pointing to the line
+gboolean GUI_get_selected_User(char **ip, int *port, char **name, GtkTreeIter *iter);
+
+
+/****************************************************************\
+|* Functions to handle the GUI file transfer subprocess table   *|
+\****************************************************************/
+// Search for a subprocess in the GUI file transfer subprocess list
+gboolean GUI_locate_thread_by_tid(unsigned tid, GtkTreeIter *iter);
+// Get selected subprocess data; returns FALSE if none is selected; returns TRUE and iter pointing to the line
+gboolean GUI_get_selected_Filetx(unsigned *tid, GtkTreeIter *iter);
+
+
+/*************************************************************\
+|* Functions to support the selection of a file to transmit  *|
+\*************************************************************/
+// Create a window to select a file to open
+char *open_select_filename_window();
+// Handler of filename button
+void on_buttonFilename_clicked(GtkButton *button, gpointer user_data);
+
+/***************************\
+|*   Auxiliary functions   *|
+\***************************/
+
+// Create a window with an error message and outputs it to the command line
+void error_message (const gchar *message);
+
+/***********************\
+|*   Event handlers    *|
+\***********************/
+
+// Handles 'Clear' button - clears textMemo
+void on_buttonClear_clicked (GtkButton *button, gpointer user_data);
+// Start sending a file to the selected user - handle button "SendFile"
+void on_buttonSendFile_clicked (GtkButton *button, gpointer user_data);
+// Stop the selected file transmission - handle button "Stop"
+void on_buttonStop_clicked (GtkButton *button, gpointer user_data);
+// Handle the rate box: new rate of "Slow" transfers, also applied to the selected transfer
+void on_entryRate_activate (GtkEntry *entry, gpointer user_data);
+// Handle the total rate box: new limit of all transfers together (0 removes it)
+void on_entryTotal_activate (GtkEntry *entry, gpointer user_data);
+// Button that starts and stops the application
+void on_togglebuttonActive_toggled (GtkToggleButton *togglebutton, gpointer user_data);
+// IPv4 type button modified; it joins or leaves the IPv4 multicast group
+void on_checkbuttonIPv4_toggled (GtkToggleButton *togglebutton, gpointer user_data);
+// IPv6 type button modified; it joins or leaves the IPv6 multicast group
+void on_checkbuttonIPv6_toggled (GtkToggleButton *togglebutton, gpointer user_data);
+// The user closed the main window
+gboolean on_window1_delete_event (GtkWidget *widget, GdkEvent *event, gpointer user_data);
+
+
+#endif
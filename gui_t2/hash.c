@@ -0,0 +1,280 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * hash.c
+ *
+ * Streaming content hash (CRC32C, Castagnoli polynomial)
+ *
+ * Uses the crc32 instruction of SSE 4.2 (x86-64) or of the ARMv8 CRC
+ * extension when the processor has it, processing 8 bytes per instruction;
+ * otherwise a table-driven version that handles 8 bytes per step.
+ \*****************************************************************************/
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "hash.h"
+
+#define CRC32C_POLY		0x82F63B78	// Reflected Castagnoli polynomial
+#define HASH_FD_BUFLEN	(64*1024)	// Block read by hash_update_fd
+
+
+/* Public variables */
+gboolean hash_zerocopy= TRUE;		// Hash the zero-copy transfers (off with option -H)
+
+
+typedef uint32_t (*Crc_Func)(uint32_t crc, const unsigned char *p, size_t len);
+
+static uint32_t crc_table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+static Crc_Func crc_func= NULL;		// Implementation selected on the first use
+
+
+/*************************************\
+|* CRC32C implementations            *|
+\*************************************/
+
+// Build the tables of the software version
+static void crc_table_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i= 0; i < 256; i++) {
+		c= i;
+		for (j= 0; j < 8; j++)
+			c= (c & 1) ? (c >> 1) ^ CRC32C_POLY : (c >> 1);
+		crc_table[0][i]= c;
+	}
+	for (i= 0; i < 256; i++)
+		for (j= 1; j < 8; j++)
+			crc_table[j][i]= (crc_table[j-1][i] >> 8) ^ crc_table[0][crc_table[j-1][i] & 0xff];
+}
+
+
+// Table-driven version, 8 bytes per step (slicing-by-8)
+static uint32_t crc_soft(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint32_t lo, hi;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc= (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p+4, 4);
+		lo ^= crc;
+		crc= crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+			 crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+			 crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+			 crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+	}
+	while (len--)
+		crc= (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+
+#if defined(__x86_64__)
+// SSE 4.2 version
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c= crc, v;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		c= _mm_crc32_u8((uint32_t)c, *p++);
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		c= _mm_crc32_u64(c, v);
+	}
+	while (len--)
+		c= _mm_crc32_u8((uint32_t)c, *p++);
+	return (uint32_t)c;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+// ARMv8 CRC extension version
+static uint32_t crc_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t v;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc= __crc32cb(crc, *p++);
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		crc= __crc32cd(crc, v);
+	}
+	while (len--)
+		crc= __crc32cb(crc, *p++);
+	return crc;
+}
+#endif
+
+
+// Select the fastest implementation available in this processor
+static Crc_Func crc_select(void)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		return crc_hw;
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+	return crc_hw;
+#endif
+	pthread_once(&table_once, crc_table_init);
+	return crc_soft;
+}
+
+
+/*************************************\
+|* Streaming hash                    *|
+\*************************************/
+
+// Start a new hash
+void hash_init(Hash_State *h)
+{
+	h->crc= 0xFFFFFFFF;
+	h->bytes= 0;
+}
+
+
+// Add len bytes to the hash
+void hash_update(Hash_State *h, const void *buf, size_t len)
+{
+	// Every thread selects the same function, so the race is harmless
+	if (crc_func == NULL)
+		crc_func= crc_select();
+	h->crc= crc_func(h->crc, (const unsigned char *)buf, len);
+	h->bytes += len;
+}
+
+
+// Add len bytes of the file fd at offset off, for the paths that do not copy the data
+gboolean hash_update_fd(Hash_State *h, int fd, long long off, long long len)
+{
+	unsigned char buf[HASH_FD_BUFLEN];
+	ssize_t n;
+
+	while (len > 0) {
+		n= pread(fd, buf, (len < HASH_FD_BUFLEN) ? len : HASH_FD_BUFLEN, off);
+		if ((n < 0) && (errno == EINTR))
+			continue;
+		if (n <= 0) {
+			if (n < 0)
+				perror("hash read");
+			return FALSE;
+		}
+		hash_update(h, buf, n);
+		off += n;
+		len -= n;
+	}
+	return TRUE;
+}
+
+
+// Digest of the bytes added so far; the hash may continue
+uint32_t hash_final(const Hash_State *h)
+{
+	return h->crc ^ 0xFFFFFFFF;
+}
+
+
+// Compare the digest received in a trailer; returns HASH_OK or HASH_MISMATCH
+int hash_check(const Hash_State *h, uint32_t digest)
+{
+	return (hash_final(h) == digest) ? HASH_OK : HASH_MISMATCH;
+}
+
+
+// Multiply the 32x32 matrix over GF(2) mat by the vector vec
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum= 0;
+
+	for (; vec; vec >>= 1, mat++)
+		if (vec & 1)
+			sum ^= *mat;
+	return sum;
+}
+
+
+// Square the matrix mat into sq
+static void gf2_square(uint32_t *sq, const uint32_t *mat)
+{
+	int i;
+
+	for (i= 0; i < 32; i++)
+		sq[i]= gf2_times(mat, mat[i]);
+}
+
+
+// Digest of two runs of bytes one after the other, given the digest of each one and
+//   the length of the second, without reading them again
+// digest1 is moved over len2 zero bytes by squaring the operator of one zero bit
+//   (the method of zlib's crc32_combine)
+uint32_t hash_combine(uint32_t digest1, uint32_t digest2, long long len2)
+{
+	uint32_t even[32], odd[32];
+	uint32_t row= 1;
+	int i;
+
+	if (len2 <= 0)
+		return digest1;
+	// Operator of one zero bit, then of two and four zero bits
+	odd[0]= CRC32C_POLY;
+	for (i= 1; i < 32; i++, row <<= 1)
+		odd[i]= row;
+	gf2_square(even, odd);
+	gf2_square(odd, even);
+	// Apply the operators of one zero byte, two, four... for the bits set in len2
+	do {
+		gf2_square(even, odd);
+		if (len2 & 1)
+			digest1= gf2_times(even, digest1);
+		len2 >>= 1;
+		if (len2 == 0)
+			break;
+		gf2_square(odd, even);
+		if (len2 & 1)
+			digest1= gf2_times(odd, digest1);
+		len2 >>= 1;
+	} while (len2 != 0);
+	return digest1 ^ digest2;
+}
+
+
+/*************************************\
+|* Trailer                           *|
+\*************************************/
+
+// Send the digest after the body (blocking socket)
+gboolean hash_send_trailer(int s, const Hash_State *h)
+{
+	uint32_t digest= hash_final(h);	// Host byte order, like the rest of the header
+	return send(s, &digest, sizeof(digest), MSG_NOSIGNAL) == sizeof(digest);
+}
+
+
+// Receive the digest after the body and compare it (blocking socket); returns a HASH_* result
+int hash_rcv_trailer(int s, const Hash_State *h)
+{
+	uint32_t digest;
+	ssize_t n;
+
+	do
+		n= recv(s, &digest, sizeof(digest), MSG_WAITALL);
+	while ((n < 0) && (errno == EINTR));
+	if (n != sizeof(digest))
+		return HASH_NONE;
+	return hash_check(h, digest);
+}
@@ -0,0 +1,78 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * hash.h
+ *
+ * Header file of the streaming content hash (CRC32C)
+ *
+ * Each connection hashes the body bytes it moves, in file order, while they
+ * pass through the transfer loops. After the body the sender appends the
+ * digest as a trailer; the receiver compares it with its own.
+ *
+ * The zero-copy paths (sendfile, splice) never see the bytes: they hash them
+ * reading them back from the page cache, after they are moved. Option -H
+ * (hash_zerocopy FALSE) skips it: the sender sends no trailer (HEADER_NOHASH)
+ * and the receiver reports the file as not checked.
+ \*****************************************************************************/
+#ifndef HASH_INC_
+#define HASH_INC_
+
+#include <glib.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define HASH_NAME		"crc32c"	// Name shown in the logs
+
+/* Results of the verification of the trailer */
+#define HASH_NONE		0		// Trailer not received (incomplete transfer)
+#define HASH_OK			1		// Digests match
+#define HASH_MISMATCH	-1		// Digests differ: the file is corrupted
+#define HASH_UNCHECKED	2		// Complete, but moved without hashing it (zero-copy)
+
+// TRUE if the result accepts the file (complete, and not found corrupted)
+#define HASH_ACCEPTED(v)	(((v) == HASH_OK) || ((v) == HASH_UNCHECKED))
+
+
+// State of a running hash
+typedef struct {
+	uint32_t crc;
+	long long bytes;	// Bytes added
+} Hash_State;
+
+
+/* Public variables */
+extern gboolean hash_zerocopy;	// TRUE: the zero-copy paths hash the bytes, reading them back;
+								//   FALSE: their files are not checked
+
+
+/*************************************\
+|* Streaming hash                    *|
+\*************************************/
+
+// Start a new hash
+void hash_init(Hash_State *h);
+// Add len bytes to the hash
+void hash_update(Hash_State *h, const void *buf, size_t len);
+// Add len bytes of the file fd at offset off, for the paths that do not copy the data
+//   (they were just moved, so they are read from the page cache)
+gboolean hash_update_fd(Hash_State *h, int fd, long long off, long long len);
+// Digest of the bytes added so far; the hash may continue
+uint32_t hash_final(const Hash_State *h);
+// Compare the digest received in a trailer; returns HASH_OK or HASH_MISMATCH
+int hash_check(const Hash_State *h, uint32_t digest);
+// Digest of two runs of bytes one after the other, given the digest of each one and
+//   the length of the second, without reading them again
+uint32_t hash_combine(uint32_t digest1, uint32_t digest2, long long len2);
+
+
+/*************************************\
+|* Trailer                           *|
+\*************************************/
+
+// Send the digest after the body (blocking socket)
+gboolean hash_send_trailer(int s, const Hash_State *h);
+// Receive the digest after the body and compare it (blocking socket); returns a HASH_* result
+int hash_rcv_trailer(int s, const Hash_State *h);
+
+#endif
@@ -0,0 +1,148 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * header.c
+ *
+ * Packed file header
+ \*****************************************************************************/
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "header.h"
+#include "stripe.h"
+
+
+// Receive exactly n bytes (blocking socket)
+static gboolean rcv_all(int s, void *buf, size_t n)
+{
+	ssize_t r;
+
+	do
+		r= recv(s, buf, n, MSG_WAITALL);
+	while ((r < 0) && (errno == EINTR));
+	return r == (ssize_t)n;
+}
+
+
+// Fill h with the header of a file; sh is the range sent, or NULL
+// Returns FALSE if the names do not fit in the header
+gboolean header_build(Packed_Header *h, const char *user, const char *fname,
+		long long size, int flags, const Stripe_Header *sh)
+{
+	size_t slen= strlen(user)+1, flen= strlen(fname)+1;
+
+	if ((slen > HEADER_USER_MAX) || (flen > HEADER_NAME_MAX))
+		return FALSE;
+	memset(h, 0, sizeof(Packed_Header));
+	h->mark= HEADER_MARK;
+	h->version= HEADER_VERSION;
+	h->flags= flags;
+	h->slen= slen;
+	h->flen= flen;
+	h->size= size;
+	if (sh != NULL)
+		memcpy(&h->stripe, sh, sizeof(Stripe_Header));
+	memcpy(h->user, user, slen);
+	memcpy(h->fname, fname, flen);
+	return TRUE;
+}
+
+
+// Send the header h in one call (blocking socket)
+gboolean header_send(int s, const Packed_Header *h)
+{
+	const char *p= (const char *)h;
+	size_t n= sizeof(Packed_Header);
+	ssize_t r;
+
+	while (n > 0) {
+		if ((r= send(s, p, n, MSG_NOSIGNAL)) <= 0) {
+			if ((r < 0) && (errno == EINTR))
+				continue;
+			return FALSE;
+		}
+		p += r;
+		n -= r;
+	}
+	return TRUE;
+}
+
+
+// Test the fields of a header received; name_str prefixes the error messages
+gboolean header_valid(const Packed_Header *h, const char *name_str)
+{
+	if ((h->slen <= 0) || (h->slen > HEADER_USER_MAX) || (h->user[h->slen-1] != '\0')) {
+		g_print("%s invalid user name - aborting\n", name_str);
+		return FALSE;
+	}
+	if ((h->flen <= 0) || (h->flen > HEADER_NAME_MAX) || (h->fname[h->flen-1] != '\0')) {
+		g_print("%s invalid file name - aborting\n", name_str);
+		return FALSE;
+	}
+	if (h->size < 0) {
+		g_print("%s invalid file length - aborting\n", name_str);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+// Receive a header, packed or original, into h (blocking socket)
+// Returns a HEADER_* result
+int header_rcv(int s, Packed_Header *h, const char *name_str)
+{
+	int16_t mark;
+	ssize_t n;
+
+	memset(h, 0, sizeof(Packed_Header));
+	// Look at the mark without consuming it, so a packed header is received in one call
+	do
+		n= recv(s, &mark, sizeof(mark), MSG_PEEK|MSG_WAITALL);
+	while ((n < 0) && (errno == EINTR));
+	// Kept connections end this way when the sender has no more files
+	if ((n == 0) || ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))))
+		return HEADER_CLOSED;
+	if (n != sizeof(mark)) {
+		g_print("%s did not receive the header - aborting\n", name_str);
+		return HEADER_ERROR;
+	}
+	if (mark == HEADER_MARK) {
+		if (!rcv_all(s, h, sizeof(Packed_Header))) {
+			g_print("%s did not receive the header - aborting\n", name_str);
+			return HEADER_ERROR;
+		}
+		if (h->version != HEADER_VERSION) {
+			g_print("%s unknown header version %d - aborting\n", name_str, h->version);
+			return HEADER_ERROR;
+		}
+		return header_valid(h, name_str) ? HEADER_OK : HEADER_ERROR;
+	}
+
+	// Original header: one field per read
+	if (!rcv_all(s, &mark, sizeof(mark))) {
+		g_print("%s did not receive the user name length - aborting\n", name_str);
+		return HEADER_ERROR;
+	}
+	h->slen= mark;
+	if ((h->slen <= 0) || (h->slen > HEADER_USER_MAX)) {
+		g_print("%s invalid user name length - aborting\n", name_str);
+		return HEADER_ERROR;
+	}
+	if (!rcv_all(s, h->user, h->slen) || !rcv_all(s, &h->flen, sizeof(h->flen))) {
+		g_print("%s did not receive the user name - aborting\n", name_str);
+		return HEADER_ERROR;
+	}
+	if ((h->flen <= 0) || (h->flen > HEADER_NAME_MAX)) {
+		g_print("%s invalid file name length - aborting\n", name_str);
+		return HEADER_ERROR;
+	}
+	if (!rcv_all(s, h->fname, h->flen) || !rcv_all(s, &h->size, sizeof(h->size))) {
+		g_print("%s did not receive the file name - aborting\n", name_str);
+		return HEADER_ERROR;
+	}
+	return header_valid(h, name_str) ? HEADER_OK : HEADER_ERROR;
+}
@@ -0,0 +1,66 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * header.h
+ *
+ * Header file of the packed file header
+ *
+ * A connection starts with HEADER_MARK in place of the user name length,
+ * followed by the rest of a fixed-size Packed_Header, so the sender writes the
+ * whole header in one call and the receiver reads it in one call. The fields
+ * are in host byte order, like the rest of the protocol. Receivers still accept
+ * the original header, with one field per read.
+ \*****************************************************************************/
+#ifndef HEADER_INC_
+#define HEADER_INC_
+
+#include <glib.h>
+#include <stdint.h>
+
+#include "stripe.h"
+
+#define HEADER_MARK			(-3)	// Value sent in place of the user name length
+#define HEADER_VERSION		1		// Version of Packed_Header sent
+#define HEADER_USER_MAX		129		// Maximum lengths of the names, with the '\0'
+#define HEADER_NAME_MAX		257
+
+/* Flags of the header */
+#define HEADER_RESUME		0x01	// The receiver answers with a Resume_Reply (see resume.h)
+#define HEADER_STRIPE		0x02	// The connection carries the range in 'stripe' (see stripe.h)
+#define HEADER_KEEP			0x04	// Another header may follow the trailer (see pool.h)
+#define HEADER_NOHASH		0x08	// No digest trailer follows the body (zero-copy, see hash.h)
+
+/* Results of header_rcv */
+#define HEADER_OK			1		// Valid header received
+#define HEADER_CLOSED		0		// Connection ended or idle before the header started
+#define HEADER_ERROR		-1		// Invalid or incomplete header
+
+
+// File header
+typedef struct __attribute__((packed)) {
+	int16_t mark;			// HEADER_MARK
+	uint8_t version;		// HEADER_VERSION
+	uint8_t flags;			// HEADER_* flags
+	int16_t slen;			// Length of user, with the '\0'
+	int16_t flen;			// Length of fname, with the '\0'
+	int64_t size;			// File length
+	Stripe_Header stripe;	// Range sent (HEADER_STRIPE); zero otherwise
+	char user[HEADER_USER_MAX];		// User name; unused bytes are zero
+	char fname[HEADER_NAME_MAX];	// File name, without the path
+} Packed_Header;
+
+
+// Fill h with the header of a file; sh is the range sent, or NULL
+// Returns FALSE if the names do not fit in the header
+gboolean header_build(Packed_Header *h, const char *user, const char *fname,
+		long long size, int flags, const Stripe_Header *sh);
+// Send the header h in one call (blocking socket)
+gboolean header_send(int s, const Packed_Header *h);
+// Test the fields of a header received; name_str prefixes the error messages
+gboolean header_valid(const Packed_Header *h, const char *name_str);
+// Receive a header, packed or original, into h (blocking socket)
+// Returns a HEADER_* result
+int header_rcv(int s, Packed_Header *h, const char *name_str);
+
+#endif
@@ -0,0 +1,281 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * headless.c
+ *
+ * User interface of the headless daemon: table of file transfers
+ *
+ * The users are read from the registry of peers (peers.c), which has no view
+ * here. The transfers are changed by the transfer threads too, so the table is
+ * protected by a mutex, as the GtkListStore of the GTK+ window (gui_g3.c).
+ \*****************************************************************************/
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <net/if.h>
+
+#include "headless.h"
+#include "peers.h"
+#include "gui.h"
+#include "callbacks.h"
+
+// File transfer in the table
+typedef struct {
+	unsigned tid;
+	char type[16];				// "SND", "RCV", "SND queued", ...
+	char name[80];
+	char fname[256];
+	int trans;					// Percentage transferred
+	double rtt;					// Last TCP_INFO sample: rtt in ms, cwnd in segments,
+	unsigned cwnd;				//   rate in Mbit/s and send queue in KB
+	unsigned retrans;
+	double rate;
+	unsigned sndq;
+} Headless_Thread;
+
+
+GMainLoop *main_loop= NULL;		// Main loop of the daemon
+gboolean headless_slow= FALSE;	// TRUE if the files received are "Slow"
+
+static GList *threads= NULL;	// List of Headless_Thread
+
+// Mutex to synchronize the log lines
+static pthread_mutex_t lmutex = PTHREAD_MUTEX_INITIALIZER;
+// Mutex to synchronize changes to the table of file transfers
+static pthread_mutex_t gmutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Temporary buffer
+static char tmp_buf[8000];
+
+
+/*********************************************\
+|* Functions for writing and reading values  *|
+\*********************************************/
+
+// Log the message str to the standard output
+void Log(const gchar *str) {
+	pthread_mutex_lock(&lmutex);
+	g_print("%s", str);
+	fflush(stdout);
+	pthread_mutex_unlock(&lmutex);
+}
+
+
+// Log the TCP port where the files are received
+void set_portT_number(u_short porto_TCP) {
+	char buf[40];
+
+	if (porto_TCP > 0) {
+		sprintf(buf, "TCP port %hu\n", porto_TCP);
+		Log(buf);
+	}
+}
+
+
+// Return TRUE if the files received are "Slow" (option -S)
+gboolean get_slow(void) {
+	return headless_slow;
+}
+
+
+// Leave the main loop of the daemon
+void GUI_quit(void) {
+	if (main_loop != NULL)
+		g_main_loop_quit(main_loop);
+}
+
+
+// Log the local addresses, after they changed
+void GUI_local_addresses(const char *ipv4, const char *ipv6) {
+	char buf[200];
+
+	sprintf(buf, "Local IPv4 address: %s\nLocal IPv6 address: %s\n", ipv4, ipv6);
+	Log(buf);
+}
+
+
+/******************************************************************\
+|* Functions to handle the table with the users list              *|
+\******************************************************************/
+
+// The users have no rows: the commands read the registry
+gpointer GUI_add_user(const Peer *p) {
+	return NULL;
+}
+
+
+void GUI_update_user(const Peer *p) {
+}
+
+
+void GUI_remove_user(const Peer *p) {
+}
+
+
+// Append one user to the GString data, with the address used and then all its addresses,
+//   with the interface where each one was heard
+static void print_user(const Peer *p, gpointer data) {
+	const Peer_Addr *a;
+	char ifname[IF_NAMESIZE];
+	int i;
+
+	g_string_append_printf((GString *)data, "%s\t%s\t%d", p->name, p->ip, p->port);
+	for (i= PEER_IPV4; i <= PEER_IPV6; i++) {
+		a= &p->addr[i];
+		if (a->ip[0] == '\0')
+			continue;
+		g_string_append_printf((GString *)data, "\t%s", a->ip);
+		if ((a->ifindex > 0) && (if_indextoname(a->ifindex, ifname) != NULL))
+			g_string_append_printf((GString *)data, " on %s", ifname);
+		if (a->rtt > 0)
+			g_string_append_printf((GString *)data, " rtt %.1f ms", a->rtt/1000.0);
+	}
+	g_string_append((GString *)data, "\n");
+}
+
+
+// Append the table of users to out, one per line
+void headless_print_users(GString *out) {
+	peers_foreach(print_user, out);
+}
+
+
+/****************************************************************\
+|* Functions to handle the file transfer subprocess table       *|
+\****************************************************************/
+
+// Search for a transfer in the table; must be called with gmutex locked
+static Headless_Thread *locate_thread(unsigned tid) {
+	GList *list;
+
+	for (list= threads; list != NULL; list= list->next)
+		if (((Headless_Thread *)list->data)->tid == tid)
+			return (Headless_Thread *)list->data;
+	return NULL;
+}
+
+
+// Regist a subprocess in subprocess table
+gboolean GUI_regist_thread(unsigned tid, const char *type, const char *name, const char *f_name) {
+	Headless_Thread *t;
+
+	pthread_mutex_lock(&gmutex);
+	if (locate_thread(tid) != NULL) {
+		pthread_mutex_unlock(&gmutex);
+		sprintf(tmp_buf, "WARNING: tid %u is already in Filetx table - ignored\n", tid);
+		Log(tmp_buf);
+		return FALSE;
+	}
+	if ((t= (Headless_Thread *)calloc(1, sizeof(Headless_Thread))) == NULL) {
+		pthread_mutex_unlock(&gmutex);
+		return FALSE;
+	}
+	t->tid= tid;
+	g_strlcpy(t->type, type, sizeof(t->type));
+	g_strlcpy(t->name, name, sizeof(t->name));
+	g_strlcpy(t->fname, f_name, sizeof(t->fname));
+	threads= g_list_append(threads, t);
+	pthread_mutex_unlock(&gmutex);
+	return TRUE;
+}
+
+
+// Update the bytes sent in subprocess table
+gboolean GUI_update_bytes_sent(unsigned tid, int trans) {
+	Headless_Thread *t;
+
+	pthread_mutex_lock(&gmutex);
+	if ((t= locate_thread(tid)) == NULL) {
+		pthread_mutex_unlock(&gmutex);
+		Log("Internal error: update of a non existing thread\n");
+		return FALSE;
+	}
+	t->trans= trans;
+	pthread_mutex_unlock(&gmutex);
+	return TRUE;
+}
+
+
+// Update the filename in subprocess table (to complete information)
+gboolean GUI_update_thread_info(unsigned tid, const char *name, const char *name_f) {
+	Headless_Thread *t;
+
+	pthread_mutex_lock(&gmutex);
+	if ((t= locate_thread(tid)) == NULL) {
+		pthread_mutex_unlock(&gmutex);
+		Log("Internal error: update of a non existing thread\n");
+		return FALSE;
+	}
+	g_strlcpy(t->name, name, sizeof(t->name));
+	g_strlcpy(t->fname, name_f, sizeof(t->fname));
+	pthread_mutex_unlock(&gmutex);
+	return TRUE;
+}
+
+
+// Update the TCP state of a connection in subprocess table
+// rtt in ms, cwnd in segments, rate in Mbit/s, sndq in KB
+gboolean GUI_update_thread_tcp(unsigned tid, double rtt, unsigned cwnd, unsigned retrans,
+		double rate, unsigned sndq) {
+	Headless_Thread *t;
+
+	pthread_mutex_lock(&gmutex);
+	if ((t= locate_thread(tid)) == NULL) {
+		// The transfer may end between the sample and this update
+		pthread_mutex_unlock(&gmutex);
+		return FALSE;
+	}
+	t->rtt= rtt;
+	t->cwnd= cwnd;
+	t->retrans= retrans;
+	t->rate= rate;
+	t->sndq= sndq;
+	pthread_mutex_unlock(&gmutex);
+	return TRUE;
+}
+
+
+// Cancels a file transfer subprocess from table
+gboolean GUI_remove_thread(unsigned tid) {
+	Headless_Thread *t;
+
+	pthread_mutex_lock(&gmutex);
+	if ((t= locate_thread(tid)) != NULL) {
+		threads= g_list_remove(threads, t);
+		free(t);
+		pthread_mutex_unlock(&gmutex);
+		return TRUE;
+	}
+	pthread_mutex_unlock(&gmutex);
+	sprintf(tmp_buf, "WARNING: Cancelling a non-existing thread '%u'\n", tid);
+	Log(tmp_buf);
+	return FALSE;
+}
+
+
+// Clear the subprocess' list
+void GUI_clear_threads() {
+	pthread_mutex_lock(&gmutex);
+	g_list_free_full(threads, free);
+	threads= NULL;
+	pthread_mutex_unlock(&gmutex);
+}
+
+
+// Append the table of file transfers to out, one per line
+void headless_print_threads(GString *out) {
+	GList *list;
+	Headless_Thread *t;
+
+	pthread_mutex_lock(&gmutex);
+	for (list= threads; list != NULL; list= list->next) {
+		t= (Headless_Thread *)list->data;
+		g_string_append_printf(out, "%u\t%s\t%s\t%s\t%d%%\trtt %.1f ms\tcwnd %u\tretrans %u\t%.1f Mb/s\tsndq %u KB\n",
+				t->tid, t->type, t->name, t->fname, t->trans, t->rtt, t->cwnd, t->retrans,
+				t->rate, t->sndq);
+	}
+	pthread_mutex_unlock(&gmutex);
+}
@@ -0,0 +1,30 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * headless.h
+ *
+ * Header file of the user interface of the headless daemon
+ *
+ * The daemon implements the functions of gui.h without GTK+: the file
+ * transfers are kept in a plain C table and the users in the registry of
+ * peers (peers.c), both read by the commands of the control socket
+ * (daemon.c), and the log goes to the standard output.
+ \*****************************************************************************/
+#ifndef HEADLESS_INC_
+#define HEADLESS_INC_
+
+#include <glib.h>
+
+// Main loop of the daemon
+extern GMainLoop *main_loop;
+// TRUE if the files received are "Slow"
+extern gboolean headless_slow;
+
+
+// Append the table of users to out, one per line
+void headless_print_users(GString *out);
+// Append the table of file transfers to out, one per line
+void headless_print_threads(GString *out);
+
+#endif
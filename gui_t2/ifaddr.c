@@ -0,0 +1,451 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * ifaddr.c
+ *
+ * Table of local addresses
+ *
+ * getifaddrs returns every address of every interface in one call. The
+ * table keeps them in that order, and the set 'local' indexes them by
+ * address, with the IPv4 addresses mapped in IPv6, so the same lookup
+ * serves both families. The table is read and changed by the main loop.
+ *
+ * The table holds the addresses of the links down too, as the kernel does;
+ * only the preferred address needs a link up. A tentative address (IPv6
+ * duplicate address detection) is left out until the kernel confirms it.
+ \*****************************************************************************/
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_addr.h>
+
+#include "ifaddr.h"
+
+// External logging function declared elsewhere
+extern void Log(const gchar *str);
+
+
+static Local_Addr table[IFADDR_MAX];	// Local addresses
+static int ntable= 0;
+static GHashTable *local= NULL;			// struct in6_addr -> Local_Addr
+
+// Addresses that are not used as preferred address
+#define IFADDR_UNUSABLE		(IFA_F_TENTATIVE | IFA_F_DEPRECATED | IFA_F_DADFAILED)
+
+
+// Hash of an address
+static guint in6_hash(gconstpointer key)
+{
+	const guint32 *w= (const guint32 *)key;
+	return w[0] ^ w[1] ^ (w[2]*31) ^ (w[3]*131);
+}
+
+
+// TRUE if two addresses are the same
+static gboolean in6_equal(gconstpointer a, gconstpointer b)
+{
+	return !memcmp(a, b, sizeof(struct in6_addr));
+}
+
+
+// Scope of an IPv4 address
+static int scope_ipv4(const struct in_addr *a)
+{
+	guint32 h= ntohl(a->s_addr);
+
+	if ((h >> 24) == 127)
+		return IFADDR_SCOPE_HOST;
+	if ((h >> 16) == 0xA9FE)		// 169.254.0.0/16
+		return IFADDR_SCOPE_LINK;
+	return IFADDR_SCOPE_GLOBAL;
+}
+
+
+// Scope of an IPv6 address
+static int scope_ipv6(const struct in6_addr *a)
+{
+	if (IN6_IS_ADDR_LOOPBACK(a))
+		return IFADDR_SCOPE_HOST;
+	if (IN6_IS_ADDR_LINKLOCAL(a))
+		return IFADDR_SCOPE_LINK;
+	if (IN6_IS_ADDR_SITELOCAL(a))
+		return IFADDR_SCOPE_SITE;
+	return IFADDR_SCOPE_GLOBAL;
+}
+
+
+// Read the address in text into addr, with the IPv4 addresses mapped in IPv6
+static gboolean parse_addr(const char *ip_str, struct in6_addr *addr)
+{
+	struct in_addr a4;
+
+	if (inet_pton(AF_INET, ip_str, &a4) == 1) {
+		memset(addr, 0, sizeof(*addr));
+		addr->s6_addr[10]= addr->s6_addr[11]= 0xff;
+		memcpy(&addr->s6_addr[12], &a4, 4);
+		return TRUE;
+	}
+	return inet_pton(AF_INET6, ip_str, addr) == 1;
+}
+
+
+// Index all the addresses of the table again; the first interface of an address wins
+static void reindex(void)
+{
+	int i;
+
+	if (local == NULL)
+		local= g_hash_table_new(in6_hash, in6_equal);
+	else
+		g_hash_table_remove_all(local);
+	for (i= ntable-1; i >= 0; i--)
+		g_hash_table_replace(local, &table[i].addr, &table[i]);
+}
+
+
+// Read the addresses of all interfaces again; FALSE if they could not be read
+gboolean ifaddr_scan(void)
+{
+	struct ifaddrs *ifa, *i;
+	Local_Addr *a;
+
+	if (getifaddrs(&ifa) < 0) {
+		perror("getifaddrs");
+		return FALSE;
+	}
+	ntable= 0;
+	for (i= ifa; (i != NULL) && (ntable < IFADDR_MAX); i= i->ifa_next) {
+		if (i->ifa_addr == NULL)
+			continue;
+		a= &table[ntable];
+		memset(a, 0, sizeof(*a));
+		if (i->ifa_addr->sa_family == AF_INET) {
+			struct in_addr *a4= &((struct sockaddr_in *)i->ifa_addr)->sin_addr;
+			a->addr.s6_addr[10]= a->addr.s6_addr[11]= 0xff;
+			memcpy(&a->addr.s6_addr[12], a4, 4);
+			inet_ntop(AF_INET, a4, a->ip, sizeof(a->ip));
+			a->scope= scope_ipv4(a4);
+		} else if (i->ifa_addr->sa_family == AF_INET6) {
+			a->addr= ((struct sockaddr_in6 *)i->ifa_addr)->sin6_addr;
+			inet_ntop(AF_INET6, &a->addr, a->ip, sizeof(a->ip));
+			a->scope= scope_ipv6(&a->addr);
+		} else
+			continue;	// AF_PACKET
+		a->family= i->ifa_addr->sa_family;
+		a->ifindex= if_nametoindex(i->ifa_name);
+		g_strlcpy(a->ifname, i->ifa_name, sizeof(a->ifname));
+		a->flags= i->ifa_flags;
+		ntable++;
+	}
+	if (i != NULL)
+		Log("Too many local addresses - the last ones were ignored\n");
+	freeifaddrs(ifa);
+	reindex();
+	return TRUE;
+}
+
+
+// Return TRUE if the address (IPv4 or IPv6, in text) is an address of this host
+gboolean ifaddr_is_local(const char *ip_str)
+{
+	struct in6_addr addr;
+
+	if ((local == NULL) || !parse_addr(ip_str, &addr))
+		return FALSE;
+	return g_hash_table_lookup(local, &addr) != NULL;
+}
+
+
+// Return TRUE if the address is an address of this host with host scope (loopback)
+gboolean ifaddr_is_loopback(const struct in6_addr *addr)
+{
+	Local_Addr *a;
+
+	if (local == NULL)
+		return FALSE;
+	a= (Local_Addr *)g_hash_table_lookup(local, addr);
+	return (a != NULL) && (a->scope == IFADDR_SCOPE_HOST);
+}
+
+
+// Return the preferred address of family, on an interface up that is not the loopback
+const Local_Addr *ifaddr_preferred(int family)
+{
+	const Local_Addr *best= NULL;
+	int i;
+
+	for (i= 0; i < ntable; i++) {
+		const Local_Addr *a= &table[i];
+		if ((a->family != family) || !(a->flags & IFF_UP) || (a->flags & IFF_LOOPBACK) ||
+				(a->scope == IFADDR_SCOPE_HOST) || (a->addr_flags & IFADDR_UNUSABLE))
+			continue;
+		if ((family == AF_INET6) && (a->scope == IFADDR_SCOPE_LINK))
+			continue;
+		if ((best == NULL) || (a->scope < best->scope))
+			best= a;
+	}
+	return best;
+}
+
+
+// Write in ifindex (up to max) the interfaces where the groups of family are joined;
+//   returns how many
+int ifaddr_mcast_links(int family, int *ifindex, int max)
+{
+	int i, j, n= 0;
+
+	for (i= 0; (i < ntable) && (n < max); i++) {
+		const Local_Addr *a= &table[i];
+		if ((a->family != family) || ((a->flags & (IFF_UP | IFF_MULTICAST)) != (IFF_UP | IFF_MULTICAST)) ||
+				(a->flags & IFF_LOOPBACK) || (a->addr_flags & (IFA_F_TENTATIVE | IFA_F_DADFAILED)))
+			continue;
+		for (j= 0; (j < n) && (ifindex[j] != a->ifindex); j++)
+			;
+		if (j == n)
+			ifindex[n++]= a->ifindex;
+	}
+	return n;
+}
+
+
+// Call func for each local address, in the order of the interfaces
+void ifaddr_foreach(void (*func)(const Local_Addr *a, gpointer data), gpointer data)
+{
+	int i;
+
+	for (i= 0; i < ntable; i++)
+		func(&table[i], data);
+}
+
+
+/*************************************\
+|* Monitor of the changes            *|
+\*************************************/
+
+// Bit of the changes of family
+#define CHANGED(family)		(((family) == AF_INET) ? IFADDR_CHANGED_IPV4 : IFADDR_CHANGED_IPV6)
+
+
+// Locate the address addr of the interface ifindex in the table; -1 if it is not there
+static int find_addr(const struct in6_addr *addr, int ifindex)
+{
+	int i;
+
+	for (i= 0; i < ntable; i++)
+		if ((table[i].ifindex == ifindex) && in6_equal(&table[i].addr, addr))
+			return i;
+	return -1;
+}
+
+
+// Flags of the interface ifname, from another address of it or from the kernel
+static unsigned link_flags(int ifindex, const char *ifname)
+{
+	struct ifreq req;
+	unsigned flags= 0;
+	int i, fd;
+
+	for (i= 0; i < ntable; i++)
+		if (table[i].ifindex == ifindex)
+			return table[i].flags;
+	if ((fd= socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		return 0;
+	memset(&req, 0, sizeof(req));
+	g_strlcpy(req.ifr_name, ifname, sizeof(req.ifr_name));
+	if (ioctl(fd, SIOCGIFFLAGS, &req) == 0)
+		flags= (unsigned short)req.ifr_flags;
+	close(fd);
+	return flags;
+}
+
+
+// Log a change of the address a
+static void log_addr(const Local_Addr *a, const char *what)
+{
+	char buf[200];
+
+	sprintf(buf, "Local address %s %s %s\n", a->ip, what, a->ifname);
+	Log(buf);
+}
+
+
+// Remove the entry i of the table; returns the family changed
+static int remove_entry(int i)
+{
+	int family= table[i].family;
+
+	log_addr(&table[i], "removed from");
+	memmove(&table[i], &table[i+1], (ntable-i-1)*sizeof(Local_Addr));
+	ntable--;
+	reindex();
+	return CHANGED(family);
+}
+
+
+// Apply a RTM_NEWADDR or RTM_DELADDR message; returns the family changed, or 0
+static int apply_addr(struct nlmsghdr *nh)
+{
+	struct ifaddrmsg *ifa= (struct ifaddrmsg *)NLMSG_DATA(nh);
+	int len= IFA_PAYLOAD(nh);
+	struct rtattr *rta;
+	const void *addr_local= NULL, *addr_peer= NULL;
+	unsigned flags= ifa->ifa_flags;
+	struct in6_addr addr;
+	Local_Addr *a;
+	int i;
+
+	if ((ifa->ifa_family != AF_INET) && (ifa->ifa_family != AF_INET6))
+		return 0;
+	for (rta= IFA_RTA(ifa); RTA_OK(rta, len); rta= RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFA_LOCAL)
+			addr_local= RTA_DATA(rta);
+		else if (rta->rta_type == IFA_ADDRESS)
+			addr_peer= RTA_DATA(rta);
+		else if (rta->rta_type == IFA_FLAGS)
+			memcpy(&flags, RTA_DATA(rta), sizeof(flags));
+	}
+	// IFA_ADDRESS is the address of the other end in point-to-point links
+	if (addr_local == NULL)
+		addr_local= addr_peer;
+	if (addr_local == NULL)
+		return 0;
+	memset(&addr, 0, sizeof(addr));
+	if (ifa->ifa_family == AF_INET) {
+		addr.s6_addr[10]= addr.s6_addr[11]= 0xff;
+		memcpy(&addr.s6_addr[12], addr_local, 4);
+	} else
+		memcpy(&addr, addr_local, 16);
+
+	i= find_addr(&addr, ifa->ifa_index);
+	if ((nh->nlmsg_type == RTM_DELADDR) || (flags & (IFA_F_TENTATIVE | IFA_F_DADFAILED)))
+		return (i >= 0) ? remove_entry(i) : 0;
+	if (i >= 0) {
+		// Known address: only its flags may change (e.g. deprecated)
+		a= &table[i];
+		if ((a->addr_flags == flags) && (a->scope == ifa->ifa_scope))
+			return 0;
+		if ((flags & IFA_F_DEPRECATED) && !(a->addr_flags & IFA_F_DEPRECATED))
+			log_addr(a, "deprecated on");
+		a->addr_flags= flags;
+		a->scope= ifa->ifa_scope;
+		return CHANGED(a->family);
+	}
+	if (ntable == IFADDR_MAX) {
+		Log("Too many local addresses - new address ignored\n");
+		return 0;
+	}
+	a= &table[ntable];
+	memset(a, 0, sizeof(*a));
+	a->family= ifa->ifa_family;
+	a->addr= addr;
+	inet_ntop(a->family, addr_local, a->ip, sizeof(a->ip));
+	a->scope= ifa->ifa_scope;	// The kernel scopes are the IFADDR_SCOPE_* values
+	a->ifindex= ifa->ifa_index;
+	if (if_indextoname(a->ifindex, a->ifname) == NULL)
+		sprintf(a->ifname, "if%d", a->ifindex);
+	a->flags= link_flags(a->ifindex, a->ifname);
+	a->addr_flags= flags;
+	ntable++;
+	reindex();
+	log_addr(a, "added on");
+	return CHANGED(a->family);
+}
+
+
+// Apply a RTM_NEWLINK or RTM_DELLINK message; returns the families of the addresses
+//   of a link that went up, down, or away
+static int apply_link(struct nlmsghdr *nh)
+{
+	struct ifinfomsg *ifi= (struct ifinfomsg *)NLMSG_DATA(nh);
+	char buf[200];
+	int i, changed= 0;
+
+	for (i= ntable-1; i >= 0; i--) {
+		if (table[i].ifindex != ifi->ifi_index)
+			continue;
+		if (nh->nlmsg_type == RTM_DELLINK)
+			changed|= remove_entry(i);
+		else if ((table[i].flags ^ ifi->ifi_flags) & IFF_UP) {
+			if (changed == 0) {
+				sprintf(buf, "Interface %s is %s\n", table[i].ifname, (ifi->ifi_flags & IFF_UP) ? "up" : "down");
+				Log(buf);
+			}
+			table[i].flags= ifi->ifi_flags;
+			changed|= CHANGED(table[i].family);
+		} else
+			table[i].flags= ifi->ifi_flags;
+	}
+	return changed;
+}
+
+
+// Open the monitor of the changes of links and addresses; returns the socket or -1
+int ifaddr_monitor_open(void)
+{
+	struct sockaddr_nl sa;
+	int s;
+
+	if ((s= socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+		perror("netlink socket");
+		return -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family= AF_NETLINK;
+	sa.nl_groups= RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if (bind(s, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		perror("netlink bind");
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+
+// Apply the changes waiting in the monitor socket to the table; returns the
+//   families changed (IFADDR_CHANGED_*), 0 if none, or -1 in case of error
+int ifaddr_monitor_read(int sock)
+{
+	static char buf[16384] __attribute__ ((aligned(NLMSG_ALIGNTO)));
+	struct nlmsghdr *nh;
+	int n, changed= 0;
+
+	while ((n= recv(sock, buf, sizeof(buf), MSG_DONTWAIT)) != 0) {
+		if (n < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				break;
+			if (errno == ENOBUFS) {
+				// The kernel dropped notifications: read the table again
+				Log("Lost notifications of the local addresses - reading them again\n");
+				if (!ifaddr_scan())
+					return -1;
+				changed|= IFADDR_CHANGED_IPV4 | IFADDR_CHANGED_IPV6;
+				continue;
+			}
+			perror("netlink recv");
+			return -1;
+		}
+		for (nh= (struct nlmsghdr *)buf; NLMSG_OK(nh, n); nh= NLMSG_NEXT(nh, n)) {
+			switch (nh->nlmsg_type) {
+			case RTM_NEWADDR:
+			case RTM_DELADDR:
+				changed|= apply_addr(nh);
+				break;
+			case RTM_NEWLINK:
+			case RTM_DELLINK:
+				changed|= apply_link(nh);
+				break;
+			}
+		}
+	}
+	return changed;
+}
@@ -0,0 +1,73 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * ifaddr.h
+ *
+ * Header file of the table of local addresses
+ *
+ * The addresses of every interface are read in the process with getifaddrs
+ * (a rtnetlink dump of the kernel tables), without running ip or ifconfig
+ * and without resolving the name of the host. They are kept in a table
+ * with the interface and the scope of each one, and in a hash set, so the
+ * test of a local address is an exact lookup of every address of the host.
+ *
+ * The monitor is a rtnetlink socket subscribed to the changes of the links
+ * and of the addresses; the main loop reads it when the kernel sends one, and
+ * the table is changed address by address, without reading it all again.
+ \*****************************************************************************/
+#ifndef IFADDR_INC_
+#define IFADDR_INC_
+
+#include <glib.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+#define IFADDR_MAX			64		// Addresses kept in the table
+
+// Scope of an address, as the kernel (rtnetlink) orders them
+#define IFADDR_SCOPE_GLOBAL	0
+#define IFADDR_SCOPE_SITE	200
+#define IFADDR_SCOPE_LINK	253
+#define IFADDR_SCOPE_HOST	254
+
+// Local address
+typedef struct Local_Addr {
+	int family;						// AF_INET or AF_INET6
+	struct in6_addr addr;			// Address; the IPv4 addresses are kept as ::ffff:a.b.c.d
+	char ip[64];					// Address in text
+	int scope;						// IFADDR_SCOPE_*
+	int ifindex;					// Interface
+	char ifname[IF_NAMESIZE];
+	unsigned flags;					// Flags of the interface (IFF_*)
+	unsigned addr_flags;			// Flags of the address (IFA_F_*), known from the monitor
+} Local_Addr;
+
+// Changes reported by ifaddr_monitor_read
+#define IFADDR_CHANGED_IPV4	1		// The IPv4 addresses, or the links with them, changed
+#define IFADDR_CHANGED_IPV6	2		// The IPv6 addresses, or the links with them, changed
+
+
+// Read the addresses of all interfaces again; FALSE if they could not be read
+gboolean ifaddr_scan(void);
+// Return TRUE if the address (IPv4 or IPv6, in text) is an address of this host
+gboolean ifaddr_is_local(const char *ip_str);
+// Return TRUE if the address is an address of this host with host scope (loopback)
+gboolean ifaddr_is_loopback(const struct in6_addr *addr);
+// Return the preferred address of family, on an interface up that is not the loopback,
+//   or NULL if there is none: the global addresses come before the site and link
+//   ones; the IPv6 link-local, tentative and deprecated addresses are not used
+const Local_Addr *ifaddr_preferred(int family);
+// Write in ifindex (up to max) the interfaces where the groups of family are joined:
+//   up, with multicast, not the loopback, with a usable address of family; returns how many
+int ifaddr_mcast_links(int family, int *ifindex, int max);
+// Call func for each local address, in the order of the interfaces
+void ifaddr_foreach(void (*func)(const Local_Addr *a, gpointer data), gpointer data);
+
+// Open the monitor of the changes of links and addresses; returns the socket or -1
+int ifaddr_monitor_open(void);
+// Apply the changes waiting in the monitor socket to the table; returns the
+//   families changed (IFADDR_CHANGED_*), 0 if none, or -1 in case of error
+int ifaddr_monitor_read(int sock);
+
+#endif
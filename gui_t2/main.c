@@ -17,14 +17,39 @@
 #include <memory.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include "gui.h"
-#include "file.h"
+#include <string.h>
+#include <unistd.h>
+#include "gui_gtk.h"
 #include "sock.h"
 #include "callbacks.h"
+#include "engine.h"
+#include "rate.h"
+#include "pool.h"
+#include "options.h"
 
 /* Public variables */
 WindowElements *main_window; // Pointer to all elements of main window
-char *out_dir;
+
+
+// Print the command line options
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [options]\n", prog);
+	transfer_usage();
+	fprintf(stderr, "  -h                          show this help\n");
+}
+
+// Read the command line options left after GTK+ removed its own
+static gboolean read_options(int argc, char *argv[]) {
+	int opt;
+
+	while ((opt= getopt(argc, argv, TRANSFER_OPTIONS "h")) != -1) {
+		if (!transfer_option(opt, optarg)) {
+			usage(argv[0]);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
 
 
 // main function
@@ -37,9 +62,15 @@ int main(int argc, char *argv[]) {
 	/* initialize GTK+ libraries */
 	gtk_init(&argc, &argv);
 
+	if (!read_options(argc, argv))
+		return 1;
+	start_transfers();
+
 	if (init_app(main_window) == FALSE)
 		return 1; /* error loading UI */
 	gtk_widget_show(main_window->window);
+	set_rate(rate_transfer/1024);
+	set_total_rate(rate_global/1024);
 
 #ifdef __i386__
 	Log("You are in a 32 bit OS\n");
@@ -60,25 +91,15 @@ int main(int argc, char *argv[]) {
 	gtk_entry_set_text(main_window->entryName, newEntry);
 
 	// Defines the output directory, where the files will be written
-	char *homedir = getenv("HOME");
-	if (homedir == NULL)
-		homedir = getenv("PWD");
-	if (homedir == NULL)
-		homedir = "/tmp";
-	out_dir = g_strdup_printf("%s/out%d", homedir, getpid());
-	if (!make_directory(out_dir)) {
-		Log("Failed creation of output directory: '");
-		Log(out_dir);
-		Log("'.\n");
-		out_dir = "/tmp";
-	}
-	Log("Received files will be created at: '");
-	Log(out_dir);
-	Log("'\n");
+	init_out_dir();
 
 	// Infinite loop handled by GTK+3.0
 	gtk_main();
 
+	if (engine_running())
+		engine_stop();
+	pool_clear();
+
 	/* free memory we allocated for TutorialTextEditor struct */
 	g_slice_free(WindowElements, main_window);
 
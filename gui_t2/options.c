@@ -0,0 +1,189 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * options.c
+ *
+ * Command line options of the file transfers
+ \*****************************************************************************/
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "options.h"
+#include "callbacks.h"
+#include "thread.h"
+#include "engine.h"
+#include "stripe.h"
+#include "resume.h"
+#include "pipeline.h"
+#include "rate.h"
+#include "pool.h"
+#include "scheduler.h"
+#include "tune.h"
+#include "tcpinfo.h"
+#include "file.h"
+#include "peers.h"
+#include "hash.h"
+
+/* Public variables */
+char *out_dir;
+static const char *opt_out_dir= NULL;	// Output directory selected in the command line
+
+
+// Print the transfer options
+void transfer_usage(void) {
+	fprintf(stderr,
+			"  -s buffered|sendfile|uring|pipelined\n"
+			"                              data path used to send files (default sendfile)\n"
+			"  -r buffered|splice|uring|pipelined\n"
+			"                              data path used to receive files (default splice)\n"
+			"  -d depth                    buffers of the pipelined data path (default 8,\n"
+			"                              maximum 64)\n"
+			"  -b kbytes                   size of each pipelined buffer (default 256)\n"
+			"  -w workers                  run transfers in an event-driven engine with 'workers'\n"
+			"                              I/O threads (default 0: one thread per transfer)\n"
+			"  -n connections              send files with at least 8 MB over 'connections'\n"
+			"                              parallel TCP connections (default 1, maximum 16)\n"
+			"  -o directory                write received files in 'directory'; use the same one\n"
+			"                              after a restart to resume partial files (default\n"
+			"                              $HOME/out<pid>)\n"
+			"  -R                          send files from the start, without asking the\n"
+			"                              receiver for a partial copy\n"
+			"  -l kbytes/s                 rate of the transfers marked \"Slow\" (default 128)\n"
+			"  -L kbytes/s                 limit of all transfers together (default 0: none)\n"
+			"  -W mbytes                   received data kept dirty in memory before it is\n"
+			"                              written and dropped from the page cache (default 8,\n"
+			"                              0 leaves it to the kernel)\n"
+			"  -q transfers                files sent at the same time; the others wait in a\n"
+			"                              queue (default 4, 0: no limit)\n"
+			"  -Q connections              connections received at the same time (default 32,\n"
+			"                              0: no limit)\n"
+			"  -T lan|wan|lowlat           socket profile of the transfers (default lan)\n"
+			"  -B kbytes                   fixed size of the socket buffers (default 0: grown\n"
+			"                              by the kernel autotuning)\n"
+			"  -i ms                       period of the TCP_INFO samples of the transfers,\n"
+			"                              written to out_dir when they end (default 500, 0: off)\n"
+			"  -e seconds                  remove the users not heard for 'seconds' (default 30)\n"
+			"  -P                          close the connection after each file sent, instead\n"
+			"                              of keeping it for the next files to the same peer\n"
+			"  -H                          do not check the files sent or received with\n"
+			"                              sendfile or splice, instead of reading them back\n"
+			"                              from the page cache to hash them (default: every\n"
+			"                              file is checked)\n");
+}
+
+// Convert a data path name into its XFER_MODE value; returns -1 if invalid
+static int get_xfer_mode(const char *name, const char *zerocopy_name) {
+	if (!strcmp(name, "buffered"))
+		return XFER_MODE_BUFFERED;
+	if (!strcmp(name, zerocopy_name))
+		return XFER_MODE_ZEROCOPY;
+	if (!strcmp(name, "uring"))
+		return XFER_MODE_URING;
+	if (!strcmp(name, "pipelined"))
+		return XFER_MODE_PIPELINED;
+	return -1;
+}
+
+// Handle the transfer option opt; returns FALSE if opt is unknown or arg is invalid
+gboolean transfer_option(int opt, const char *arg) {
+	switch (opt) {
+	case 's':
+		return (snd_mode= get_xfer_mode(arg, "sendfile")) >= 0;
+	case 'r':
+		return (rcv_mode= get_xfer_mode(arg, "splice")) >= 0;
+	case 'd':
+		pipeline_depth= atoi(arg);
+		return (pipeline_depth >= 2) && (pipeline_depth <= PIPELINE_MAX_DEPTH);
+	case 'b':
+		pipeline_block= atoi(arg)*1024;
+		return (pipeline_block >= PIPELINE_MIN_BLOCK) && (pipeline_block <= PIPELINE_MAX_BLOCK);
+	case 'w':
+		engine_workers= atoi(arg);
+		return (engine_workers >= 0) && (engine_workers <= ENGINE_MAX_WORKERS);
+	case 'n':
+		stripes= atoi(arg);
+		return (stripes >= 1) && (stripes <= STRIPE_MAX);
+	case 'o':
+		opt_out_dir= arg;
+		return TRUE;
+	case 'R':
+		resume_enabled= FALSE;
+		return TRUE;
+	case 'q':
+		sched_max_snd= atoi(arg);
+		return sched_max_snd >= 0;
+	case 'Q':
+		sched_max_rcv= atoi(arg);
+		return sched_max_rcv >= 0;
+	case 'T':
+		return tune_select(arg);
+	case 'B':
+		tune_buffer= atoi(arg)*1024;
+		return (tune_buffer >= 0) && (atoi(arg) <= 256*1024);
+	case 'i':
+		tcpinfo_period= atoi(arg);
+		return tcpinfo_period >= 0;
+	case 'e':
+		peers_timeout= atoi(arg)*1000;
+		return peers_timeout > 0;
+	case 'P':
+		pool_enabled= FALSE;
+		return TRUE;
+	case 'H':
+		hash_zerocopy= FALSE;
+		return TRUE;
+	case 'l':
+		rate_transfer= atoll(arg)*1024;
+		return rate_transfer > 0;
+	case 'L':
+		if (atoll(arg) < 0)
+			return FALSE;
+		rate_set_global(atoll(arg)*1024);
+		return TRUE;
+	case 'W':
+		write_behind= atoi(arg)*1024*1024;
+		return (write_behind >= 0) && (atoi(arg) <= 1024);
+	default:
+		return FALSE;
+	}
+}
+
+// Create the directory of the received files (option -o, or $HOME/out<pid>) and set out_dir
+void init_out_dir(void) {
+	// Defines the output directory, where the files will be written
+	char *homedir = getenv("HOME");
+	if (homedir == NULL)
+		homedir = getenv("PWD");
+	if (homedir == NULL)
+		homedir = "/tmp";
+	if (opt_out_dir != NULL)
+		out_dir = g_strdup(opt_out_dir);
+	else
+		out_dir = g_strdup_printf("%s/out%d", homedir, getpid());
+	if (!make_directory(out_dir)) {
+		Log("Failed creation of output directory: '");
+		Log(out_dir);
+		Log("'.\n");
+		out_dir = "/tmp";
+	}
+	Log("Received files will be created at: '");
+	Log(out_dir);
+	Log("'\n");
+}
+
+// Start the transfer engine, if requested, and the TCP_INFO sampler
+void start_transfers(void) {
+	// A receiver that rejects a file closes the connection; sendfile must fail with EPIPE instead
+	signal(SIGPIPE, SIG_IGN);
+	if ((engine_workers > 0) && !engine_start(engine_workers)) {
+		fprintf(stderr, "Failed to start the transfer engine - using one thread per transfer\n");
+		engine_workers= 0;
+	}
+	// Sample the state of the TCP connections of the transfers
+	tcpinfo_start();
+}
@@ -0,0 +1,30 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * options.h
+ *
+ * Header file of the command line options of the file transfers
+ *
+ * The options are shared by the GTK+ application (main.c) and the headless
+ * daemon (daemon.c), which add their own options to TRANSFER_OPTIONS.
+ \*****************************************************************************/
+#ifndef OPTIONS_INC_
+#define OPTIONS_INC_
+
+#include <glib.h>
+
+// getopt() string of the transfer options
+#define TRANSFER_OPTIONS	"s:r:d:b:w:n:o:l:L:W:q:Q:T:B:i:e:RPH"
+
+
+// Print the transfer options
+void transfer_usage(void);
+// Handle the transfer option opt; returns FALSE if opt is unknown or arg is invalid
+gboolean transfer_option(int opt, const char *arg);
+// Create the directory of the received files (option -o, or $HOME/out<pid>) and set out_dir
+void init_out_dir(void);
+// Start the transfer engine, if requested, and the TCP_INFO sampler
+void start_transfers(void);
+
+#endif
@@ -0,0 +1,562 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * peers.c
+ *
+ * Registry of peers
+ *
+ * Each user is in two hash tables: by_addr, keyed by each of its addresses
+ * (ip and port), and by_name, keyed by name, with the users that share a name chained
+ * from the first one registered. The users are also in a list, in the order
+ * of registration, that the commands walk, and in the slot of the timing
+ * wheel of their deadline. The registry is changed by the main loop, but it
+ * is locked as the table of the user interface, which is changed under the
+ * same lock.
+ *
+ * The deadline of a user is half a period after the latest time of the next
+ * registration it missed, so the users that announce themselves in time are
+ * not touched. The period grows with the users of the group, as the users
+ * announce themselves less often, and the timeout grows with it. The users
+ * do not send their period, and the users that joined later know fewer users
+ * than the others: the period of each user is learned from the gaps between
+ * its registrations in each group, as the longest gap heard lately; a gap much
+ * longer than that spans registrations lost, and is not a period. It is not
+ * shorter than the local period (name_period). The first gap of a user found
+ * by a query is shorter than its period: until two gaps are heard, the user
+ * also has the mean period of the users in the registry, as it is then, which
+ * grows as the group is heard.
+ \*****************************************************************************/
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "peers.h"
+#include "gui.h"
+#include "callbacks.h"
+
+
+static GHashTable *by_addr= NULL;			// Peer_Addr -> Peer_Addr, by ip and port
+static GHashTable *by_name= NULL;			// name -> first Peer with the name
+static Peer *first= NULL, *last= NULL;		// Users in the order of registration
+static Peer *wheel[PEERS_WHEEL_SLOTS];		// Users by slot of their deadline
+static long long wheel_now= -1;				// Last tick handled
+static int npeers= 0;						// Users in the registry
+static long long period_sum= 0;			// Sum of the periods learned from the users (usec)
+static int nperiods= 0;						// Users with a period learned
+int peers_timeout= PEERS_DEFAULT_TIMEOUT;	// Time without registrations before a user is removed (ms)
+static pthread_mutex_t umutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Temporary buffer, used with umutex locked
+static char tmp_buf[400];
+
+
+/*************************************\
+|* Indexes                           *|
+\*************************************/
+
+// Hash of an address of a user
+static guint addr_hash(gconstpointer key)
+{
+	const Peer_Addr *a= (const Peer_Addr *)key;
+	return g_str_hash(a->ip)*31 + (guint)a->port;
+}
+
+
+// TRUE if two addresses are the same
+static gboolean addr_equal(gconstpointer a, gconstpointer b)
+{
+	const Peer_Addr *p= (const Peer_Addr *)a, *q= (const Peer_Addr *)b;
+	return (p->port == q->port) && !strcmp(p->ip, q->ip);
+}
+
+
+// Create the indexes, the first time they are used
+static void init_indexes(void)
+{
+	if (by_addr == NULL) {
+		by_addr= g_hash_table_new(addr_hash, addr_equal);
+		by_name= g_hash_table_new(g_str_hash, g_str_equal);
+	}
+}
+
+
+// Locate the address (ip, port) of a user; must be called with umutex locked
+static Peer_Addr *locate_addr(const char *ip, int port)
+{
+	Peer_Addr key;
+
+	g_strlcpy(key.ip, ip, sizeof(key.ip));
+	key.port= port;
+	return (Peer_Addr *)g_hash_table_lookup(by_addr, &key);
+}
+
+
+// Set the address of family fam of p and index it
+static void set_addr(Peer *p, int fam, const char *ip, long long now)
+{
+	Peer_Addr *a= &p->addr[fam];
+
+	g_strlcpy(a->ip, ip, sizeof(a->ip));
+	a->port= p->port;
+	a->seen= now;
+	a->rtt= 0;
+	a->peer= p;
+	g_hash_table_insert(by_addr, a, a);
+}
+
+
+// Forget the address a of a user
+static void clear_addr(Peer_Addr *a)
+{
+	if (a->ip[0] == '\0')
+		return;
+	g_hash_table_remove(by_addr, a);
+	a->ip[0]= '\0';
+	a->rtt= 0;
+}
+
+
+// Choose the address where the files are sent to p: the lowest RTT measured,
+//   once both addresses were tried; IPv6 first. Returns TRUE if it changed
+static gboolean choose_addr(Peer *p)
+{
+	Peer_Addr *a4= &p->addr[PEER_IPV4], *a6= &p->addr[PEER_IPV6], *best;
+
+	if ((a4->ip[0] == '\0') || (a6->ip[0] == '\0'))
+		best= (a6->ip[0] != '\0') ? a6 : a4;
+	else if (a6->rtt == 0)
+		best= a6;
+	else if (a4->rtt == 0)
+		best= a4;
+	else
+		best= (a4->rtt < a6->rtt) ? a4 : a6;
+	if (!strcmp(p->ip, best->ip))
+		return FALSE;
+	g_strlcpy(p->ip, best->ip, sizeof(p->ip));
+	return TRUE;
+}
+
+
+// Add p to the end of the chain of its name
+static void link_name(Peer *p)
+{
+	Peer *q= (Peer *)g_hash_table_lookup(by_name, p->name);
+
+	p->name_next= NULL;
+	if (q == NULL) {
+		g_hash_table_insert(by_name, p->name, p);
+		return;
+	}
+	while (q->name_next != NULL)
+		q= q->name_next;
+	q->name_next= p;
+}
+
+
+// Remove p from the chain of its name
+static void unlink_name(Peer *p)
+{
+	Peer *q= (Peer *)g_hash_table_lookup(by_name, p->name);
+
+	if (q == p) {
+		// The key is the name of the first user of the chain
+		if (p->name_next != NULL)
+			g_hash_table_replace(by_name, p->name_next->name, p->name_next);
+		else
+			g_hash_table_remove(by_name, p->name);
+	} else {
+		while ((q != NULL) && (q->name_next != p))
+			q= q->name_next;
+		if (q != NULL)
+			q->name_next= p->name_next;
+	}
+	p->name_next= NULL;
+}
+
+
+/*************************************\
+|* Timing wheel                      *|
+\*************************************/
+
+// Tick of a time (usec)
+#define WHEEL_TICK_OF(t)	((t)/(PEERS_WHEEL_TICK*1000LL))
+
+
+// Longest time expected between two registrations of p (usec): the longest gap
+//   learned, plus half of it for the jitter not heard yet, or 1.5 local periods
+static long long gap_usec(const Peer *p)
+{
+	long long gap= ((p->gaps < 2) && (nperiods > 0)) ? MAX(p->period, period_sum/nperiods) : p->period;
+
+	return MAX(gap + gap/2, name_period*1500LL);
+}
+
+
+// Time without registrations before p is removed (usec): peers_timeout, for
+//   the shortest period, and as many periods as p has for the longer ones
+static long long timeout_usec(const Peer *p)
+{
+	return peers_timeout*1000LL*gap_usec(p)/(NAME_TIMER_PERIOD*1500LL);
+}
+
+
+// Learn the period of p from the gap (usec) since its last registration in the
+//   same group: the longer gaps are taken at once, as a period that grew, and the
+//   shorter ones slowly. The gaps shorter than half the shortest period are the
+//   answers to the queries and the registrations of a new address, and the gaps
+//   longer than 1.5 periods, once two were heard, span registrations lost
+static void learn_period(Peer *p, long long gap)
+{
+	if ((gap < NAME_TIMER_PERIOD*500LL) || (gap >= timeout_usec(p)))
+		return;		// Not a period
+	if ((p->gaps >= 2) && (gap > p->period + p->period/2))
+		return;
+	if (p->gaps == 0)
+		nperiods++;
+	else
+		period_sum-= p->period;
+	if (p->gaps < 2)
+		p->gaps++;
+	if (gap > p->period)
+		p->period= gap;
+	else
+		p->period+= (gap - p->period)/16;
+	period_sum+= p->period;
+}
+
+
+// Remove p from the slot of its deadline
+static void unlink_wheel(Peer *p)
+{
+	if (p->wheel_prev != NULL)
+		p->wheel_prev->wheel_next= p->wheel_next;
+	else
+		wheel[WHEEL_TICK_OF(p->deadline) % PEERS_WHEEL_SLOTS]= p->wheel_next;
+	if (p->wheel_next != NULL)
+		p->wheel_next->wheel_prev= p->wheel_prev;
+	p->wheel_prev= p->wheel_next= NULL;
+}
+
+
+// Put p in the slot of its next deadline: half a period after the latest time
+//   of the next registration it misses (the longest gap of p), or when it times out
+static void link_wheel(Peer *p)
+{
+	long long timeout= p->seen + timeout_usec(p);
+	long long period= gap_usec(p);
+	Peer **slot;
+
+	p->deadline= p->seen + (p->timer+1)*period + period/2;
+	if (p->deadline > timeout)
+		p->deadline= timeout;
+	if ((wheel_now >= 0) && (WHEEL_TICK_OF(p->deadline) <= wheel_now))
+		// The slot was already handled: wait for the next tick, not for the next turn
+		p->deadline= (wheel_now+1)*PEERS_WHEEL_TICK*1000LL;
+	slot= &wheel[WHEEL_TICK_OF(p->deadline) % PEERS_WHEEL_SLOTS];
+	p->wheel_prev= NULL;
+	p->wheel_next= *slot;
+	if (*slot != NULL)
+		(*slot)->wheel_prev= p;
+	*slot= p;
+}
+
+
+// Remove p from the registry and from the user interface, and free it
+static void remove_peer(Peer *p)
+{
+	GUI_remove_user(p);
+	unlink_wheel(p);
+	unlink_name(p);
+	clear_addr(&p->addr[PEER_IPV4]);
+	clear_addr(&p->addr[PEER_IPV6]);
+	if (p->gaps > 0) {
+		period_sum-= p->period;
+		nperiods--;
+	}
+	if (p->prev != NULL)
+		p->prev->next= p->next;
+	else
+		first= p->next;
+	if (p->next != NULL)
+		p->next->prev= p->prev;
+	else
+		last= p->prev;
+	npeers--;
+	free(p);
+}
+
+
+/*************************************\
+|* Registrations                     *|
+\*************************************/
+
+// Regist the name of the user at (ip, port), or refresh it; returns TRUE if it is new or changed
+gboolean peers_regist(const char *name, const char *ip, int port, int ifindex)
+{
+	int fam= (strchr(ip, ':') != NULL) ? PEER_IPV6 : PEER_IPV4;
+	long long now= g_get_monotonic_time();
+	Peer_Addr *a, *other;
+	Peer *p;
+
+	pthread_mutex_lock(&umutex);
+	init_indexes();
+	if ((a= locate_addr(ip, port)) != NULL) {
+		p= a->peer;
+		unlink_wheel(p);
+		learn_period(p, now - a->seen);
+		a->seen= p->seen= now;
+		a->ifindex= ifindex;
+		// The address of the other family is forgotten when it is not heard anymore
+		other= &p->addr[1-fam];
+		if ((other->ip[0] != '\0') && (now-other->seen >= timeout_usec(p))) {
+			clear_addr(other);
+			if (choose_addr(p))
+				GUI_update_user(p);
+		}
+		if (!strcmp(p->name, name)) {
+			// Name already in the table
+			if (p->timer > 0) {
+				p->timer= 0;
+				GUI_update_user(p);
+			}
+			link_wheel(p);
+			pthread_mutex_unlock(&umutex);
+			return FALSE;
+		}
+		snprintf(tmp_buf, sizeof(tmp_buf), "WARNING: The user at %s:%d did not cancel its previous name\n", ip, port);
+		Log(tmp_buf);
+		// Registration will be replaced
+		unlink_name(p);
+		g_strlcpy(p->name, name, sizeof(p->name));
+		link_name(p);
+		p->timer= 0;
+		link_wheel(p);
+		GUI_update_user(p);
+		pthread_mutex_unlock(&umutex);
+		return TRUE;
+	}
+
+	// The same user heard in the group of the other family: same name and TCP port
+	for (p= (Peer *)g_hash_table_lookup(by_name, name); p != NULL; p= p->name_next)
+		if ((p->port == port) && (p->addr[fam].ip[0] == '\0'))
+			break;
+	if (p != NULL) {
+		snprintf(tmp_buf, sizeof(tmp_buf), "User '%s' also at %s\n", name, ip);
+		Log(tmp_buf);
+		unlink_wheel(p);
+		set_addr(p, fam, ip, now);
+		p->addr[fam].ifindex= ifindex;
+		p->seen= now;
+		p->timer= 0;
+		link_wheel(p);
+		choose_addr(p);
+		GUI_update_user(p);
+		pthread_mutex_unlock(&umutex);
+		return TRUE;
+	}
+
+	// New registration
+	if (g_hash_table_lookup(by_name, name) != NULL) {
+		snprintf(tmp_buf, sizeof(tmp_buf), "WARNING: Duplicate name registered '%s'\n", name);
+		Log(tmp_buf);
+	}
+	if ((p= (Peer *)calloc(1, sizeof(Peer))) == NULL) {
+		pthread_mutex_unlock(&umutex);
+		return FALSE;
+	}
+	g_strlcpy(p->name, name, sizeof(p->name));
+	p->port= port;
+	set_addr(p, fam, ip, now);
+	p->addr[fam].ifindex= ifindex;
+	choose_addr(p);
+	p->seen= now;
+	link_wheel(p);
+	link_name(p);
+	p->prev= last;
+	if (last != NULL)
+		last->next= p;
+	else
+		first= p;
+	last= p;
+	npeers++;
+	p->view= GUI_add_user(p);
+	pthread_mutex_unlock(&umutex);
+	return TRUE;
+}
+
+
+// Remove the name of the user at (ip, port); returns FALSE if it was not registered
+// A user with an address in the other family keeps it
+gboolean peers_cancel(const char *name, const char *ip, int port)
+{
+	Peer_Addr *a;
+	Peer *p;
+
+	pthread_mutex_lock(&umutex);
+	init_indexes();
+	if (((a= locate_addr(ip, port)) != NULL) && !strcmp(a->peer->name, name)) {
+		p= a->peer;
+		clear_addr(a);
+		if ((p->addr[PEER_IPV4].ip[0] == '\0') && (p->addr[PEER_IPV6].ip[0] == '\0')) {
+			remove_peer(p);
+		} else {
+			choose_addr(p);
+			GUI_update_user(p);
+		}
+		pthread_mutex_unlock(&umutex);
+		return TRUE;
+	}
+	snprintf(tmp_buf, sizeof(tmp_buf), "WARNING: The user at %s:%hu canceled a non-existing name '%s'\n",
+			ip, (unsigned short)port, name);
+	Log(tmp_buf);
+	pthread_mutex_unlock(&umutex);
+	return FALSE;
+}
+
+
+// Handle the users that are due until now: count the periods missed and remove
+//   the users not heard for peers_timeout; called each PEERS_WHEEL_TICK ms
+void peers_expire(void)
+{
+	long long now= g_get_monotonic_time();
+	long long tick= WHEEL_TICK_OF(now);
+	Peer *p, *next;
+
+	pthread_mutex_lock(&umutex);
+	if ((wheel_now < 0) || (tick-wheel_now > PEERS_WHEEL_SLOTS))
+		// First tick, or the main loop was blocked for more than a turn
+		wheel_now= tick-PEERS_WHEEL_SLOTS;
+	while (wheel_now < tick) {
+		wheel_now++;
+		for (p= wheel[wheel_now % PEERS_WHEEL_SLOTS]; p != NULL; p= next) {
+			next= p->wheel_next;
+			if (WHEEL_TICK_OF(p->deadline) > wheel_now)
+				continue;	// Due in a later turn of the wheel
+			if (now-p->seen >= timeout_usec(p)) {
+				snprintf(tmp_buf, sizeof(tmp_buf), "User '%s' marked - name timeout\n", p->name);
+				Log(tmp_buf);
+				remove_peer(p);
+				continue;
+			}
+			// One more registration missed
+			unlink_wheel(p);
+			p->timer++;
+			link_wheel(p);
+			GUI_update_user(p);
+		}
+	}
+	pthread_mutex_unlock(&umutex);
+}
+
+
+// Remove all users
+void peers_clear(void)
+{
+	pthread_mutex_lock(&umutex);
+	while (first != NULL)
+		remove_peer(first);
+	pthread_mutex_unlock(&umutex);
+}
+
+
+/*************************************\
+|* Lookups                           *|
+\*************************************/
+
+// Add an RTT sample (usec) of a connection to the user at (ip, port), and choose its best address
+void peers_rtt(const char *ip, int port, long long rtt)
+{
+	Peer_Addr *a;
+	Peer *p;
+
+	if (rtt <= 0)
+		return;
+	pthread_mutex_lock(&umutex);
+	if ((by_addr != NULL) && ((a= locate_addr(ip, port)) != NULL)) {
+		a->rtt= (a->rtt == 0) ? rtt : (7*a->rtt + rtt)/8;
+		p= a->peer;
+		if (choose_addr(p)) {
+			a= !strcmp(p->ip, p->addr[PEER_IPV4].ip) ? &p->addr[PEER_IPV4] : &p->addr[PEER_IPV6];
+			if (a->rtt > 0)
+				snprintf(tmp_buf, sizeof(tmp_buf), "Files to '%s' sent to %s (rtt %.1f ms)\n", p->name, p->ip, a->rtt/1000.0);
+			else
+				snprintf(tmp_buf, sizeof(tmp_buf), "Files to '%s' sent to %s (rtt not measured yet)\n", p->name, p->ip);
+			Log(tmp_buf);
+			GUI_update_user(p);
+		}
+	}
+	pthread_mutex_unlock(&umutex);
+}
+
+
+// Return the interface where the user at (ip, port) was heard, when ip is an IPv6
+//   link-local address, which needs it to be reached; 0 for the other addresses
+int peers_scope_id(const struct in6_addr *ip, int port)
+{
+	char ip_str[64];
+	Peer_Addr *a;
+	int ifindex= 0;
+
+	if (!IN6_IS_ADDR_LINKLOCAL(ip))
+		return 0;
+	inet_ntop(AF_INET6, ip, ip_str, sizeof(ip_str));
+	pthread_mutex_lock(&umutex);
+	if ((by_addr != NULL) && ((a= locate_addr(ip_str, port)) != NULL))
+		ifindex= a->ifindex;
+	pthread_mutex_unlock(&umutex);
+	return ifindex;
+}
+
+
+// Locate the user 'name' and return its address (text) in ip and its TCP port; FALSE if unknown
+gboolean peers_locate_name(const char *name, char *ip, size_t len, int *port)
+{
+	Peer *p= NULL;
+
+	pthread_mutex_lock(&umutex);
+	if ((by_name != NULL) && ((p= (Peer *)g_hash_table_lookup(by_name, name)) != NULL)) {
+		g_strlcpy(ip, p->ip, len);
+		*port= p->port;
+	}
+	pthread_mutex_unlock(&umutex);
+	return p != NULL;
+}
+
+
+// Call func for each user, in the order of registration, with the registry locked
+void peers_foreach(void (*func)(const Peer *p, gpointer data), gpointer data)
+{
+	Peer *p;
+
+	pthread_mutex_lock(&umutex);
+	for (p= first; p != NULL; p= p->next)
+		func(p, data);
+	pthread_mutex_unlock(&umutex);
+}
+
+
+// Call func for each user heard in the group of family fam (PEER_IPV4 or PEER_IPV6)
+//   in the first half of its timeout, with the registry locked: the other users
+//   hear its next registrations before they remove it
+void peers_foreach_known(int fam, void (*func)(const Peer *p, gpointer data), gpointer data)
+{
+	long long now= g_get_monotonic_time();
+	Peer *p;
+
+	pthread_mutex_lock(&umutex);
+	for (p= first; p != NULL; p= p->next)
+		if ((p->addr[fam].ip[0] != '\0') && (now-p->addr[fam].seen < timeout_usec(p)/2))
+			func(p, data);
+	pthread_mutex_unlock(&umutex);
+}
+
+
+// Return the number of users in the registry
+int peers_count(void)
+{
+	return npeers;
+}
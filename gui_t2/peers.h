@@ -0,0 +1,99 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * peers.h
+ *
+ * Header file of the registry of peers
+ *
+ * The users announced in the multicast groups are kept in memory, indexed by
+ * address (ip, TCP port) and by name in hash tables, so a registration, a
+ * cancellation or a lookup does not depend on the number of users. A user
+ * heard in the IPv4 and in the IPv6 group, with the same name and TCP port,
+ * is one user with two addresses; the files are sent to the address with the
+ * lowest RTT measured by the transfers (TCP_INFO), after both were tried. The table
+ * of the user interface is a view of the registry: it is changed one row at a
+ * time by the functions GUI_add_user, GUI_update_user and GUI_remove_user.
+ *
+ * The users wait for their deadline in a timing wheel: a registration just
+ * moves the user to another slot, and each tick only looks at the users of
+ * the slots that are due. A user that announces itself every period is never
+ * due; a late user is due once per period missed, to count it in the table,
+ * and is removed when it is not heard for peers_timeout ms, or for as many
+ * periods, when the periods are longer than NAME_TIMER_PERIOD in large groups;
+ * the period of each user is learned from the gaps between its registrations.
+ \*****************************************************************************/
+#ifndef PEERS_INC_
+#define PEERS_INC_
+
+#include <glib.h>
+#include <netinet/in.h>
+
+#define PEERS_DEFAULT_TIMEOUT	30000	// Users not heard for this time are removed (ms)
+#define PEERS_WHEEL_TICK		250		// Period of the timing wheel (ms)
+#define PEERS_WHEEL_SLOTS		256		// Slots of the wheel: one turn takes 64 s; later
+										//   deadlines stay in their slot for the next turns
+
+// Time after the last registration when a user is removed (ms), with the shortest period
+extern int peers_timeout;
+
+#define PEERS_NAME_LENGTH		80		// Longest name of a user, with the '\0'
+
+#define PEER_IPV4			0		// Index of the address of each family of a user
+#define PEER_IPV6			1
+
+// Address of a user in one IP family
+typedef struct Peer_Addr {
+	char ip[64];					// Address in text, as received; "" if not known
+	int port;						// TCP port
+	long long seen;					// Time of the last registration from this address (usec)
+	long long rtt;					// Smoothed RTT of the files sent to it (usec); 0 if not measured
+	int ifindex;					// Interface where it was last heard; 0 if not known
+	struct Peer *peer;
+} Peer_Addr;
+
+// User in the registry
+typedef struct Peer {
+	char name[PEERS_NAME_LENGTH];
+	char ip[64];					// Address where the files are sent, in text
+	int port;						// TCP port
+	Peer_Addr addr[2];				// Addresses in the IPv4 and in the IPv6 group
+	int timer;						// Periods of the name timer without a registration
+	long long period;				// Longest gap between its registrations in a group,
+									//   lately (usec); the period it announces itself with
+	int gaps;						// Gaps learned, up to 2
+	long long seen;					// Time of the last registration, from any address (usec)
+	long long deadline;				// Time when the user is due in the wheel (usec)
+	struct Peer *wheel_prev, *wheel_next;	// Users in the same slot of the wheel
+	struct Peer *name_next;			// Next user with the same name
+	struct Peer *prev, *next;		// Users in the order of registration
+	gpointer view;					// Row of the user in the user interface
+} Peer;
+
+
+// Regist the name of the user at (ip, port), heard in the interface ifindex, or refresh it;
+//   returns TRUE if it is new or changed
+gboolean peers_regist(const char *name, const char *ip, int port, int ifindex);
+// Remove the name of the user at (ip, port); returns FALSE if it was not registered
+gboolean peers_cancel(const char *name, const char *ip, int port);
+// Handle the users that are due until now: count the periods missed and remove
+//   the users not heard for peers_timeout; called each PEERS_WHEEL_TICK ms
+void peers_expire(void);
+// Remove all users
+void peers_clear(void);
+// Add an RTT sample (usec) of a connection to the user at (ip, port), and choose its best address
+void peers_rtt(const char *ip, int port, long long rtt);
+// Return the interface where the user at (ip, port) was heard if ip is an IPv6
+//   link-local address, to be used as its scope; 0 for the other addresses
+int peers_scope_id(const struct in6_addr *ip, int port);
+// Locate the user 'name' and return its address (text) in ip and its TCP port; FALSE if unknown
+gboolean peers_locate_name(const char *name, char *ip, size_t len, int *port);
+// Call func for each user, in the order of registration, with the registry locked
+void peers_foreach(void (*func)(const Peer *p, gpointer data), gpointer data);
+// Call func for each user heard in the group of family fam (PEER_IPV4 or PEER_IPV6)
+//   recently enough to be known by the other users until its next registration
+void peers_foreach_known(int fam, void (*func)(const Peer *p, gpointer data), gpointer data);
+// Return the number of users in the registry
+int peers_count(void);
+
+#endif
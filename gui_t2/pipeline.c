@@ -0,0 +1,370 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * pipeline.c
+ *
+ * Pipelined transfer loops
+ *
+ * The ring has pipeline_depth page-aligned buffers. Only the producer changes
+ * head and only the consumer changes tail, so the slots are handed over
+ * without locks. A stage that finds the ring full (producer) or empty
+ * (consumer) counts a stall and sleeps on a futex until the other stage moves;
+ * the other stage only makes the wake-up system call when someone sleeps.
+ \*****************************************************************************/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "pipeline.h"
+#include "thread.h"
+#include "callbacks.h"
+#include "hash.h"
+#include "file.h"
+#include "rate.h"
+#include "gui.h"
+
+#define PIPELINE_WAIT_USEC	100000		// Maximum sleep before testing the stop conditions
+
+
+// Ring shared by the two stages of a transfer
+typedef struct {
+	Thread_Data *pt;
+	char *mem;					// depth buffers of block bytes
+	unsigned depth;
+	size_t block;
+	size_t len[PIPELINE_MAX_DEPTH];	// Bytes in each buffer
+	unsigned head;				// Buffers produced; changed by the producer
+	unsigned tail;				// Buffers consumed; changed by the consumer
+	unsigned prod_seq;			// Futex words, incremented on every move of a stage
+	unsigned cons_seq;
+	int prod_waiting;			// Stage sleeping on the futex of the other one
+	int cons_waiting;
+	int done;					// Producer ended: no more buffers
+	int stop;					// Consumer ended before the producer
+	int error;					// The helper stage failed
+	long long moved;			// Bytes written by the disk stage of a reception
+	long long prod_stalls;
+	long long cons_stalls;
+} Pipeline_Ring;
+
+
+int pipeline_depth= 8;						// Buffers per transfer
+int pipeline_block= 256*1024;				// Bytes per buffer
+
+
+/***********************************\
+|* Functions that handle the ring  *|
+\***********************************/
+
+// TRUE if the transfer was stopped by the user or the application
+static gboolean stopped(Thread_Data *pt)
+{
+	return !active || (pt->self != pt) || pt->finished;
+}
+
+
+// Sleep until the futex word changes from val, at most PIPELINE_WAIT_USEC
+static void ring_sleep(unsigned *seq, unsigned val)
+{
+	struct timespec ts= { 0, PIPELINE_WAIT_USEC*1000L };
+	syscall(SYS_futex, seq, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+
+// Signal a move of a stage, waking up the other one if it sleeps
+static void ring_wake(unsigned *seq, int *waiting)
+{
+	__atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+
+// Create the ring of a transfer; returns FALSE if there is no memory
+static gboolean ring_init(Pipeline_Ring *r, Thread_Data *pt)
+{
+	memset(r, 0, sizeof(Pipeline_Ring));
+	r->pt= pt;
+	r->depth= pipeline_depth;
+	r->block= pipeline_block;
+	return !posix_memalign((void **)&r->mem, 4096, r->depth*r->block);
+}
+
+
+// Producer: return the next free buffer, waiting while the ring is full; NULL if the consumer stopped
+static char *ring_get(Pipeline_Ring *r)
+{
+	gboolean stalled= FALSE;
+	unsigned seq;
+
+	for (;;) {
+		if (__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE) || stopped(r->pt))
+			return NULL;
+		if (r->head-__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) < r->depth)
+			return r->mem + (r->head % r->depth)*r->block;
+		if (!stalled) {
+			r->prod_stalls++;
+			stalled= TRUE;
+		}
+		__atomic_store_n(&r->prod_waiting, 1, __ATOMIC_SEQ_CST);
+		seq= __atomic_load_n(&r->cons_seq, __ATOMIC_SEQ_CST);
+		// Test again: the consumer may have moved before it saw prod_waiting
+		if ((r->head-__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) < r->depth) ||
+				__atomic_load_n(&r->stop, __ATOMIC_SEQ_CST))
+			continue;
+		ring_sleep(&r->cons_seq, seq);
+	}
+}
+
+
+// Producer: hand over the buffer returned by ring_get with len bytes
+static void ring_put(Pipeline_Ring *r, size_t len)
+{
+	r->len[r->head % r->depth]= len;
+	__atomic_store_n(&r->head, r->head+1, __ATOMIC_RELEASE);
+	ring_wake(&r->prod_seq, &r->cons_waiting);
+}
+
+
+// Producer: no more buffers
+static void ring_finish(Pipeline_Ring *r)
+{
+	__atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+	ring_wake(&r->prod_seq, &r->cons_waiting);
+}
+
+
+// Consumer: return the next full buffer and its length, waiting while the ring is empty
+// Returns NULL when the producer ended and all buffers were consumed, or the transfer was stopped
+static char *ring_peek(Pipeline_Ring *r, size_t *len)
+{
+	gboolean stalled= FALSE;
+	unsigned seq;
+
+	for (;;) {
+		if (stopped(r->pt))
+			return NULL;
+		if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail) {
+			*len= r->len[r->tail % r->depth];
+			return r->mem + (r->tail % r->depth)*r->block;
+		}
+		if (__atomic_load_n(&r->done, __ATOMIC_ACQUIRE))
+			return NULL;
+		if (!stalled) {
+			r->cons_stalls++;
+			stalled= TRUE;
+		}
+		__atomic_store_n(&r->cons_waiting, 1, __ATOMIC_SEQ_CST);
+		seq= __atomic_load_n(&r->prod_seq, __ATOMIC_SEQ_CST);
+		// Test again: the producer may have moved before it saw cons_waiting
+		if ((__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != r->tail) ||
+				__atomic_load_n(&r->done, __ATOMIC_SEQ_CST))
+			continue;
+		ring_sleep(&r->prod_seq, seq);
+	}
+}
+
+
+// Consumer: release the buffer returned by ring_peek
+static void ring_release(Pipeline_Ring *r)
+{
+	__atomic_store_n(&r->tail, r->tail+1, __ATOMIC_RELEASE);
+	ring_wake(&r->cons_seq, &r->prod_waiting);
+}
+
+
+// Consumer: stop before the producer ended
+static void ring_stop(Pipeline_Ring *r)
+{
+	__atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+	ring_wake(&r->cons_seq, &r->prod_waiting);
+}
+
+
+/**************************************************\
+|* Pipelined transfer loops                       *|
+\**************************************************/
+
+// Disk stage of a sending transfer: read the file into the ring
+static void *disk_reader(void *ptr)
+{
+	Pipeline_Ring *r= (Pipeline_Ring *)ptr;
+	Thread_Data *pt= r->pt;
+	long long off= pt->offset;	// Resumed transfers start after the bytes already sent
+	char *buf;
+	ssize_t n;
+
+	while ((off < pt->flen) && ((buf= ring_get(r)) != NULL)) {
+		n= pread(fileno(pt->f), buf, (pt->flen-off < (long long)r->block) ? pt->flen-off : (long long)r->block, off);
+		if ((n < 0) && (errno == EINTR))
+			continue;
+		if (n <= 0) {
+			fprintf(stderr, "%spipelined read failed: %s\n", pt->name_str,
+					(n < 0) ? strerror(errno) : "file ended before the announced length");
+			r->error= 1;
+			break;
+		}
+		ring_put(r, n);
+		off += n;
+	}
+	ring_finish(r);
+	return NULL;
+}
+
+
+// Send the file body from pt->f to pt->s; returns an XFER_* result
+int pipeline_send_body(Thread_Data *pt, short int *last_c, Pipeline_Stats *st)
+{
+	Pipeline_Ring r;
+	pthread_t tid;
+	char *buf;
+	size_t len, k;
+	ssize_t n;
+	int res= XFER_OK;
+
+	if (!ring_init(&r, pt))
+		return XFER_UNSUPPORTED;
+	if (pthread_create(&tid, NULL, disk_reader, &r)) {
+		free(r.mem);
+		return XFER_UNSUPPORTED;
+	}
+
+	// Network stage: send the buffers in file order
+	while ((res == XFER_OK) && ((buf= ring_peek(&r, &len)) != NULL)) {
+		for (k= 0; k < len; k += n) {
+			if ((n= send(pt->s, buf+k, rate_chunk(pt, len-k), MSG_NOSIGNAL)) <= 0) {
+				if ((n < 0) && (errno == EINTR)) {
+					n= 0;
+					continue;
+				}
+				perror("pipelined send");
+				res= XFER_ERROR;
+				break;
+			}
+			rate_throttle(pt, n);
+		}
+		if (res != XFER_OK)
+			break;
+		hash_update(&pt->hash, buf, len);
+		ring_release(&r);
+		pt->total += len;
+		update_progress(pt, last_c);
+	}
+	ring_stop(&r);
+	pthread_join(tid, NULL);
+	if (r.error)
+		res= XFER_ERROR;
+	st->disk= r.prod_stalls;
+	st->net= r.cons_stalls;
+	free(r.mem);
+	return res;
+}
+
+
+// Disk stage of a receiving transfer: write the buffers of the ring to the file
+static void *disk_writer(void *ptr)
+{
+	Pipeline_Ring *r= (Pipeline_Ring *)ptr;
+	Thread_Data *pt= r->pt;
+	long long off= pt->offset;	// Resumed transfers start after the bytes already received
+	char *buf;
+	size_t len, k;
+	ssize_t m;
+
+	while ((buf= ring_peek(r, &len)) != NULL) {
+		for (k= 0; k < len; k += m) {
+			if ((m= pwrite(pt->fd, buf+k, len-k, off+k)) <= 0) {
+				if ((m < 0) && (errno == EINTR)) {
+					m= 0;
+					continue;
+				}
+				perror("pipelined write");
+				r->error= 1;
+				ring_stop(r);
+				return NULL;
+			}
+		}
+		ring_release(r);
+		off += len;
+		__atomic_store_n(&r->moved, off-pt->offset, __ATOMIC_RELAXED);
+		file_write_behind(&pt->wb, pt->fd, off);
+	}
+	ring_stop(r);
+	return NULL;
+}
+
+
+// Receive the file body from pt->s into pt->fd; returns an XFER_* result
+int pipeline_rcv_body(Thread_Data *pt, short int *last_c, Pipeline_Stats *st)
+{
+	Pipeline_Ring r;
+	pthread_t tid;
+	long long recv_off= pt->offset;
+	char *buf;
+	size_t len, k;
+	ssize_t n= 0;
+	int res= XFER_OK;
+
+	if (!ring_init(&r, pt))
+		return XFER_UNSUPPORTED;
+	if (pthread_create(&tid, NULL, disk_writer, &r)) {
+		free(r.mem);
+		return XFER_UNSUPPORTED;
+	}
+
+	// Network stage: receive whole buffers, without reading the trailer after the body
+	while ((recv_off < pt->flen) && ((buf= ring_get(&r)) != NULL)) {
+		len= rate_chunk(pt, (pt->flen-recv_off < (long long)r.block) ? pt->flen-recv_off : r.block);
+		for (k= 0; k < len; k += n) {
+			if ((n= recv(pt->s, buf+k, len-k, MSG_WAITALL)) <= 0) {
+				if ((n < 0) && (errno == EINTR)) {
+					n= 0;
+					continue;
+				}
+				break;
+			}
+		}
+		if (k > 0) {
+			hash_update(&pt->hash, buf, k);
+			ring_put(&r, k);
+			recv_off += k;
+			rate_throttle(pt, k);
+		}
+		if (n < 0) {
+			perror("pipelined recv");
+			res= XFER_ERROR;
+			break;
+		}
+		if (n == 0) {
+			g_print("%s connection closed by the sender\n", pt->name_str);
+			res= XFER_ERROR;
+			break;
+		}
+		// The GUI shows the bytes already written
+		pt->total= pt->offset+__atomic_load_n(&r.moved, __ATOMIC_RELAXED);
+		update_progress(pt, last_c);
+	}
+	ring_finish(&r);
+	pthread_join(tid, NULL);
+	if (r.error)
+		res= XFER_ERROR;
+	pt->total= pt->offset+r.moved;
+	update_progress(pt, last_c);
+	st->disk= r.cons_stalls;
+	st->net= r.prod_stalls;
+	free(r.mem);
+	return res;
+}
@@ -0,0 +1,45 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * pipeline.h
+ *
+ * Header file of the pipelined transfer loops
+ *
+ * The transfer thread runs the network stage and a helper thread runs the disk
+ * stage; they exchange blocks through a single-producer/single-consumer ring,
+ * so file reads run ahead of the sends and receives run ahead of file writes.
+ \*****************************************************************************/
+#ifndef PIPELINE_INC_
+#define PIPELINE_INC_
+
+#include <glib.h>
+
+#include "callbacks.h"
+
+#define PIPELINE_MAX_DEPTH	64				// Maximum number of buffers in the ring
+#define PIPELINE_MIN_BLOCK	(4*1024)		// Limits of the block size
+#define PIPELINE_MAX_BLOCK	(16*1024*1024)
+
+// Number of buffers in the ring of each transfer
+extern int pipeline_depth;
+// Size of each buffer, in bytes
+extern int pipeline_block;
+
+// Stalls of one transfer: times each stage found the ring full (producer) or empty (consumer)
+typedef struct {
+	long long disk;		// Disk stage waited for the network stage
+	long long net;		// Network stage waited for the disk stage
+} Pipeline_Stats;
+
+
+/**************************************************\
+|* Pipelined transfer loops                       *|
+\**************************************************/
+
+// Send the file body from pt->f to pt->s; returns an XFER_* result
+int pipeline_send_body(Thread_Data *pt, short int *last_c, Pipeline_Stats *st);
+// Receive the file body from pt->s into pt->fd; returns an XFER_* result
+int pipeline_rcv_body(Thread_Data *pt, short int *last_c, Pipeline_Stats *st);
+
+#endif
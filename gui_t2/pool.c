@@ -0,0 +1,145 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * pool.c
+ *
+ * Pool of connections to the peers
+ *
+ * The idle connections are kept in one list, the most recently used first.
+ * A receiver may close a connection at any time, so a connection is tested
+ * before it is reused: a connection that has data or the end of the stream to
+ * read is not idle anymore and is closed.
+ \*****************************************************************************/
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "pool.h"
+
+
+// Idle connection
+typedef struct {
+	struct in6_addr ip;		// Peer
+	u_short port;
+	int s;					// Connection socket
+	long long idle;			// Time when it became idle (usec)
+} Pool_Conn;
+
+
+gboolean pool_enabled= TRUE;				// Keep the connections between files
+static GList *idle= NULL;					// Idle connections, most recent first
+static pthread_mutex_t pmutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+// TRUE if the peer did not close the connection nor sent anything on it
+static gboolean is_idle(int s)
+{
+	char c;
+	ssize_t n= recv(s, &c, 1, MSG_PEEK|MSG_DONTWAIT);
+	return (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+}
+
+
+// Take an idle connection to the peer (ip, port); returns -1 if there is none
+// The socket is returned in blocking or non-blocking mode, as requested
+int pool_get(const struct in6_addr *ip, u_short port, gboolean nonblocking)
+{
+	long long now= g_get_monotonic_time();
+	GList *list, *next;
+	Pool_Conn *pc;
+	int s= -1, fl;
+
+	pthread_mutex_lock(&pmutex);
+	for (list= idle; (list != NULL) && (s < 0); list= next) {
+		next= list->next;
+		pc= (Pool_Conn *)list->data;
+		if ((pc->port != port) || memcmp(&pc->ip, ip, sizeof(struct in6_addr)))
+			continue;
+		idle= g_list_delete_link(idle, list);
+		// pool_expire runs once per name period: the receiver may be closing an older one
+		if ((now-pc->idle <= POOL_IDLE_TIMEOUT) && is_idle(pc->s))
+			s= pc->s;
+		else
+			close(pc->s);
+		free(pc);
+	}
+	pthread_mutex_unlock(&pmutex);
+	if ((s >= 0) && ((fl= fcntl(s, F_GETFL)) >= 0))
+		fcntl(s, F_SETFL, nonblocking ? (fl | O_NONBLOCK) : (fl & ~O_NONBLOCK));
+	return s;
+}
+
+
+// Keep the connection s to the peer (ip, port) for the next file, after a complete transfer
+void pool_put(const struct in6_addr *ip, u_short port, int s)
+{
+	GList *list, *next;
+	Pool_Conn *pc;
+	int n= 0;
+
+	if (!pool_enabled || ((pc= (Pool_Conn *)malloc(sizeof(Pool_Conn))) == NULL)) {
+		close(s);
+		return;
+	}
+	memcpy(&pc->ip, ip, sizeof(struct in6_addr));
+	pc->port= port;
+	pc->s= s;
+	pc->idle= g_get_monotonic_time();
+	pthread_mutex_lock(&pmutex);
+	idle= g_list_prepend(idle, pc);
+	// Close the oldest connections of the peer above the limit
+	for (list= idle; list != NULL; list= next) {
+		next= list->next;
+		pc= (Pool_Conn *)list->data;
+		if ((pc->port != port) || memcmp(&pc->ip, ip, sizeof(struct in6_addr)) || (++n <= POOL_MAX_IDLE))
+			continue;
+		close(pc->s);
+		free(pc);
+		idle= g_list_delete_link(idle, list);
+	}
+	pthread_mutex_unlock(&pmutex);
+}
+
+
+// Close the connections idle for more than POOL_IDLE_TIMEOUT
+void pool_expire(void)
+{
+	long long now= g_get_monotonic_time();
+	GList *list, *next;
+	Pool_Conn *pc;
+
+	pthread_mutex_lock(&pmutex);
+	for (list= idle; list != NULL; list= next) {
+		next= list->next;
+		pc= (Pool_Conn *)list->data;
+		if ((now-pc->idle <= POOL_IDLE_TIMEOUT) && is_idle(pc->s))
+			continue;
+		close(pc->s);
+		free(pc);
+		idle= g_list_delete_link(idle, list);
+	}
+	pthread_mutex_unlock(&pmutex);
+}
+
+
+// Close all idle connections
+void pool_clear(void)
+{
+	GList *list;
+
+	pthread_mutex_lock(&pmutex);
+	for (list= idle; list != NULL; list= list->next) {
+		close(((Pool_Conn *)list->data)->s);
+		free(list->data);
+	}
+	g_list_free(idle);
+	idle= NULL;
+	pthread_mutex_unlock(&pmutex);
+}
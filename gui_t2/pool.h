@@ -0,0 +1,39 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * pool.h
+ *
+ * Header file of the pool of connections to the peers
+ *
+ * A file sent with the HEADER_KEEP flag leaves its connection open after the
+ * digest trailer: the sender keeps it in the pool of its peer (ip, TCP port)
+ * and the next file to the same peer is sent over it, without a new handshake
+ * and with the congestion window already open. The receiver reads the header
+ * of the next file in a new reception on the same connection.
+ \*****************************************************************************/
+#ifndef POOL_INC_
+#define POOL_INC_
+
+#include <glib.h>
+#include <netinet/in.h>
+
+#define POOL_MAX_IDLE		4			// Idle connections kept per peer
+#define POOL_IDLE_TIMEOUT	5000000LL	// Close idle connections after 5 s (usec), before the
+										//   receivers stop waiting for the next header (10 s)
+
+// FALSE sends each file in its own connection
+extern gboolean pool_enabled;
+
+
+// Take an idle connection to the peer (ip, port); returns -1 if there is none
+// The socket is returned in blocking or non-blocking mode, as requested
+int pool_get(const struct in6_addr *ip, u_short port, gboolean nonblocking);
+// Keep the connection s to the peer (ip, port) for the next file, after a complete transfer
+void pool_put(const struct in6_addr *ip, u_short port, int s);
+// Close the connections idle for more than POOL_IDLE_TIMEOUT
+void pool_expire(void);
+// Close all idle connections
+void pool_clear(void);
+
+#endif
@@ -0,0 +1,155 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * rate.c
+ *
+ * Token-bucket rate limiter of the file transfers
+ *
+ * A bucket gains 'rate' tokens (bytes) per second, up to RATE_BURST_USEC of
+ * them, and loses the bytes moved; a negative balance is a debt that the
+ * transfer pays by waiting. A transfer in debt with its own bucket borrows the
+ * tokens left unused in the global bucket, so the bandwidth not used by the
+ * other transfers is not lost. The buckets of all transfers share one mutex;
+ * transfers without limits never take it.
+ \*****************************************************************************/
+#include <glib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "rate.h"
+#include "callbacks.h"
+
+
+long long rate_transfer= RATE_DEFAULT;		// Limit of "Slow" transfers
+long long rate_global= 0;					// Limit of all transfers together
+static double global_tokens= 0;				// Global bucket
+static long long global_last= 0;
+static pthread_mutex_t rtmutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*************************************\
+|* Buckets                           *|
+\*************************************/
+
+// Add the tokens earned since the last update; must be called with rtmutex locked
+static void refill(long long rate, double *tokens, long long *last, long long now)
+{
+	double cap;
+
+	if (rate <= 0) {
+		*tokens= 0;
+	} else {
+		*tokens += (double)rate*(now-*last)/1000000.0;
+		cap= MAX((double)rate*RATE_BURST_USEC/1000000.0, RATE_MIN_CHUNK);
+		if (*tokens > cap)
+			*tokens= cap;
+	}
+	*last= now;
+}
+
+
+// Time until a bucket has no debt (usec)
+static long long deficit(long long rate, double tokens)
+{
+	return ((rate > 0) && (tokens < 0)) ? (long long)(-tokens*1000000.0/rate)+1 : 0;
+}
+
+
+// Update the buckets of pt, charging n bytes; returns the time to wait (usec)
+// Must be called with rtmutex locked
+static long long update(Thread_Data *pt, size_t n)
+{
+	long long now= g_get_monotonic_time();
+	long long rate= pt->rate, grate= rate_global;
+
+	refill(rate, &pt->rate_tokens, &pt->rate_last, now);
+	refill(grate, &global_tokens, &global_last, now);
+	if (rate > 0)
+		pt->rate_tokens -= n;
+	if (grate > 0)
+		global_tokens -= n;
+	// Over its own limit: use the global bandwidth left unused by the other transfers
+	if ((pt->rate_tokens < 0) && (grate > 0) && (global_tokens > 0))
+		pt->rate_tokens= MIN(0, pt->rate_tokens+global_tokens);
+	return MAX(deficit(rate, pt->rate_tokens), deficit(grate, global_tokens));
+}
+
+
+/*************************************\
+|* Configuration                     *|
+\*************************************/
+
+// Set the limit of a transfer (bytes/s; 0 if unlimited), also while it runs
+void rate_set(Thread_Data *pt, long long rate)
+{
+	pthread_mutex_lock(&rtmutex);
+	pt->rate= (rate > 0) ? rate : 0;
+	pt->rate_tokens= 0;
+	pt->rate_last= g_get_monotonic_time();
+	pthread_mutex_unlock(&rtmutex);
+}
+
+
+// Set the limit of all transfers together (bytes/s; 0 if unlimited)
+void rate_set_global(long long rate)
+{
+	pthread_mutex_lock(&rtmutex);
+	rate_global= (rate > 0) ? rate : 0;
+	global_tokens= 0;
+	global_last= g_get_monotonic_time();
+	pthread_mutex_unlock(&rtmutex);
+}
+
+
+/*************************************\
+|* Transfer loops                    *|
+\*************************************/
+
+// Largest block pt should move at once, at most 'chunk'
+// Small blocks keep the rate smooth; the transfer's own limit sets the size when it has one
+size_t rate_chunk(Thread_Data *pt, size_t chunk)
+{
+	long long rate= (pt->rate > 0) ? pt->rate : rate_global;
+	size_t slice;
+
+	if (rate <= 0)
+		return chunk;
+	slice= MAX(rate*RATE_SLICE_USEC/1000000, RATE_MIN_CHUNK);
+	return MIN(chunk, slice);
+}
+
+
+// Charge n bytes moved by pt; returns the time to wait before moving more (usec)
+long long rate_charge(Thread_Data *pt, size_t n)
+{
+	long long d;
+
+	if ((pt->rate == 0) && (rate_global == 0))
+		return 0;
+	pthread_mutex_lock(&rtmutex);
+	d= update(pt, n);
+	pthread_mutex_unlock(&rtmutex);
+	return d;
+}
+
+
+// Time pt must still wait before moving more (usec)
+long long rate_delay(Thread_Data *pt)
+{
+	return rate_charge(pt, 0);
+}
+
+
+// Charge n bytes and sleep while pt is over its limits (blocking, for the transfer threads)
+// Sleeps at most RATE_MAX_SLEEP at a time, so stops and new limits are seen quickly
+void rate_throttle(Thread_Data *pt, size_t n)
+{
+	long long d= rate_charge(pt, n);
+
+	while ((d > 0) && active && (pt->self == pt) && !pt->finished) {
+		usleep((d < RATE_MAX_SLEEP) ? d : RATE_MAX_SLEEP);
+		d= rate_delay(pt);
+	}
+}
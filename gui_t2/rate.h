@@ -0,0 +1,57 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * rate.h
+ *
+ * Header file of the token-bucket rate limiter of the file transfers
+ *
+ * Each transfer may have its own limit (transfers started with "Slow" get
+ * rate_transfer), and all transfers together are limited by rate_global.
+ * The transfer loops move at most rate_chunk() bytes at a time and charge
+ * them after moving them; the bucket then tells how long to wait.
+ \*****************************************************************************/
+#ifndef RATE_INC_
+#define RATE_INC_
+
+#include <glib.h>
+#include <stddef.h>
+
+#include "callbacks.h"
+
+#define RATE_DEFAULT		(128*1024)	// Default limit of "Slow" transfers (bytes/s)
+#define RATE_SLICE_USEC		10000		// Bytes moved per call: 10 ms at the limited rate
+#define RATE_BURST_USEC		20000		// Unused tokens kept: 20 ms at the limited rate
+#define RATE_MIN_CHUNK		4096		// Minimum bytes moved per call
+#define RATE_MAX_SLEEP		100000		// Maximum sleep before testing the stop conditions (usec)
+
+// Limit of the transfers started with "Slow" (bytes/s)
+extern long long rate_transfer;
+// Limit of all transfers together (bytes/s); 0 if unlimited
+extern long long rate_global;
+
+
+/*************************************\
+|* Configuration                     *|
+\*************************************/
+
+// Set the limit of a transfer (bytes/s; 0 if unlimited), also while it runs
+void rate_set(Thread_Data *pt, long long rate);
+// Set the limit of all transfers together (bytes/s; 0 if unlimited)
+void rate_set_global(long long rate);
+
+
+/*************************************\
+|* Transfer loops                    *|
+\*************************************/
+
+// Largest block pt should move at once, at most 'chunk'
+size_t rate_chunk(Thread_Data *pt, size_t chunk);
+// Charge n bytes moved by pt; returns the time to wait before moving more (usec)
+long long rate_charge(Thread_Data *pt, size_t n);
+// Time pt must still wait before moving more (usec)
+long long rate_delay(Thread_Data *pt);
+// Charge n bytes and sleep while pt is over its limits (blocking, for the transfer threads)
+void rate_throttle(Thread_Data *pt, size_t n);
+
+#endif
@@ -0,0 +1,481 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * resume.c
+ *
+ * Resumable file transfers
+ *
+ * The journal of an output file is a small text file created next to it, with
+ * the name and length of the file being received. A partial copy matches an
+ * incoming file with the same name and length; the user name is not compared
+ * because it changes when the sender restarts. The checksum exchanged in the
+ * header decides if the bytes already received are really the same.
+ *
+ * While the file arrives, a "have" line is appended to the journal each time
+ * the percentage received changes, and when the connection ends, with the
+ * bytes received and their CRC32C: the digest of the bytes before the offset
+ * combined with the hash of the connection. The last complete line wins; a
+ * line without the digest means the bytes were not hashed (splice).
+ \*****************************************************************************/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "resume.h"
+#include "thread.h"
+#include "callbacks.h"
+#include "file.h"
+#include "hash.h"
+
+
+gboolean resume_enabled= TRUE;				// Negotiate the offset of large files
+static GList *busy= NULL;					// Output files being received
+static pthread_mutex_t rsmutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*************************************\
+|* Sender side                       *|
+\*************************************/
+
+// TRUE if the file of pt should be sent in a resumable connection
+gboolean resume_wanted(Thread_Data *pt)
+{
+	return resume_enabled && (pt->flen >= RESUME_MIN_SIZE);
+}
+
+
+// Time allowed for the sender to check the have bytes of the receiver (usec)
+long long resume_timeout(long long have)
+{
+	return RESUME_TIMEOUT*1000000LL + ((have > 0) ? (long long)(have*1000000.0/RESUME_CHECK_RATE) : 0);
+}
+
+
+// Set the timeout of the blocking receptions of socket s
+static void set_rcv_timeout(int s, long long usec)
+{
+	struct timeval tv;
+
+	tv.tv_sec = usec/1000000;
+	tv.tv_usec = usec%1000000;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *)&tv, sizeof(struct timeval));
+}
+
+
+// TRUE if the sender has to read the bytes of the receiver to answer the reply
+gboolean resume_check_needed(Thread_Data *pt, const Resume_Reply *rr)
+{
+	return (rr->have > 0) && (rr->have <= pt->flen) && (rr->kind != RESUME_SUM_NONE);
+}
+
+
+// TRUE if the first bytes of the file fd have the checksum of the reply
+static gboolean resume_match(int fd, const Resume_Reply *rr)
+{
+	Hash_State h;
+
+	if (rr->kind != RESUME_SUM_CRC32C)
+		return FALSE;
+	hash_init(&h);
+	return hash_update_fd(&h, fd, 0, rr->have) && (hash_final(&h) == rr->sum);
+}
+
+
+// Offset where the body starts, given the reply and the result of its check
+static long long resume_result(Thread_Data *pt, const Resume_Reply *rr, gboolean match)
+{
+	if ((rr->have <= 0) || (rr->have > pt->flen))
+		return 0;
+	if (rr->kind == RESUME_SUM_NONE) {
+		g_print("%s receiver has %lld bytes of %s, not checked - resuming\n", pt->name_str,
+				(long long)rr->have, pt->fname);
+		return rr->have;
+	}
+	if (!match) {
+		g_print("%s receiver has a different copy of %s - sending the whole file\n", pt->name_str, pt->fname);
+		return 0;
+	}
+	g_print("%s receiver has %lld bytes of %s - resuming\n", pt->name_str, (long long)rr->have, pt->fname);
+	return rr->have;
+}
+
+
+// Choose the offset where the body of pt->f starts, given the reply of the receiver
+long long resume_offset(Thread_Data *pt, const Resume_Reply *rr)
+{
+	return resume_result(pt, rr, resume_check_needed(pt, rr) && resume_match(fileno(pt->f), rr));
+}
+
+
+// Helper thread that checks the bytes of a reply
+static void *resume_check_thread(void *ptr)
+{
+	Resume_Check *rc= (Resume_Check *)ptr;
+	gboolean match= resume_match(rc->fd, &rc->rr);
+	gboolean dropped;
+
+	pthread_mutex_lock(&rsmutex);
+	rc->match= match;
+	rc->done= TRUE;
+	dropped= rc->dropped;
+	pthread_mutex_unlock(&rsmutex);
+	if (dropped) {
+		close(rc->fd);
+		free(rc);
+	}
+	return NULL;
+}
+
+
+// Start checking the bytes of the reply in a helper thread; FALSE if it could not start
+gboolean resume_check_start(Thread_Data *pt, const Resume_Reply *rr)
+{
+	Resume_Check *rc= (Resume_Check *)calloc(1, sizeof(Resume_Check));
+	pthread_t tid;
+
+	if (rc == NULL)
+		return FALSE;
+	rc->rr= *rr;
+	// The helper may outlive the transfer, so it reads its own descriptor
+	if ((rc->fd= dup(fileno(pt->f))) < 0) {
+		free(rc);
+		return FALSE;
+	}
+	if (pthread_create(&tid, NULL, resume_check_thread, rc)) {
+		close(rc->fd);
+		free(rc);
+		return FALSE;
+	}
+	pthread_detach(tid);
+	pt->check= rc;
+	return TRUE;
+}
+
+
+// TRUE if the check of pt ended, setting off with the offset where the body starts
+gboolean resume_check_done(Thread_Data *pt, long long *off)
+{
+	Resume_Check *rc= pt->check;
+	gboolean done;
+
+	pthread_mutex_lock(&rsmutex);
+	done= rc->done;
+	pthread_mutex_unlock(&rsmutex);
+	if (!done)
+		return FALSE;
+	*off= resume_result(pt, &rc->rr, rc->match);
+	close(rc->fd);
+	free(rc);
+	pt->check= NULL;
+	return TRUE;
+}
+
+
+// The transfer ends: the check still running is left to its helper thread
+void resume_check_drop(Thread_Data *pt)
+{
+	Resume_Check *rc= pt->check;
+	gboolean done;
+
+	if (rc == NULL)
+		return;
+	pt->check= NULL;
+	pthread_mutex_lock(&rsmutex);
+	rc->dropped= TRUE;
+	done= rc->done;
+	pthread_mutex_unlock(&rsmutex);
+	if (done) {
+		close(rc->fd);
+		free(rc);
+	}
+}
+
+
+// Exchange the reply and the offset with the receiver, after sending the header
+// Blocking version used by the transfer threads
+gboolean resume_snd_negotiate(Thread_Data *pt)
+{
+	Resume_Reply rr;
+	long long off;
+
+	set_rcv_timeout(pt->s, RESUME_TIMEOUT*1000000LL);
+	if (recv(pt->s, &rr, sizeof(rr), MSG_WAITALL) != sizeof(rr))
+		return FALSE;
+	off= resume_offset(pt, &rr);
+	if (send(pt->s, &off, sizeof(off), MSG_NOSIGNAL) != sizeof(off))
+		return FALSE;
+	if (fseeko(pt->f, off, SEEK_SET))
+		return FALSE;
+	pt->offset= pt->total= off;
+	return TRUE;
+}
+
+
+/*************************************\
+|* Receiver side                     *|
+\*************************************/
+
+// Read the file name and length stored in a journal
+static gboolean journal_read(const char *jname, char *f_name, size_t size, long long *flen)
+{
+	char line[300];
+	gboolean has_name= FALSE, has_len= FALSE;
+	FILE *f;
+
+	if ((f= fopen(jname, "r")) == NULL)
+		return FALSE;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\n")]= '\0';
+		if (!strncmp(line, "file ", 5) && (strlen(line+5) < size)) {
+			strcpy(f_name, line+5);
+			has_name= TRUE;
+		} else if (!strncmp(line, "length ", 7))
+			has_len= (sscanf(line+7, "%lld", flen) == 1);
+	}
+	fclose(f);
+	return has_name && has_len;
+}
+
+
+// Read the last complete "have" line of a journal with at most limit bytes into the reply
+static void journal_read_have(const char *jname, long long limit, Resume_Reply *rr)
+{
+	char line[300];
+	long long have;
+	unsigned sum;
+	int k;
+	FILE *f;
+
+	if ((f= fopen(jname, "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		// The last line may be cut short by a crash while it was written
+		if (strncmp(line, "have ", 5) || (strchr(line, '\n') == NULL))
+			continue;
+		k= sscanf(line+5, "%lld " HASH_NAME " %x", &have, &sum);
+		if ((k < 1) || (have < 0) || (have > limit))
+			continue;
+		rr->have= have;
+		rr->sum= (k == 2) ? sum : 0;
+		rr->kind= (k == 2) ? RESUME_SUM_CRC32C : RESUME_SUM_NONE;
+	}
+	fclose(f);
+}
+
+
+// Write the "have" line of the bytes of pt received so far; FALSE if their digest is not known
+static gboolean journal_have(FILE *f, Thread_Data *pt)
+{
+	// A corrupted copy is sent again from the start
+	if (pt->verified == HASH_MISMATCH)
+		fprintf(f, "have 0\n");
+	else if (pt->unhashed)
+		fprintf(f, "have %lld\n", pt->total);
+	else if (pt->hash.bytes == pt->total-pt->offset)
+		fprintf(f, "have %lld %s %08x\n", pt->total, HASH_NAME,
+				hash_combine(pt->resume_sum, hash_final(&pt->hash), pt->total-pt->offset));
+	else
+		return FALSE;	// Hashed ahead of the bytes written (pipelined, io_uring)
+	return TRUE;
+}
+
+
+// Write the journal of the output file pt->fname
+static gboolean journal_write(Thread_Data *pt, const char *nome, const char *f_name)
+{
+	char jname[sizeof(pt->fname)+sizeof(RESUME_SUFFIX)];
+	FILE *f;
+
+	sprintf(jname, "%s%s", pt->fname, RESUME_SUFFIX);
+	if ((f= fopen(jname, "w")) == NULL) {
+		perror("Error creating resume journal");
+		return FALSE;
+	}
+	fprintf(f, "file %s\nuser %s\nlength %lld\n", f_name, nome, pt->flen);
+	journal_have(f, pt);
+	return !fclose(f);
+}
+
+
+// Record in the journal the bytes received so far and their checksum
+void resume_checkpoint(Thread_Data *pt)
+{
+	char jname[sizeof(pt->fname)+sizeof(RESUME_SUFFIX)];
+	FILE *f;
+
+	if (pt->sending || !pt->journal)
+		return;
+	sprintf(jname, "%s%s", pt->fname, RESUME_SUFFIX);
+	if ((f= fopen(jname, "a")) == NULL) {
+		perror("Error updating resume journal");
+		return;
+	}
+	journal_have(f, pt);
+	fclose(f);
+}
+
+
+// TRUE if the output file is being received; must be called with rsmutex locked
+static gboolean is_busy(const char *path)
+{
+	GList *list;
+	for (list= busy; list != NULL; list= list->next)
+		if (!strcmp((const char *)list->data, path))
+			return TRUE;
+	return FALSE;
+}
+
+
+// Look for a partial copy of the file in out_dir and prepare the reply;
+//   if one exists, pt->fname is changed to its pathname
+void resume_lookup(Thread_Data *pt, const char *nome, const char *f_name, Resume_Reply *rr)
+{
+	char path[sizeof(pt->fname)+sizeof(RESUME_SUFFIX)+1];
+	char name[257];
+	size_t slen= strlen(RESUME_SUFFIX);
+	long long flen;
+	struct dirent *de;
+	DIR *dir;
+
+	memset(rr, 0, sizeof(Resume_Reply));
+	rr->kind= RESUME_SUM_CRC32C;
+	if ((dir= opendir(out_dir)) == NULL)
+		return;
+	pthread_mutex_lock(&rsmutex);
+	while ((de= readdir(dir)) != NULL) {
+		size_t n= strlen(de->d_name);
+		if ((n <= slen) || strcmp(de->d_name+n-slen, RESUME_SUFFIX) ||
+				(strlen(out_dir)+1+n >= sizeof(path)))
+			continue;
+		sprintf(path, "%s/%s", out_dir, de->d_name);
+		if (!journal_read(path, name, sizeof(name), &flen) || strcmp(name, f_name) || (flen != pt->flen))
+			continue;
+		path[strlen(path)-slen]= '\0';	// Output file
+		if (is_busy(path))
+			continue;
+		strcpy(pt->fname, path);
+		busy= g_list_append(busy, strdup(path));
+		pt->journal= TRUE;
+		break;
+	}
+	pthread_mutex_unlock(&rsmutex);
+	closedir(dir);
+	if (!pt->journal)
+		return;
+
+	// The bytes and the digest come from the journal: the file is not read again
+	flen= get_filesize(pt->fname);
+	sprintf(path, "%s%s", pt->fname, RESUME_SUFFIX);
+	journal_read_have(path, MIN(flen, pt->flen), rr);
+	pt->resume_sum= rr->sum;
+	pt->unhashed= (rr->kind == RESUME_SUM_NONE);
+	g_print("%s found %lld bytes of %s from %s in '%s'\n", pt->name_str, (long long)rr->have, f_name, nome, pt->fname);
+}
+
+
+// Open pt->fname to receive the body from offset and write its journal
+gboolean resume_open(Thread_Data *pt, const char *nome, const char *f_name, long long offset)
+{
+	if (!pt->journal) {
+		pthread_mutex_lock(&rsmutex);
+		busy= g_list_append(busy, strdup(pt->fname));
+		pthread_mutex_unlock(&rsmutex);
+		pt->journal= TRUE;
+	}
+	// Opened for reading too, so the bytes spliced to the file can be hashed
+	if ((pt->fd= open(pt->fname, (offset > 0) ? O_RDWR : O_RDWR|O_CREAT|O_TRUNC, 0666)) < 0) {
+		perror("Error creating file for writing");
+		fprintf(stderr, "%s failed to create file '%s' for writing\n", pt->name_str, pt->fname);
+		return FALSE;
+	}
+	if (lseek(pt->fd, offset, SEEK_SET) != offset) {
+		perror("Error seeking the resume offset");
+		return FALSE;
+	}
+	pt->offset= pt->total= offset;
+	hash_init(&pt->hash);
+	// A new copy starts without the digest of a previous one
+	if (offset == 0) {
+		pt->resume_sum= 0;
+		pt->unhashed= FALSE;
+	}
+	file_write_behind_init(&pt->wb, offset);
+	return journal_write(pt, nome, f_name);
+}
+
+
+// Exchange the reply and the offset with the sender, and open the output file
+// Blocking version used by the transfer threads
+gboolean resume_rcv_negotiate(Thread_Data *pt, const char *nome, const char *f_name)
+{
+	Resume_Reply rr;
+	long long off;
+
+	resume_lookup(pt, nome, f_name, &rr);
+	if (send(pt->s, &rr, sizeof(rr), MSG_NOSIGNAL) != sizeof(rr))
+		return FALSE;
+	// The sender reads its copy of the bytes to check them before answering
+	set_rcv_timeout(pt->s, resume_timeout(rr.have));
+	if (recv(pt->s, &off, sizeof(off), MSG_WAITALL) != sizeof(off))
+		return FALSE;
+	set_rcv_timeout(pt->s, RESUME_TIMEOUT*1000000LL);
+	if ((off != 0) && (off != rr.have)) {
+		g_print("%s invalid resume offset %lld\n", pt->name_str, off);
+		return FALSE;
+	}
+	return resume_open(pt, nome, f_name, off);
+}
+
+
+// Let other receptions use the output file of pt
+static void resume_unbusy(Thread_Data *pt)
+{
+	GList *list;
+
+	pthread_mutex_lock(&rsmutex);
+	for (list= busy; list != NULL; list= list->next) {
+		if (!strcmp((const char *)list->data, pt->fname)) {
+			free(list->data);
+			busy= g_list_delete_link(busy, list);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&rsmutex);
+	pt->journal= FALSE;
+}
+
+
+// The whole file was received: remove the journal
+void resume_complete(Thread_Data *pt)
+{
+	char jname[sizeof(pt->fname)+sizeof(RESUME_SUFFIX)];
+
+	sprintf(jname, "%s%s", pt->fname, RESUME_SUFFIX);
+	if (unlink(jname) && (errno != ENOENT))
+		perror("Error removing resume journal");
+	resume_unbusy(pt);
+}
+
+
+// Release the output file of pt when it is freed; the journal of incomplete files remains,
+//   with the bytes received
+void resume_release(Thread_Data *pt)
+{
+	// The journal already has the offset, if no byte arrived after it
+	if ((pt->total > pt->offset) || (pt->verified == HASH_MISMATCH))
+		resume_checkpoint(pt);
+	resume_unbusy(pt);
+}
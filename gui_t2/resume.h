@@ -0,0 +1,101 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * resume.h
+ *
+ * Header file of the resumable file transfers
+ *
+ * A resumable connection has the HEADER_RESUME flag in its header. The
+ * receiver answers with a Resume_Reply telling how many bytes of the file it
+ * already has and their checksum; the sender answers with the
+ * offset where the body starts (the same value, or 0 if the checksum does not
+ * match), and sends the rest of the file. Partial files have a sidecar journal
+ * in out_dir, so a restarted receiver can also resume them.
+ *
+ * The journal keeps the CRC32C of the bytes received so far, updated as they
+ * arrive, so the receiver answers without reading the file again. The sender
+ * reads its copy of those bytes to check them, which takes longer the more
+ * there are: the receiver waits for the offset for resume_timeout(have), and
+ * the engine runs the check in a helper thread (Resume_Check).
+ \*****************************************************************************/
+#ifndef RESUME_INC_
+#define RESUME_INC_
+
+#include <glib.h>
+#include <stdint.h>
+
+#include "callbacks.h"
+
+#define RESUME_MIN_SIZE		(4LL*1024*1024)		// Smaller files are always sent from the start
+#define RESUME_SUFFIX		".journal"			// Journal name: output file name + suffix
+#define RESUME_TIMEOUT		10					// Seconds to wait for the other side in the negotiation
+#define RESUME_CHECK_RATE	(32LL*1024*1024)	// Slowest read of the bytes checked by the sender (bytes/s)
+
+/* How the receiver got the checksum of the bytes it has (Resume_Reply.kind) */
+#define RESUME_SUM_CRC32C	1		// CRC32C kept in the journal while the bytes arrived
+#define RESUME_SUM_NONE		2		// Bytes moved without hashing them: not checked (see hash.h)
+
+
+// Response of the receiver, in host byte order like the rest of the header
+typedef struct {
+	int64_t have;		// Bytes of the file already received
+	uint32_t sum;		// Checksum of those bytes
+	uint32_t kind;		// How sum was computed: RESUME_SUM_*
+} Resume_Reply;
+
+// Check of the bytes of the receiver, run by a helper thread for the engine workers
+typedef struct Resume_Check {
+	int fd;				// Own descriptor of the file sent
+	Resume_Reply rr;	// Reply of the receiver
+	gboolean match;		// Result: the sender has the same bytes
+	gboolean done;		// The helper ended
+	gboolean dropped;	// The transfer ended first: the helper frees the check
+} Resume_Check;
+
+// FALSE disables resuming for the files sent
+extern gboolean resume_enabled;
+
+
+/*************************************\
+|* Sender side                       *|
+\*************************************/
+
+// TRUE if the file of pt should be sent in a resumable connection
+gboolean resume_wanted(Thread_Data *pt);
+// Choose the offset where the body of pt->f starts, given the reply of the receiver
+long long resume_offset(Thread_Data *pt, const Resume_Reply *rr);
+// Receive the reply and send the offset, after the header (blocking, for the transfer threads)
+gboolean resume_snd_negotiate(Thread_Data *pt);
+// TRUE if the sender has to read the bytes of the receiver to answer the reply
+gboolean resume_check_needed(Thread_Data *pt, const Resume_Reply *rr);
+// Start checking the bytes of the reply in a helper thread; FALSE if it could not start
+gboolean resume_check_start(Thread_Data *pt, const Resume_Reply *rr);
+// TRUE if the check of pt ended, setting off with the offset where the body starts
+gboolean resume_check_done(Thread_Data *pt, long long *off);
+// The transfer ends: the check still running is left to its helper thread
+void resume_check_drop(Thread_Data *pt);
+// Time allowed for the sender to check the have bytes of the receiver (usec)
+long long resume_timeout(long long have);
+
+
+/*************************************\
+|* Receiver side                     *|
+\*************************************/
+
+// Look for a partial copy of the file in out_dir and prepare the reply;
+//   if one exists, pt->fname is changed to its pathname
+void resume_lookup(Thread_Data *pt, const char *nome, const char *f_name, Resume_Reply *rr);
+// Open pt->fname to receive the body from offset and write its journal
+gboolean resume_open(Thread_Data *pt, const char *nome, const char *f_name, long long offset);
+// Send the reply, receive the offset and open the output file (blocking, for the transfer threads)
+gboolean resume_rcv_negotiate(Thread_Data *pt, const char *nome, const char *f_name);
+// Record in the journal the bytes received so far and their checksum
+void resume_checkpoint(Thread_Data *pt);
+// The whole file was received: remove the journal
+void resume_complete(Thread_Data *pt);
+// Release the output file of pt when it is freed; the journal of incomplete files remains,
+//   with the bytes received
+void resume_release(Thread_Data *pt);
+
+#endif
@@ -0,0 +1,611 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * scheduler.c
+ *
+ * Transfer scheduler: bounded number of transfers and queue of the others
+ *
+ * The queue is a list in arrival order, scanned when a slot is released; the
+ * order of the files sent depends on the number of files being sent to each
+ * peer, which changes as transfers start and end, so it is computed at each
+ * scan instead of being kept sorted. The mutex is recursive: it is held while
+ * a transfer starts, so its slot is recorded before it may end, and a
+ * transfer that fails to start releases its descriptor in the same thread.
+ * The connections waiting for their first bytes are watched by one thread,
+ * with poll, outside the slots and the queue.
+ \*****************************************************************************/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "scheduler.h"
+#include "thread.h"
+#include "callbacks.h"
+#include "sock.h"
+#include "file.h"
+#include "gui.h"
+#include "header.h"
+#include "stripe.h"
+
+
+// Transfer waiting in the queue
+typedef struct {
+	unsigned id;			// Row in the table of transfers
+	gboolean sending;
+	int prio;				// (sending) SCHED_PRIO_*
+	struct in6_addr ip;		// Peer
+	u_short port;
+	char nome[80];			// (sending) User name of the peer
+	char fname[256];		// (sending) File to send
+	long long size;			// (sending) File length
+	int s;					// (!sending) Connection accepted
+	gboolean striped;		// (!sending) The header carries a range of the file stripe_id
+	uint64_t stripe_id;
+	gboolean slow;
+	long long queued;		// Time when it entered the queue (usec)
+} Sched_Job;
+
+// Files being sent to one peer
+typedef struct {
+	struct in6_addr ip;
+	u_short port;
+	int active;
+} Sched_Peer;
+
+
+int sched_max_snd= SCHED_DEFAULT_SND;		// Files sent at the same time
+int sched_max_rcv= SCHED_DEFAULT_RCV;		// Connections received at the same time
+static GList *queue= NULL;					// Sched_Job, in arrival order
+static GList *peers= NULL;					// Sched_Peer with files being sent
+static GList *waiting= NULL;				// Sched_Job of the connections without data yet
+static int wake[2]= { -1, -1 };				// Pipe that wakes the thread watching them
+static gboolean watching= FALSE;			// That thread is running
+static Sched_Stats stats;
+static pthread_mutex_t smutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+
+/*************************************\
+|* Slots                             *|
+\*************************************/
+
+// Locate the counter of files sent to a peer; creates it if 'create'
+static Sched_Peer *find_peer(const struct in6_addr *ip, u_short port, gboolean create)
+{
+	GList *list;
+	Sched_Peer *p;
+
+	for (list= peers; list != NULL; list= list->next) {
+		p= (Sched_Peer *)list->data;
+		if ((p->port == port) && !memcmp(&p->ip, ip, sizeof(struct in6_addr)))
+			return p;
+	}
+	if (!create || ((p= (Sched_Peer *)malloc(sizeof(Sched_Peer))) == NULL))
+		return NULL;
+	memcpy(&p->ip, ip, sizeof(struct in6_addr));
+	p->port= port;
+	p->active= 0;
+	peers= g_list_prepend(peers, p);
+	return p;
+}
+
+
+// Count one more (delta 1) or one less (delta -1) file sent to a peer
+static void peer_add(const struct in6_addr *ip, u_short port, int delta)
+{
+	Sched_Peer *p= find_peer(ip, port, delta > 0);
+
+	if (p == NULL)
+		return;
+	p->active += delta;
+	if (p->active <= 0) {
+		peers= g_list_remove(peers, p);
+		free(p);
+	}
+}
+
+
+// Files being sent to a peer
+static int peer_active(const struct in6_addr *ip, u_short port)
+{
+	Sched_Peer *p= find_peer(ip, port, FALSE);
+	return (p != NULL) ? p->active : 0;
+}
+
+
+// TRUE if one more transfer may start in this direction
+static gboolean has_slot(gboolean sending)
+{
+	if (sending)
+		return (sched_max_snd <= 0) || (stats.active_snd < sched_max_snd);
+	return (sched_max_rcv <= 0) || (stats.active_rcv < sched_max_rcv);
+}
+
+
+/*************************************\
+|* Queue                             *|
+\*************************************/
+
+// TRUE if the file 'a' should be sent before 'b'
+static gboolean before(Sched_Job *a, Sched_Job *b)
+{
+	int pa, pb;
+
+	if (a->prio != b->prio)
+		return a->prio < b->prio;
+	// Share the slots among the peers
+	pa= peer_active(&a->ip, a->port);
+	pb= peer_active(&b->ip, b->port);
+	if (pa != pb)
+		return pa < pb;
+	// Shortest first; the equal ones in arrival order
+	return a->size < b->size;
+}
+
+
+// Next transfer to start in a direction; NULL if none is waiting
+static Sched_Job *next_job(gboolean sending)
+{
+	long long now= g_get_monotonic_time();
+	Sched_Job *j, *best= NULL;
+	GList *list;
+
+	for (list= queue; list != NULL; list= list->next) {
+		j= (Sched_Job *)list->data;
+		if (j->sending != sending)
+			continue;
+		// Connections are received in arrival order, and so are the files waiting too long
+		if (!sending || (now-j->queued > SCHED_AGING_USEC))
+			return j;
+		if ((best == NULL) || before(j, best))
+			best= j;
+	}
+	return best;
+}
+
+
+// Start a transfer, in a slot or not; must be called with smutex locked. Returns FALSE if it failed
+static gboolean start(Sched_Job *j, gboolean slot)
+{
+	char buf[sizeof(j->fname)];
+	Thread_Data *pt;
+
+	if (j->sending) {
+		if ((pt= start_snd_file_thread(&j->ip, j->port, j->nome, j->fname, j->slow)) == NULL)
+			return FALSE;
+		pt->sched= SCHED_SND;
+		stats.active_snd++;
+		peer_add(&j->ip, j->port, 1);
+	} else {
+		// Sets the filename where the received data will be created
+		new_rcv_filename(buf, sizeof(buf));
+		if ((pt= start_rcv_file_thread(j->s, &j->ip, j->port, buf, j->slow)) == NULL)
+			return FALSE;
+		if (slot) {
+			pt->sched= SCHED_RCV;
+			stats.active_rcv++;
+		}
+	}
+	return TRUE;
+}
+
+
+// Take a job out of the queue and free it; closes a connection still waiting
+static void drop(Sched_Job *j, gboolean close_conn)
+{
+	queue= g_list_remove(queue, j);
+	GUI_remove_thread(j->id);
+	if (close_conn && !j->sending)
+		close(j->s);
+	free(j);
+}
+
+
+// Start the queued transfers that have a slot; must be called with smutex locked
+static void dispatch(void)
+{
+	long long wait;
+	Sched_Job *j;
+	char buf[400];
+	int dir;
+
+	for (dir= 0; dir < 2; dir++) {
+		while (active && has_slot(dir == 0) && ((j= next_job(dir == 0)) != NULL)) {
+			wait= g_get_monotonic_time()-j->queued;
+			queue= g_list_remove(queue, j);
+			GUI_remove_thread(j->id);
+			if (j->sending)
+				stats.queued_snd--;
+			else
+				stats.queued_rcv--;
+			stats.started++;
+			stats.wait_total += wait;
+			if (wait > stats.wait_max)
+				stats.wait_max= wait;
+			if (j->sending)
+				snprintf(buf, sizeof(buf), "Sending %s to %s after %.1f s in the queue - %d files waiting\n",
+						j->fname, j->nome, wait/1000000.0, stats.queued_snd);
+			else
+				snprintf(buf, sizeof(buf), "Receiving from %s after %.1f s in the queue - %d connections waiting\n",
+						addr_ipv6(&j->ip), wait/1000000.0, stats.queued_rcv);
+			Log(buf);
+			if (!start(j, TRUE)) {
+				if (!j->sending)
+					close(j->s);
+				Log("Failed starting a queued transfer\n");
+			}
+			free(j);
+		}
+	}
+}
+
+
+// Put a job in the queue and show it in the table
+static void enqueue(Sched_Job *j, const char *type, const char *name, const char *fname)
+{
+	j->id= (unsigned)(uintptr_t)j;	// Unique while queued, like the thread IDs of the table
+	j->queued= g_get_monotonic_time();
+	queue= g_list_append(queue, j);
+	if (j->sending)
+		stats.queued_snd++;
+	else
+		stats.queued_rcv++;
+	GUI_regist_thread(j->id, type, name, fname);
+}
+
+
+/*************************************\
+|* Connections waiting for data      *|
+\*************************************/
+
+// TRUE if the packed header already waiting in s carries a range of a file, returned in id
+static gboolean peek_stripe(int s, uint64_t *id)
+{
+	Packed_Header h;
+
+	if ((recv(s, &h, offsetof(Packed_Header, user), MSG_PEEK|MSG_DONTWAIT) < (ssize_t)offsetof(Packed_Header, user))
+			|| (h.mark != HEADER_MARK) || !(h.flags & HEADER_STRIPE))
+		return FALSE;
+	*id= h.stripe.id;
+	return TRUE;
+}
+
+
+// Receive a connection whose first bytes arrived now, or queue it if sched_max_rcv connections
+//   are being received; must be called with smutex locked
+static void admit(Sched_Job *j)
+{
+	j->striped= peek_stripe(j->s, &j->stripe_id);
+	if (j->striped && stripe_rcv_pending(&j->ip, j->stripe_id)) {
+		// Another range of a file being received: the slot of its first connection serves them all
+		if (!start(j, FALSE)) {
+			close(j->s);
+			Log("Failed starting a reception\n");
+		}
+		free(j);
+	} else if (has_slot(FALSE) && (stats.queued_rcv == 0)) {
+		if (!start(j, TRUE)) {
+			close(j->s);
+			Log("Failed starting a reception\n");
+		}
+		free(j);
+	} else if (stats.queued_rcv >= SCHED_RCV_BACKLOG) {
+		// Admission control: the sender fails now instead of after its timeout
+		stats.refused++;
+		close(j->s);
+		free(j);
+		Log("Too many connections waiting - connection refused\n");
+	} else {
+		enqueue(j, "RCV queued", "?", addr_ipv6(&j->ip));
+	}
+}
+
+
+// Take a connection out of the waiting list; closes it unless it is admitted
+static void stop_waiting(Sched_Job *j, gboolean admitted)
+{
+	waiting= g_list_remove(waiting, j);
+	if (admitted) {
+		admit(j);
+	} else {
+		close(j->s);
+		free(j);
+	}
+}
+
+
+// Thread that watches the connections without data: each one is admitted when its first bytes
+//   arrive, and closed if the sender closes it or sends nothing for SCHED_HEADER_WAIT
+static void *watch_thread(void *ptr)
+{
+	struct pollfd *fds= NULL;
+	Sched_Job **jobs= NULL;
+	int i, n, max= 0;
+	ssize_t r;
+	char c[64];
+	long long now;
+	Sched_Job *j;
+	GList *list;
+
+	pthread_mutex_lock(&smutex);
+	while (active) {
+		n= g_list_length(waiting)+1;
+		if (n > max) {
+			max= 2*n;
+			fds= (struct pollfd *)realloc(fds, max*sizeof(struct pollfd));
+			jobs= (Sched_Job **)realloc(jobs, max*sizeof(Sched_Job *));
+			assert((fds != NULL) && (jobs != NULL));
+		}
+		fds[0].fd= wake[0];
+		fds[0].events= POLLIN;
+		for (i= 1, list= waiting; list != NULL; i++, list= list->next) {
+			jobs[i]= (Sched_Job *)list->data;
+			fds[i].fd= jobs[i]->s;
+			fds[i].events= POLLIN;
+		}
+		pthread_mutex_unlock(&smutex);
+		// Wakes up every second, to test the timeouts and 'active'
+		if (poll(fds, n, 1000) < 0)
+			n= 1;
+		while (read(wake[0], c, sizeof(c)) > 0)
+			;
+		pthread_mutex_lock(&smutex);
+		now= g_get_monotonic_time();
+		for (i= 1; i < n; i++) {
+			j= jobs[i];
+			// Skip the connections closed meanwhile by sched_clear
+			if ((g_list_find(waiting, j) == NULL) || (j->s != fds[i].fd))
+				continue;
+			if (fds[i].revents) {
+				if ((r= recv(j->s, c, 1, MSG_PEEK|MSG_DONTWAIT)) > 0)
+					stop_waiting(j, TRUE);
+				else if ((r == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)))
+					stop_waiting(j, FALSE);		// Closed by the sender: a kept connection ends here
+			} else if (now-j->queued > SCHED_HEADER_WAIT) {
+				stop_waiting(j, FALSE);
+				Log("Closed a connection without data\n");
+			}
+		}
+	}
+	while (waiting != NULL)
+		stop_waiting((Sched_Job *)waiting->data, FALSE);
+	watching= FALSE;
+	pthread_mutex_unlock(&smutex);
+	free(fds);
+	free(jobs);
+	return NULL;
+}
+
+
+// Add a connection to the waiting list, starting the thread that watches it
+// Returns FALSE, with s still open, if it could not be added
+static gboolean wait_data(int s, struct in6_addr *ip, u_short port, gboolean slow)
+{
+	Sched_Job *j;
+	pthread_t tid;
+	gboolean ok= TRUE;
+
+	if ((j= (Sched_Job *)malloc(sizeof(Sched_Job))) == NULL)
+		return FALSE;
+	j->sending= FALSE;
+	j->prio= SCHED_PRIO_NORMAL;
+	memcpy(&j->ip, ip, sizeof(struct in6_addr));
+	j->port= port;
+	j->nome[0]= '\0';
+	j->fname[0]= '\0';
+	j->size= 0;
+	j->s= s;
+	j->striped= FALSE;
+	j->stripe_id= 0;
+	j->slow= slow;
+	j->queued= g_get_monotonic_time();
+
+	pthread_mutex_lock(&smutex);
+	if ((wake[0] < 0) && pipe2(wake, O_NONBLOCK|O_CLOEXEC)) {
+		perror("creating the pipe of the scheduler");
+		ok= FALSE;
+	} else if (!watching) {
+		if (pthread_create(&tid, NULL, watch_thread, NULL)) {
+			perror("starting the thread of the scheduler");
+			ok= FALSE;
+		} else {
+			pthread_detach(tid);
+			watching= TRUE;
+		}
+	}
+	if (ok) {
+		waiting= g_list_append(waiting, j);
+		if ((write(wake[1], "w", 1) < 0) && (errno != EAGAIN))	// A full pipe wakes it too
+			perror("waking the thread of the scheduler");
+	} else {
+		free(j);
+	}
+	pthread_mutex_unlock(&smutex);
+	return ok;
+}
+
+
+/*************************************\
+|* Interface                         *|
+\*************************************/
+
+// Send a file now, or queue it if sched_max_snd files are being sent
+gboolean sched_snd(struct in6_addr *ip, u_short port, const char *nome,
+		const char *filename, gboolean slow, int prio)
+{
+	Sched_Job *j;
+	gboolean ok= TRUE;
+	char buf[400];
+
+	if ((j= (Sched_Job *)malloc(sizeof(Sched_Job))) == NULL)
+		return FALSE;
+	j->sending= TRUE;
+	j->prio= prio;
+	memcpy(&j->ip, ip, sizeof(struct in6_addr));
+	j->port= port;
+	strncpy(j->nome, nome, sizeof(j->nome)-1);
+	j->nome[sizeof(j->nome)-1]= '\0';
+	strncpy(j->fname, filename, sizeof(j->fname)-1);
+	j->fname[sizeof(j->fname)-1]= '\0';
+	j->size= get_filesize(filename);
+	j->s= -1;
+	j->slow= slow;
+
+	pthread_mutex_lock(&smutex);
+	if (has_slot(TRUE) && (stats.queued_snd == 0)) {
+		ok= start(j, TRUE);
+		free(j);
+	} else {
+		enqueue(j, "SND queued", j->nome, j->fname);
+		snprintf(buf, sizeof(buf), "%s queued - %d files waiting\n", j->fname, stats.queued_snd);
+		Log(buf);
+	}
+	pthread_mutex_unlock(&smutex);
+	return ok;
+}
+
+
+// Receive a connection when its first bytes arrive, or queue it if sched_max_rcv connections are
+//   being received; returns TRUE, to keep accepting connections
+gboolean sched_rcv(int s, struct in6_addr *ip, u_short port, gboolean slow)
+{
+	if (!wait_data(s, ip, port, slow))
+		close(s);
+	return TRUE;
+}
+
+
+// Receive the next file of the kept connection of pt, which ended, like a new connection
+// It waits for the next header outside the slots, so idle kept connections do not take them
+// Returns FALSE, with pt->s still open, if the connection could not be kept
+gboolean sched_keep(Thread_Data *pt)
+{
+	return wait_data(pt->s, &pt->ip, pt->port, pt->rate > 0);
+}
+
+
+// Start the queued connections of the file 'id' from ip, whose first connection was just received
+// They hold no slot, like the ranges of the file that arrive later (see admit)
+void sched_stripe(const struct in6_addr *ip, uint64_t id)
+{
+	GList *list, *next;
+	Sched_Job *j;
+
+	pthread_mutex_lock(&smutex);
+	for (list= queue; list != NULL; list= next) {
+		next= list->next;
+		j= (Sched_Job *)list->data;
+		if (j->sending || !j->striped || (j->stripe_id != id) || memcmp(&j->ip, ip, sizeof(struct in6_addr)))
+			continue;
+		queue= g_list_remove(queue, j);
+		GUI_remove_thread(j->id);
+		stats.queued_rcv--;
+		stats.started++;
+		if (!start(j, FALSE)) {
+			close(j->s);
+			Log("Failed starting a queued transfer\n");
+		}
+		free(j);
+	}
+	pthread_mutex_unlock(&smutex);
+}
+
+
+// Release the slot of a transfer that ended and start the next ones (free_file_thread_desc)
+void sched_done(Thread_Data *pt)
+{
+	pthread_mutex_lock(&smutex);
+	if (pt->sched == SCHED_SND) {
+		stats.active_snd--;
+		peer_add(&pt->ip, pt->port, -1);
+	} else if (pt->sched == SCHED_RCV) {
+		stats.active_rcv--;
+	}
+	if (pt->sched != SCHED_NONE) {
+		pt->sched= SCHED_NONE;
+		dispatch();
+	}
+	pthread_mutex_unlock(&smutex);
+}
+
+
+// Remove a queued transfer shown in the table with 'id'; returns FALSE if there is none
+gboolean sched_cancel(unsigned id)
+{
+	GList *list;
+	Sched_Job *j;
+
+	pthread_mutex_lock(&smutex);
+	for (list= queue; list != NULL; list= list->next) {
+		j= (Sched_Job *)list->data;
+		if (j->id != id)
+			continue;
+		if (j->sending)
+			stats.queued_snd--;
+		else
+			stats.queued_rcv--;
+		drop(j, TRUE);
+		pthread_mutex_unlock(&smutex);
+		return TRUE;
+	}
+	pthread_mutex_unlock(&smutex);
+	return FALSE;
+}
+
+
+// Close the connections waiting for more than SCHED_RCV_MAX_WAIT
+void sched_expire(void)
+{
+	long long now= g_get_monotonic_time();
+	GList *list, *next;
+	Sched_Job *j;
+
+	pthread_mutex_lock(&smutex);
+	for (list= queue; list != NULL; list= next) {
+		next= list->next;
+		j= (Sched_Job *)list->data;
+		if (j->sending || (now-j->queued <= SCHED_RCV_MAX_WAIT))
+			continue;
+		stats.queued_rcv--;
+		stats.refused++;
+		Log("Closed a connection that waited too long in the queue\n");
+		drop(j, TRUE);
+	}
+	pthread_mutex_unlock(&smutex);
+}
+
+
+// Remove all queued transfers
+void sched_clear(void)
+{
+	pthread_mutex_lock(&smutex);
+	while (queue != NULL)
+		drop((Sched_Job *)queue->data, TRUE);
+	while (waiting != NULL)
+		stop_waiting((Sched_Job *)waiting->data, FALSE);
+	stats.queued_snd= 0;
+	stats.queued_rcv= 0;
+	pthread_mutex_unlock(&smutex);
+}
+
+
+// Get the state of the scheduler
+void sched_stats(Sched_Stats *st)
+{
+	pthread_mutex_lock(&smutex);
+	memcpy(st, &stats, sizeof(Sched_Stats));
+	pthread_mutex_unlock(&smutex);
+}
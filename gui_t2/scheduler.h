@@ -0,0 +1,86 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * scheduler.h
+ *
+ * Header file of the transfer scheduler
+ *
+ * At most sched_max_snd files are sent and sched_max_rcv connections are
+ * received at the same time; the others wait in a queue, shown in the table
+ * of transfers as "SND queued" or "RCV queued". When a transfer ends, the
+ * next file sent is the one with the best priority, then the one to the peer
+ * with fewer files being sent, then the smallest one; files waiting for more
+ * than SCHED_AGING_USEC go first, in arrival order, so large files still get
+ * their turn. Incoming connections are started in arrival order, and refused
+ * when SCHED_RCV_BACKLOG of them are already waiting. A connection, new or kept
+ * by its sender for the next file, takes a slot only when its first bytes
+ * arrive; the other ranges of a striped file being received take none.
+ \*****************************************************************************/
+#ifndef SCHEDULER_INC_
+#define SCHEDULER_INC_
+
+#include <glib.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "callbacks.h"
+
+#define SCHED_DEFAULT_SND	4			// Files sent at the same time
+#define SCHED_DEFAULT_RCV	32			// Connections received at the same time
+#define SCHED_RCV_BACKLOG	64			// Connections waiting; the next ones are refused
+#define SCHED_RCV_MAX_WAIT	10000000LL	// Connections waiting longer are closed (usec), since
+										//   their senders stopped waiting (10 s without progress)
+#define SCHED_HEADER_WAIT	10000000LL	// Connections without data are closed (usec)
+#define SCHED_AGING_USEC	30000000LL	// Files waiting longer are sent first (usec)
+
+/* Priorities of the files sent */
+#define SCHED_PRIO_HIGH		0
+#define SCHED_PRIO_NORMAL	1
+#define SCHED_PRIO_LOW		2			// "Slow" files
+
+/* Slot held by a transfer (Thread_Data.sched) */
+#define SCHED_NONE			0			// Started outside the scheduler
+#define SCHED_SND			1
+#define SCHED_RCV			2
+
+// Maximum transfers at the same time, in each direction; 0 if unlimited
+extern int sched_max_snd;
+extern int sched_max_rcv;
+
+// State of the scheduler
+typedef struct {
+	int active_snd;			// Transfers running
+	int active_rcv;
+	int queued_snd;			// Transfers waiting
+	int queued_rcv;
+	long long started;		// Transfers started after waiting in the queue
+	long long refused;		// Connections refused or closed while waiting
+	long long wait_total;	// Time waited by the transfers started (usec)
+	long long wait_max;
+} Sched_Stats;
+
+
+// Send a file now, or queue it if sched_max_snd files are being sent
+gboolean sched_snd(struct in6_addr *ip, u_short port, const char *nome,
+		const char *filename, gboolean slow, int prio);
+// Receive a connection when its first bytes arrive, or queue it if sched_max_rcv connections are
+//   being received; returns TRUE, to keep accepting connections
+gboolean sched_rcv(int s, struct in6_addr *ip, u_short port, gboolean slow);
+// Receive the next file of the kept connection of pt, which ended, when its header arrives
+// Returns FALSE, with pt->s still open, if the connection could not be kept
+gboolean sched_keep(Thread_Data *pt);
+// Start the queued connections of the file 'id' from ip, whose first connection was just received
+void sched_stripe(const struct in6_addr *ip, uint64_t id);
+// Release the slot of a transfer that ended and start the next ones (free_file_thread_desc)
+void sched_done(Thread_Data *pt);
+// Remove a queued transfer shown in the table with 'id'; returns FALSE if there is none
+gboolean sched_cancel(unsigned id);
+// Close the connections waiting for more than SCHED_RCV_MAX_WAIT
+void sched_expire(void);
+// Remove all queued transfers
+void sched_clear(void);
+// Get the state of the scheduler
+void sched_stats(Sched_Stats *st);
+
+#endif
@@ -9,6 +9,9 @@
  * Updated on October 8, 2019,16:00
  * @author  Luis Bernardo
 \*****************************************************************************/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		// recvmmsg
+#endif
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -22,199 +25,125 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/ioctl.h>
+#include <netinet/tcp.h>
 #include "sock.h"
+#include "ifaddr.h"
+#include "tune.h"
 
 // External logging function declared elsewhere
 extern void Log(const gchar *str);
 
 
 // Variables with local IP addresses
-static const char *devicename= NULL;
 static gboolean got_local_ip= FALSE; // Set local IP variables
 struct in_addr local_ipv4;// Local IPv4 address
 gboolean valid_local_ipv4; // TRUE if the local IPv4 address is valid
 struct in6_addr local_ipv6;// Local IPv6 address
 gboolean valid_local_ipv6; // TRUE if the local IPv6 address is valid
 
-
+// Counters of the datagrams received in batches
+static Udp_Stats ustats;
+// Last drop counter (SO_RXQ_OVFL) read from each datagram socket, which
+//   starts at zero; the multicast and query sockets of both families are read in turn
+#define OVFL_SOCKS	8
+static struct {
+	int sock;
+	uint32_t last;
+} ovfl_last[OVFL_SOCKS];
+static int ovfl_next= 0;		// Next entry reused
+// recvmmsg arguments of the batches
+static struct mmsghdr bmsg[UDP_BATCH];
+static struct iovec biov[UDP_BATCH];
+// SO_RXQ_OVFL counter of the socket and the interface where each datagram arrived (PKTINFO)
+static char bctrl[UDP_BATCH][CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct in6_pktinfo))];
+
+
+
+// Log one local address
+static void print_local_addr(const Local_Addr *a, gpointer data) {
+	char buf[160];
+	const char *scope= (a->scope == IFADDR_SCOPE_HOST) ? "host" :
+			(a->scope == IFADDR_SCOPE_LINK) ? "link" :
+			(a->scope == IFADDR_SCOPE_SITE) ? "site" : "global";
+
+	sprintf(buf, "Local address %s on %s (%s)\n", a->ip, a->ifname, scope);
+	Log(buf);
+}
 
 // Set the contents of the variables with the local IP addresses
 void set_local_IP() {
   if (!got_local_ip) {
+    if (ifaddr_scan())
+      ifaddr_foreach(print_local_addr, NULL);
     valid_local_ipv4= init_local_ipv4(&local_ipv4);
     valid_local_ipv6= init_local_ipv6(&local_ipv6);
     got_local_ip= TRUE;
   }
 }
 
-// Get the local network device name
-static const char *get_device_name() {
-	static char buf[100];
-	if (system(
-		"ip link show | grep -v LOOPBACK | grep BROADCAST | awk '{ print $2 }' | sed '$ s/.$//' > /tmp/lixo0123456789.txt")<0)
-		return NULL;
-	FILE *fd = fopen("/tmp/lixo0123456789.txt", "r");
-	char *pt= fgets(buf,100,fd);
-	if (pt != NULL) {
-		pt[strlen(pt)-1]='\0';	// Remove pending '\n'
-	}
-	fclose(fd);
-	unlink("/tmp/lixo0123456789.txt");
-
-	return pt;
-}
-
-// Get the local IPv4 address (device dev) using "ioctl" command
-static gboolean get_local_ipv4name_using_ioctl(const char *dev,
-		struct in_addr *addr) {
-	struct ifreq req;
-	int fd;
-	assert((dev!=NULL) && (addr!=NULL));
-	fd = socket(AF_INET, SOCK_DGRAM, 0);
-	strcpy(req.ifr_name, dev);
-	req.ifr_addr.sa_family = AF_INET;
-	if (ioctl(fd, SIOCGIFADDR, &req) < 0) {
-		perror("getting local IP address");
-		close(fd);
-		return FALSE;
-	}
-	close(fd);
-	struct sockaddr_in *pt = (struct sockaddr_in *) &req.ifr_ifru.ifru_addr;
-	memcpy(addr, &(pt->sin_addr), 4);
-	return TRUE;
-}
-
-// Get the local IPv4 address (device dev) using command "ifconfig"
-static gboolean get_local_ipv4name_using_ifconfig(char *buf, int buf_len) {
-	if (system("/sbin/ifconfig | grep -w inet | grep broadcast | head -1 | awk '{ print $2 }' | sed 's/addr\\://' > /tmp/lixo0123456789.txt")
-			< 0)
-		return FALSE;
-	FILE *fd = fopen("/tmp/lixo0123456789.txt", "r");
-	int n = fread(buf, 1, buf_len, fd);
-	buf[n - 1] = '\0';
-	fclose(fd);
-	unlink("/tmp/lixo0123456789.txt");
-
-	if (n <= 0)
-		return FALSE;
-	if (n >= 256)
-		return FALSE;
-	return TRUE;
+// Choose the local IP addresses again, after the table of local addresses changed
+// Returns TRUE if local_ipv4 or local_ipv6 changed
+gboolean update_local_IP() {
+  struct in_addr ip4;
+  struct in6_addr ip6;
+  gboolean changed;
+
+  valid_local_ipv4= init_local_ipv4(&ip4);
+  valid_local_ipv6= init_local_ipv6(&ip6);
+  changed= memcmp(&ip4, &local_ipv4, sizeof(ip4)) || memcmp(&ip6, &local_ipv6, sizeof(ip6));
+  local_ipv4= ip4;
+  local_ipv6= ip6;
+  got_local_ip= TRUE;
+  return changed;
 }
 
-// Get local IPv4 address
+// Get local IPv4 address: the preferred address of the table of local addresses
 gboolean init_local_ipv4(struct in_addr *ip) {
-	char name[265];
-	struct hostent *hp;
+	const Local_Addr *a;
 
 	assert(ip != NULL);
-	devicename= get_device_name();
-	if (devicename != NULL) {
-		printf("device name='%s'\n",devicename);
-		if (get_local_ipv4name_using_ioctl(devicename, ip))
-			return TRUE;
-	} else {
-		Log("no device name found\n");
-	}
-	if (!get_local_ipv4name_using_ifconfig(name, sizeof(name)))
-		if (gethostname(name, 256)) {
-			Log("Failed to get the machine's name\n");
-			return FALSE;
-		}
-	printf("Local name = %s\n", name);
-	hp = gethostbyname2(name, AF_INET);
-	if (hp == 0) {
+	if ((a= ifaddr_preferred(AF_INET)) == NULL) {
 		Log("This machine does not have an IPv4 address\n");
 		inet_pton(AF_INET, "127.0.0.1", ip);
 		return TRUE;
 	}
-	assert(hp->h_length == 4);
-	bcopy(hp->h_addr, ip, hp->h_length);
+	memcpy(ip, &a->addr.s6_addr[12], 4);
 	return TRUE;
 }
 
-/*
- The ioctl SIOCGIFADDR works fine for v4 but usually returns EINVAL for v6.
- */
-
-// Get the local IPv6 address (device dev) using command "ifconfig"
-static gboolean get_local_ipv6name_using_ifconfig(const char *dev, char *buf,
-		int buf_len) {
-	if (system("/sbin/ifconfig | grep inet6 | grep -i 'global' | head -1 | awk '{ print $2 }' > /tmp/lixo0123456789.txt")
-				< 0)
-		return FALSE;
-	FILE *fd = fopen("/tmp/lixo0123456789.txt", "r");
-	int n = fread(buf, 1, buf_len, fd);
-	fclose(fd);
-	unlink("/tmp/lixo0123456789.txt");
-
-	if (n <= 0)
-		return FALSE;
-	if (n >= 256)
-		return FALSE;
-	char *p = strchr(buf, '\n');
-	if (p == NULL)
-		return FALSE;
-	*p = '\0';
-	return TRUE;
-}
-
-// Get the local IPv6 address
+// Get the local IPv6 address: the preferred address of the table of local addresses
 gboolean init_local_ipv6(struct in6_addr *ip) {
-	char name[256];
-	struct hostent *hp;
+	const Local_Addr *a;
 
 	assert(ip != NULL);
-	if (devicename == NULL) {
-		Log("No network device available\n");
-	}
-	if (!get_local_ipv6name_using_ifconfig(devicename, name, sizeof(name)))
-		if (gethostname(name, 256)) {
-			Log("Failed to get the machine's name\n");
-			return FALSE;
-		}
-	printf("Local name = %s\n", name);
-	hp = gethostbyname2(name, AF_INET6);
-	if (hp == 0) {
+	if ((a= ifaddr_preferred(AF_INET6)) == NULL) {
 		Log("This machine does not have an IPv6 global address\n");
 		inet_pton(AF_INET6, "::1", ip);
 		return TRUE;
 	}
-	assert(hp->h_length == 16);
-	bcopy(hp->h_addr, ip, hp->h_length);
+	memcpy(ip, &a->addr, 16);
 	return TRUE;
 }
 
 
-// Return TRUE if 'ip_str' is a local address
-// BUGS: It only works for 1 address per host
+// Return TRUE if 'ip_str' is a local address, of any interface
 gboolean is_local_ip(const char *ip_str) {
   assert(ip_str != NULL);
   set_local_IP();
 
-  if (strchr(ip_str, ':') != NULL) {
-    // IPv6
-    if (!strcmp(ip_str, "::1"))
-      return TRUE;
-    if (valid_local_ipv6)
-      return !strcmp(ip_str, addr_ipv6(&local_ipv6));
-    return FALSE;
-  }
-  // IPv4
+  // All 127.0.0.0/8 goes to the loopback, not only the address of lo
   if (!strncmp("127.", ip_str, 4))
     return TRUE;
-  if (valid_local_ipv4) {
-      return !strcmp(ip_str, addr_ipv4(&local_ipv4));
-  }
-  return FALSE;
+  return ifaddr_is_local(ip_str);
 }
 
 
-// Convert "::1" to the local global address
+// Convert a loopback address ("::1") to the local global address
 void translate_local_ip(struct in6_addr *ip) {
   assert(ip != NULL);
-  if (valid_local_ipv6 && !strcmp(addr_ipv6(ip), "::1"))
+  if (valid_local_ipv6 && ifaddr_is_loopback(ip))
     // substitui
     bcopy(&local_ipv6, ip, 16);
 }
@@ -279,6 +208,43 @@ char *addr_ipv6(struct in6_addr *addr) {
 	return buf;
 }
 
+// Ask the kernel to pass the number of datagrams dropped by socket s with each datagram read
+static void count_drops(int s) {
+	int on = 1, i;
+
+	if (setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0)
+		perror("setsockopt SO_RXQ_OVFL failed");
+	// A new socket starts counting from zero; its descriptor may be of a closed one
+	for (i = 0; (i < OVFL_SOCKS) && (ovfl_last[i].sock != s); i++)
+		;
+	if (i == OVFL_SOCKS) {
+		i = ovfl_next;
+		ovfl_next = (ovfl_next + 1) % OVFL_SOCKS;
+	}
+	ovfl_last[i].sock = s;
+	ovfl_last[i].last = 0;
+}
+
+// Return the last drop counter read from socket s
+static uint32_t *drop_counter(int s) {
+	static uint32_t unknown;
+	int i;
+
+	for (i = 0; i < OVFL_SOCKS; i++)
+		if (ovfl_last[i].sock == s)
+			return &ovfl_last[i].last;
+	return &unknown;
+}
+
+// Ask the kernel to pass the interface where each datagram arrived to socket s of family
+static void recv_pktinfo(int s, int family) {
+	int on = 1;
+
+	if ((family == AF_INET) ? setsockopt(s, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on)) < 0 :
+			setsockopt(s, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on)) < 0)
+		perror("setsockopt PKTINFO failed");
+}
+
 // Initialize an IPv4 socket
 //  dom = SOCK_DGRAM or SOCK_STREAM
 //  Returns: -1 - error;  >0 - socket number
@@ -317,6 +283,10 @@ int init_socket_ipv4(int dom, int porto, gboolean shared) {
 		perror("IPv4 port number association");
 		return -1;
 	}
+	if (dom == SOCK_DGRAM) {
+		count_drops(s);
+		recv_pktinfo(s, AF_INET);
+	}
 	return s;
 }
 
@@ -333,6 +303,9 @@ int init_socket_ipv6(int dom, int port, gboolean shared) {
 		perror("IPv6 socket creation");
 		return -1;
 	}
+	// The connections accepted by a TCP server inherit its socket profile
+	if (dom == SOCK_STREAM)
+		tune_socket(s, TUNE_LISTEN, "TCP server> ");
 
 	if (shared) {
 		/* Make the IP/port of the socket sharable - allows several servers to be associated
@@ -359,6 +332,10 @@ int init_socket_ipv6(int dom, int port, gboolean shared) {
 		perror("IPv4 port number association");
 		return -1;
 	}
+	if (dom == SOCK_DGRAM) {
+		count_drops(s);
+		recv_pktinfo(s, AF_INET6);
+	}
 	return s;
 }
 
@@ -426,6 +403,90 @@ int read_data_ipv6(int sock, char *buf, int n, struct in6_addr *ip,
 	return m;
 }
 
+// Read up to UDP_BATCH datagrams waiting in socket sock with one recvmmsg, without blocking, into b
+// Returns the number of datagrams read (<0 in case of error)
+int read_batch_udp(int sock, Udp_Batch *b) {
+	struct cmsghdr *cmsg;
+	struct in_pktinfo pi4;
+	struct in6_pktinfo pi6;
+	uint32_t ovfl, *last;
+	int i, m, k;
+
+	assert(b != NULL);
+	if (sock < 0)
+		return -1;
+	for (i = 0; i < UDP_BATCH; i++) {
+		biov[i].iov_base = b->buf[i];
+		biov[i].iov_len = UDP_MAX_LENGTH;
+		memset(&bmsg[i], 0, sizeof(bmsg[i]));
+		bmsg[i].msg_hdr.msg_name = &b->from[i];
+		bmsg[i].msg_hdr.msg_namelen = sizeof(b->from[i]);
+		bmsg[i].msg_hdr.msg_iov = &biov[i];
+		bmsg[i].msg_hdr.msg_iovlen = 1;
+		bmsg[i].msg_hdr.msg_control = bctrl[i];
+		bmsg[i].msg_hdr.msg_controllen = sizeof(bctrl[i]);
+	}
+	if ((m = recvmmsg(sock, bmsg, UDP_BATCH, MSG_DONTWAIT /* non blocking */, NULL)) < 0) {
+		b->n = 0;
+		return m;
+	}
+	b->n = m;
+	if (m == 0)
+		return 0;
+
+	// Count the batch and the datagrams dropped since the last one
+	ustats.datagrams += m;
+	for (k = 0; (k < UDP_BATCH_BUCKETS-1) && (m >= (2 << k)); k++)
+		;
+	ustats.batches[k]++;
+	last = drop_counter(sock);
+	for (i = 0; i < m; i++) {
+		b->len[i] = bmsg[i].msg_len;
+		b->ifindex[i] = 0;
+		for (cmsg = CMSG_FIRSTHDR(&bmsg[i].msg_hdr); cmsg != NULL;
+				cmsg = CMSG_NXTHDR(&bmsg[i].msg_hdr, cmsg)) {
+			if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_RXQ_OVFL)) {
+				memcpy(&ovfl, CMSG_DATA(cmsg), sizeof(ovfl));
+				ustats.drops += (uint32_t)(ovfl - *last);
+				*last = ovfl;
+			} else if ((cmsg->cmsg_level == IPPROTO_IP) && (cmsg->cmsg_type == IP_PKTINFO)) {
+				memcpy(&pi4, CMSG_DATA(cmsg), sizeof(pi4));
+				b->ifindex[i] = pi4.ipi_ifindex;
+			} else if ((cmsg->cmsg_level == IPPROTO_IPV6) && (cmsg->cmsg_type == IPV6_PKTINFO)) {
+				memcpy(&pi6, CMSG_DATA(cmsg), sizeof(pi6));
+				b->ifindex[i] = pi6.ipi6_ifindex;
+			}
+		}
+	}
+	return m;
+}
+
+// Return the sender of datagram i of a batch as text, and its port
+const char *batch_sender(Udp_Batch *b, int i, short unsigned int *port) {
+	struct sockaddr_in *from4 = (struct sockaddr_in *) &b->from[i];
+
+	assert((i >= 0) && (i < b->n));
+	if (from4->sin_family == AF_INET) {
+		*port = ntohs(from4->sin_port);
+		return addr_ipv4(&from4->sin_addr);
+	}
+	*port = ntohs(b->from[i].sin6_port);
+	return addr_ipv6(&b->from[i].sin6_addr);
+}
+
+// Get the counters of the batches received
+void udp_stats(Udp_Stats *st) {
+	*st = ustats;
+}
+
+// Write the counters of the batches received in buf
+void udp_stats_str(char *buf, int n) {
+	snprintf(buf, n, "multicast: %lld datagrams, batches of 1: %lld, 2-3: %lld, 4-7: %lld, "
+			"8-15: %lld, 16-31: %lld, 32: %lld; %lld dropped\n", ustats.datagrams,
+			ustats.batches[0], ustats.batches[1], ustats.batches[2], ustats.batches[3],
+			ustats.batches[4], ustats.batches[5], ustats.drops);
+}
+
 // Create a GIOchannel object and regist a callback function in the GIO main loop
 // event = G_IO_IN ; G_IO_OUT; G_IO_IN | G_IO_OUT
 gboolean put_socket_in_mainloop(int sock, void *ptr, guint *chan_id, GIOChannel **chan,
@@ -502,3 +563,12 @@ void close_socket(int sock)
 		return;
 	close(sock);
 }
+
+// Hold (on=TRUE) or flush (on=FALSE) partial TCP segments, to send several writes together
+// Clearing the option sends the pending bytes at once, even with TCP_NODELAY
+void set_cork(int sock, gboolean on)
+{
+	int opt= on ? 1 : 0;
+	if (setsockopt(sock, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt)))
+		perror("setsockopt TCP_CORK");
+}
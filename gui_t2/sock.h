@@ -13,7 +13,6 @@
 #define _INCL_SOCK_H_
 
 #include <netinet/in.h>
-#include <gtk/gtk.h>
 #include <glib.h>
 
 
@@ -38,11 +37,12 @@ extern gboolean valid_local_ipv6; // TRUE if the local IPv6 address is valid
 
 
 void set_local_IP(); // Set the contents of the variables with the local IP addresses
-					 // BUGS: It only works for 1 address per host
+					 // local_ipv4/6 are the preferred ones; is_local_ip knows all of them
+gboolean update_local_IP(); // Choose them again after a change of the local addresses; TRUE if changed
 gboolean init_local_ipv4(struct in_addr *ip);  //  Get local IPv4 address
 gboolean init_local_ipv6(struct in6_addr *ip);  //  Get local IPv6 address
 gboolean is_local_ip(const char *ip_str); // Return TRUE if 'ip_str' is a local address
-void translate_local_ip(struct in6_addr *ip); // Convert "::1" to the local global address
+void translate_local_ip(struct in6_addr *ip); // Convert a loopback address ("::1") to the local global address
 
 gboolean get_IPv6(const gchar *textIP, struct in6_addr *addrv6); // Read an IPv6 Multicast address
 gboolean get_IPv4(const gchar *textIP, struct in_addr *addrv4); // Read an IPv4 Multicast address
@@ -69,6 +69,37 @@ int read_data_ipv4(int sock, char *buf, int n, struct in_addr *ip,
 int read_data_ipv6(int sock, char *buf, int n, struct in6_addr *ip,
 		    short unsigned int *port);
 
+/* Batched reception of datagrams */
+#define UDP_BATCH			32		// Datagrams read by each recvmmsg
+#define UDP_MAX_LENGTH		9000	// Maximum length of a datagram
+#define UDP_BATCH_BUCKETS	6		// Sizes of the batches counted: 1, 2-3, 4-7, 8-15, 16-31, 32
+
+// Datagrams received in a batch, with their sender, length and interface
+typedef struct {
+	int n;										// Datagrams received
+	int len[UDP_BATCH];
+	int ifindex[UDP_BATCH];						// Interface where it arrived; 0 if not known
+	struct sockaddr_in6 from[UDP_BATCH];		// sockaddr_in for an IPv4 socket
+	char buf[UDP_BATCH][UDP_MAX_LENGTH];
+} Udp_Batch;
+
+// Counters of the datagrams received in batches
+typedef struct {
+	long long datagrams;
+	long long batches[UDP_BATCH_BUCKETS];	// Batches by size: 1, 2-3, 4-7, 8-15, 16-31, 32
+	long long drops;						// Datagrams dropped by the socket, full buffer
+} Udp_Stats;
+
+// Read up to UDP_BATCH datagrams waiting in socket sock with one recvmmsg, without blocking, into b
+// Returns the number of datagrams read (<0 in case of error)
+int read_batch_udp(int sock, Udp_Batch *b);
+// Return the sender of datagram i of a batch as text, and its port
+const char *batch_sender(Udp_Batch *b, int i, short unsigned int *port);
+// Get the counters of the batches received
+void udp_stats(Udp_Stats *st);
+// Write the counters of the batches received in buf
+void udp_stats_str(char *buf, int n);
+
 // Create a GIOchannel object and regist a callback function in the GIO main loop
 // event = G_IO_IN ; G_IO_OUT; G_IO_IN | G_IO_OUT
 gboolean put_socket_in_mainloop(int sock, void *ptr, guint *chan_id, GIOChannel **chan,
@@ -91,6 +122,9 @@ void remove_socket_from_mainloop(int sock, guint chan_id, GIOChannel *chan);
 // Close the socket
 void close_socket(int sock);
 
+// Hold (on=TRUE) or flush (on=FALSE) partial TCP segments, to send several writes together
+void set_cork(int sock, gboolean on);
+
 
 #endif
 
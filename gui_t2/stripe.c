@@ -0,0 +1,590 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * stripe.c
+ *
+ * Striped (multi-connection) file transfers
+ *
+ * The sending thread starts one helper thread per range and only aggregates the
+ * progress, so the GUI keeps a single row per file. On the receiving side each
+ * connection keeps its own descriptor; the first one of a file owns the output
+ * file and the GUI row, and the others remove their rows when they join.
+ * Each range is followed by the digest of its bytes; the file is complete when
+ * all ranges were received and verified.
+ \*****************************************************************************/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "stripe.h"
+#include "header.h"
+#include "tune.h"
+#include "thread.h"
+#include "hash.h"
+#include "rate.h"
+#include "callbacks.h"
+#include "sock.h"
+#include "file.h"
+#include "gui.h"
+#include "peers.h"
+#include "scheduler.h"
+
+#define STRIPE_ALIGN		(64*1024)		// Ranges start at multiples of this size
+#define STRIPE_POLL_USEC	100000			// Maximum period of the progress updates
+
+
+// Range being sent by a helper thread
+typedef struct {
+	Thread_Data *pt;			// Sending thread descriptor
+	int s;						// Connection socket
+	Stripe_Header sh;			// Range sent
+	volatile long long sent;	// Bytes of the range already sent
+	volatile gboolean done;		// Helper thread ended
+	volatile gboolean *stop;	// Set by the sending thread to stop the helpers
+	int result;					// XFER_* result
+	pthread_t tid;
+} Stripe_Send;
+
+// Connections of a file being received
+typedef struct Stripe_Group {
+	struct in6_addr ip;			// Sender address
+	uint64_t id;				// File identifier
+	int count;					// Number of ranges
+	long long flen;				// File length
+	int fd;						// Output file
+	Thread_Data *owner;			// Connection that owns the file and GUI row; NULL after it left
+	unsigned tid;				// GUI row of the file
+	int refs;					// Connections in the group
+	volatile gboolean failed;	// A connection failed; the others abort
+	long long total;			// Bytes written
+	short int last_c;			// Last percentage shown in the GUI
+	long long last_io;			// Time of the last progress (usec)
+	gboolean taken[STRIPE_MAX];	// Range already has a connection
+	int64_t offset[STRIPE_MAX];	// Ranges
+	int64_t length[STRIPE_MAX];
+	int64_t got[STRIPE_MAX];	// Bytes written per range
+	gboolean verified[STRIPE_MAX];	// Digest of the range matched
+	int nverified;				// Ranges verified
+	gboolean unchecked;			// Some range was accepted without a digest (HASH_UNCHECKED)
+} Stripe_Group;
+
+
+int stripes= 1;								// Connections used to send large files
+static GList *groups= NULL;					// Files being received
+static pthread_mutex_t smutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scond = PTHREAD_COND_INITIALIZER;	// Signals ended stripes and files
+
+
+// Wait on scond for at most STRIPE_POLL_USEC; must be called with smutex locked
+static void stripe_timedwait(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += STRIPE_POLL_USEC*1000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_cond_timedwait(&scond, &smutex, &ts);
+}
+
+
+/*************************************\
+|* Sending striped files             *|
+\*************************************/
+
+// TRUE if the file of pt should be striped
+gboolean stripe_wanted(Thread_Data *pt)
+{
+	return (stripes > 1) && (pt->flen >= STRIPE_MIN_SIZE);
+}
+
+
+// Send n bytes; returns FALSE on error
+static gboolean send_all(int s, const char *buf, size_t n)
+{
+	ssize_t m;
+	while (n > 0) {
+		if ((m= send(s, buf, n, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		buf += m;
+		n -= m;
+	}
+	return TRUE;
+}
+
+
+// Open an additional connection to the receiver of pt
+static int stripe_connect(Thread_Data *pt)
+{
+	struct sockaddr_in6 server;
+	struct timeval tv;
+	int s;
+
+	if ((s= socket(AF_INET6, SOCK_STREAM, 0)) < 0) {
+		perror("opening stream socket");
+		return -1;
+	}
+	server.sin6_family = AF_INET6;
+	server.sin6_flowinfo= 0;
+	server.sin6_port = htons(pt->port);
+	server.sin6_addr = pt->ip;
+	server.sin6_scope_id= peers_scope_id(&pt->ip, pt->port);	// Link-local: interface where it was heard
+	tune_socket(s, TUNE_SND, pt->name_str);
+	if (connect(s, (struct sockaddr *)&server, sizeof(server)) < 0) {
+		perror("SND>error connecting the TCP socket to send a stripe");
+		close(s);
+		return -1;
+	}
+	tv.tv_sec = 10;
+	tv.tv_usec = 0;
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (struct timeval *)&tv, sizeof(struct timeval));
+	return s;
+}
+
+
+// Mark a helper thread as ended and wake up the sending thread
+static void stripe_snd_end(Stripe_Send *ss)
+{
+	pthread_mutex_lock(&smutex);
+	ss->done= TRUE;
+	pthread_cond_broadcast(&scond);
+	pthread_mutex_unlock(&smutex);
+}
+
+
+// Helper thread that sends one range
+static void *stripe_snd_thread(void *ptr)
+{
+	Stripe_Send *ss= (Stripe_Send *)ptr;
+	Thread_Data *pt= ss->pt;
+	Packed_Header h;
+	off_t off= ss->sh.offset;
+	long long left= ss->sh.length;
+	size_t chunk= STRIPE_CHUNK;
+	gboolean zerocopy= (snd_mode == XFER_MODE_ZEROCOPY) || (snd_mode == XFER_MODE_URING);
+	gboolean hashed= hash_zerocopy || !zerocopy;	// sendfile does not see the bytes
+	char *buf= NULL;
+	Hash_State hash;
+	ssize_t n;
+
+	ss->result= XFER_ERROR;
+	hash_init(&hash);
+	if ((ss->s < 0) && ((ss->s= stripe_connect(pt)) < 0)) {
+		stripe_snd_end(ss);
+		return NULL;
+	}
+	// Header of the file, carrying the range of this connection
+	if (!header_build(&h, user_name, pt->fname, pt->flen, HEADER_STRIPE | (hashed ? 0 : HEADER_NOHASH), &ss->sh) ||
+			!header_send(ss->s, &h)) {
+		perror("stripe send header");
+		stripe_snd_end(ss);
+		return NULL;
+	}
+
+	while ((left > 0) && !*ss->stop) {
+		// The helpers of a transfer share its buckets, so the limit covers all its connections
+		size_t len= rate_chunk(pt, (left < (long long)chunk) ? left : chunk);
+		if (zerocopy) {
+			n= sendfile(ss->s, fileno(pt->f), &off, len);
+			if ((n < 0) && (off == ss->sh.offset) && ((errno == EINVAL) || (errno == ENOSYS))) {
+				zerocopy= FALSE;
+				continue;
+			}
+			if ((n > 0) && hashed && !hash_update_fd(&hash, fileno(pt->f), off-n, n))
+				break;
+		} else {
+			if ((buf == NULL) && ((buf= (char *)malloc(chunk)) == NULL))
+				break;
+			n= pread(fileno(pt->f), buf, len, off);
+			if ((n > 0) && !send_all(ss->s, buf, n))
+				n= -1;
+			if (n > 0) {
+				hash_update(&hash, buf, n);
+				off += n;
+			}
+		}
+		if ((n < 0) && (errno == EINTR))
+			continue;
+		if (n <= 0) {
+			if (n < 0)
+				perror("stripe send");
+			break;
+		}
+		left -= n;
+		ss->sent += n;
+		rate_throttle(pt, n);
+	}
+	free(buf);
+	// The digest of the range follows its last byte
+	if ((left == 0) && (!hashed || hash_send_trailer(ss->s, &hash)))
+		ss->result= XFER_OK;
+	stripe_snd_end(ss);
+	return NULL;
+}
+
+
+// Send the file pt->f over 'stripes' connections, the first one pt->s; returns an XFER_* result
+// pt->fname must already have the name without the path
+int stripe_send_file(Thread_Data *pt, short int *last_c)
+{
+	Stripe_Send ss[STRIPE_MAX];
+	volatile gboolean stop= FALSE;
+	int count= (stripes > STRIPE_MAX) ? STRIPE_MAX : stripes;
+	uint64_t id= ((uint64_t)g_random_int() << 32) | g_random_int();
+	long long part, off= 0, sent;
+	gboolean running;
+	int i, started= 0, res= XFER_OK;
+
+	if ((strlen(user_name)+1 > 129) || (strlen(pt->fname)+1 > 257))
+		return XFER_ERROR;
+
+	// Ranges start at multiples of STRIPE_ALIGN; the last one gets the remainder
+	part= ((pt->flen/count)+STRIPE_ALIGN-1) / STRIPE_ALIGN * STRIPE_ALIGN;
+	for (i= 0; i < count; i++) {
+		memset(&ss[i], 0, sizeof(Stripe_Send));
+		ss[i].pt= pt;
+		ss[i].s= (i == 0) ? pt->s : -1;
+		ss[i].stop= &stop;
+		ss[i].result= XFER_ERROR;
+		ss[i].sh.id= id;
+		ss[i].sh.index= i;
+		ss[i].sh.count= count;
+		ss[i].sh.offset= off;
+		ss[i].sh.length= (i == count-1) ? pt->flen-off : MIN(part, pt->flen-off);
+		off += ss[i].sh.length;
+		if (pthread_create(&ss[i].tid, NULL, stripe_snd_thread, &ss[i])) {
+			fprintf(stderr, "%s error starting stripe thread\n", pt->name_str);
+			stop= TRUE;
+			res= XFER_ERROR;
+			break;
+		}
+		started++;
+	}
+	g_print("%s sending file %s in %d connections\n", pt->name_str, pt->fname, count);
+
+	// Show the aggregated progress and stop the helpers if the transfer is stopped
+	pthread_mutex_lock(&smutex);
+	do {
+		running= FALSE;
+		for (i= 0, sent= 0; i < started; i++) {
+			sent += ss[i].sent;
+			if (!ss[i].done)
+				running= TRUE;
+			else if (ss[i].result != XFER_OK)
+				stop= TRUE;
+		}
+		pt->total= sent;
+		update_progress(pt, last_c);
+		if (!active || (pt->self != pt) || pt->finished)
+			stop= TRUE;
+		if (running)
+			stripe_timedwait();
+	} while (running);
+	pthread_mutex_unlock(&smutex);
+
+	for (i= 0; i < started; i++) {
+		pthread_join(ss[i].tid, NULL);
+		if (ss[i].result != XFER_OK)
+			res= XFER_ERROR;
+		if ((i > 0) && (ss[i].s >= 0))
+			close(ss[i].s);
+	}
+	return res;
+}
+
+
+/*************************************\
+|* Receiving striped files           *|
+\*************************************/
+
+// Locate the group of a file; must be called with smutex locked
+static Stripe_Group *stripe_find(const struct in6_addr *ip, uint64_t id)
+{
+	GList *list;
+	for (list= groups; list != NULL; list= list->next) {
+		Stripe_Group *g= (Stripe_Group *)list->data;
+		if ((g->id == id) && !memcmp(&g->ip, ip, sizeof(struct in6_addr)))
+			return g;
+	}
+	return NULL;
+}
+
+
+// TRUE if the file 'id' from ip is being received, so another of its connections joins it
+gboolean stripe_rcv_pending(const struct in6_addr *ip, uint64_t id)
+{
+	gboolean found;
+
+	pthread_mutex_lock(&smutex);
+	found= (stripe_find(ip, id) != NULL);
+	pthread_mutex_unlock(&smutex);
+	return found;
+}
+
+
+// Add the connection pt to the group of its file, after the header was received
+// The first connection creates the output file pt->fname with the full length
+gboolean stripe_rcv_join(Thread_Data *pt, const Stripe_Header *sh, const char *nome, const char *f_name)
+{
+	Stripe_Group *g;
+	gboolean owner= FALSE;
+
+	if ((sh->count < 2) || (sh->count > STRIPE_MAX) || (sh->index >= sh->count) || (sh->offset < 0) ||
+			(sh->length < 0) || (sh->offset+sh->length > pt->flen)) {
+		g_print("%s invalid stripe header - aborting\n", pt->name_str);
+		return FALSE;
+	}
+	pthread_mutex_lock(&smutex);
+	if ((g= stripe_find(&pt->ip, sh->id)) == NULL) {
+		g= (Stripe_Group *)calloc(1, sizeof(Stripe_Group));
+		if ((g == NULL) || ((g->fd= open(pt->fname, O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0)) {
+			perror("Error creating file for writing");
+			free(g);
+			pthread_mutex_unlock(&smutex);
+			return FALSE;
+		}
+		// Reserve the whole file at once, so the ranges written in any order do not fragment it
+		if (!file_preallocate(g->fd, 0, pt->flen)) {
+			g_print("%s no disk space for %lld bytes - aborting\n", pt->name_str, pt->flen);
+			close(g->fd);
+			free(g);
+			pthread_mutex_unlock(&smutex);
+			return FALSE;
+		}
+		memcpy(&g->ip, &pt->ip, sizeof(struct in6_addr));
+		g->id= sh->id;
+		g->count= sh->count;
+		g->flen= pt->flen;
+		g->owner= pt;
+		g->tid= (unsigned)pt->tid;
+		groups= g_list_append(groups, g);
+		owner= TRUE;
+		g_print("%s receiving file %s from %s in %d connections\n", pt->name_str, f_name, nome, g->count);
+	} else if ((g->count != sh->count) || (g->flen != pt->flen) || g->taken[sh->index] || g->failed) {
+		pthread_mutex_unlock(&smutex);
+		g_print("%s stripe %d does not match its file - aborting\n", pt->name_str, sh->index);
+		return FALSE;
+	}
+	g->taken[sh->index]= TRUE;
+	g->offset[sh->index]= sh->offset;
+	g->length[sh->index]= sh->length;
+	g->refs++;
+	g->last_io= g_get_monotonic_time();
+	pt->stripe= g;
+	pt->stripe_idx= sh->index;
+	pthread_mutex_unlock(&smutex);
+	file_write_behind_init(&pt->wb, sh->offset);
+
+	if (owner)
+		sched_stripe(&pt->ip, sh->id);	// The other connections of the file may be queued
+	else
+		GUI_remove_thread((unsigned)pt->tid);	// The file is shown in the row of its owner
+	return TRUE;
+}
+
+
+// TRUE if pt owns the file and its GUI row
+gboolean stripe_rcv_owner(Thread_Data *pt)
+{
+	return (pt->stripe != NULL) && (pt->stripe->owner == pt);
+}
+
+
+// Number of bytes of the range of pt still missing
+long long stripe_rcv_left(Thread_Data *pt)
+{
+	Stripe_Group *g= pt->stripe;
+	return g->length[pt->stripe_idx]-g->got[pt->stripe_idx];
+}
+
+
+// Write n bytes received by pt at the next position of its range; FALSE if the file failed
+gboolean stripe_rcv_write(Thread_Data *pt, const char *buf, size_t n)
+{
+	Stripe_Group *g= pt->stripe;
+	int i= pt->stripe_idx;
+	off_t off= g->offset[i]+g->got[i];	// got[i] is only changed by this connection
+	ssize_t m;
+	size_t k;
+	short int c;
+
+	if (g->failed)
+		return FALSE;
+	for (k= 0; k < n; k += m) {
+		if ((m= pwrite(g->fd, buf+k, n-k, off+k)) <= 0) {
+			perror("stripe write");
+			g->failed= TRUE;
+			return FALSE;
+		}
+	}
+	hash_update(&pt->hash, buf, n);
+	// Each connection writes its range sequentially, so it has its own write-behind
+	if (g->got[i]+(long long)n < g->length[i])
+		file_write_behind(&pt->wb, g->fd, off+n);
+	else
+		file_write_behind_end(&pt->wb, g->fd, off+n);
+	pthread_mutex_lock(&smutex);
+	g->got[i] += n;
+	g->total += n;
+	g->last_io= g_get_monotonic_time();
+	c= (int)((g->total*100.0)/g->flen);
+	if ((c != g->last_c) && (g->owner != NULL)) {
+		GUI_update_bytes_sent(g->tid, c);
+		g->last_c= c;
+	}
+	if (g->total >= g->flen)
+		pthread_cond_broadcast(&scond);
+	pthread_mutex_unlock(&smutex);
+	return TRUE;
+}
+
+
+// Receive the range of pt with blocking reads; returns an XFER_* result
+int stripe_rcv_body(Thread_Data *pt, char *buf, size_t len)
+{
+	long long left;
+	ssize_t n;
+
+	while ((left= stripe_rcv_left(pt)) > 0) {
+		if (!active || (pt->self != pt) || pt->finished)
+			return XFER_ERROR;
+		n= read(pt->s, buf, rate_chunk(pt, (left < (long long)len) ? left : len));
+		if ((n < 0) && (errno == EINTR))
+			continue;
+		if (n <= 0) {
+			g_print("%s connection closed before the end of stripe %d\n", pt->name_str, pt->stripe_idx);
+			pt->stripe->failed= TRUE;
+			return XFER_ERROR;
+		}
+		if (!stripe_rcv_write(pt, buf, n))
+			return XFER_ERROR;
+		rate_throttle(pt, n);
+	}
+	return stripe_rcv_verify(pt, pt->hashed ? hash_rcv_trailer(pt->s, &pt->hash) : HASH_UNCHECKED) ?
+			XFER_OK : XFER_ERROR;
+}
+
+
+// Record the result of the check of the digest of the range of pt; FALSE if the file failed
+gboolean stripe_rcv_verify(Thread_Data *pt, int result)
+{
+	Stripe_Group *g= pt->stripe;
+
+	if (result == HASH_MISMATCH)
+		g_print("%s %s of stripe %d does not match the sender - the file is corrupted\n",
+				pt->name_str, HASH_NAME, pt->stripe_idx);
+	else if (result == HASH_NONE)
+		g_print("%s connection closed before the %s of stripe %d\n", pt->name_str, HASH_NAME, pt->stripe_idx);
+	pthread_mutex_lock(&smutex);
+	if (HASH_ACCEPTED(result)) {
+		g->verified[pt->stripe_idx]= TRUE;
+		g->nverified++;
+		g->unchecked |= (result == HASH_UNCHECKED);
+	} else
+		g->failed= TRUE;
+	pthread_cond_broadcast(&scond);
+	pthread_mutex_unlock(&smutex);
+	return HASH_ACCEPTED(result);
+}
+
+
+// State of the whole file; must be called with smutex locked
+static int stripe_status(Thread_Data *pt)
+{
+	Stripe_Group *g= pt->stripe;
+	int res;
+
+	if ((g->total >= g->flen) && (g->nverified == g->count)) {
+		res= XFER_OK;
+	} else if (g->failed || (g_get_monotonic_time()-g->last_io > STRIPE_IDLE_TIMEOUT)) {
+		g->failed= TRUE;
+		res= XFER_ERROR;
+	} else
+		res= STRIPE_RUNNING;
+	if (g->owner == pt) {
+		pt->total= g->total;
+		if (res == XFER_OK)
+			pt->verified= g->unchecked ? HASH_UNCHECKED : HASH_OK;
+	}
+	return res;
+}
+
+
+// State of the whole file: XFER_OK, XFER_ERROR or STRIPE_RUNNING; the owner gets the total in pt->total
+int stripe_rcv_status(Thread_Data *pt)
+{
+	int res;
+
+	pthread_mutex_lock(&smutex);
+	res= stripe_status(pt);
+	pthread_mutex_unlock(&smutex);
+	return res;
+}
+
+
+// Wait until the other connections complete the file; returns an XFER_* result
+int stripe_rcv_wait(Thread_Data *pt)
+{
+	int res;
+
+	pthread_mutex_lock(&smutex);
+	while ((res= stripe_status(pt)) == STRIPE_RUNNING) {
+		if (!active || (pt->self != pt) || pt->finished) {
+			res= XFER_ERROR;
+			break;
+		}
+		stripe_timedwait();
+	}
+	pthread_mutex_unlock(&smutex);
+	return res;
+}
+
+
+// Leave the group when pt is freed; returns TRUE if pt owned the GUI row
+// The output file is closed when the last connection leaves
+gboolean stripe_leave(Thread_Data *pt)
+{
+	Stripe_Group *g= pt->stripe;
+	gboolean owner= FALSE;
+
+	pthread_mutex_lock(&smutex);
+	if (!g->verified[pt->stripe_idx])
+		g->failed= TRUE;
+	if (g->owner == pt) {
+		g->owner= NULL;
+		if (g->total < g->flen)
+			g->failed= TRUE;
+		owner= TRUE;
+	}
+	if (g->failed)
+		pthread_cond_broadcast(&scond);
+	if (--g->refs == 0) {
+		groups= g_list_remove(groups, g);
+		close(g->fd);
+		free(g);
+	}
+	pthread_mutex_unlock(&smutex);
+	pt->stripe= NULL;
+	return owner;
+}
@@ -0,0 +1,80 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * stripe.h
+ *
+ * Header file of the striped (multi-connection) file transfers
+ *
+ * The sender splits a large file in ranges and sends each one over its own TCP
+ * connection. Each connection starts with a header carrying its Stripe_Header
+ * (see header.h). The receiver groups the connections with the same peer and
+ * identifier and writes each range with pwrite. Each range
+ * ends with the digest of its bytes (see hash.h).
+ \*****************************************************************************/
+#ifndef STRIPE_INC_
+#define STRIPE_INC_
+
+#include <glib.h>
+#include <stdint.h>
+
+#include "callbacks.h"
+
+#define STRIPE_MAX			16					// Maximum number of connections per file
+#define STRIPE_MIN_SIZE		(8LL*1024*1024)		// Smaller files are sent over one connection
+#define STRIPE_CHUNK		(1024*1024)			// Maximum bytes sent per system call
+#define STRIPE_IDLE_TIMEOUT	10000000LL			// Abort files without progress for 10 s (usec)
+
+#define STRIPE_RUNNING		1					// Result of stripe_rcv_status: more data missing
+
+
+// Range carried in the header (HEADER_STRIPE), in host byte order like the rest of the header
+typedef struct {
+	uint64_t id;		// File identifier, chosen by the sender
+	int64_t offset;		// First byte of the range
+	int64_t length;		// Number of bytes of the range
+	uint16_t index;		// Range number
+	uint16_t count;		// Number of ranges of the file
+	uint32_t reserved;	// Sent as zero
+} Stripe_Header;
+
+// Number of connections used to send large files; 1 disables striping
+extern int stripes;
+
+
+/*************************************\
+|* Sending striped files             *|
+\*************************************/
+
+// TRUE if the file of pt should be striped
+gboolean stripe_wanted(Thread_Data *pt);
+// Send the file pt->f over 'stripes' connections, the first one pt->s; returns an XFER_* result
+int stripe_send_file(Thread_Data *pt, short int *last_c);
+
+
+/*************************************\
+|* Receiving striped files           *|
+\*************************************/
+
+// TRUE if the file 'id' from ip is being received, so another of its connections joins it
+gboolean stripe_rcv_pending(const struct in6_addr *ip, uint64_t id);
+// Add the connection pt to the group of its file, after the header was received
+gboolean stripe_rcv_join(Thread_Data *pt, const Stripe_Header *sh, const char *nome, const char *f_name);
+// TRUE if pt owns the file and its GUI row
+gboolean stripe_rcv_owner(Thread_Data *pt);
+// Number of bytes of the range of pt still missing
+long long stripe_rcv_left(Thread_Data *pt);
+// Write n bytes received by pt at the next position of its range; FALSE if the file failed
+gboolean stripe_rcv_write(Thread_Data *pt, const char *buf, size_t n);
+// Record the result (HASH_*) of the check of the digest of the range of pt; FALSE if the file failed
+gboolean stripe_rcv_verify(Thread_Data *pt, int result);
+// Receive the range of pt and its digest with blocking reads; returns an XFER_* result
+int stripe_rcv_body(Thread_Data *pt, char *buf, size_t len);
+// State of the whole file: XFER_OK, XFER_ERROR or STRIPE_RUNNING; the owner gets the total in pt->total
+int stripe_rcv_status(Thread_Data *pt);
+// Wait until the other connections complete the file; returns an XFER_* result
+int stripe_rcv_wait(Thread_Data *pt);
+// Leave the group when pt is freed; returns TRUE if pt owned the GUI row
+gboolean stripe_leave(Thread_Data *pt);
+
+#endif
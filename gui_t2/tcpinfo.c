@@ -0,0 +1,238 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * tcpinfo.c
+ *
+ * TCP_INFO sampler of the transfers
+ *
+ * The sampler reads the sockets with the list of transfers locked, so a
+ * socket is not closed while it is read (free_file_thread_desc removes the
+ * transfer from the list before closing it). A transfer that hands its
+ * connection over to the next file ends its series before, while it is still
+ * in the list, so the series are also protected by smutex. The fields that
+ * the running kernel does not fill are left at 0.
+ \*****************************************************************************/
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/tcp.h>
+#include <linux/sockios.h>
+
+#include "tcpinfo.h"
+#include "callbacks.h"
+#include "gui.h"
+#include "peers.h"
+
+
+int tcpinfo_period= TCPINFO_DEFAULT_PERIOD;		// Period of the samples (ms)
+
+static pthread_mutex_t smutex= PTHREAD_MUTEX_INITIALIZER;	// Protects the series of the transfers
+
+
+/*************************************\
+|* Samples                           *|
+\*************************************/
+
+// Read the state of socket s into smp; returns FALSE if it is not a TCP connection
+static gboolean read_sample(int s, Tcpinfo_Sample *smp)
+{
+	struct tcp_info ti;
+	socklen_t len= sizeof(ti);
+	int q;
+
+	memset(&ti, 0, sizeof(ti));
+	if (getsockopt(s, IPPROTO_TCP, TCP_INFO, &ti, &len))
+		return FALSE;
+	smp->rtt= ti.tcpi_rtt;
+	smp->rttvar= ti.tcpi_rttvar;
+	smp->cwnd= ti.tcpi_snd_cwnd;
+	smp->mss= ti.tcpi_snd_mss;
+	smp->retrans= ti.tcpi_total_retrans;
+	smp->delivery_rate= ti.tcpi_delivery_rate;
+	smp->notsent= ti.tcpi_notsent_bytes;
+	smp->rcv_space= ti.tcpi_rcv_space;
+	smp->busy= ti.tcpi_busy_time;
+	smp->rwnd_limited= ti.tcpi_rwnd_limited;
+	smp->sndbuf_limited= ti.tcpi_sndbuf_limited;
+	smp->sndq= ioctl(s, SIOCOUTQ, &q) ? 0 : q;
+	return TRUE;
+}
+
+
+// Sample the connection of pt and keep the sample in its series
+// Must be called with smutex locked
+static void sample(Thread_Data *pt)
+{
+	Tcpinfo_Series *se= pt->tcpinfo;
+	long long now= g_get_monotonic_time();
+	Tcpinfo_Sample smp;
+	int i;
+
+	if ((pt->s <= 0) || !read_sample(pt->s, &smp))
+		return;
+	if ((se == NULL) && ((se= pt->tcpinfo= (Tcpinfo_Series *)calloc(1, sizeof(Tcpinfo_Series))) == NULL))
+		return;
+	if (se->n == 0) {
+		se->start= now;
+		se->stride= 1;
+	}
+	smp.t= now-se->start;
+	smp.total= pt->total;
+	if (++se->skip < se->stride)
+		return;
+	se->skip= 0;
+	if (se->n == TCPINFO_MAX_SAMPLES) {
+		// Keep half of the samples, evenly spaced, and take half as many from now on
+		for (i= 0; i < TCPINFO_MAX_SAMPLES/2; i++)
+			se->s[i]= se->s[2*i];
+		se->n= TCPINFO_MAX_SAMPLES/2;
+		se->stride *= 2;
+	}
+	se->s[se->n++]= smp;
+}
+
+
+// Sample one transfer and show the values in the table
+static void sample_transfer(Thread_Data *pt, void *data)
+{
+	Tcpinfo_Sample last;
+
+	if ((pt->self != pt) || pt->finished)
+		return;
+	pthread_mutex_lock(&smutex);
+	sample(pt);
+	if ((pt->tcpinfo == NULL) || (pt->tcpinfo->n == 0)) {
+		pthread_mutex_unlock(&smutex);
+		return;
+	}
+	last= pt->tcpinfo->s[pt->tcpinfo->n-1];
+	pthread_mutex_unlock(&smutex);
+	GUI_update_thread_tcp((unsigned)pt->tid, last.rtt/1000.0, last.cwnd, last.retrans,
+			last.delivery_rate*8/1000000.0, last.sndq/1024);
+}
+
+
+// Sampler thread
+static void *sampler(void *ptr)
+{
+	while (tcpinfo_period > 0) {
+		usleep(tcpinfo_period*1000);
+		if (active)
+			foreach_file_thread(sample_transfer, NULL);
+	}
+	return NULL;
+}
+
+
+// Start the sampler thread, if tcpinfo_period > 0
+void tcpinfo_start(void)
+{
+	pthread_t tid;
+
+	if (tcpinfo_period <= 0)
+		return;
+	if (pthread_create(&tid, NULL, sampler, NULL)) {
+		perror("starting the TCP_INFO sampler");
+		return;
+	}
+	pthread_detach(tid);
+}
+
+
+// Give the RTT of a connection that sent a file to the registry of peers, which
+//   chooses the address of the peer (IPv4 or IPv6) with it
+static void report_rtt(Thread_Data *pt)
+{
+	Tcpinfo_Sample smp;
+	char ip[INET6_ADDRSTRLEN];
+
+	if (!pt->sending || (pt->s <= 0) || !read_sample(pt->s, &smp))
+		return;
+	if (IN6_IS_ADDR_V4MAPPED(&pt->ip))
+		inet_ntop(AF_INET, &pt->ip.s6_addr[12], ip, sizeof(ip));
+	else
+		inet_ntop(AF_INET6, &pt->ip, ip, sizeof(ip));
+	peers_rtt(ip, pt->port, smp.rtt);
+}
+
+
+/*************************************\
+|* Time series                       *|
+\*************************************/
+
+// Tell where a sender spent the time between the first and the last sample
+static void log_summary(Thread_Data *pt, Tcpinfo_Series *se, const char *path)
+{
+	Tcpinfo_Sample *a= &se->s[0], *b= &se->s[se->n-1];
+	double elapsed= (double)(b->t-a->t);
+	double busy= (double)(b->busy-a->busy);
+	double rwnd= (double)(b->rwnd_limited-a->rwnd_limited);
+	double sndbuf= (double)(b->sndbuf_limited-a->sndbuf_limited);
+	double cwnd= busy-rwnd-sndbuf;
+	double app= elapsed-busy;
+	char buf[400];
+
+	if (elapsed <= 0)
+		return;
+	snprintf(buf, sizeof(buf), "%sTCP rtt %.1f ms, %u retransmits - limited by: congestion window %.0f%%, "
+			"receiver window %.0f%%, send buffer %.0f%%, application or disk %.0f%% - samples in %s\n",
+			pt->name_str, b->rtt/1000.0, b->retrans-a->retrans, (cwnd > 0) ? 100*cwnd/elapsed : 0,
+			100*rwnd/elapsed, 100*sndbuf/elapsed, (app > 0) ? 100*app/elapsed : 0, path);
+	Log(buf);
+}
+
+
+// Take the last sample, write the series of pt and free it
+// Must be called while pt->s is still open; does nothing if the series was already written
+void tcpinfo_end(Thread_Data *pt)
+{
+	Tcpinfo_Series *se;
+	Tcpinfo_Sample *smp;
+	char path[300];
+	FILE *f;
+	int i;
+
+	report_rtt(pt);
+	pthread_mutex_lock(&smutex);
+	if ((se= pt->tcpinfo) != NULL) {
+		// The last sample is always kept
+		se->skip= se->stride;
+		sample(pt);
+		pt->tcpinfo= NULL;
+	}
+	pthread_mutex_unlock(&smutex);
+	if (se == NULL)
+		return;
+	if ((se->n < 2) || (out_dir == NULL)) {
+		free(se);
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/tcpinfo-%s-%u.csv", out_dir, pt->sending ? "snd" : "rcv", (unsigned)pt->tid);
+	if ((f= fopen(path, "w")) == NULL) {
+		perror("writing the TCP_INFO samples");
+		free(se);
+		return;
+	}
+	fprintf(f, "# %s%s, %lld of %lld bytes\n", pt->name_str, pt->fname, pt->total, pt->flen);
+	fprintf(f, "t_ms,bytes,rtt_ms,rttvar_ms,cwnd,mss,retrans,delivery_mbps,sndq,notsent,rcv_space,"
+			"busy_ms,rwnd_limited_ms,sndbuf_limited_ms\n");
+	for (i= 0; i < se->n; i++) {
+		smp= &se->s[i];
+		fprintf(f, "%.1f,%lld,%.3f,%.3f,%u,%u,%u,%.3f,%u,%u,%u,%.1f,%.1f,%.1f\n",
+				smp->t/1000.0, smp->total, smp->rtt/1000.0, smp->rttvar/1000.0, smp->cwnd, smp->mss,
+				smp->retrans, smp->delivery_rate*8/1000000.0, smp->sndq, smp->notsent, smp->rcv_space,
+				smp->busy/1000.0, smp->rwnd_limited/1000.0, smp->sndbuf_limited/1000.0);
+	}
+	fclose(f);
+	if (pt->sending)
+		log_summary(pt, se, path);
+	free(se);
+}
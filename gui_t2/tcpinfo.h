@@ -0,0 +1,67 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * tcpinfo.h
+ *
+ * Header file of the TCP_INFO sampler of the transfers
+ *
+ * A sampler thread reads TCP_INFO on the socket of every transfer each
+ * tcpinfo_period ms, shows the last values in the table of transfers and
+ * keeps them, with the bytes moved, in a series per transfer. When the
+ * transfer ends the series is written to out_dir/tcpinfo-<snd|rcv>-<tid>.csv
+ * and a summary tells where the sender spent its time: waiting for the
+ * receiver window, for the send buffer, or for the application (disk, rate
+ * limits); the rest is the congestion window. The RTT of every file sent is
+ * also given to the registry of peers, to choose the address of each peer.
+ \*****************************************************************************/
+#ifndef TCPINFO_INC_
+#define TCPINFO_INC_
+
+#include <glib.h>
+#include <stdint.h>
+
+#include "callbacks.h"
+
+#define TCPINFO_DEFAULT_PERIOD	500		// Period of the samples (ms)
+#define TCPINFO_MAX_SAMPLES		1024	// Samples kept per transfer; beyond that every
+										//   other sample is dropped and the period doubles
+
+// Period of the samples (ms); 0 turns the sampler off
+extern int tcpinfo_period;
+
+// One sample of a connection
+typedef struct {
+	long long t;				// Time since the first sample (usec)
+	long long total;			// Bytes of the file moved (pt->total)
+	uint32_t rtt;				// Smoothed RTT and its variation (usec)
+	uint32_t rttvar;
+	uint32_t cwnd;				// Congestion window (segments)
+	uint32_t mss;
+	uint32_t retrans;			// Segments retransmitted since the connection started
+	uint64_t delivery_rate;		// Last delivery rate measured (bytes/s)
+	uint32_t sndq;				// Bytes in the send buffer: not sent or not acknowledged
+	uint32_t notsent;			// Bytes in the send buffer not sent yet
+	uint32_t rcv_space;			// Receive window the receiver is autotuning (bytes)
+	uint64_t busy;				// Time with data in flight (usec), and part of it limited by
+	uint64_t rwnd_limited;		//   the receiver window and by the send buffer
+	uint64_t sndbuf_limited;
+} Tcpinfo_Sample;
+
+// Samples of one transfer
+typedef struct Tcpinfo_Series {
+	long long start;			// Time of the first sample (usec)
+	int n;						// Samples kept
+	int stride;					// Samples taken per sample kept
+	int skip;					// Samples not kept since the last one
+	Tcpinfo_Sample s[TCPINFO_MAX_SAMPLES];
+} Tcpinfo_Series;
+
+
+// Start the sampler thread, if tcpinfo_period > 0
+void tcpinfo_start(void);
+// Take the last sample, write the series of pt and free it, and give the RTT of a file sent to peers.c
+// Must be called while pt->s is still open; does nothing if the series was already written
+void tcpinfo_end(Thread_Data *pt);
+
+#endif
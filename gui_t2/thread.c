@@ -12,8 +12,10 @@
 #ifdef HAVE_CONFIG_H
 #  include <config.h>
 #endif
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		// splice, F_SETPIPE_SZ and RUSAGE_THREAD
+#endif
 
-#include <gtk/gtk.h>
 #include <glib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -29,13 +31,28 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
 
 
 #include "thread.h"
+#include "engine.h"
+#include "uring.h"
+#include "pipeline.h"
+#include "stripe.h"
+#include "resume.h"
+#include "header.h"
+#include "pool.h"
+#include "scheduler.h"
+#include "tune.h"
+#include "tcpinfo.h"
+#include "hash.h"
+#include "rate.h"
 #include "callbacks.h"
 #include "sock.h"
 #include "file.h"
 #include "gui.h"
+#include "peers.h"
 #include <netinet/tcp.h>
 
 #ifdef DEBUG
@@ -44,7 +61,18 @@
 #define debugstr(x)
 #endif
 
-#define SLOW_SLEEPTIME	500000		// Sleep time between reads and writes in slow sending
+#define SND_BUFLEN		63*1024		// Block size of the buffered sending loop
+#define RCV_BUFLEN		63*1024		// Block size of the buffered receiving loop
+#define SENDFILE_CHUNK	(1024*1024)	// Maximum bytes moved by each sendfile call
+#define SPLICE_PIPE_SIZE (1024*1024)	// Capacity requested for the splice pipe
+
+
+// Data path used for the file body (selected in the command line)
+int snd_mode= XFER_MODE_ZEROCOPY;
+int rcv_mode= XFER_MODE_ZEROCOPY;
+
+// Holds receiving threads until start_rcv_file_thread registered them in the GUI
+static pthread_mutex_t rmutex = PTHREAD_MUTEX_INITIALIZER;
 
 
 /*******************************************************\
@@ -67,31 +95,190 @@
 							 }
 
 
+// Update the percentage shown in the GUI table, if it changed since the last update
+void update_progress(Thread_Data *pt, short int *last_c)
+{
+	short int c= (pt->flen > 0) ? (int)((pt->total*100.0)/pt->flen) : 100;
+	if (c != *last_c) {
+		GUI_update_bytes_sent((unsigned)pt->tid, c);
+		*last_c= c;
+		// The journal of a received file follows the bytes already here
+		if (!pt->sending && pt->journal)
+			resume_checkpoint(pt);
+	}
+}
+
+
+// Send the file body from pt->f to pt->s with sendfile(2), moving data directly from
+//   the page cache to the socket without copying it through user space
+// Returns XFER_UNSUPPORTED if the kernel refused sendfile before any byte was sent
+static int send_body_sendfile(Thread_Data *pt, short int *last_c)
+{
+	int fd= fileno(pt->f);
+	off_t off= pt->total;	// Resumed transfers start after the bytes already sent
+	ssize_t n;
+
+	while (active && (pt->self == pt) && !pt->finished && (pt->total < pt->flen)) {
+		size_t left= (size_t)(pt->flen - pt->total);
+		size_t chunk= rate_chunk(pt, SENDFILE_CHUNK);	// Read again: the limit may change
+		n= sendfile(pt->s, fd, &off, (left < chunk) ? left : chunk);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((pt->total == pt->offset) && ((errno == EINVAL) || (errno == ENOSYS) || (errno == EOPNOTSUPP)))
+				return XFER_UNSUPPORTED;
+			perror("sendfile");
+			return XFER_ERROR;
+		}
+		if (n == 0) {
+			// File shrank while it was being sent
+			g_print("%s file ended before the announced length\n", pt->name_str);
+			return XFER_ERROR;
+		}
+		// The pages just sent are still in the page cache
+		if (pt->hashed && !hash_update_fd(&pt->hash, fd, off-n, n))
+			return XFER_ERROR;
+		pt->total += n;
+		update_progress(pt, last_c);
+		rate_throttle(pt, n);
+	}
+	return XFER_OK;
+}
+
+
+// Receive the file body from pt->s into pt->fd with splice(2), moving the socket pages
+//   through a pipe to the file without copying them through user space
+// Returns XFER_UNSUPPORTED if the kernel refused splice before any byte was received
+static int rcv_body_splice(Thread_Data *pt, short int *last_c)
+{
+	int p[2];
+	ssize_t n, m, k;
+	size_t chunk= SPLICE_PIPE_SIZE;
+	int res= XFER_OK;
+
+	if (pipe(p))
+		return XFER_UNSUPPORTED;
+	if (fcntl(p[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE) < 0)
+		chunk= RCV_BUFLEN;	// Keep the default pipe capacity
+
+	while (active && (pt->self == pt) && !pt->finished && (pt->total < pt->flen)) {
+		size_t left= MIN((size_t)(pt->flen - pt->total), rate_chunk(pt, chunk));
+		n= splice(pt->s, NULL, p[1], NULL, left, SPLICE_F_MOVE|SPLICE_F_MORE);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((pt->total == pt->offset) && ((errno == EINVAL) || (errno == ENOSYS)))
+				res= XFER_UNSUPPORTED;
+			else {
+				perror("splice from socket");
+				res= XFER_ERROR;
+			}
+			break;
+		}
+		if (n == 0) {
+			g_print("%s connection closed by the sender\n", pt->name_str);
+			res= XFER_ERROR;
+			break;
+		}
+		// Drain the pipe to the file
+		for (k= n; k > 0; k -= m) {
+			m= splice(p[0], NULL, pt->fd, NULL, k, SPLICE_F_MOVE);
+			if (m <= 0) {
+				if ((m < 0) && (errno == EINTR)) {
+					m= 0;
+					continue;
+				}
+				perror("splice to file");
+				res= XFER_ERROR;
+				break;
+			}
+			pt->total += m;
+		}
+		// Hash the bytes written, read back from the page cache, only if asked to
+		if ((res == XFER_OK) && hash_zerocopy && !hash_update_fd(&pt->hash, pt->fd, pt->total-n, n))
+			res= XFER_ERROR;
+		if (res != XFER_OK)
+			break;
+		file_write_behind(&pt->wb, pt->fd, pt->total);
+		update_progress(pt, last_c);
+		rate_throttle(pt, n);
+	}
+	close(p[0]);
+	close(p[1]);
+	return res;
+}
+
+
+// Return the CPU time (user+system) used by the calling thread, in usec
+static long thread_cpu_usec(void)
+{
+	struct rusage ru;
+	if (getrusage(RUSAGE_THREAD, &ru))
+		return 0;
+	return (ru.ru_utime.tv_sec+ru.ru_stime.tv_sec)*1000000L + ru.ru_utime.tv_usec+ru.ru_stime.tv_usec;
+}
+
+
+// Log the duration, throughput and CPU time used by a transfer
+// cpu < 0 means the CPU time is not available (transfers sharing a thread)
+void log_transfer_stats(Thread_Data *pt, const char *dir, const char *mode,
+		long diff, long cpu)
+{
+	char buf[256];
+	long long bytes= pt->total-pt->offset;	// A resumed transfer only moved the rest of the file
+	double rate= (diff > 0) ? (bytes*1000000.0/diff) : 0.0;
+	int n= sprintf(buf, "%s%s ended (%s) - %lld bytes in %ld usec - %.0f bytes/s",
+			pt->name_str, dir, mode, bytes, diff, rate);
+	if (pt->offset > 0)
+		n += sprintf(buf+n, " - resumed at byte %lld", pt->offset);
+	if (pt->verified == HASH_UNCHECKED)
+		n += sprintf(buf+n, " - %s not checked", HASH_NAME);
+	else if (pt->verified != HASH_NONE)
+		n += sprintf(buf+n, " - %s %s", HASH_NAME, (pt->verified == HASH_OK) ? "ok" : "MISMATCH");
+	if (cpu >= 0)
+		sprintf(buf+n, " - cpu %ld usec\n", cpu);
+	else
+		sprintf(buf+n, "\n");
+	Log(buf);
+}
+
+
 // Starts a thread for receiving a file
 void *rcv_file_thread (void *ptr)
 {
 	assert(ptr!=NULL);
 	Thread_Data *pt= (Thread_Data *)ptr;
 
-#define RCV_BUFLEN 63*1024
 	// Starts a thread that receives data from the TCP socket
 	char buf[RCV_BUFLEN+1];
-	char nome_p[129];
-	char f_name[256];
-	short int slen;
-	short int flen;
+	Packed_Header h;
+	const char *nome_p;
+	const char *f_name;
 	long n, m;
-	short int c, last_c;
+	short int c, last_c= 0;
 	struct timeval tv1, tv2;
 	struct timezone tz;
 	long diff= 0;
+	long cpu;
 	struct timeval tv;
-	long len = 63*1024;
+	int res= XFER_UNSUPPORTED;
+	const char *mode= "buffered";
+	char mode_str[80];
+	Pipeline_Stats stalls;
+	Stripe_Header sh;
+	gboolean striped= FALSE;
+	gboolean resumable= FALSE;
+	gboolean spliced= FALSE;	// Body moved by splice, without hashing it (no hash_zerocopy)
+	gboolean unhashed;
 
 	// *************************************************************************************
 	// *      THREAD                                                                   *
 	// *************************************************************************************
 
+	// The row of a stripe may be removed from the GUI, so it must be there first
+	pthread_mutex_lock(&rmutex);
+	pthread_mutex_unlock(&rmutex);
+
 	sprintf(pt->name_str, "RCV(%u)> ", (unsigned)pt->tid);
 	fprintf(stderr, "%s started receiving thread (tid = %u)\n", pt->name_str, (unsigned)pt->tid);
 	buf[RCV_BUFLEN]= '\0';
@@ -99,133 +286,183 @@ void *rcv_file_thread (void *ptr)
 	// Don't forget to configure your socket to define a timeout time for reading operations and
 	// to set buffers or other any configuration that maximizes throughput
 
-	// configure rcv buffer size
-	setsockopt(pt->s, SOL_SOCKET, SO_RCVBUF, &len, sizeof(len));
+	// configure the socket profile; the receive buffer is left to the kernel autotuning
+	tune_socket(pt->s, TUNE_RCV, pt->name_str);
 	// configure timeout -> 10 seconds
 	tv.tv_sec = 10;
+	tv.tv_usec = 0;
 	setsockopt(pt->s, SOL_SOCKET, SO_RCVTIMEO,(struct timeval *)&tv,sizeof(struct timeval));
 
-	// Receive header
-	// Read and validate the user name length
-	if (!active || (pt->self != pt) || pt->finished || read(pt->s, &slen, sizeof(slen)) != sizeof(slen)) {
-		g_print("%s did not receive the user name length - aborting\n", pt->name_str);
-		STOP_THREAD(pt);
-	}
-	if (slen> 129) {
-		g_print("%s invalid user name length - aborting\n", pt->name_str);
-		STOP_THREAD(pt);
-	}
-
-	// Read and validate the user name
-	if (!active || (pt->self != pt) || pt->finished || read(pt->s, nome_p, slen) != slen) {
-		g_print("%s did not receive the user name - aborting\n", pt->name_str);
+	// Receive the header, with the fields of the file and the extensions used
+	// A kept connection closed by the sender (HEADER_CLOSED) just ends here
+	if (!active || (pt->self != pt) || pt->finished || (header_rcv(pt->s, &h, pt->name_str) != HEADER_OK))
 		STOP_THREAD(pt);
-	}
-	if (nome_p[slen-1] != '\0') {
-		g_print("%s user name does not have '\\0'- aborting\n", pt->name_str);
-		STOP_THREAD(pt);
-	}
+	striped= (h.flags & HEADER_STRIPE) != 0;
+	resumable= !striped && (h.flags & HEADER_RESUME);
+	pt->keep= !striped && (h.flags & HEADER_KEEP);
+	pt->hashed= !(h.flags & HEADER_NOHASH);
+	memcpy(&sh, &h.stripe, sizeof(sh));
+	nome_p= h.user;
+	f_name= h.fname;
+	pt->flen= h.size;
 
-	// TASK 5:
-	// Complete the reading thread code
+	// update gui with read fields
+	GUI_update_thread_info((unsigned)pt->tid, nome_p, f_name);
 
-	// Read the file name length
-	if (!active || (pt->self != pt) || pt->finished || read(pt->s, &flen, sizeof(flen)) != sizeof(flen)) {
-		g_print("%d did not receive the file name length - aborting\n", flen);
-		STOP_THREAD(pt);
-	}
-	if (flen > 257) {
-		g_print("%d invalid file name length - aborting\n", flen);
-		STOP_THREAD(pt);
-	}
+	g_print("%s receiving file %s from %s with %lld bytes\n", pt->name_str, f_name, nome_p, pt->flen);
 
-	// Read the file name
-	if (!active || (pt->self != pt) || pt->finished || read(pt->s, f_name, flen) != flen) {
-		g_print("%s did not receive the file name - aborting\n", pt->fname);
-		STOP_THREAD(pt);
-	}
-	if (f_name[flen-1] != '\0') {
-		g_print("%s invalid file name - aborting\n", pt->fname);
+	// Stripes are written in the file created by the first connection of the file
+	if (striped && !stripe_rcv_join(pt, &sh, nome_p, f_name))
 		STOP_THREAD(pt);
-	}
 
-	// Read the file length and store it in pt->flen
-	if (!active || (pt->self != pt) || pt->finished || read(pt->s, &pt->flen, sizeof(pt->flen)) != sizeof(pt->flen)) {
-		g_print("%lld did not receive the file name - aborting\n", pt->flen);
-		STOP_THREAD(pt);
-	}
-	if (pt->flen < 0) {
-		g_print("%lld invalid file length - aborting\n", pt->flen);
+	// Tell the sender how much of the file is already here and open it at the offset chosen
+	if (resumable && !resume_rcv_negotiate(pt, nome_p, f_name)) {
+		g_print("%s failed negotiating the resume offset - aborting\n", pt->name_str);
 		STOP_THREAD(pt);
 	}
 
-	// update gui with read fields
-	GUI_update_thread_info((unsigned)pt->tid, nome_p, f_name);
-
-	g_print("%s receiving file %s from %s with %lld bytes\n", pt->name_str, f_name, nome_p, pt->flen);
-
 	// Open file for writing
-	if ((pt->f= fopen(pt->fname, "w")) == NULL) {
+	// The splice loop reads back the bytes written to hash them
+	if (!striped && !resumable && ((pt->fd= open(pt->fname, O_RDWR|O_CREAT|O_TRUNC, 0666)) < 0)) {
 		perror("Error creating file for writing");
 		fprintf(stderr, "%s failed to create file '%s' for writing\n", pt->name_str, pt->fname);
 		STOP_THREAD(pt);
 	}
+	// Reserve the rest of the file at once, instead of growing it write by write
+	if (!striped && !file_preallocate(pt->fd, pt->offset, pt->flen-pt->offset)) {
+		g_print("%s no disk space for %lld bytes - aborting\n", pt->name_str, pt->flen-pt->offset);
+		STOP_THREAD(pt);
+	}
 
 	// Memorize the time when transmission started
 	if (gettimeofday(&tv1, &tz))
 		Log("Error getting the time to start reception\n");
-
-	// Receive file from pt->s and store it in the output file pt->f
-	// See the file copy example in the documentation, and adapt to a socket scenario ...
-	// Loop forever until end of file
-	do {
-		// read from buffer
-		n = read(pt->s, buf, RCV_BUFLEN);
-		// add bytes read to pt->total
-		pt->total += n;
-		// if read was sucessfull
-		if (n > 0){
-			if ((m = fwrite(buf, 1, n, pt->f) != n))
-				break;
-		}
-		// if not sucessfull
+	cpu= thread_cpu_usec();
+
+	// Receive file from pt->s and store it in the output file pt->fd
+	// Use the selected engine; io_uring falls back to splice, and splice to the buffered loop
+	if (striped) {
+		res= stripe_rcv_body(pt, buf, RCV_BUFLEN);
+		// Only the owner of the file waits for the other connections and logs the statistics
+		if ((res == XFER_OK) && !stripe_rcv_owner(pt))
+			STOP_THREAD(pt);
+		if (res == XFER_OK)
+			res= stripe_rcv_wait(pt);
+		mode= "striped";
+	}
+	if ((res == XFER_UNSUPPORTED) && (rcv_mode == XFER_MODE_URING)) {
+		res= uring_rcv_body(pt, &last_c);
+		if (res == XFER_UNSUPPORTED)
+			g_print("%s io_uring not available - using splice\n", pt->name_str);
+		else
+			mode= "io_uring";
+	}
+	if ((res == XFER_UNSUPPORTED) && (rcv_mode == XFER_MODE_PIPELINED)) {
+		res= pipeline_rcv_body(pt, &last_c, &stalls);
+		if (res == XFER_UNSUPPORTED)
+			g_print("%s no memory for the pipeline - using buffered copy\n", pt->name_str);
 		else {
-			if(n == 0)
-				g_print("transfer completed\n");
-			if(n < 0) {
-				g_print("transfer error\n");
-				STOP_THREAD(pt);
-			}
+			sprintf(mode_str, "pipelined - stalls: disk %lld, network %lld", stalls.disk, stalls.net);
+			mode= mode_str;
 		}
-		// calculate the percentage of file already sent
-		c = (int)((pt->total*100.0)/pt->flen);
-		// if the percentage changed since last iteration
-		if(c != last_c){
-			GUI_update_bytes_sent((unsigned)pt->tid, c);
-			last_c = c;
+	}
+	if ((res == XFER_UNSUPPORTED) && ((rcv_mode == XFER_MODE_ZEROCOPY) || (rcv_mode == XFER_MODE_URING))) {
+		// The splice loop does not hash the bytes, unless asked to
+		unhashed= pt->unhashed;
+		pt->unhashed= unhashed || !hash_zerocopy;
+		res= rcv_body_splice(pt, &last_c);
+		if (res == XFER_UNSUPPORTED) {
+			pt->unhashed= unhashed;
+			g_print("%s splice not supported - using buffered copy\n", pt->name_str);
+		} else {
+			mode= "splice";
+			spliced= !hash_zerocopy;
 		}
-		// if percentage reaches 100, flag finished activated
-		if (c == 100)
-			pt->finished = 1;
-		// if slow mode activated
-		if (pt->slow)
-			usleep(SLOW_SLEEPTIME);
-	 } while (active && (n > 0) && (pt->flen - pt->total) > 0 && !pt->finished);
-	// while the EOF isn't reached or flag finished not true
+	}
+	if (res == XFER_UNSUPPORTED) {
+		// Loop forever until end of file
+		do {
+			// read from buffer, without reading the trailer after the body
+			n = read(pt->s, buf, MIN(rate_chunk(pt, RCV_BUFLEN), pt->flen - pt->total));
+			// if read was sucessfull
+			if (n > 0){
+				if ((m = write(pt->fd, buf, n)) != n) {
+					perror("Error writing file");
+					STOP_THREAD(pt);
+				}
+				hash_update(&pt->hash, buf, n);
+				// add bytes written to pt->total
+				pt->total += n;
+				file_write_behind(&pt->wb, pt->fd, pt->total);
+			}
+			// if not sucessfull: the body ended before its length
+			else if ((n < 0) || (pt->total < pt->flen)) {
+				if (n == 0)
+					g_print("%s connection closed by the sender\n", pt->name_str);
+				else
+					perror("read from socket");
+				res= XFER_ERROR;
+			}
+			// calculate the percentage of file already sent
+			c = (pt->flen > 0) ? (int)((pt->total*100.0)/pt->flen) : 100;
+			// if the percentage changed since last iteration
+			if(c != last_c){
+				GUI_update_bytes_sent((unsigned)pt->tid, c);
+				last_c = c;
+				if (pt->journal)
+					resume_checkpoint(pt);
+			}
+			// if percentage reaches 100, flag finished activated
+			if (c == 100)
+				pt->finished = 1;
+			// wait while over the rate limits
+			if (n > 0)
+				rate_throttle(pt, n);
+		} while (active && (n > 0) && (pt->flen - pt->total) > 0 && !pt->finished);
+		// while the EOF isn't reached or flag finished not true
+	}
+	// Every engine reports a body cut short in the same way
+	if (res == XFER_ERROR) {
+		g_print("%s failed receiving the file contents - aborting\n", pt->name_str);
+		STOP_THREAD(pt);
+	}
 
-	//close fill and clear pointer
-	fclose(pt->f);
-	pt->f= NULL;
+	// Compare the digest sent after the body with the hash of the bytes received
+	// A body sent or received without hashing it is accepted as not checked
+	if (!striped && (pt->total >= pt->flen)) {
+		if (!pt->hashed)
+			pt->verified= HASH_UNCHECKED;
+		else if (((pt->verified= hash_rcv_trailer(pt->s, &pt->hash)) != HASH_NONE) && spliced)
+			pt->verified= HASH_UNCHECKED;
+	}
+	if (pt->verified == HASH_MISMATCH)
+		g_print("%s %s does not match the sender - '%s' is corrupted\n", pt->name_str, HASH_NAME, pt->fname);
+
+	//close file and clear descriptor
+	if (pt->fd >= 0) {
+		file_write_behind_end(&pt->wb, pt->fd, pt->total);
+		close(pt->fd);
+	}
+	pt->fd= -1;
+	// The journal is only kept for incomplete files; a corrupted copy is sent again from the start
+	if (pt->journal && (pt->total >= pt->flen) && HASH_ACCEPTED(pt->verified))
+		resume_complete(pt);
 
 	if (gettimeofday(&tv2, &tz)) {
 		Log("Error getting the time to stop reception\n");
 		diff= 0;
 	} else
 		diff= (tv2.tv_sec-tv1.tv_sec)*1000000+(tv2.tv_usec-tv1.tv_usec);
+	cpu= thread_cpu_usec()-cpu;
 
-	sprintf(buf, "%s receiving thread ended - lasted %ld usec\n",
-			pt->name_str, diff);
-	Log(buf);
+	log_transfer_stats(pt, "receiving thread", mode, diff, cpu);
+
+	// The sender keeps the connection for its next file: the scheduler waits for its next header
+	if (pt->keep && HASH_ACCEPTED(pt->verified) && active && (pt->self == pt)) {
+		tcpinfo_end(pt);
+		if (sched_keep(pt))
+			pt->s= -1;
+	}
 
 	STOP_THREAD(pt);
 
@@ -240,48 +477,30 @@ Thread_Data *start_rcv_file_thread (int msgsock, struct in6_addr *ip, u_short po
 {
 	if (!active)
 		return NULL;
+	if (engine_running())
+		return engine_start_rcv(msgsock, ip, port, filename, slow);
 	Thread_Data *pt= new_file_thread_desc(FALSE, ip, port, filename, slow);
 	// Store the socket information
 	pt->s= msgsock;
 	// Start the thread
+	pthread_mutex_lock(&rmutex);
 	if (pthread_create(&pt->tid, NULL, rcv_file_thread, (void *)pt)) {
+		pthread_mutex_unlock(&rmutex);
 		fprintf(stderr, "main: error starting thread\n");
 		free (pt);
 		return NULL;
 	}
 	// Add to the FList table
 	GUI_regist_thread((unsigned)pt->tid, "RCV", "?", filename);
+	pthread_mutex_unlock(&rmutex);
 	return pt;
 }
 
-// Starts thread for sending a file
-void *snd_file_thread (void *ptr)
+// Connect a new socket to the receiver (pt->ip : pt->port) in pt->s; FALSE if it failed
+static gboolean connect_peer(Thread_Data *pt)
 {
-	assert(ptr!=NULL);
-	Thread_Data *pt= (Thread_Data *)ptr;
-
-#define SND_BUFLEN 63*1024
-	struct timeval tv1, tv2;
-	struct timezone tz;
-	char buf[SND_BUFLEN+1];
-	long diff= 0;
-	short int slen;
 	struct sockaddr_in6 server;
-	short int flen;
-	short int c, last_c = 0;
-	long n, m;
 	struct timeval tv;
-	int len = 63*1024;
-
-	//*************************************************************************************
-	//*      THREAD                                                                       *
-	//*************************************************************************************
-
-	sprintf(pt->name_str, "SND(%u)> ", (unsigned)pt->tid);
-	fprintf(stderr, "%sstarted sending subprocess (file= '%s' tid = %u)\n", pt->name_str, pt->fname, (int)pt->tid);
-	buf[SND_BUFLEN]= '\0';
-
-	// TASK 8:
 
 	// Create a new temporary socket TCP IPv6 to send the file
 	pt->s = socket(AF_INET6, SOCK_STREAM, 0);
@@ -297,25 +516,64 @@ void *snd_file_thread (void *ptr)
 	server.sin6_flowinfo= 0;
 	server.sin6_port = htons(pt->port);
 	server.sin6_addr = pt->ip;
+	server.sin6_scope_id= peers_scope_id(&pt->ip, pt->port);	// Link-local: interface where it was heard
 
 	unsigned int length = sizeof(server);
 
+	// socket profile: buffers, congestion control and keepalives, set before the handshake
+	tune_socket(pt->s, TUNE_SND, pt->name_str);
+
 	/* Connect the socket to (pt->ip : pt->port) */
 	if (connect(pt->s, (struct sockaddr *)&server, length) < 0){
 		perror("SND>error connecting the TCP socket to send the file");
 		fprintf(stderr, "%sconnection failed\n", pt->name_str);
-		STOP_THREAD(pt);
+		return FALSE;
 	}
 
-	short aux = 1;
-
-	// socket description of send buffer size
-	setsockopt(pt->s, SOL_SOCKET, SO_SNDBUF, &aux, sizeof(len));
-	// socket description to use the nagle algorithm
-	setsockopt(pt->s, IPPROTO_TCP, TCP_NODELAY, &aux, sizeof(aux));
 	// socket description of maximum timeout time -> 10 seconds
 	tv.tv_sec = 10;
+	tv.tv_usec = 0;
 	setsockopt(pt->s, SOL_SOCKET, SO_SNDTIMEO,(struct timeval *)&tv,sizeof(struct timeval));
+	return TRUE;
+}
+
+// Starts thread for sending a file
+void *snd_file_thread (void *ptr)
+{
+	assert(ptr!=NULL);
+	Thread_Data *pt= (Thread_Data *)ptr;
+
+	struct timeval tv1, tv2;
+	struct timezone tz;
+	char buf[SND_BUFLEN+1];
+	long diff= 0;
+	Packed_Header h;
+	short int c, last_c = 0;
+	long n, m, k;
+	int res= XFER_UNSUPPORTED;
+	long cpu;
+	const char *mode= "buffered";
+	char mode_str[80];
+	Pipeline_Stats stalls;
+	gboolean resumable, reused= FALSE;
+	const char *msg;
+
+	//*************************************************************************************
+	//*      THREAD                                                                       *
+	//*************************************************************************************
+
+	sprintf(pt->name_str, "SND(%u)> ", (unsigned)pt->tid);
+	fprintf(stderr, "%sstarted sending subprocess (file= '%s' tid = %u)\n", pt->name_str, pt->fname, (int)pt->tid);
+	buf[SND_BUFLEN]= '\0';
+
+	// TASK 8:
+
+	// Reuse the connection left open by a previous file sent to the same peer
+	if ((pt->s= pool_get(&pt->ip, pt->port, FALSE)) >= 0) {
+		fprintf(stderr, "%sreusing a kept connection\n", pt->name_str);
+		reused= TRUE;
+	} else if (!connect_peer(pt))
+		STOP_THREAD(pt);
 
 	// Open file
 	if ((pt->f= fopen(pt->fname, "r")) == NULL) {
@@ -326,85 +584,153 @@ void *snd_file_thread (void *ptr)
 	// Get the file length
 	pt->flen= get_filesize(pt->fname);
 
-	// Send the user name length
-	slen= strlen(user_name)+1;
-	if (!active || (pt->self != pt) || pt->finished || send(pt->s, &slen, sizeof(slen), 0) < 0) {
-		g_print("%s failed sending user name length - aborting\n", pt->name_str);
-		STOP_THREAD(pt);
-	}
-
-	// Validate and send the user name
-	if (!active || (pt->self != pt) || pt->finished || send(pt->s, user_name, slen, 0) < 0) {
-		g_print("%s did not send the user name - aborting\n", pt->name_str);
+	// Large files are split in ranges sent in parallel, each one over its own connection
+	if (stripe_wanted(pt)) {
+		strcpy(pt->fname, get_trunc_filename(pt->fname));
+		if (gettimeofday(&tv1, &tz))
+			Log("Error getting the time to start sending\n");
+		if (stripe_send_file(pt, &last_c) != XFER_OK) {
+			g_print("%s failed sending the striped file - aborting\n", pt->name_str);
+			STOP_THREAD(pt);
+		}
+		if (gettimeofday(&tv2, &tz))
+			Log("Error getting the time to stop sending\n");
+		diff= (tv2.tv_sec-tv1.tv_sec)*1000000+(tv2.tv_usec-tv1.tv_usec);
+		// The helper threads did the work, so the CPU time of this thread is not shown
+		log_transfer_stats(pt, "sending thread", "striped", diff, -1);
 		STOP_THREAD(pt);
 	}
 
 	// Prepare the filename removing the path part from the complete pathname using
 	// the function get_trunc_filename
-
 	strcpy(pt->fname, get_trunc_filename(pt->fname));
 
-	flen = strlen(pt->fname)+1;
-	// Send the file name length
-	if (!active || (pt->self != pt) || pt->finished || send(pt->s, &flen, sizeof(flen), 0) < 0) {
-		g_print("%d did not send the file name length - aborting\n", flen);
+	// Large files are sent in resumable connections, announced in the header
+	resumable= resume_wanted(pt);
+	pt->keep= pool_enabled;
+	// sendfile does not see the bytes: without hash_zerocopy no digest is sent
+	pt->hashed= hash_zerocopy || (snd_mode != XFER_MODE_ZEROCOPY);
+	if (!header_build(&h, user_name, pt->fname, pt->flen, (resumable ? HEADER_RESUME : 0) |
+			(pt->keep ? HEADER_KEEP : 0) | (pt->hashed ? 0 : HEADER_NOHASH), NULL)) {
+		g_print("%s file name too long - aborting\n", pt->name_str);
 		STOP_THREAD(pt);
 	}
-
-	// Send the file name
-	if (!active || (pt->self != pt) || pt->finished || send(pt->s, pt->fname, flen, 0) < 0) {
-		g_print("%s did not send the file name - aborting\n", pt->fname);
-		STOP_THREAD(pt);
-	}
-
-	// Send the file length
-	if (!active || (pt->self != pt) || pt->finished || send(pt->s, &pt->flen, sizeof(pt->flen), 0) < 0) {
-		g_print("%lld did not send the file name - aborting\n", pt->flen);
-		STOP_THREAD(pt);
+	// The receiver may be closing a kept connection: a file that fails on it before
+	// the body is sent once more over a new connection
+	for (;;) {
+		// Without the resume reply to wait for, the header, the body of small files and
+		// the trailer leave together in full segments
+		if (!resumable)
+			set_cork(pt->s, TRUE);
+		TEST_INTERRUPTED(pt);
+		if (!header_send(pt->s, &h))
+			msg= "failed sending the header";
+		// Learn from the receiver where the body starts
+		else if (resumable && !resume_snd_negotiate(pt))
+			msg= "failed negotiating the resume offset";
+		else
+			break;
+		if (!reused) {
+			g_print("%s %s - aborting\n", pt->name_str, msg);
+			STOP_THREAD(pt);
+		}
+		g_print("%s %s on a kept connection - connecting again\n", pt->name_str, msg);
+		close(pt->s);
+		pt->s= -1;
+		reused= FALSE;
+		if (!connect_peer(pt))
+			STOP_THREAD(pt);
 	}
 
 	g_print("%s sending file %s from %s with %lld bytes\n", user_name, pt->fname, pt->nome, pt->flen);
 
 	if (gettimeofday(&tv1, &tz))
 		Log("Error getting the time to start sending\n");
+	cpu= thread_cpu_usec();
 
 	// Send the file contents from pt->f to pt->s
-	// See the file copy example in the documentation, and adapt to a socket scenario ...
-	// Loop forever until end of file
-	do {
-		// read from buffer
-		n = fread(buf, 1, SND_BUFLEN, pt->f);
-		// add bytes sent
-		pt->total += n;
-		// if read was sucessfull
-		if (n > 0) {
-			if ((m = write(pt->s, buf, n)) < 0)
-				break;
-		}
-		// if not sucessfull
+	// Use the selected engine; io_uring falls back to sendfile, and sendfile to the buffered loop
+	if (snd_mode == XFER_MODE_URING) {
+		res= uring_send_body(pt, &last_c);
+		if (res == XFER_UNSUPPORTED)
+			g_print("%s io_uring not available - using sendfile\n", pt->name_str);
+		else
+			mode= "io_uring";
+	}
+	if (snd_mode == XFER_MODE_PIPELINED) {
+		res= pipeline_send_body(pt, &last_c, &stalls);
+		if (res == XFER_UNSUPPORTED)
+			g_print("%s no memory for the pipeline - using buffered copy\n", pt->name_str);
 		else {
-			if(n == 0)
-				g_print("transfer completed\n");
-			if(n < 0) {
-				g_print("transfer error\n");
+			sprintf(mode_str, "pipelined - stalls: disk %lld, network %lld", stalls.disk, stalls.net);
+			mode= mode_str;
+		}
+	}
+	if ((res == XFER_UNSUPPORTED) && ((snd_mode == XFER_MODE_ZEROCOPY) || (snd_mode == XFER_MODE_URING))) {
+		res= send_body_sendfile(pt, &last_c);
+		if (res == XFER_UNSUPPORTED)
+			g_print("%s sendfile not supported - using buffered copy\n", pt->name_str);
+		else
+			mode= "sendfile";
+	}
+	if (res == XFER_ERROR) {
+		g_print("%s failed sending the file contents - aborting\n", pt->name_str);
+		STOP_THREAD(pt);
+	}
+	if (res == XFER_UNSUPPORTED) {
+		do {
+			// read from buffer
+			n = fread(buf, 1, rate_chunk(pt, SND_BUFLEN), pt->f);
+			// if read was sucessfull
+			if (n > 0) {
+				// write the whole buffer: the socket may take only part of it
+				for (k= 0; k < n; k += m) {
+					if ((m = write(pt->s, buf+k, n-k)) < 0) {
+						if (errno == EINTR) {
+							m= 0;
+							continue;
+						}
+						break;
+					}
+				}
+				// add bytes sent, and hash only them
+				hash_update(&pt->hash, buf, k);
+				pt->total += k;
+				if (k < n) {
+					perror("Error sending file");
+					g_print("%s failed sending the file contents - aborting\n", pt->name_str);
+					STOP_THREAD(pt);
+				}
+			}
+			// if not sucessfull
+			else if (pt->total < pt->flen) {
+				g_print("%s file ended before the announced length - aborting\n", pt->name_str);
 				STOP_THREAD(pt);
 			}
-		}
-		// calculate the percentage of file already sent
-		c = (int)((pt->total*100.0)/pt->flen);
-		// if the percentage changed since last iteration
-		if(c != last_c){
-			GUI_update_bytes_sent((unsigned)pt->tid, c);
-			last_c = c;
-		}
-		// if percentage reaches 100, flag finished activated
-		if (c == 100)
-			pt->finished = 1;
-		// if slow mode activated
-		if (pt->slow)
-			usleep(SLOW_SLEEPTIME);
-	} while (active && (n > 0) && (pt->flen - pt->total) > 0 && !pt->finished);
-	// while the EOF isn't reached or flag finished not true
+			// calculate the percentage of file already sent
+			c = (int)((pt->total*100.0)/pt->flen);
+			// if the percentage changed since last iteration
+			if(c != last_c){
+				GUI_update_bytes_sent((unsigned)pt->tid, c);
+				last_c = c;
+			}
+			// if percentage reaches 100, flag finished activated
+			if (c == 100)
+				pt->finished = 1;
+			// wait while over the rate limits
+			if (n > 0)
+				rate_throttle(pt, n);
+		} while (active && (n > 0) && (pt->flen - pt->total) > 0 && !pt->finished);
+		// while the EOF isn't reached or flag finished not true
+	}
+
+	// Send the digest of the body, so the receiver can verify it
+	if ((pt->total >= pt->flen) && pt->hashed && !hash_send_trailer(pt->s, &pt->hash)) {
+		g_print("%s failed sending the %s trailer - aborting\n", pt->name_str, HASH_NAME);
+		STOP_THREAD(pt);
+	}
+	if (!resumable)
+		set_cork(pt->s, FALSE);
 
 	//close fill and clear pointer
 	fclose(pt->f);
@@ -415,11 +741,16 @@ void *snd_file_thread (void *ptr)
 		diff= 0;
 	} else
 		diff= (tv2.tv_sec-tv1.tv_sec)*1000000+(tv2.tv_usec-tv1.tv_usec);
+	cpu= thread_cpu_usec()-cpu;
 
-	sprintf(buf, "%ssending thread ended - lasted %ld usec\n",
-			pt->name_str, diff);
+	log_transfer_stats(pt, "sending thread", mode, diff, cpu);
 
-	Log(buf);
+	// The receiver waits for another file: keep the connection for the next one to this peer
+	if (pt->keep && (pt->total >= pt->flen) && active && (pt->self == pt)) {
+		tcpinfo_end(pt);
+		pool_put(&pt->ip, pt->port, pt->s);
+		pt->s= -1;
+	}
 	STOP_THREAD(pt);
 
 	//*********************************************************************************
@@ -436,7 +767,9 @@ Thread_Data *start_snd_file_thread (struct in6_addr *ip_file, u_short port,
 	assert(nome != NULL);
 	assert(filename != NULL);
 
-	Thread_Data *pt= new_file_thread_desc(FALSE, ip_file, port, filename, slow);
+	if (engine_running())
+		return engine_start_snd(ip_file, port, nome, filename, slow);
+	Thread_Data *pt= new_file_thread_desc(TRUE, ip_file, port, filename, slow);
 	// Store the name information
 	strncpy(pt->nome, nome, sizeof(pt->nome));
 
@@ -14,7 +14,7 @@ extern char *out_dir;
 #ifndef SUBPROCESS_INC_
 #define SUBPROCESS_INC_
 
-#include <gtk/gtk.h>
+#include <glib.h>
 #include <netinet/in.h>
 #include <inttypes.h>
 
@@ -22,6 +22,22 @@ extern char *out_dir;
 
 //#define DEBUG
 
+/* Data paths used for the file body */
+#define XFER_MODE_BUFFERED	0	// read/write through a user space buffer
+#define XFER_MODE_ZEROCOPY	1	// sendfile when sending; splice when receiving
+#define XFER_MODE_URING		2	// io_uring with registered buffers
+#define XFER_MODE_PIPELINED	3	// disk and network stages in separate threads (pipeline.c)
+
+/* Results of the transmit engines */
+#define XFER_OK				0		// File body transferred (or stopped by the user)
+#define XFER_ERROR			-1		// I/O error during the transfer
+#define XFER_UNSUPPORTED	-2		// Engine not supported for this file/socket - nothing was moved
+
+// Data path used when sending files
+extern int snd_mode;
+// Data path used when receiving files
+extern int rcv_mode;
+
 /*******************************************************\
 |* Functions that implement file transmission threads  *|
 \*******************************************************/
@@ -37,5 +53,11 @@ Thread_Data *start_snd_file_thread (struct in6_addr *ip_file, u_short port,
 // File send thread
 void *snd_file_thread (void *ptr);
 
+// Update the percentage shown in the GUI table, if it changed since the last update
+void update_progress(Thread_Data *pt, short int *last_c);
+// Log the duration, throughput and CPU time (cpu<0 if not available) used by a transfer
+void log_transfer_stats(Thread_Data *pt, const char *dir, const char *mode,
+		long diff, long cpu);
+
 
 #endif
@@ -0,0 +1,117 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * tune.c
+ *
+ * Socket profiles of the file transfers
+ *
+ * An option the kernel does not accept (e.g. a congestion control algorithm
+ * whose module is not loaded) is reported in the log line of the socket and
+ * the kernel default stays in effect.
+ \*****************************************************************************/
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "tune.h"
+
+#define TUNE_CC_NAME_MAX	16		// Length of the name of a congestion control algorithm
+
+
+// Profiles, indexed by TUNE_*
+static const Tune_Profile profiles[]= {
+	// name, notsent_lowat, congestion, keepidle, keepintvl, keepcnt
+	{ "lan",		0,			NULL,	60,	10,	5 },
+	// BBR keeps the throughput of long paths with some loss; the unsent data is kept
+	// low, so the autotuned buffer holds the window in flight and not a queue
+	{ "wan",		128*1024,	"bbr",	60,	10,	6 },
+	// Small unsent queue, so new data is not delayed behind older data; dead peers are found fast
+	{ "lowlat",		16*1024,	NULL,	10,	5,	3 },
+};
+
+int tune_profile= TUNE_LAN;		// Profile used by the new sockets
+int tune_buffer= 0;				// Fixed size of the socket buffers; 0 for autotuning
+
+
+// Select a profile by its name ("lan", "wan" or "lowlat"); returns FALSE if unknown
+gboolean tune_select(const char *name)
+{
+	int i;
+
+	for (i= 0; i < (int)(sizeof(profiles)/sizeof(profiles[0])); i++)
+		if (!strcmp(name, profiles[i].name)) {
+			tune_profile= i;
+			return TRUE;
+		}
+	return FALSE;
+}
+
+
+// Set an integer option; returns FALSE if the kernel refused it
+static gboolean set_int(int s, int level, int opt, int val)
+{
+	return setsockopt(s, level, opt, &val, sizeof(val)) == 0;
+}
+
+
+// Read an integer option; returns -1 if it is not available
+static int get_int(int s, int level, int opt)
+{
+	int val;
+	socklen_t len= sizeof(val);
+	return getsockopt(s, level, opt, &val, &len) ? -1 : val;
+}
+
+
+// Apply the profile to a TCP socket used as 'use' (TUNE_*) and log the values in effect
+// name_str prefixes the log line
+void tune_socket(int s, int use, const char *name_str)
+{
+	const Tune_Profile *p= &profiles[tune_profile];
+	char cc[TUNE_CC_NAME_MAX+1]= "default", note[80]= "";
+	socklen_t len= TUNE_CC_NAME_MAX;
+	int lowat= 0;
+
+	// Fixed buffers turn autotuning off; the receive buffer also sets the window scale,
+	//   so it must be set before listen()
+	if (tune_buffer > 0) {
+		if (use != TUNE_SND)
+			set_int(s, SOL_SOCKET, SO_RCVBUF, tune_buffer);
+		if (use != TUNE_RCV)
+			set_int(s, SOL_SOCKET, SO_SNDBUF, tune_buffer);
+	}
+	// Headers and trailers are grouped with TCP_CORK, so Nagle is never needed
+	set_int(s, IPPROTO_TCP, TCP_NODELAY, 1);
+#ifdef TCP_NOTSENT_LOWAT
+	if ((p->notsent_lowat > 0) && (use != TUNE_RCV))
+		set_int(s, IPPROTO_TCP, TCP_NOTSENT_LOWAT, p->notsent_lowat);
+#endif
+#ifdef TCP_CONGESTION
+	if ((p->congestion != NULL) &&
+			setsockopt(s, IPPROTO_TCP, TCP_CONGESTION, p->congestion, strlen(p->congestion)))
+		snprintf(note, sizeof(note), " (%s not available)", p->congestion);
+#endif
+	if (p->keepidle > 0) {
+		set_int(s, SOL_SOCKET, SO_KEEPALIVE, 1);
+		set_int(s, IPPROTO_TCP, TCP_KEEPIDLE, p->keepidle);
+		set_int(s, IPPROTO_TCP, TCP_KEEPINTVL, p->keepintvl);
+		set_int(s, IPPROTO_TCP, TCP_KEEPCNT, p->keepcnt);
+	}
+
+	// Values in effect; the kernel reports twice the buffer sizes requested (bookkeeping overhead)
+#ifdef TCP_CONGESTION
+	if (!getsockopt(s, IPPROTO_TCP, TCP_CONGESTION, cc, &len))
+		cc[(len < TUNE_CC_NAME_MAX) ? len : TUNE_CC_NAME_MAX]= '\0';
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+	lowat= get_int(s, IPPROTO_TCP, TCP_NOTSENT_LOWAT);
+#endif
+	fprintf(stderr, "%ssocket profile %s: sndbuf %d, rcvbuf %d%s, congestion %s%s, notsent_lowat %d, keepalive %s\n",
+			name_str, p->name, get_int(s, SOL_SOCKET, SO_SNDBUF), get_int(s, SOL_SOCKET, SO_RCVBUF),
+			(tune_buffer > 0) ? " (fixed)" : " (autotuned)", cc, note, lowat,
+			get_int(s, SOL_SOCKET, SO_KEEPALIVE) > 0 ? "on" : "off");
+}
@@ -0,0 +1,53 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * tune.h
+ *
+ * Header file of the socket profiles of the file transfers
+ *
+ * A profile sets the options of the TCP sockets of the transfers: buffers,
+ * Nagle, TCP_NOTSENT_LOWAT, congestion control and keepalives. The buffers
+ * are left to the kernel, which grows them with the window (autotuning),
+ * unless tune_buffer fixes their size; setting SO_SNDBUF or SO_RCVBUF turns
+ * autotuning off for that socket. The listening socket gets the profile too,
+ * so the accepted connections inherit it from the handshake on.
+ \*****************************************************************************/
+#ifndef TUNE_INC_
+#define TUNE_INC_
+
+#include <glib.h>
+
+/* Profiles */
+#define TUNE_LAN		0		// Bulk transfers in a LAN (default)
+#define TUNE_WAN		1		// Paths with a large bandwidth-delay product
+#define TUNE_LOWLAT		2		// Small files and interactive use: little data queued in the socket
+
+/* Use of a socket */
+#define TUNE_LISTEN		0		// Listening socket; the accepted connections inherit its options
+#define TUNE_SND		1		// Connection that sends a file
+#define TUNE_RCV		2		// Connection that receives a file
+
+// Options set by a profile
+typedef struct {
+	const char *name;
+	int notsent_lowat;			// Unsent bytes kept in the socket (TCP_NOTSENT_LOWAT); 0 keeps the default
+	const char *congestion;		// Congestion control algorithm; NULL keeps the default
+	int keepidle;				// Keepalive: idle time, interval between probes (s) and probes;
+	int keepintvl;				//   keepidle 0 turns keepalives off
+	int keepcnt;
+} Tune_Profile;
+
+// Profile used by the new sockets (TUNE_*)
+extern int tune_profile;
+// Fixed size of the socket buffers (bytes); 0 leaves them to the kernel autotuning
+extern int tune_buffer;
+
+
+// Select a profile by its name ("lan", "wan" or "lowlat"); returns FALSE if unknown
+gboolean tune_select(const char *name);
+// Apply the profile to a TCP socket used as 'use' (TUNE_*) and log the values in effect
+// name_str prefixes the log line
+void tune_socket(int s, int use, const char *name_str);
+
+#endif
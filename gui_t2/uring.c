@@ -0,0 +1,502 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * uring.c
+ *
+ * io_uring backend of the file transfer threads
+ *
+ * Each transfer creates its own ring and registers URING_SLOTS buffers.
+ * Sending: file reads run ahead with READ_FIXED while the socket writes are
+ *   issued in file order, one at a time, since writes to the same TCP stream
+ *   may not be reordered.
+ * Receiving: each block is a linked RECV(MSG_WAITALL) -> WRITE_FIXED pair; the
+ *   file writes carry their offset, so several of them may be in flight.
+ \*****************************************************************************/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <glib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "uring.h"
+#include "thread.h"
+#include "hash.h"
+#include "file.h"
+#include "rate.h"
+#include "callbacks.h"
+#include "gui.h"
+
+#define URING_WAIT_USEC		250000		// Maximum blocking time before testing the stop conditions
+#define URING_IDLE_TIMEOUT	10000000LL	// Abort transfers without progress for 10 s (usec)
+
+/* Operations encoded in user_data */
+#define OP_READ			1
+#define OP_SEND			2
+#define OP_RECV			3
+#define OP_WRITE		4
+#define UDATA(op, slot)	(((__u64)(op) << 8) | (slot))
+#define UDATA_OP(u)		((int)((u) >> 8))
+#define UDATA_SLOT(u)	((int)((u) & 0xff))
+
+/* Slot states */
+#define SLOT_FREE		0	// Buffer available
+#define SLOT_BUSY		1	// Read (sending) or recv+write (receiving) in flight
+#define SLOT_READY		2	// Data read from the file, waiting to be sent
+
+// Per-buffer state of a transfer
+typedef struct {
+	int state;
+	size_t len;			// Bytes of the block
+	size_t pos;			// Bytes of the block already sent
+	long long off;		// File offset of the block
+	gboolean redo;		// Write was cancelled by a short recv and must be submitted again
+} Uring_Slot;
+
+
+/***********************************\
+|* Functions that handle the ring  *|
+\***********************************/
+
+// Create a ring with 'entries' submission entries; returns FALSE if io_uring is not available
+gboolean uring_init(Uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(r, 0, sizeof(Uring));
+	memset(&p, 0, sizeof(p));
+	if ((r->fd= syscall(__NR_io_uring_setup, entries, &p)) < 0)
+		return FALSE;
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		// Needed to wait with a timeout (Linux 5.11)
+		close(r->fd);
+		errno= ENOSYS;
+		return FALSE;
+	}
+
+	r->sq_size= p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	r->cq_size= p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	r->sqes_size= p.sq_entries*sizeof(struct io_uring_sqe);
+	r->sq_ptr= mmap(NULL, r->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			r->fd, IORING_OFF_SQ_RING);
+	r->cq_ptr= mmap(NULL, r->cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			r->fd, IORING_OFF_CQ_RING);
+	r->sqes= mmap(NULL, r->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			r->fd, IORING_OFF_SQES);
+	if ((r->sq_ptr == MAP_FAILED) || (r->cq_ptr == MAP_FAILED) || (r->sqes == MAP_FAILED)) {
+		perror("io_uring mmap");
+		uring_exit(r);
+		return FALSE;
+	}
+	r->sq_head= (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+	r->sq_tail= (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+	r->sq_mask= (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array= (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+	r->cq_head= (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+	r->cq_tail= (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+	r->cq_mask= (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes= (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+	return TRUE;
+}
+
+
+// Destroy the ring, cancelling all pending operations
+void uring_exit(Uring *r)
+{
+	if ((r->sq_ptr != NULL) && (r->sq_ptr != MAP_FAILED))
+		munmap(r->sq_ptr, r->sq_size);
+	if ((r->cq_ptr != NULL) && (r->cq_ptr != MAP_FAILED))
+		munmap(r->cq_ptr, r->cq_size);
+	if ((r->sqes != NULL) && (r->sqes != MAP_FAILED))
+		munmap(r->sqes, r->sqes_size);
+	if (r->fd >= 0)
+		close(r->fd);
+	r->fd= -1;
+}
+
+
+// Register 'n' buffers for READ_FIXED/WRITE_FIXED operations
+gboolean uring_register_buffers(Uring *r, const struct iovec *iov, unsigned n)
+{
+	return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, n) == 0;
+}
+
+
+// Return a cleared submission entry, or NULL if the ring is full
+struct io_uring_sqe *uring_get_sqe(Uring *r)
+{
+	unsigned head= __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail= *r->sq_tail + r->sq_pending;
+	struct io_uring_sqe *sqe;
+
+	if (tail-head > *r->sq_mask)
+		return NULL;
+	sqe= &r->sqes[tail & *r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[tail & *r->sq_mask]= tail & *r->sq_mask;
+	r->sq_pending++;
+	return sqe;
+}
+
+
+// Number of submission entries still free
+static unsigned uring_sq_free(Uring *r)
+{
+	unsigned head= __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	return *r->sq_mask + 1 - (*r->sq_tail + r->sq_pending - head);
+}
+
+
+// Submit the queued entries and wait for at least 'wait' completions, at most URING_WAIT_USEC
+int uring_submit(Uring *r, unsigned wait)
+{
+	struct __kernel_timespec ts= { 0, URING_WAIT_USEC*1000 };
+	struct io_uring_getevents_arg arg;
+	unsigned n= r->sq_pending;
+	int res;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.ts= (__u64)(unsigned long)&ts;
+	__atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+	r->sq_pending= 0;
+	res= syscall(__NR_io_uring_enter, r->fd, n, wait,
+			(wait ? IORING_ENTER_GETEVENTS : 0) | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if ((res < 0) && ((errno == ETIME) || (errno == EINTR)))
+		return 0;
+	return res;
+}
+
+
+// Return the next completion, or NULL if none is available
+struct io_uring_cqe *uring_peek_cqe(Uring *r)
+{
+	unsigned head= *r->cq_head;
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &r->cqes[head & *r->cq_mask];
+}
+
+
+// Mark the completion returned by uring_peek_cqe as consumed
+void uring_cqe_seen(Uring *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+/**************************************************\
+|* Transfer loops using the io_uring backend      *|
+\**************************************************/
+
+// Create a ring and register the transfer buffers
+static gboolean uring_setup_transfer(Uring *r, char **mem, struct iovec *iov)
+{
+	int i;
+
+	if (!uring_init(r, 2*URING_SLOTS))
+		return FALSE;
+	if (posix_memalign((void **)mem, 4096, URING_SLOTS*URING_BLOCK)) {
+		uring_exit(r);
+		return FALSE;
+	}
+	for (i= 0; i < URING_SLOTS; i++) {
+		iov[i].iov_base= *mem + i*URING_BLOCK;
+		iov[i].iov_len= URING_BLOCK;
+	}
+	if (!uring_register_buffers(r, iov, URING_SLOTS)) {
+		perror("io_uring register buffers");
+		uring_exit(r);
+		free(*mem);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+// Wait for all pending operations, then destroy the ring; res is the XFER_* result of the transfer
+// The socket is shut down to end the operations still blocked on it, only if the transfer failed:
+//   after XFER_UNSUPPORTED it is used by the next engine. Returns the result, XFER_ERROR if it could not be used
+static int uring_finish_transfer(Uring *r, char *mem, Thread_Data *pt, int inflight, int res)
+{
+	struct io_uring_cqe *cqe;
+	int tries= 0;
+
+	// Reap the operations already completed, like the write cancelled with a recv that failed
+	while ((inflight > 0) && ((cqe= uring_peek_cqe(r)) != NULL)) {
+		inflight--;
+		uring_cqe_seen(r);
+	}
+	if ((inflight > 0) && (res != XFER_UNSUPPORTED))
+		shutdown(pt->s, SHUT_RDWR);	// Force pending socket operations to complete
+	while ((inflight > 0) && (tries++ < 20)) {
+		uring_submit(r, 1);
+		while ((cqe= uring_peek_cqe(r)) != NULL) {
+			inflight--;
+			uring_cqe_seen(r);
+		}
+	}
+	uring_exit(r);
+	if (inflight > 0)
+		return XFER_ERROR;	// The kernel may still use the buffers and the socket
+	free(mem);
+	return res;
+}
+
+
+// Send the file body from pt->f to pt->s; returns an XFER_* result
+int uring_send_body(Thread_Data *pt, short int *last_c)
+{
+	Uring r;
+	char *mem;
+	struct iovec iov[URING_SLOTS];
+	Uring_Slot slot[URING_SLOTS];
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int fd= fileno(pt->f);
+	int next_read= 0, next_send= 0, inflight= 0;
+	gboolean sending= FALSE;
+	long long read_off= pt->total;	// Resumed transfers start after the bytes already sent
+	long long last_progress= g_get_monotonic_time();
+	int res= XFER_OK;
+
+	if (!uring_setup_transfer(&r, &mem, iov))
+		return XFER_UNSUPPORTED;
+	memset(slot, 0, sizeof(slot));
+
+	while (active && (pt->self == pt) && !pt->finished && (pt->total < pt->flen)) {
+		// Read ahead into every free buffer
+		while ((slot[next_read].state == SLOT_FREE) && (read_off < pt->flen)) {
+			Uring_Slot *s= &slot[next_read];
+			if ((sqe= uring_get_sqe(&r)) == NULL)
+				break;	// Submission queue full: read the next ones after this submission
+			s->len= (pt->flen-read_off < URING_BLOCK) ? pt->flen-read_off : URING_BLOCK;
+			s->off= read_off;
+			s->pos= 0;
+			s->state= SLOT_BUSY;
+			sqe->opcode= IORING_OP_READ_FIXED;
+			sqe->fd= fd;
+			sqe->addr= (unsigned long)iov[next_read].iov_base;
+			sqe->len= s->len;
+			sqe->off= s->off;
+			sqe->buf_index= next_read;
+			sqe->user_data= UDATA(OP_READ, next_read);
+			inflight++;
+			read_off += s->len;
+			next_read= (next_read+1) % URING_SLOTS;
+		}
+		// Send the next block in file order
+		if (!sending && (slot[next_send].state == SLOT_READY) && ((sqe= uring_get_sqe(&r)) != NULL)) {
+			Uring_Slot *s= &slot[next_send];
+			sqe->opcode= IORING_OP_WRITE_FIXED;
+			sqe->fd= pt->s;
+			sqe->addr= (unsigned long)iov[next_send].iov_base + s->pos;
+			sqe->len= rate_chunk(pt, s->len - s->pos);
+			sqe->buf_index= next_send;
+			sqe->user_data= UDATA(OP_SEND, next_send);
+			inflight++;
+			sending= TRUE;
+		}
+
+		if (uring_submit(&r, 1) < 0) {
+			perror("io_uring_enter");
+			res= XFER_ERROR;
+			break;
+		}
+		while ((res == XFER_OK) && ((cqe= uring_peek_cqe(&r)) != NULL)) {
+			int i= UDATA_SLOT(cqe->user_data);
+			Uring_Slot *s= &slot[i];
+			inflight--;
+			if (UDATA_OP(cqe->user_data) == OP_READ) {
+				if (cqe->res == (int)s->len)
+					s->state= SLOT_READY;
+				else if ((cqe->res == -EINVAL) && (pt->total == pt->offset) && (s->off == pt->offset))
+					res= XFER_UNSUPPORTED;
+				else {
+					fprintf(stderr, "%sio_uring read failed: %s\n", pt->name_str,
+							(cqe->res < 0) ? strerror(-cqe->res) : "file ended before the announced length");
+					res= XFER_ERROR;
+				}
+			} else {
+				sending= FALSE;
+				if (cqe->res > 0) {
+					s->pos += cqe->res;
+					pt->total += cqe->res;
+					last_progress= g_get_monotonic_time();
+					update_progress(pt, last_c);
+					if (s->pos == s->len) {
+						// Blocks are sent in file order, so they are hashed in order
+						hash_update(&pt->hash, iov[i].iov_base, s->len);
+						s->state= SLOT_FREE;
+						next_send= (next_send+1) % URING_SLOTS;
+					}
+					rate_throttle(pt, cqe->res);
+				} else if ((cqe->res == -EINVAL) && (pt->total == pt->offset)) {
+					res= XFER_UNSUPPORTED;
+				} else if ((cqe->res != -EINTR) && (cqe->res != -EAGAIN)) {
+					fprintf(stderr, "%sio_uring send failed: %s\n", pt->name_str, strerror(-cqe->res));
+					res= XFER_ERROR;
+				}
+			}
+			uring_cqe_seen(&r);
+		}
+		if (res != XFER_OK)
+			break;
+		if (g_get_monotonic_time()-last_progress > URING_IDLE_TIMEOUT) {
+			g_print("%s no progress for %lld s - aborting\n", pt->name_str, URING_IDLE_TIMEOUT/1000000);
+			res= XFER_ERROR;
+			break;
+		}
+	}
+	if ((res == XFER_UNSUPPORTED) && (pt->total > pt->offset))
+		res= XFER_ERROR;
+	return uring_finish_transfer(&r, mem, pt, inflight, res);
+}
+
+
+// Queue the file write of slot 'i'; returns FALSE if the submission queue is full
+static gboolean uring_queue_write(Uring *r, struct iovec *iov, Uring_Slot *slot, int i, int fd)
+{
+	struct io_uring_sqe *sqe= uring_get_sqe(r);
+
+	if (sqe == NULL)
+		return FALSE;
+	sqe->opcode= IORING_OP_WRITE_FIXED;
+	sqe->fd= fd;
+	sqe->addr= (unsigned long)iov[i].iov_base;
+	sqe->len= slot[i].len;
+	sqe->off= slot[i].off;
+	sqe->buf_index= i;
+	sqe->user_data= UDATA(OP_WRITE, i);
+	return TRUE;
+}
+
+
+// Receive the file body from pt->s into pt->fd; returns an XFER_* result
+int uring_rcv_body(Thread_Data *pt, short int *last_c)
+{
+	Uring r;
+	char *mem;
+	struct iovec iov[URING_SLOTS];
+	Uring_Slot slot[URING_SLOTS];
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int next= 0, inflight= 0, writes= 0;
+	gboolean receiving= FALSE, eof= FALSE;
+	long long recv_off= pt->total;	// Resumed transfers start after the bytes already received
+	long long last_progress= g_get_monotonic_time();
+	int res= XFER_OK;
+
+	if (!uring_setup_transfer(&r, &mem, iov))
+		return XFER_UNSUPPORTED;
+	memset(slot, 0, sizeof(slot));
+
+	while (active && (pt->self == pt) && !pt->finished && (pt->total < pt->flen)) {
+		if (eof && (writes == 0))
+			break;
+		// Start the next linked recv -> write pair, only if both entries fit: a recv queued alone
+		//   would be linked to the next operation submitted
+		if (!receiving && !eof && (recv_off < pt->flen) && (slot[next].state == SLOT_FREE) &&
+				(uring_sq_free(&r) >= 2) && ((sqe= uring_get_sqe(&r)) != NULL)) {
+			Uring_Slot *s= &slot[next];
+			s->len= rate_chunk(pt, (pt->flen-recv_off < URING_BLOCK) ? pt->flen-recv_off : URING_BLOCK);
+			s->off= recv_off;
+			s->redo= FALSE;
+			s->state= SLOT_BUSY;
+			sqe->opcode= IORING_OP_RECV;
+			sqe->fd= pt->s;
+			sqe->addr= (unsigned long)iov[next].iov_base;
+			sqe->len= s->len;
+			sqe->msg_flags= MSG_WAITALL;
+			sqe->flags= IOSQE_IO_LINK;
+			sqe->user_data= UDATA(OP_RECV, next);
+			uring_queue_write(&r, iov, slot, next, pt->fd);	// Its entry is free, see above
+			inflight += 2;
+			writes++;
+			receiving= TRUE;
+		}
+
+		if (uring_submit(&r, 1) < 0) {
+			perror("io_uring_enter");
+			res= XFER_ERROR;
+			break;
+		}
+		while ((res == XFER_OK) && ((cqe= uring_peek_cqe(&r)) != NULL)) {
+			int i= UDATA_SLOT(cqe->user_data);
+			Uring_Slot *s= &slot[i];
+			inflight--;
+			if (UDATA_OP(cqe->user_data) == OP_RECV) {
+				receiving= FALSE;
+				// Only one recv is in flight, so the blocks are hashed in order
+				if (cqe->res > 0) {
+					hash_update(&pt->hash, iov[i].iov_base, cqe->res);
+					rate_throttle(pt, cqe->res);
+				}
+				if (cqe->res == (int)s->len) {
+					recv_off += s->len;
+					next= (next+1) % URING_SLOTS;
+				} else if (cqe->res >= 0) {
+					// Short recv: the linked write is cancelled; write the bytes received
+					if (cqe->res == 0) {
+						g_print("%s connection closed by the sender\n", pt->name_str);
+						eof= TRUE;
+					} else {
+						s->len= cqe->res;
+						s->redo= TRUE;
+						recv_off += s->len;
+						next= (next+1) % URING_SLOTS;
+					}
+				} else if ((cqe->res == -EINVAL) && (recv_off == pt->offset)) {
+					res= XFER_UNSUPPORTED;
+				} else if ((cqe->res != -EINTR) && (cqe->res != -EAGAIN)) {
+					fprintf(stderr, "%sio_uring recv failed: %s\n", pt->name_str, strerror(-cqe->res));
+					res= XFER_ERROR;
+				}
+			} else if (cqe->res == -ECANCELED) {
+				if (s->redo) {
+					s->redo= FALSE;
+					if (uring_queue_write(&r, iov, slot, i, pt->fd)) {
+						inflight++;
+					} else {
+						fprintf(stderr, "%sio_uring submission queue full\n", pt->name_str);
+						res= XFER_ERROR;
+					}
+				} else {
+					s->state= SLOT_FREE;
+					writes--;
+				}
+			} else if (cqe->res == (int)s->len) {
+				s->state= SLOT_FREE;
+				writes--;
+				pt->total += cqe->res;
+				file_write_behind(&pt->wb, pt->fd, pt->total);
+				last_progress= g_get_monotonic_time();
+				update_progress(pt, last_c);
+			} else {
+				fprintf(stderr, "%sio_uring write failed: %s\n", pt->name_str,
+						(cqe->res < 0) ? strerror(-cqe->res) : "short write");
+				res= XFER_ERROR;
+			}
+			uring_cqe_seen(&r);
+		}
+		if (res != XFER_OK)
+			break;
+		if (g_get_monotonic_time()-last_progress > URING_IDLE_TIMEOUT) {
+			g_print("%s no progress for %lld s - aborting\n", pt->name_str, URING_IDLE_TIMEOUT/1000000);
+			res= XFER_ERROR;
+			break;
+		}
+	}
+	// The bytes received before the sender closed are written, but the body is incomplete
+	if (eof && (res == XFER_OK))
+		res= XFER_ERROR;
+	return uring_finish_transfer(&r, mem, pt, inflight, res);
+}
@@ -0,0 +1,74 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes I
+ * MIEEC - FCT/UNL  2019/2020
+ *
+ * uring.h
+ *
+ * Header file of the io_uring backend of the file transfer threads
+ *
+ * Uses the raw io_uring system calls, so it does not depend on liburing.
+ \*****************************************************************************/
+#ifndef URING_INC_
+#define URING_INC_
+
+#include <glib.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "callbacks.h"
+
+#define URING_SLOTS		8			// Registered buffers (operations in flight) per transfer
+#define URING_BLOCK		(256*1024)	// Size of each registered buffer
+
+
+// Submission and completion rings of an io_uring instance
+typedef struct {
+	int fd;						// io_uring descriptor
+	unsigned *sq_head;			// Submission ring
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;	// Submission queue entries
+	unsigned sq_pending;		// Entries queued but not yet submitted
+	unsigned *cq_head;			// Completion ring
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;				// Mapped regions
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+} Uring;
+
+
+/***********************************\
+|* Functions that handle the ring  *|
+\***********************************/
+
+// Create a ring with 'entries' submission entries; returns FALSE if io_uring is not available
+gboolean uring_init(Uring *r, unsigned entries);
+// Destroy the ring, cancelling all pending operations
+void uring_exit(Uring *r);
+// Register 'n' buffers for READ_FIXED/WRITE_FIXED operations
+gboolean uring_register_buffers(Uring *r, const struct iovec *iov, unsigned n);
+// Return a cleared submission entry, or NULL if the ring is full
+struct io_uring_sqe *uring_get_sqe(Uring *r);
+// Submit the queued entries and wait for at least 'wait' completions
+int uring_submit(Uring *r, unsigned wait);
+// Return the next completion, or NULL if none is available
+struct io_uring_cqe *uring_peek_cqe(Uring *r);
+// Mark the completion returned by uring_peek_cqe as consumed
+void uring_cqe_seen(Uring *r);
+
+
+/**************************************************\
+|* Transfer loops using the io_uring backend      *|
+\**************************************************/
+
+// Send the file body from pt->f to pt->s; returns an XFER_* result
+int uring_send_body(Thread_Data *pt, short int *last_c);
+// Receive the file body from pt->s into pt->fd; returns an XFER_* result
+int uring_rcv_body(Thread_Data *pt, short int *last_c);
+
+#endif